@@ -0,0 +1,217 @@
+// Connection acceptance benchmark for Dasynq.
+//
+// Bursts of client connections are made to a listening TCP socket on the loopback address, for a
+// given duration; after each burst, the event loop is run until all the connections have been
+// accepted. The event loop accepts (and closes) the connections using either an fd_watcher which accepts a single connection per event, an
+// fd_watcher which accepts connections until none remain, or a listener_watcher (which accepts up
+// to a budget per dispatch, and then requeues itself). At the same time, a "bystander" watcher, on a
+// pipe which is always readable, counts the number of times it is dispatched; this indicates how
+// fairly the event loop is shared with other watchers. The connection rate, the bystander dispatch
+// rate and the largest number of connections accepted between bystander dispatches are reported.
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include <vector>
+
+#include "dasynq.h"
+
+using loop_t = dasynq::event_loop_n;
+using dasynq::rearm;
+
+static unsigned long long now_nsecs()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Accepts a single connection per event
+class single_acceptor : public loop_t::fd_watcher_impl<single_acceptor>
+{
+    public:
+    size_t accepted = 0;
+
+    void add_watch(loop_t &loop, int fd)
+    {
+        fd_watcher_impl::add_watch(loop, fd, dasynq::IN_EVENTS);
+    }
+
+    rearm fd_event(loop_t &loop, int fd, int flags)
+    {
+        int new_fd = accept4(fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (new_fd != -1) {
+            accepted++;
+            close(new_fd);
+        }
+        return rearm::REARM;
+    }
+};
+
+// Accepts connections until none remain
+class loop_acceptor : public loop_t::fd_watcher_impl<loop_acceptor>
+{
+    public:
+    size_t accepted = 0;
+
+    void add_watch(loop_t &loop, int fd)
+    {
+        fd_watcher_impl::add_watch(loop, fd, dasynq::IN_EVENTS);
+    }
+
+    rearm fd_event(loop_t &loop, int fd, int flags)
+    {
+        int new_fd;
+        while ((new_fd = accept4(fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+            accepted++;
+            close(new_fd);
+        }
+        return rearm::REARM;
+    }
+};
+
+// listener_watcher, with the default budget
+class listener : public loop_t::listener_watcher_impl<listener>
+{
+    public:
+    size_t accepted = 0;
+
+    rearm connections_accepted(loop_t &loop, const int *fds, size_t count)
+    {
+        for (size_t i = 0; i < count; i++) {
+            close(fds[i]);
+        }
+        accepted += count;
+        return rearm::REARM;
+    }
+};
+
+// Counts dispatches; the pipe is never drained, so it is always ready. Also records the largest
+// number of connections accepted between successive dispatches.
+class bystander : public loop_t::fd_watcher_impl<bystander>
+{
+    public:
+    size_t dispatches = 0;
+    const size_t *accepted = nullptr;
+    size_t last_accepted = 0;
+    size_t max_gap = 0;
+
+    rearm fd_event(loop_t &loop, int fd, int flags)
+    {
+        dispatches++;
+        size_t gap = *accepted - last_accepted;
+        if (gap > max_gap) max_gap = gap;
+        last_accepted = *accepted;
+        return rearm::REARM;
+    }
+};
+
+template <typename A>
+static void run_bench(const char *name, int burst, double duration)
+{
+    loop_t loop;
+
+    int listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addr_len = sizeof(addr);
+    if (bind(listen_fd, (sockaddr *)&addr, sizeof(addr)) == -1
+            || getsockname(listen_fd, (sockaddr *)&addr, &addr_len) == -1
+            || listen(listen_fd, burst) == -1) {
+        perror("listen");
+        exit(1);
+    }
+
+    A acceptor;
+    acceptor.add_watch(loop, listen_fd);
+
+    int pipe_fds[2];
+    if (pipe(pipe_fds) == -1) {
+        perror("pipe");
+        exit(1);
+    }
+    write(pipe_fds[1], "x", 1);
+    bystander bys;
+    bys.accepted = &acceptor.accepted;
+    bys.add_watch(loop, pipe_fds[0], dasynq::IN_EVENTS);
+
+    std::vector<int> clients;
+    size_t connected = 0;
+
+    unsigned long long start = now_nsecs();
+    unsigned long long end = start + (unsigned long long)(duration * 1000000000.0);
+    unsigned long long now;
+    do {
+        // Connect a burst of clients (on the loopback interface, the connection is established,
+        // and queued on the listening socket, by connect() itself):
+        for (int i = 0; i < burst; i++) {
+            int fd = socket(AF_INET, SOCK_STREAM, 0);
+            if (fd == -1 || connect(fd, (sockaddr *)&addr, sizeof(addr)) == -1) {
+                perror("connect");
+                exit(1);
+            }
+            clients.push_back(fd);
+        }
+        connected += burst;
+
+        while (acceptor.accepted < connected) {
+            loop.run();
+        }
+
+        // Close with a reset, to avoid accumulating connections in TIME_WAIT state:
+        for (int fd : clients) {
+            struct linger lg = { 1, 0 };
+            setsockopt(fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+            close(fd);
+        }
+        clients.clear();
+
+        now = now_nsecs();
+    } while (now < end);
+
+    double secs = (now - start) / 1000000000.0;
+
+    acceptor.deregister(loop);
+    bys.deregister(loop);
+    close(listen_fd);
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+
+    printf("%-24s %9.0f connections/s  %9.0f bystander dispatches/s  max. %zu accepts between\n",
+            name, acceptor.accepted / secs, bys.dispatches / secs, bys.max_gap);
+}
+
+int main(int argc, char **argv)
+{
+    int burst = 256;
+    double duration = 2.0;
+
+    int c;
+    while ((c = getopt(argc, argv, "b:t:")) != -1) {
+        switch (c) {
+        case 'b':
+            burst = atoi(optarg);
+            break;
+        case 't':
+            duration = atof(optarg);
+            break;
+        default:
+            fprintf(stderr, "Illegal argument \"%c\"\n", c);
+            return 1;
+        }
+    }
+
+    run_bench<single_acceptor>("accept() per event:", burst, duration);
+    run_bench<loop_acceptor>("accept() until EAGAIN:", burst, duration);
+    run_bench<listener>("listener_watcher:", burst, duration);
+
+    return 0;
+}
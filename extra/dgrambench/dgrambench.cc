@@ -0,0 +1,219 @@
+// Datagram throughput benchmark for Dasynq.
+//
+// Two UDP sockets are bound to the loopback address. Bursts of datagrams are sent from one to the
+// other, and after each burst the event loop is run to receive them, for a given duration. The
+// receiving side is handled either by an fd_watcher which receives a single datagram (with
+// recvfrom()) per event, or by a datagram_watcher which receives batches (with recvmmsg()). The
+// sending side correspondingly uses sendto() for each datagram, or datagram_watcher's
+// queue_datagram() for each datagram and flush() for each burst (which uses sendmmsg(), and
+// optionally UDP segmentation offload). The rate of received datagrams is reported.
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <time.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include <vector>
+
+#include "dasynq.h"
+
+using loop_t = dasynq::event_loop_n;
+using dasynq::rearm;
+
+static unsigned long long now_nsecs()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Receives a single datagram per event, with recvfrom()
+class simple_receiver : public loop_t::fd_watcher_impl<simple_receiver>
+{
+    public:
+    size_t received = 0;
+
+    void add_watch(loop_t &loop, int fd)
+    {
+        fd_watcher_impl::add_watch(loop, fd, dasynq::IN_EVENTS);
+    }
+
+    rearm fd_event(loop_t &loop, int fd, int flags)
+    {
+        char buf[65536];
+        sockaddr_storage addr;
+        socklen_t addr_len = sizeof(addr);
+        if (recvfrom(fd, buf, sizeof(buf), 0, (sockaddr *)&addr, &addr_len) >= 0) {
+            received++;
+        }
+        return rearm::REARM;
+    }
+};
+
+// Sends each datagram with sendto()
+class simple_sender
+{
+    int fd;
+
+    public:
+    void add_watch(loop_t &loop, int fd_p)
+    {
+        fd = fd_p;
+    }
+
+    void send(loop_t &loop, const char *buf, size_t len, const sockaddr *addr, socklen_t addr_len)
+    {
+        sendto(fd, buf, len, 0, addr, addr_len);
+    }
+
+    void end_burst(loop_t &loop)
+    {
+    }
+
+    void deregister(loop_t &loop)
+    {
+    }
+};
+
+// datagram_watcher, receiving in batches and sending with queue_datagram()/flush()
+template <bool offload>
+class batch_watcher : public loop_t::datagram_watcher_impl<batch_watcher<offload>>
+{
+    public:
+    size_t received = 0;
+
+    void add_watch(loop_t &loop, int fd)
+    {
+        this->set_offload(offload, offload);
+        loop_t::datagram_watcher_impl<batch_watcher<offload>>::add_watch(loop, fd);
+    }
+
+    rearm datagrams_received(loop_t &loop, const dasynq::datagram *dgrams, size_t count)
+    {
+        received += count;
+        return rearm::REARM;
+    }
+
+    void send(loop_t &loop, const char *buf, size_t len, const sockaddr *addr, socklen_t addr_len)
+    {
+        this->queue_datagram(loop, buf, len, addr, addr_len);
+    }
+
+    void end_burst(loop_t &loop)
+    {
+        this->flush(loop);
+    }
+};
+
+static int open_socket(sockaddr_in &addr)
+{
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    if (fd == -1) {
+        perror("socket");
+        exit(1);
+    }
+    int bufsize = 4 * 1024 * 1024;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addr_len = sizeof(addr);
+    if (bind(fd, (sockaddr *)&addr, sizeof(addr)) == -1 || getsockname(fd, (sockaddr *)&addr, &addr_len) == -1) {
+        perror("bind");
+        exit(1);
+    }
+    return fd;
+}
+
+template <typename S, typename R>
+static double run_bench(size_t dgram_size, int burst, double duration, size_t &sent_count,
+        size_t &recv_count)
+{
+    loop_t loop;
+    S sender;
+    R receiver;
+
+    sockaddr_in send_addr, recv_addr;
+    int send_fd = open_socket(send_addr);
+    int recv_fd = open_socket(recv_addr);
+    sender.add_watch(loop, send_fd);
+    receiver.add_watch(loop, recv_fd);
+
+    std::vector<char> dgram(dgram_size, 'x');
+    size_t sent = 0;
+
+    unsigned long long start = now_nsecs();
+    unsigned long long end = start + (unsigned long long)(duration * 1000000000.0);
+    unsigned long long now;
+
+    do {
+        for (int i = 0; i < burst; i++) {
+            sender.send(loop, dgram.data(), dgram_size, (sockaddr *)&recv_addr, sizeof(recv_addr));
+        }
+        sender.end_burst(loop);
+        sent += burst;
+
+        // Receive (the datagrams are delivered, or dropped, on the loopback interface during sending):
+        size_t prev_received;
+        do {
+            prev_received = receiver.received;
+            loop.poll();
+        } while (receiver.received != prev_received);
+        now = now_nsecs();
+    } while (now < end);
+
+    unsigned long long elapsed = now - start;
+    sent_count = sent;
+    recv_count = receiver.received;
+
+    sender.deregister(loop);
+    receiver.deregister(loop);
+    close(send_fd);
+    close(recv_fd);
+
+    return double(receiver.received) / (elapsed / 1000000000.0);
+}
+
+template <typename S, typename R>
+static void report(const char *name, size_t dgram_size, int burst, double duration)
+{
+    size_t sent, received;
+    double rate = run_bench<S, R>(dgram_size, burst, duration, sent, received);
+    printf("%-40s %10.0f datagrams/s  (%.2f%% lost)\n", name, rate,
+            sent ? (100.0 * (sent - received) / sent) : 0.0);
+}
+
+int main(int argc, char **argv)
+{
+    size_t dgram_size = 100;
+    int burst = 64;
+    double duration = 2.0;
+
+    int c;
+    while ((c = getopt(argc, argv, "s:b:t:")) != -1) {
+        switch (c) {
+        case 's':
+            dgram_size = atoi(optarg);
+            break;
+        case 'b':
+            burst = atoi(optarg);
+            break;
+        case 't':
+            duration = atof(optarg);
+            break;
+        default:
+            fprintf(stderr, "Illegal argument \"%c\"\n", c);
+            return 1;
+        }
+    }
+
+    report<simple_sender, simple_receiver>("sendto() / recvfrom() per event:", dgram_size, burst, duration);
+    report<batch_watcher<false>, batch_watcher<false>>("datagram_watcher:", dgram_size, burst, duration);
+    report<batch_watcher<true>, batch_watcher<true>>("datagram_watcher (GSO/GRO):", dgram_size, burst, duration);
+
+    return 0;
+}
@@ -0,0 +1,149 @@
+// Pause/resume benchmark for Dasynq.
+//
+// A large number of fd watchers (on eventfd descriptors, which are never readable) are registered,
+// and then repeatedly disabled and re-enabled as a group, as might be done to apply backpressure to
+// a set of connections. The time taken to disable (pause) and enable (resume) all the watchers is
+// measured, both by calling set_enabled on each watcher individually and by using a watcher_set.
+// Optionally (-t), another thread polls the event loop throughout, so that enabling a watcher
+// requires the polling thread to be interrupted.
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <time.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "dasynq.h"
+
+using loop_t = dasynq::event_loop_th;
+using dasynq::rearm;
+
+static unsigned long long now_nsecs()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+class my_watcher : public loop_t::fd_watcher_impl<my_watcher>
+{
+    public:
+    rearm fd_event(loop_t &loop, int fd, int flags)
+    {
+        return rearm::REARM;
+    }
+};
+
+int main(int argc, char **argv)
+{
+    int num_watchers = 10000;
+    int num_iterations = 20;
+    bool poll_thread = false;
+
+    int c;
+    while ((c = getopt(argc, argv, "n:c:t")) != -1) {
+        switch (c) {
+        case 'n':
+            num_watchers = atoi(optarg);
+            break;
+        case 'c':
+            num_iterations = atoi(optarg);
+            break;
+        case 't':
+            poll_thread = true;
+            break;
+        default:
+            fprintf(stderr, "Illegal argument \"%c\"\n", c);
+            return 1;
+        }
+    }
+
+    loop_t loop;
+    loop.reserve(num_watchers, 0);
+
+    std::vector<my_watcher> watchers(num_watchers);
+    loop_t::watcher_set wset;
+    for (int i = 0; i < num_watchers; i++) {
+        int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (fd == -1) {
+            perror("eventfd");
+            return 1;
+        }
+        watchers[i].add_watch(loop, fd, dasynq::IN_EVENTS);
+        wset.add(&watchers[i]);
+    }
+
+    std::atomic<bool> stop(false);
+    std::thread poller;
+    int stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    auto stop_watcher = loop_t::fd_watcher::add_watch(loop, stop_fd, dasynq::IN_EVENTS,
+            [](loop_t &eloop, int fd, int flags) -> rearm {
+        return rearm::REMOVE;
+    });
+    if (poll_thread) {
+        poller = std::thread([&]() {
+            while (! stop.load()) {
+                loop.run();
+            }
+        });
+        // give the poller a chance to start waiting:
+        usleep(10000);
+    }
+
+    unsigned long long ind_pause = 0, ind_resume = 0;
+    unsigned long long set_pause = 0, set_resume = 0;
+
+    for (int i = 0; i < num_iterations; i++) {
+        unsigned long long t0 = now_nsecs();
+        for (auto &w : watchers) {
+            w.set_enabled(loop, false);
+        }
+        unsigned long long t1 = now_nsecs();
+        for (auto &w : watchers) {
+            w.set_enabled(loop, true);
+        }
+        unsigned long long t2 = now_nsecs();
+        wset.disable_all(loop);
+        unsigned long long t3 = now_nsecs();
+        wset.enable_all(loop);
+        unsigned long long t4 = now_nsecs();
+
+        ind_pause += t1 - t0;
+        ind_resume += t2 - t1;
+        set_pause += t3 - t2;
+        set_resume += t4 - t3;
+    }
+
+    if (poll_thread) {
+        stop.store(true);
+        uint64_t one = 1;
+        if (write(stop_fd, &one, sizeof(one)) != sizeof(one)) {
+            perror("write");
+        }
+        poller.join();
+    }
+    else {
+        stop_watcher->deregister(loop);
+    }
+    close(stop_fd);
+
+    printf("watchers: %d  iterations: %d%s\n", num_watchers, num_iterations,
+            poll_thread ? "  (with polling thread)" : "");
+    printf("individual:   pause %llu us  resume %llu us\n", ind_pause / num_iterations / 1000,
+            ind_resume / num_iterations / 1000);
+    printf("watcher_set:  pause %llu us  resume %llu us\n", set_pause / num_iterations / 1000,
+            set_resume / num_iterations / 1000);
+
+    for (auto &w : watchers) {
+        int fd = w.get_watched_fd();
+        w.deregister(loop);
+        close(fd);
+    }
+
+    return 0;
+}
@@ -0,0 +1,167 @@
+// Priority latency benchmark for Dasynq.
+//
+// A number of low-priority socket watchers are kept permanently readable, and each performs some
+// busy work when dispatched. A separate thread periodically writes a timestamp to a pipe watched by
+// a high-priority watcher; the delay between the write and the dispatch of the high-priority watcher
+// is measured. With the default settings, the high-priority watcher may need to wait for a whole
+// batch of low-priority watchers to be processed; with a re-poll interval set (-r / -u), it should be
+// dispatched much sooner.
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "dasynq.h"
+
+using loop_t = dasynq::event_loop_n;
+using dasynq::rearm;
+
+static unsigned long long now_nsecs()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void busy_wait(unsigned usecs)
+{
+    unsigned long long until = now_nsecs() + usecs * 1000ULL;
+    while (now_nsecs() < until) { }
+}
+
+static int num_low = 200;          // number of low-priority watchers
+static unsigned work_usecs = 20;   // busy work per low-priority dispatch (usecs)
+static int num_samples = 1000;     // number of latency samples to collect
+static unsigned interval_usecs = 2000; // interval between high-priority events (usecs)
+
+class low_watcher : public loop_t::fd_watcher_impl<low_watcher>
+{
+    public:
+    rearm fd_event(loop_t &loop, int fd, int flags)
+    {
+        // Leave the data unread, so that the watcher remains ready:
+        busy_wait(work_usecs);
+        return rearm::REARM;
+    }
+};
+
+class high_watcher : public loop_t::fd_watcher_impl<high_watcher>
+{
+    public:
+    std::vector<unsigned long long> latencies;
+
+    rearm fd_event(loop_t &loop, int fd, int flags)
+    {
+        unsigned long long stamp;
+        while (read(fd, &stamp, sizeof(stamp)) == sizeof(stamp)) {
+            latencies.push_back(now_nsecs() - stamp);
+        }
+        return rearm::REARM;
+    }
+};
+
+int main(int argc, char **argv)
+{
+    unsigned repoll_dispatches = 0;
+    unsigned repoll_usecs = 0;
+
+    int c;
+    while ((c = getopt(argc, argv, "n:s:c:i:r:u:")) != -1) {
+        switch (c) {
+        case 'n':
+            num_low = atoi(optarg);
+            break;
+        case 's':
+            work_usecs = atoi(optarg);
+            break;
+        case 'c':
+            num_samples = atoi(optarg);
+            break;
+        case 'i':
+            interval_usecs = atoi(optarg);
+            break;
+        case 'r':
+            repoll_dispatches = atoi(optarg);
+            break;
+        case 'u':
+            repoll_usecs = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Illegal argument \"%c\"\n", c);
+            return 1;
+        }
+    }
+
+    loop_t loop;
+    loop.set_repoll_interval(repoll_dispatches, repoll_usecs);
+
+    std::vector<low_watcher> low_watchers(num_low);
+    std::vector<int> low_fds;
+    for (int i = 0; i < num_low; i++) {
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1) {
+            perror("socketpair");
+            return 1;
+        }
+        if (write(fds[1], "e", 1) != 1) {
+            perror("write");
+            return 1;
+        }
+        low_fds.push_back(fds[0]);
+        low_fds.push_back(fds[1]);
+        low_watchers[i].add_watch(loop, fds[0], dasynq::IN_EVENTS, true, 100);
+    }
+
+    int hpipe[2];
+    if (pipe2(hpipe, O_NONBLOCK) == -1) {
+        perror("pipe2");
+        return 1;
+    }
+
+    high_watcher hwatcher;
+    hwatcher.latencies.reserve(num_samples);
+    hwatcher.add_watch(loop, hpipe[0], dasynq::IN_EVENTS, true, 1);
+
+    std::atomic<bool> stop(false);
+    std::thread writer([&]() {
+        while (! stop.load(std::memory_order_relaxed)) {
+            usleep(interval_usecs);
+            unsigned long long stamp = now_nsecs();
+            if (write(hpipe[1], &stamp, sizeof(stamp)) != sizeof(stamp)) break;
+        }
+    });
+
+    while (hwatcher.latencies.size() < size_t(num_samples)) {
+        loop.run();
+    }
+
+    stop.store(true);
+    writer.join();
+
+    std::vector<unsigned long long> &lat = hwatcher.latencies;
+    std::sort(lat.begin(), lat.end());
+    size_t n = lat.size();
+    printf("samples: %zu  p50: %llu us  p99: %llu us  max: %llu us\n", n, lat[n / 2] / 1000,
+            lat[std::min(n - 1, n * 99 / 100)] / 1000, lat[n - 1] / 1000);
+
+    hwatcher.deregister(loop);
+    for (auto &w : low_watchers) {
+        w.deregister(loop);
+    }
+    for (int fd : low_fds) {
+        close(fd);
+    }
+    close(hpipe[0]);
+    close(hpipe[1]);
+
+    return 0;
+}
@@ -0,0 +1,237 @@
+// Stream output throughput benchmark for Dasynq.
+//
+// A number of connections (socket pairs) are set up. For each connection, small messages are sent
+// on one end, and read from the other end by an fd watcher, until a total amount of data has been
+// transferred. The sending side is handled either by a bidi_fd_watcher with a std::string output
+// buffer (as in the chatserver example: the buffer is appended to, and one write() call is made for
+// each output event, after which the written data is erased from the front of the string) or by a
+// stream_watcher (either sending each message with send(), or buffering a burst of messages with
+// buffer_output() and then calling flush()). In all cases the sender queues messages for a connection
+// until a given amount of output is buffered for it (or all data has been queued).
+
+#include <sys/socket.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include <string>
+#include <vector>
+
+#include "dasynq.h"
+
+using loop_t = dasynq::event_loop_n;
+using dasynq::rearm;
+
+static unsigned long long now_nsecs()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Reads and counts data at the receiving end of a connection
+class sink_watcher : public loop_t::fd_watcher_impl<sink_watcher>
+{
+    public:
+    size_t received = 0;
+
+    rearm fd_event(loop_t &loop, int fd, int flags)
+    {
+        char buf[65536];
+        ssize_t r;
+        while ((r = read(fd, buf, sizeof(buf))) > 0) {
+            received += r;
+        }
+        return rearm::REARM;
+    }
+};
+
+// Naive output buffering, as in examples/chatserver/chatserver-mt.cc
+class naive_watcher : public loop_t::bidi_fd_watcher_impl<naive_watcher>
+{
+    std::string outbuf;
+
+    public:
+    void add_watch(loop_t &loop, int fd)
+    {
+        bidi_fd_watcher_impl::add_watch(loop, fd, 0);
+    }
+
+    rearm read_ready(loop_t &loop, int fd)
+    {
+        return rearm::DISARM;
+    }
+
+    rearm write_ready(loop_t &loop, int fd)
+    {
+        int r = write(fd, outbuf.c_str(), outbuf.length());
+        if (r > 0) {
+            outbuf = outbuf.substr(r);
+        }
+        return outbuf.empty() ? rearm::DISARM : rearm::REARM;
+    }
+
+    void queue_msg(loop_t &loop, const char *buf, size_t len)
+    {
+        bool was_empty = outbuf.empty();
+        outbuf.append(buf, len);
+        if (was_empty) {
+            set_out_watch_enabled(loop, true);
+        }
+    }
+
+    void end_burst(loop_t &loop)
+    {
+    }
+
+    size_t get_output_size()
+    {
+        return outbuf.size();
+    }
+};
+
+// stream_watcher, using send() for each message
+class stream_watcher : public loop_t::stream_watcher_impl<stream_watcher>
+{
+    public:
+    rearm data_received(loop_t &loop, dasynq::stream_buffer &input)
+    {
+        input.clear();
+        return rearm::REARM;
+    }
+
+    void queue_msg(loop_t &loop, const char *buf, size_t len)
+    {
+        send(loop, buf, len);
+    }
+
+    void end_burst(loop_t &loop)
+    {
+    }
+};
+
+// stream_watcher, using buffer_output() for each message and flush() after each burst of messages
+class batching_stream_watcher : public loop_t::stream_watcher_impl<batching_stream_watcher>
+{
+    public:
+    rearm data_received(loop_t &loop, dasynq::stream_buffer &input)
+    {
+        input.clear();
+        return rearm::REARM;
+    }
+
+    void queue_msg(loop_t &loop, const char *buf, size_t len)
+    {
+        buffer_output(loop, buf, len);
+    }
+
+    void end_burst(loop_t &loop)
+    {
+        flush(loop);
+    }
+};
+
+template <typename W>
+static double run_bench(int num_conns, size_t msg_size, size_t total, size_t max_buffered)
+{
+    loop_t loop;
+    std::vector<W> senders(num_conns);
+    std::vector<sink_watcher> sinks(num_conns);
+    std::vector<size_t> sent(num_conns);
+    std::vector<int> fds;
+
+    for (int i = 0; i < num_conns; i++) {
+        int sv[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+            perror("socketpair");
+            exit(1);
+        }
+        fcntl(sv[0], F_SETFL, O_NONBLOCK);
+        fcntl(sv[1], F_SETFL, O_NONBLOCK);
+        fds.push_back(sv[0]);
+        fds.push_back(sv[1]);
+        senders[i].add_watch(loop, sv[0]);
+        sinks[i].add_watch(loop, sv[1], dasynq::IN_EVENTS);
+    }
+
+    std::vector<char> msg(msg_size, 'x');
+
+    unsigned long long start = now_nsecs();
+
+    bool done = false;
+    while (! done) {
+        done = true;
+        for (int i = 0; i < num_conns; i++) {
+            while (sent[i] < total && senders[i].get_output_size() < max_buffered) {
+                senders[i].queue_msg(loop, msg.data(), msg_size);
+                sent[i] += msg_size;
+            }
+            senders[i].end_burst(loop);
+            if (sinks[i].received < total) {
+                done = false;
+            }
+        }
+        if (! done) {
+            loop.run();
+        }
+    }
+
+    unsigned long long elapsed = now_nsecs() - start;
+
+    for (int i = 0; i < num_conns; i++) {
+        senders[i].deregister(loop);
+        sinks[i].deregister(loop);
+    }
+    for (int fd : fds) {
+        close(fd);
+    }
+
+    return double(total) * num_conns / 1048576.0 / (elapsed / 1000000000.0);
+}
+
+int main(int argc, char **argv)
+{
+    int num_conns = 16;
+    size_t msg_size = 100;
+    size_t total_mb = 64;
+    size_t max_buffered_kb = 1024;
+
+    int c;
+    while ((c = getopt(argc, argv, "n:s:t:b:")) != -1) {
+        switch (c) {
+        case 'n':
+            num_conns = atoi(optarg);
+            break;
+        case 's':
+            msg_size = atoi(optarg);
+            break;
+        case 't':
+            total_mb = atoi(optarg);
+            break;
+        case 'b':
+            max_buffered_kb = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Illegal argument \"%c\"\n", c);
+            return 1;
+        }
+    }
+
+    size_t total = total_mb * 1048576 / num_conns;
+    total -= total % msg_size;
+    size_t max_buffered = max_buffered_kb * 1024;
+
+    double naive_rate = run_bench<naive_watcher>(num_conns, msg_size, total, max_buffered);
+    printf("std::string buffer: %8.1f MB/s\n", naive_rate);
+
+    double stream_rate = run_bench<stream_watcher>(num_conns, msg_size, total, max_buffered);
+    printf("stream_watcher:     %8.1f MB/s  (send() per message)\n", stream_rate);
+
+    double batched_rate = run_bench<batching_stream_watcher>(num_conns, msg_size, total, max_buffered);
+    printf("stream_watcher:     %8.1f MB/s  (buffer_output() per message, flush() per burst)\n",
+            batched_rate);
+
+    return 0;
+}
@@ -7,6 +7,8 @@
 #include "dasynq/stableheap.h"
 #include "dasynq/interrupt.h"
 #include "dasynq/util.h"
+#include "dasynq/slabpool.h"
+#include "dasynq/bufpool.h"
 
 // Dasynq uses a "mix-in" pattern to produce an event loop implementation incorporating selectable
 // implementations of various components (main backend, timers, child process watch mechanism etc). In C++
@@ -47,8 +49,11 @@
 // below, which contains the "main" traits, particularly the sigdata_t, fd_r and fd_s types). The traits
 // classes are composable via inheritance in a similar way to the backend components (and in fact, the
 // traits expose the composed backend template via the `backend_tmpl' member, so that `loop_t' is defined
-// via reference to that rather than as in the example above). Currently `child_proc_traits' is always
-// the terminal traits in the chain, as all backends use it.
+// via reference to that rather than as in the example above). The terminal traits in the chain is always
+// either `child_proc_traits' or, for a loop without child process watch support, `no_child_proc_traits'.
+//
+// For each backend, `build_loop_traits_t<child_watch, system_timers>' composes the traits chain with
+// optional features removed (see `custom_traits'); `loop_traits_t' is the chain with all features.
 //
 // Note that the event_dispatch class exposes the loop traits as traits_t, and these are then potentially
 // augmented at each stage of the mechanism inheritance chain (i.e. the final traits are exposed as
@@ -110,7 +115,9 @@ inline namespace v2 {
 #include "dasynq/childproc.h"
 namespace dasynq {
 inline namespace v2 {
-    using loop_traits_t = macos_kqueue_traits<timer_events_traits<interrupt_channel_traits<child_proc_traits>>>;
+    template <bool child_watch, bool system_timers> using build_loop_traits_t
+            = macos_kqueue_traits<timer_events_traits<interrupt_channel_traits<child_proc_traits_for<child_watch>>>>;
+    using loop_traits_t = build_loop_traits_t<true, true>;
 } // namespace v2
 } // namespace dasynq
 #else
@@ -118,33 +125,65 @@ inline namespace v2 {
 #include "dasynq/childproc.h"
 namespace dasynq {
 inline namespace v2 {
-    using loop_traits_t = kqueue_traits<timer_events_traits<interrupt_channel_traits<child_proc_traits>>>;
+    template <bool child_watch, bool system_timers> using build_loop_traits_t
+            = kqueue_traits<timer_events_traits<interrupt_channel_traits<child_proc_traits_for<child_watch>>>>;
+    using loop_traits_t = build_loop_traits_t<true, true>;
 } // namespace v2
 } // namespace dasynq
 #endif
 #elif DASYNQ_HAVE_EPOLL
 #include "dasynq/epoll.h"
-#include "dasynq/timerfd.h"
 #include "dasynq/childproc.h"
+#if DASYNQ_HAVE_EPOLL_PWAIT2
+#include "dasynq/pwait2timer.h"
+namespace dasynq {
+inline namespace v2 {
+    // (if the system clock timer is omitted, the monotonic clock timerfd runs all timers):
+    template <bool child_watch, bool system_timers> using build_loop_traits_t = typename std::conditional<
+            system_timers,
+            epoll_traits<pwait2_timer_traits<interrupt_channel_traits<child_proc_traits_for<child_watch>>>>,
+            epoll_traits<interrupt_channel_traits<timer_fd_traits<child_proc_traits_for<child_watch>, false>>>
+            >::type;
+    using loop_traits_t = build_loop_traits_t<true, true>;
+} // namespace v2
+} // namespace dasynq
+#else
+#include "dasynq/timerfd.h"
 namespace dasynq {
 inline namespace v2 {
-    using loop_traits_t = epoll_traits<interrupt_channel_traits<timer_fd_traits<child_proc_traits>>>;
+    template <bool child_watch, bool system_timers> using build_loop_traits_t
+            = epoll_traits<interrupt_channel_traits<timer_fd_traits<child_proc_traits_for<child_watch>, system_timers>>>;
+    using loop_traits_t = build_loop_traits_t<true, true>;
 } // namespace v2
 } // namespace dasynq
+#endif
 #else
 #include "dasynq/childproc.h"
-#if DASYNQ_HAVE_PSELECT
+#if DASYNQ_HAVE_POLL
+#include "dasynq/poll.h"
+namespace dasynq {
+inline namespace v2 {
+    template <bool child_watch, bool system_timers> using build_loop_traits_t
+            = poll_traits<timer_events_traits<interrupt_channel_traits<child_proc_traits_for<child_watch>>>>;
+    using loop_traits_t = build_loop_traits_t<true, true>;
+} // namespace v2
+} // namespace dasynq
+#elif DASYNQ_HAVE_PSELECT
 #include "dasynq/pselect.h"
 namespace dasynq {
 inline namespace v2 {
-    using loop_traits_t = pselect_traits<timer_events_traits<interrupt_channel_traits<child_proc_traits>>>;
+    template <bool child_watch, bool system_timers> using build_loop_traits_t
+            = pselect_traits<timer_events_traits<interrupt_channel_traits<child_proc_traits_for<child_watch>>>>;
+    using loop_traits_t = build_loop_traits_t<true, true>;
 } // namespace v2
 } // namespace dasynq
 #else
 #include "dasynq/select.h"
 namespace dasynq {
 inline namespace v2 {
-    using loop_traits_t = select_traits<timer_events_traits<interrupt_channel_traits<child_proc_traits>>>;
+    template <bool child_watch, bool system_timers> using build_loop_traits_t
+            = select_traits<timer_events_traits<interrupt_channel_traits<child_proc_traits_for<child_watch>>>>;
+    using loop_traits_t = build_loop_traits_t<true, true>;
 } // namespace v2
 } // namespace dasynq
 #endif
@@ -161,6 +200,7 @@ inline namespace v2 {
 #include <cstdint>
 #include <cstddef>
 #include <system_error>
+#include <vector>
 
 #include <unistd.h>
 #include <fcntl.h>
@@ -363,7 +403,7 @@ class loop_access {
 
     template <typename Loop>
     static rearm process_secondary_rearm(Loop &loop, typename Loop::base_bidi_fd_watcher *bdfw,
-            base_watcher *outw, rearm rearm_type) noexcept
+            queued_watcher *outw, rearm rearm_type) noexcept
     {
         return loop.process_secondary_rearm(bdfw, outw, rearm_type);
     }
@@ -390,16 +430,54 @@ class loop_access {
     }
 
     template <typename Loop>
-    static void requeue_watcher(Loop &loop, base_watcher *watcher) noexcept
+    static void process_group_timer_rearm(Loop &loop, typename Loop::base_group_timer_watcher *bgtw,
+            rearm rearm_type) noexcept
+    {
+        loop.process_group_timer_rearm(bgtw, rearm_type);
+    }
+
+    template <typename Loop>
+    static void requeue_watcher(Loop &loop, queued_watcher *watcher) noexcept
     {
         loop.requeue_watcher(watcher);
     }
 
     template <typename Loop>
-    static void release_watcher(Loop &loop, base_watcher *watcher) noexcept
+    static void release_watcher(Loop &loop, queued_watcher *watcher) noexcept
     {
         loop.release_watcher(watcher);
     }
+
+    template <typename Loop>
+    static void register_queued(Loop &loop, base_watcher *watcher)
+    {
+        loop.register_queued(watcher);
+    }
+
+    template <typename Loop>
+    static void deregister_queued(Loop &loop, base_watcher *watcher) noexcept
+    {
+        loop.deregister_queued(watcher);
+    }
+
+    template <typename Loop>
+    static void queue_completions(Loop &loop, queued_watcher * const *watchers, size_t count) noexcept
+    {
+        loop.queue_completions(watchers, count);
+    }
+
+    template <typename Loop>
+    static void queue_completion_async(Loop &loop, queued_watcher *watcher, bool &wake_pending) noexcept
+    {
+        loop.queue_completion_async(watcher, wake_pending);
+    }
+
+    template <typename Loop>
+    static void set_fd_watchers_enabled(Loop &loop, typename Loop::fd_watcher * const *watchers,
+            size_t count, bool enable) noexcept
+    {
+        loop.set_fd_watchers_enabled(watchers, count, enable);
+    }
 };
 
 // Do standard post-dispatch processing for a watcher. This handles the case of removing or
@@ -420,7 +498,7 @@ template <typename Loop> void post_dispatch(Loop &loop, base_watcher *watcher, r
 
 // Post-dispatch handling for bidi fd watchers.
 template <typename Loop> void post_dispatch(Loop &loop, bidi_fd_watcher<Loop> *bdfd_watcher,
-        base_watcher *out_watcher, rearm rearm_type)
+        queued_watcher *out_watcher, rearm rearm_type)
 {
     base_watcher *watcher = (base_watcher *)bdfd_watcher;
     if (rearm_type == rearm::REMOVE) {
@@ -454,10 +532,29 @@ template <typename Traits, typename LoopTraits> class event_dispatch
     using traits_t = Traits;
     using delayed_init = dasynq::delayed_init;
 
+    // Allocator for loop data structures (rebound as required):
+    using allocator_t = typename traits_allocator<LoopTraits>::type;
+
+    // Begin and end a batch of fd watch enable/disable changes (made via enable_fd_watch_nolock() /
+    // disable_fd_watch_nolock()). A backend which can submit several changes to the kernel at once
+    // (kqueue) hides these, to defer the changes until the end of the batch; by default, each change
+    // is made immediately. Call with lock held.
+    void begin_fd_changes() noexcept { }
+    void end_fd_changes() noexcept { }
+
     private:
 
     // queue data structure/pointer
-    prio_queue event_queue;
+    using event_queue_t = heap_def<node_type, int,
+            typename std::allocator_traits<allocator_t>::template rebind_alloc<node_type>>;
+    event_queue_t event_queue;
+
+    // A single queued watcher, held outside the event queue. When a watcher is queued while the
+    // queue is empty, it is stored here rather than inserted into the queue; if another watcher is
+    // subsequently queued, it is first moved into the queue (so that priority and FIFO ordering are
+    // maintained). This avoids the cost of queue insertion and removal in the common case where a
+    // single event is received and processed at a time. If non-null, event_queue is empty.
+    queued_watcher *lone_watcher = nullptr;
 
     using base_signal_watcher = dprivate::base_signal_watcher<typename traits_t::sigdata_t>;
     using base_child_watcher = dprivate::base_child_watcher<typename traits_t::proc_status_t>;
@@ -465,25 +562,45 @@ template <typename Traits, typename LoopTraits> class event_dispatch
 
     // Add a watcher into the queueing system (but don't queue it). Call with lock held.
     //   may throw: std::bad_alloc
-    void prepare_watcher(base_watcher *bwatcher)
+    void prepare_watcher(queued_watcher *bwatcher)
     {
         allocate_handle(event_queue, bwatcher->heap_handle, bwatcher);
     }
 
-    void queue_watcher(base_watcher *bwatcher) noexcept
+    // Pre-allocate queue capacity for the specified total number of watchers. Call with lock held.
+    //   may throw: std::bad_alloc
+    void reserve_watchers(size_t amount)
+    {
+        event_queue.reserve(amount);
+    }
+
+    void queue_watcher(queued_watcher *bwatcher) noexcept
     {
+        if (lone_watcher == nullptr) {
+            if (event_queue.empty()) {
+                lone_watcher = bwatcher;
+                return;
+            }
+        }
+        else {
+            event_queue.insert(lone_watcher->heap_handle, lone_watcher->priority);
+            lone_watcher = nullptr;
+        }
         event_queue.insert(bwatcher->heap_handle, bwatcher->priority);
     }
 
-    void dequeue_watcher(base_watcher *bwatcher) noexcept
+    void dequeue_watcher(queued_watcher *bwatcher) noexcept
     {
-        if (event_queue.is_queued(bwatcher->heap_handle)) {
+        if (lone_watcher == bwatcher) {
+            lone_watcher = nullptr;
+        }
+        else if (event_queue.is_queued(bwatcher->heap_handle)) {
             event_queue.remove(bwatcher->heap_handle);
         }
     }
 
     // Remove watcher from the queueing system
-    void release_watcher(base_watcher *bwatcher) noexcept
+    void release_watcher(queued_watcher *bwatcher) noexcept
     {
         event_queue.deallocate(bwatcher->heap_handle);
     }
@@ -494,6 +611,11 @@ template <typename Traits, typename LoopTraits> class event_dispatch
     template <typename T> void init(T *loop) noexcept { }
     void cleanup() noexcept { }
 
+    // Hooks for a timer mechanism which relies on the backend wait timeout (see pwait2timer.h). By
+    // default timers are independent of the wait, and begin_timer_wait returns false.
+    bool begin_timer_wait(bool &do_wait, timespec &ts, timespec *&wait_ts) noexcept { return false; }
+    void end_timer_wait(bool timed_out) noexcept { }
+
     void sigmaskf(int how, const sigset_t *set, sigset_t *oset)
     {
         LoopTraits::sigmaskf(how, set, oset);
@@ -506,6 +628,14 @@ template <typename Traits, typename LoopTraits> class event_dispatch
     {
         base_signal_watcher *bwatcher = static_cast<base_signal_watcher *>(userdata);
         bwatcher->siginfo = siginfo;
+        if (bwatcher->coalesce) {
+            // Leave the signal enabled. If the watcher is already queued, or its handler is running,
+            // just count the signal (the watcher is requeued when the handler returns):
+            if (bwatcher->sig_count++ == 0 && ! bwatcher->active) {
+                queue_watcher(bwatcher);
+            }
+            return false;
+        }
         queue_watcher(bwatcher);
         return true;
     }
@@ -519,15 +649,23 @@ template <typename Traits, typename LoopTraits> class event_dispatch
     {
         base_fd_watcher *bfdw = static_cast<base_fd_watcher *>(userdata);
 
+        bool is_multi_watch = bfdw->watch_flags & multi_watch;
+        if (is_multi_watch && (flags & IO_EVENTS) == 0) {
+            // An error condition only: report it to the output watcher if only that is enabled,
+            // otherwise to the input watcher.
+            int enabled = bfdw->watch_flags & IO_EVENTS;
+            flags |= (enabled == OUT_EVENTS) ? OUT_EVENTS : IN_EVENTS;
+        }
+
         bfdw->event_flags |= flags;
         typename Traits::fd_s watch_fd_s {bfdw->watch_fd};
 
-        base_watcher *bwatcher = bfdw;
+        queued_watcher *bwatcher = bfdw;
 
-        bool is_multi_watch = bfdw->watch_flags & multi_watch;
         if (is_multi_watch) {
             base_bidi_fd_watcher *bbdw = static_cast<base_bidi_fd_watcher *>(bwatcher);
-            bbdw->watch_flags &= ~flags;
+            // (ERR_EVENTS has the same value as multi_watch, so only clear the in/out flags)
+            bbdw->watch_flags &= ~(flags & IO_EVENTS);
             if ((flags & IN_EVENTS) && (flags & OUT_EVENTS)) {
                 // Queue the secondary watcher first:
                 queue_watcher(&bbdw->out_watcher);
@@ -572,23 +710,61 @@ template <typename Traits, typename LoopTraits> class event_dispatch
         queue_watcher(watcher);
     }
 
+    // Expiry of a one-shot timer. If the timer is a timer group, queue the group's expired timers and
+    // return true, with next_timeout set, if the group timer should be re-armed (i.e. if the group
+    // has further armed timers); otherwise, queue the timer watcher and return false.
+    bool receive_timer_expiry(timer_handle_t & timer_handle, void *userdata, int intervals,
+            const time_val &curtime, time_val &next_timeout) noexcept
+    {
+        base_timer_watcher *watcher = static_cast<base_timer_watcher *>(userdata);
+        if (watcher->watchType != watch_type_t::TIMER_GROUP) {
+            watcher->intervals += intervals;
+            queue_watcher(watcher);
+            return false;
+        }
+
+        base_timer_group *group = static_cast<base_timer_group *>(watcher);
+        base_group_timer_watcher *t = group->first;
+        while (t != nullptr && t->expiry <= curtime) {
+            group->unlink(t);
+            // If the timer is already queued, or its handler is running, just record the expiry
+            // (the handler will be requeued when it completes):
+            if (t->intervals++ == 0 && ! t->active) {
+                queue_watcher(t);
+            }
+            t = group->first;
+        }
+
+        if (t == nullptr) {
+            return false;
+        }
+        next_timeout = t->expiry;
+        return true;
+    }
+
     // Pull a single event from the queue; returns nullptr if the queue is empty.
     // Call with lock held.
-    base_watcher *pull_queued_event() noexcept
+    queued_watcher *pull_queued_event() noexcept
     {
+        if (lone_watcher != nullptr) {
+            queued_watcher *r = lone_watcher;
+            lone_watcher = nullptr;
+            return r;
+        }
+
         if (event_queue.empty()) {
             return nullptr;
         }
 
         auto & rhndl = event_queue.get_root();
-        base_watcher *r = dprivate::get_watcher(event_queue, rhndl);
+        queued_watcher *r = dprivate::get_watcher(event_queue, rhndl);
         event_queue.pull_root();
         return r;
     }
 
     size_t num_queued_events() noexcept
     {
-        return event_queue.size();
+        return event_queue.size() + (lone_watcher != nullptr ? 1 : 0);
     }
 
     // Queue a watcher for removal, or issue "removed" callback to it.
@@ -633,7 +809,7 @@ template <typename Traits, typename LoopTraits> class event_dispatch
             watcher->read_removed = true;
         }
 
-        base_watcher *secondary = &(watcher->out_watcher);
+        queued_watcher *secondary = &(watcher->out_watcher);
         if (secondary->active) {
             secondary->deleteme = true;
             release_watcher(watcher);
@@ -662,6 +838,15 @@ template <typename Traits, typename LoopTraits> class event_dispatch
 
 inline namespace v2 {
 
+// Event loop statistics (see event_loop::get_stats()).
+struct loop_stats
+{
+    size_t queued_watchers;         // watchers queued for dispatch
+    size_t buffer_segments_in_use;  // stream buffer pool: segments held by buffers
+    size_t buffer_segments_free;    // stream buffer pool: free segments retained for re-use
+    size_t buffer_segment_size;     // stream buffer pool: size of each segment's data area
+};
+
 // This is the main event_loop implementation. It serves as an interface to the event loop backend (of which
 // it maintains an internal instance). It also serialises polling the backend and provides safe deletion of
 // watchers (see comments inline).
@@ -684,6 +869,8 @@ class event_loop
     friend class dprivate::signal_watcher<my_event_loop_t>;
     friend class dprivate::child_proc_watcher<my_event_loop_t>;
     friend class dprivate::timer<my_event_loop_t>;
+    friend class dprivate::timer_group<my_event_loop_t>;
+    friend class dprivate::group_timer<my_event_loop_t>;
     
     friend class dprivate::loop_access;
 
@@ -703,11 +890,14 @@ class event_loop
     template <typename T> using waitqueue = dprivate::waitqueue<T>;
     template <typename T> using waitqueue_node = dprivate::waitqueue_node<T>;
     using base_watcher = dprivate::base_watcher;
+    using queued_watcher = dprivate::queued_watcher;
     using base_signal_watcher = dprivate::base_signal_watcher<typename loop_traits_t::sigdata_t>;
     using base_fd_watcher = dprivate::base_fd_watcher;
     using base_bidi_fd_watcher = dprivate::base_bidi_fd_watcher;
     using base_child_watcher = dprivate::base_child_watcher<typename loop_traits_t::proc_status_t>;
     using base_timer_watcher = dprivate::base_timer_watcher;
+    using base_group_timer_watcher = dprivate::base_group_timer_watcher;
+    using base_timer_group = dprivate::base_timer_group;
     using watch_type_t = dprivate::watch_type_t;
 
     loop_mech_t loop_mech;
@@ -773,7 +963,29 @@ class event_loop
     bool long_poll_running = false;  // whether any thread is polling the backend (with non-zero timeout)
     waitqueue<mutex_t> attn_waitqueue;
     waitqueue<mutex_t> wait_waitqueue;
-    
+
+    // Interleaved re-polling of the backend while processing a batch of queued events (see
+    // set_repoll_interval()). Zero values disable the corresponding trigger.
+    unsigned repoll_dispatches = 0;  // re-poll after this many dispatches
+    unsigned repoll_usecs = 0;       // re-poll after this many microseconds
+
+    // Pool for dynamically allocated watchers (see get_watcher_allocator()).
+    slab_pool<T_Mutex> watcher_pool;
+
+    // Pool for stream buffer segments (see get_stream_buffer_pool()).
+    stream_buffer_pool<T_Mutex> stream_pool;
+
+    // File descriptor watchers with priority at or above (numerically <=) this level are registered
+    // with the backend using the FAST_FD hint (see set_fast_fd_priority()).
+    bool use_fast_fds = false;
+    int fast_fd_priority = 0;
+
+    // Get the FAST_FD hint flag for registering a watcher with the specified priority.
+    int fast_fd_flag(int prio) noexcept
+    {
+        return (use_fast_fds && prio <= fast_fd_priority) ? FAST_FD : 0;
+    }
+
     mutex_t &get_base_lock() noexcept
     {
         return loop_mech.lock;
@@ -817,10 +1029,20 @@ class event_loop
     {
         std::lock_guard<mutex_t> guard(loop_mech.lock);
 
+        if (register_fd_nolock(callback, fd, eventmask, enabled, emulate)) {
+            interrupt_if_necessary();
+        }
+    }
+
+    // Register an fd watcher; call with lock held. Returns true if the caller should subsequently
+    // call interrupt_if_necessary().
+    bool register_fd_nolock(base_fd_watcher *callback, int fd, int eventmask, bool enabled, bool emulate)
+    {
         loop_mech.prepare_watcher(callback);
 
         try {
-            if (! loop_mech.add_fd_watch(fd, callback, eventmask | ONE_SHOT, enabled, emulate)) {
+            int fast_flag = fast_fd_flag(callback->priority);
+            if (! loop_mech.add_fd_watch(fd, callback, eventmask | ONE_SHOT | fast_flag, enabled, emulate)) {
                 callback->emulatefd = true;
                 callback->emulate_enabled = enabled;
                 if (enabled) {
@@ -831,13 +1053,28 @@ class event_loop
                 }
             }
             else if (enabled && backend_traits_t::interrupt_after_fd_add) {
-                interrupt_if_necessary();
+                return true;
             }
         }
         catch (...) {
             loop_mech.release_watcher(callback);
             throw;
         }
+
+        return false;
+    }
+
+    // Reverse the effect of register_fd_nolock; call with lock held. Used to roll back a partially
+    // completed batch registration (the watcher cannot have been dispatched).
+    void unregister_fd_nolock(base_fd_watcher *callback, int fd) noexcept
+    {
+        if (callback->emulatefd) {
+            loop_mech.dequeue_watcher(callback);
+        }
+        else {
+            loop_mech.remove_fd_watch_nolock(fd, callback->watch_flags);
+        }
+        loop_mech.release_watcher(callback);
     }
     
     // Register a bidi fd watcher. The watch_flags should already be set to the eventmask to watch
@@ -876,7 +1113,8 @@ class event_loop
                     }
                 }
                 else {
-                    if (! loop_mech.add_fd_watch(fd, callback, eventmask | ONE_SHOT, true, emulate)) {
+                    int fast_flag = fast_fd_flag(std::min(callback->priority, callback->out_watcher.priority));
+                    if (! loop_mech.add_fd_watch(fd, callback, eventmask | ONE_SHOT | fast_flag, true, emulate)) {
                         callback->emulatefd = true;
                         callback->out_watcher.emulatefd = true;
                         if (eventmask & IN_EVENTS) {
@@ -921,6 +1159,47 @@ class event_loop
         }
     }
 
+    // Enable or disable a number of fd watchers, acquiring the lock only once, and interrupting the
+    // poll-waiter (if necessary) at most once. Where the backend supports it (kqueue), the changes are
+    // submitted to the kernel together.
+    void set_fd_watchers_enabled(dprivate::fd_watcher<my_event_loop_t> * const *watchers, size_t count,
+            bool enable) noexcept
+    {
+        std::lock_guard<mutex_t> guard(loop_mech.lock);
+
+        loop_mech.begin_fd_changes();
+
+        bool do_interrupt = false;
+        for (size_t i = 0; i < count; i++) {
+            base_fd_watcher *watcher = watchers[i];
+            if (watcher->emulatefd) {
+                if (enable && ! watcher->emulate_enabled) {
+                    loop_mech.queue_watcher(watcher);
+                    do_interrupt = true;
+                }
+                watcher->emulate_enabled = enable;
+            }
+            else if (enable) {
+                loop_mech.enable_fd_watch_nolock(watcher->watch_fd, watcher,
+                        watcher->watch_flags | ONE_SHOT);
+                do_interrupt |= backend_traits_t::interrupt_after_fd_add;
+            }
+            else {
+                loop_mech.disable_fd_watch_nolock(watcher->watch_fd, watcher->watch_flags);
+            }
+
+            if (! enable) {
+                loop_mech.dequeue_watcher(watcher);
+            }
+        }
+
+        loop_mech.end_fd_changes();
+
+        if (do_interrupt) {
+            interrupt_if_necessary();
+        }
+    }
+
     void set_fd_enabled_nolock(base_watcher *watcher, int fd, int watch_flags, bool enabled) noexcept
     {
         if (enabled) {
@@ -1073,6 +1352,28 @@ class event_loop
         loop_mech.set_timer_rel(callback->timer_handle, timeout, interval, true, clock);
     }
 
+    // Extend a timer's timeout (see timer::extend_timer). If the timer is not armed, or if the new
+    // timeout is earlier than the current timeout, the timer is re-armed normally.
+    void extend_timer(base_timer_watcher *callback, const timespec &timeout, clock_type clock) noexcept
+    {
+        time_val interval;
+        {
+            std::lock_guard<mutex_t> guard(loop_mech.lock);
+            if (loop_mech.extend_timer_nolock(callback->timer_handle, timeout, interval, clock)) {
+                return;
+            }
+        }
+        loop_mech.set_timer(callback->timer_handle, timeout, interval, true, clock);
+    }
+
+    void extend_timer_rel(base_timer_watcher *callback, const timespec &timeout, clock_type clock) noexcept
+    {
+        time_val alarmtime;
+        loop_mech.get_time(alarmtime, clock, false);
+        alarmtime += timeout;
+        extend_timer(callback, alarmtime, clock);
+    }
+
     void set_timer_enabled(base_timer_watcher *callback, clock_type clock, bool enabled) noexcept
     {
         loop_mech.enable_timer(callback->timer_handle, enabled, clock);
@@ -1100,18 +1401,142 @@ class event_loop
         release_lock(qnode);
     }
     
-    void dequeue_watcher(base_watcher *watcher) noexcept
+    // Register a timer group member. Group members are not registered with the backend; the group
+    // queues them as they expire.
+    void register_group_timer(base_group_timer_watcher *callback, base_timer_group *group)
+    {
+        std::lock_guard<mutex_t> guard(loop_mech.lock);
+        loop_mech.prepare_watcher(callback);
+        callback->group = group;
+        callback->intervals = 0;
+        callback->armed = false;
+    }
+
+    void deregister(base_group_timer_watcher *callback) noexcept
+    {
+        stop_group_timer(callback);
+
+        waitqueue_node<T_Mutex> qnode;
+        get_attn_lock(qnode);
+
+        loop_mech.issue_delete(callback);
+
+        release_lock(qnode);
+    }
+
+    // Register a watcher which is queued directly, rather than via the backend mechanism (such as
+    // an asynchronous I/O completion watcher; see queue_completions()).
+    //   may throw: std::bad_alloc
+    void register_queued(base_watcher *callback)
+    {
+        std::lock_guard<mutex_t> guard(loop_mech.lock);
+        loop_mech.prepare_watcher(callback);
+    }
+
+    void deregister_queued(base_watcher *callback) noexcept
+    {
+        waitqueue_node<T_Mutex> qnode;
+        get_attn_lock(qnode);
+
+        loop_mech.issue_delete(callback);
+
+        release_lock(qnode);
+    }
+
+    // Queue a number of directly-queued watchers (see register_queued()), eg. for completed
+    // operations. Call with lock free. Any poll in progress is not interrupted.
+    void queue_completions(queued_watcher * const *watchers, size_t count) noexcept
+    {
+        std::lock_guard<mutex_t> guard(loop_mech.lock);
+        for (size_t i = 0; i < count; i++) {
+            loop_mech.queue_watcher(watchers[i]);
+        }
+    }
+
+    // Queue a directly-queued watcher from a thread which is not running the event loop (eg. a
+    // worker thread), and interrupt any poll in progress so that it is processed. The interrupt is
+    // skipped if wake_pending is already set, i.e. an interrupt has already been issued for a
+    // watcher which has not yet been dispatched (and which will cause the queue to be processed);
+    // wake_pending is protected by the loop lock, and should be cleared when such a watcher is
+    // dispatched. Call with lock free.
+    void queue_completion_async(queued_watcher *watcher, bool &wake_pending) noexcept
+    {
+        std::lock_guard<mutex_t> guard(loop_mech.lock);
+        loop_mech.queue_watcher(watcher);
+        if (! wake_pending) {
+            wake_pending = true;
+            loop_mech.interrupt_wait();
+        }
+    }
+
+    // Arm a group timer to expire after the group duration: this just appends it to the group's list.
+    void set_group_timer(base_group_timer_watcher *callback) noexcept
+    {
+        base_timer_group *group = callback->group;
+        clock_type clock = group->clock;
+        time_val expiry;
+        bool is_first;
+        {
+            std::lock_guard<mutex_t> guard(loop_mech.lock);
+            if (callback->armed) {
+                group->unlink(callback);
+            }
+            // Read the time with the lock held, so that the list remains ordered:
+            loop_mech.get_time(expiry, clock, false);
+            expiry += group->duration;
+            callback->expiry = expiry;
+            is_first = group->link(callback);
+        }
+
+        // If the list was empty, the group timer is either not armed or is still set for an earlier
+        // time (the expiry of a since-stopped timer), in which case extending it is cheap. Otherwise,
+        // the group timer is already set to expire no later than the first timer in the list (if it
+        // expires early, it is re-armed for the new first timer).
+        if (is_first) {
+            extend_timer(group, expiry, clock);
+        }
+    }
+
+    // Stop a group timer, discarding any unreported expiry. Call with lock held.
+    void stop_group_timer_nolock(base_group_timer_watcher *callback) noexcept
+    {
+        if (callback->armed) {
+            callback->group->unlink(callback);
+        }
+        callback->intervals = 0;
+        loop_mech.dequeue_watcher(callback);
+    }
+
+    void stop_group_timer(base_group_timer_watcher *callback) noexcept
+    {
+        std::lock_guard<mutex_t> guard(loop_mech.lock);
+        stop_group_timer_nolock(callback);
+    }
+
+    void process_group_timer_rearm(base_group_timer_watcher *callback, rearm rearm_type) noexcept
+    {
+        // Called with lock held
+        if (rearm_type == rearm::REMOVE || rearm_type == rearm::DISARM) {
+            stop_group_timer_nolock(callback);
+        }
+        else if (callback->intervals != 0 && rearm_type != rearm::REQUEUE) {
+            // Re-armed, and expired again, while the handler was running:
+            requeue_watcher(callback);
+        }
+    }
+
+    void dequeue_watcher(queued_watcher *watcher) noexcept
     {
         loop_mech.dequeue_watcher(watcher);
     }
 
-    void requeue_watcher(base_watcher *watcher) noexcept
+    void requeue_watcher(queued_watcher *watcher) noexcept
     {
         loop_mech.queue_watcher(watcher);
         interrupt_if_necessary();
     }
 
-    void release_watcher(base_watcher *watcher) noexcept
+    void release_watcher(queued_watcher *watcher) noexcept
     {
         loop_mech.release_watcher(watcher);
     }
@@ -1221,7 +1646,17 @@ class event_loop
     void process_signal_rearm(base_signal_watcher *bsw, rearm rearm_type) noexcept
     {
         // Called with lock held
-        if (rearm_type == rearm::REARM) {
+        if (bsw->coalesce) {
+            // The signal remains enabled (DISARM and REQUEUE are treated as REARM); requeue the watcher
+            // if further signals were received while the handler was running.
+            if (rearm_type == rearm::REMOVE) {
+                loop_mech.remove_signal_watch_nolock(bsw->siginfo.get_signo());
+            }
+            else if (bsw->sig_count != 0) {
+                requeue_watcher(bsw);
+            }
+        }
+        else if (rearm_type == rearm::REARM) {
             loop_mech.rearm_signal_watch_nolock(bsw->siginfo.get_signo(), bsw);
             if (backend_traits_t::interrupt_after_signal_add) {
                 interrupt_if_necessary();
@@ -1344,7 +1779,7 @@ class event_loop
     }
 
     // Process re-arm for the secondary (output) watcher in a Bi-direction Fd watcher.
-    rearm process_secondary_rearm(base_bidi_fd_watcher *bdfw, base_watcher *outw, rearm rearm_type) noexcept
+    rearm process_secondary_rearm(base_bidi_fd_watcher *bdfw, queued_watcher *outw, rearm rearm_type) noexcept
     {
         bool emulatedfd = outw->emulatefd;
 
@@ -1439,17 +1874,60 @@ class event_loop
         }
     }
 
+    // Poll the backend (without waiting) in the middle of processing a batch of queued events, so
+    // that any newly-ready watchers are queued and can pre-empt lower-priority watchers remaining in
+    // the batch. If another thread is polling the backend, the attention lock cannot be obtained
+    // cheaply, and we don't bother (that thread will queue any new events anyway).
+    // Called with the base lock held; the lock is released while polling.
+    void repoll_backend() noexcept
+    {
+        waitqueue_node<T_Mutex> qnode;
+        loop_mech.lock.unlock();
+        if (poll_attn_lock(qnode)) {
+            loop_mech.pull_events(false);
+            release_lock(qnode);
+        }
+        loop_mech.lock.lock();
+    }
+
+    // Check whether the backend is due to be re-polled during processing of a batch of events,
+    // according to the re-poll interval (as captured at the start of the batch); if so, reset the
+    // dispatch count / start time.
+    bool repoll_due(unsigned dispatches, unsigned usecs, unsigned &dispatch_count, time_val &batch_start) noexcept
+    {
+        if (dispatches != 0 && ++dispatch_count >= dispatches) {
+            dispatch_count = 0;
+            if (usecs != 0) {
+                loop_mech.get_time(batch_start, clock_type::MONOTONIC, true);
+            }
+            return true;
+        }
+
+        if (usecs != 0) {
+            time_val now;
+            loop_mech.get_time(now, clock_type::MONOTONIC, true);
+            time_val elapsed = now - batch_start;
+            if (elapsed.seconds() * 1000000u + elapsed.nseconds() / 1000u >= usecs) {
+                batch_start = now;
+                dispatch_count = 0;
+                return true;
+            }
+        }
+
+        return false;
+    }
+
     // Process queued events; returns true if any events were processed.
     //   limit - maximum number of events to process before returning; -1 for
     //           no limit.
     bool process_events(int limit) noexcept
     {
         loop_mech.lock.lock();
-        
+
         if (limit == 0) {
             return false;
         }
-        
+
         // limit processing to the number of events currently queued, to avoid prolonged processing
         // of watchers which requeueu themselves immediately (including file watchers which are using
         // emulation for watching regular files)
@@ -1458,43 +1936,37 @@ class event_loop
         // queued events when cast to size_t (which is unsigned).
         limit = std::min(size_t(limit), loop_mech.num_queued_events());
 
-        base_watcher *pqueue = loop_mech.pull_queued_event();
+        // state for interleaved re-polling. The interval is captured now, since it may be changed
+        // (via set_repoll_interval()) by a watcher while the lock is released during dispatch:
+        unsigned batch_repoll_dispatches = repoll_dispatches;
+        unsigned batch_repoll_usecs = repoll_usecs;
+        bool do_repoll = (batch_repoll_dispatches != 0 || batch_repoll_usecs != 0);
+        unsigned dispatch_count = 0;
+        time_val batch_start {0, 0};
+        if (batch_repoll_usecs != 0) {
+            loop_mech.get_time(batch_start, clock_type::MONOTONIC, true);
+        }
+
+        queued_watcher *pqueue = loop_mech.pull_queued_event();
         bool active = false;
-        
+
         while (pqueue != nullptr) {
         
             pqueue->active = true;
             active = true;
             
-            base_bidi_fd_watcher *bbfw = nullptr;
-            
-            // (Above variables are initialised only to silence compiler warnings).
-            
-            if (pqueue->watchType == watch_type_t::SECONDARYFD) {
-                // construct a pointer to the main watcher, using integer arithmetic to avoid undefined
-                // pointer arithmetic:
-                uintptr_t rp = (uintptr_t)pqueue;
-
-                // Here we take the offset of a member from a non-standard-layout class, which is
-                // specified to have undefined result by the C++ language standard, but which
-                // in practice works fine:
-                _Pragma ("GCC diagnostic push")
-                _Pragma ("GCC diagnostic ignored \"-Winvalid-offsetof\"")
-                rp -= offsetof(base_bidi_fd_watcher, out_watcher);
-                _Pragma ("GCC diagnostic pop")
-                bbfw = (base_bidi_fd_watcher *)rp;
-
-                // issue a secondary dispatch:
-                bbfw->dispatch_second(this);
-            }
-            else {
-                pqueue->dispatch(this);
-            }
+            pqueue->dispatch_fn(pqueue, this);
 
             if (limit > 0) {
                 limit--;
                 if (limit == 0) break;
             }
+
+            if (do_repoll && repoll_due(batch_repoll_dispatches, batch_repoll_usecs, dispatch_count,
+                    batch_start)) {
+                repoll_backend();
+            }
+
             pqueue = loop_mech.pull_queued_event();
         }
         
@@ -1509,12 +1981,25 @@ class event_loop
     using signal_watcher = dprivate::signal_watcher<my_event_loop_t>;
     using child_proc_watcher = dprivate::child_proc_watcher<my_event_loop_t>;
     using timer = dprivate::timer<my_event_loop_t>;
+    using watcher_set = dprivate::watcher_set<my_event_loop_t>;
+    using timer_group = dprivate::timer_group<my_event_loop_t>;
+    using group_timer = dprivate::group_timer<my_event_loop_t>;
+    using offload_pool = dprivate::offload_pool<my_event_loop_t>;
+    using file_io_pool = offload_pool;
     
     template <typename D> using fd_watcher_impl = dprivate::fd_watcher_impl<my_event_loop_t, D>;
     template <typename D> using bidi_fd_watcher_impl = dprivate::bidi_fd_watcher_impl<my_event_loop_t, D>;
     template <typename D> using signal_watcher_impl = dprivate::signal_watcher_impl<my_event_loop_t, D>;
     template <typename D> using child_proc_watcher_impl = dprivate::child_proc_watcher_impl<my_event_loop_t, D>;
     template <typename D> using timer_impl = dprivate::timer_impl<my_event_loop_t, D>;
+    template <typename D> using group_timer_impl = dprivate::group_timer_impl<my_event_loop_t, D>;
+    template <typename D> using stream_watcher_impl = dprivate::stream_watcher_impl<my_event_loop_t, D>;
+    template <typename D> using transfer_watcher_impl = dprivate::transfer_watcher_impl<my_event_loop_t, D>;
+    template <typename D> using datagram_watcher_impl = dprivate::datagram_watcher_impl<my_event_loop_t, D>;
+    template <typename D> using listener_watcher_impl = dprivate::listener_watcher_impl<my_event_loop_t, D>;
+    template <typename D> using offload_watcher_impl = dprivate::offload_watcher_impl<my_event_loop_t, D>;
+    template <typename D> using file_io_watcher_impl = dprivate::file_io_watcher_impl<my_event_loop_t, D>;
+    template <typename D> using zerocopy_watcher_impl = dprivate::zerocopy_watcher_impl<my_event_loop_t, D>;
 
     // Poll the event loop and process any pending events (up to a limit). If no events are pending, wait
     // for and process at least one event.
@@ -1546,37 +2031,259 @@ class event_loop
         process_events(limit);
     }
 
-    // Get the current time corresponding to a specific clock.
-    //   ts - the timespec variable to receive the time
-    //   clock - specifies the clock
-    //   force_update (default = false) - if true, the time returned will be updated from
-    //       the system rather than being a previously cached result. It may be more
-    //       accurate, but note that reading from a system clock may be relatively expensive.
-    void get_time(timespec &ts, clock_type clock, bool force_update = false) noexcept
+    // Set the interval at which the backend is re-polled (without waiting) while processing a batch
+    // of queued events. Events are normally processed in batches, and a watcher which becomes ready
+    // during processing of a batch is not seen until the batch is complete, even if it has higher
+    // priority than the remaining watchers in the batch. Re-polling allows such a watcher to be
+    // queued and dispatched ahead of lower-priority watchers, at the cost of additional backend polls.
+    //   dispatches - re-poll after this many watchers have been dispatched (0 = no limit)
+    //   usecs - re-poll when this many microseconds have elapsed since the batch started, or since the
+    //           last re-poll (0 = no limit). Checking the elapsed time requires reading the monotonic
+    //           clock after each dispatch.
+    // By default, both values are 0 and the backend is not re-polled during a batch.
+    void set_repoll_interval(unsigned dispatches, unsigned usecs = 0) noexcept
     {
-        loop_mech.get_time(ts, clock, force_update);
+        std::lock_guard<mutex_t> guard(loop_mech.lock);
+        repoll_dispatches = dispatches;
+        repoll_usecs = usecs;
     }
 
-    void get_time(time_val &tv, clock_type clock, bool force_update = false) noexcept
+    using watcher_pool_t = slab_pool<T_Mutex>;
+    using watcher_allocator_t = pool_allocator<char, watcher_pool_t>;
+
+    // Get an allocator which allocates from this loop's watcher pool. This can be passed to the
+    // allocator-accepting lambda watcher factory functions (e.g. fd_watcher::add_watch), so that
+    // memory for short-lived watchers is recycled rather than allocated from the global heap each
+    // time. Watchers allocated from the pool must be removed before the loop is destroyed.
+    watcher_allocator_t get_watcher_allocator() noexcept
     {
-        loop_mech.get_time(tv, clock, force_update);
+        return watcher_allocator_t(watcher_pool);
     }
 
-    event_loop() { }
-    event_loop(delayed_init d) noexcept : loop_mech(d) { }
-    event_loop(const event_loop &other) = delete;
+    using stream_buffer_pool_t = stream_buffer_pool<T_Mutex>;
 
-    // Perform delayed initialisation, if constructed with delayed_init
-    void init()
+    // Get the pool from which the buffers of stream watchers registered with this loop obtain their
+    // segments. Other stream buffers may also use it (see stream_buffer::set_pool()). Buffers using
+    // the pool must be destroyed (or emptied) before the loop is destroyed.
+    stream_buffer_pool_t &get_stream_buffer_pool() noexcept
     {
-        loop_mech.init();
+        return stream_pool;
     }
-};
-
-typedef event_loop<null_mutex> event_loop_n;
-typedef event_loop<std::mutex> event_loop_th;
-
-} // v2
+
+    // Get statistics for the event loop.
+    loop_stats get_stats() noexcept
+    {
+        loop_stats stats;
+        {
+            std::lock_guard<mutex_t> guard(loop_mech.lock);
+            stats.queued_watchers = loop_mech.num_queued_events();
+        }
+        stream_pool.get_occupancy(stats.buffer_segments_in_use, stats.buffer_segments_free);
+        stats.buffer_segment_size = stream_segment::data_size;
+        return stats;
+    }
+
+    // Set the priority threshold for "fast" file descriptor watches. File descriptor watchers which
+    // are subsequently registered with a priority at or above this level (i.e. with a priority value
+    // less than or equal to the specified value) are placed in a separate set by backends which
+    // support it (currently epoll), which is checked before other watches each time the backend is
+    // polled. This prevents readiness of high-priority descriptors from being delayed at the backend
+    // level by a large number of ready lower-priority descriptors. The priority of a bidirectional
+    // watcher is the higher of its input and output priorities. Watchers registered before the
+    // threshold is set, or whose priority is changed after registration, are not moved.
+    void set_fast_fd_priority(int prio) noexcept
+    {
+        std::lock_guard<mutex_t> guard(loop_mech.lock);
+        use_fast_fds = true;
+        fast_fd_priority = prio;
+    }
+
+    // Pre-allocate internal capacity for the specified numbers of watchers, so that a large set of
+    // watchers can be registered without repeatedly growing (and copying) the internal queues. The
+    // amounts are totals rather than increments, and capacity is retained once reserved.
+    //   num_watchers - number of watchers other than timers (count bidirectional fd watchers twice)
+    //   num_timers - number of timers (capacity is reserved for this many timers on each clock)
+    // Throws std::bad_alloc on failure (capacity may have been partially reserved).
+    void reserve(size_t num_watchers, size_t num_timers)
+    {
+        std::lock_guard<mutex_t> guard(loop_mech.lock);
+        loop_mech.reserve_watchers(num_watchers + num_timers);
+        loop_mech.reserve_timers_nolock(num_timers);
+    }
+
+    // Pre-allocate capacity in the child process map for the specified total number of child process
+    // watchers (in addition to any reservation made via reserve(...), which should include child
+    // watchers in its num_watchers count). Throws std::bad_alloc on failure.
+    void reserve_child_watchers(size_t num_child_watchers)
+    {
+        std::lock_guard<mutex_t> guard(loop_mech.lock);
+        loop_mech.reserve_child_watches_nolock(num_child_watchers);
+    }
+
+    // An entry for register_fds(...), specifying a watcher and the arguments that would otherwise be
+    // passed to its add_watch(...) function.
+    struct fd_registration
+    {
+        fd_watcher *watcher;
+        int fd;
+        int flags;
+        bool enabled;
+        int prio;
+
+        fd_registration(fd_watcher *watcher_p, int fd_p, int flags_p, bool enabled_p = true,
+                int prio_p = DEFAULT_PRIORITY) noexcept
+            : watcher(watcher_p), fd(fd_p), flags(flags_p), enabled(enabled_p), prio(prio_p)
+        {
+        }
+    };
+
+    // Register a batch of file descriptor watchers, equivalent to calling add_watch(...) for each
+    // entry, but acquiring the loop lock only once for the whole batch. Consider calling reserve(...)
+    // first if the batch is large.
+    //   regs - pointer to the first entry
+    //   count - number of entries
+    // Can fail with std::bad_alloc or std::system_error; in that case, no watchers in the batch are
+    // left registered.
+    void register_fds(const fd_registration *regs, size_t count)
+    {
+        std::lock_guard<mutex_t> guard(loop_mech.lock);
+
+        bool do_interrupt = false;
+        size_t i = 0;
+        try {
+            for ( ; i < count; i++) {
+                const fd_registration &reg = regs[i];
+                base_fd_watcher *bfw = reg.watcher;
+                bfw->init();
+                bfw->priority = reg.prio;
+                bfw->watch_fd = reg.fd;
+                bfw->watch_flags = reg.flags;
+                do_interrupt |= register_fd_nolock(bfw, reg.fd, reg.flags, reg.enabled, true);
+            }
+        }
+        catch (...) {
+            while (i > 0) {
+                --i;
+                unregister_fd_nolock(regs[i].watcher, regs[i].fd);
+            }
+            throw;
+        }
+
+        if (do_interrupt) {
+            interrupt_if_necessary();
+        }
+    }
+
+    // An entry for arm_timers(...), specifying a timer and the arguments that would otherwise be passed
+    // to its arm_timer(...) function.
+    struct timer_setting
+    {
+        timer *watcher;
+        timespec timeout;
+        timespec interval;
+
+        timer_setting(timer *watcher_p, const timespec &timeout_p,
+                const timespec &interval_p = timespec {0, 0}) noexcept
+            : watcher(watcher_p), timeout(timeout_p), interval(interval_p)
+        {
+        }
+    };
+
+    // Arm a batch of timers, equivalent to calling arm_timer(...) for each entry, but acquiring the
+    // loop lock only once for the whole batch and updating the backend timer (if any) at most once
+    // for each clock.
+    //   settings - pointer to the first entry
+    //   count - number of entries
+    void arm_timers(const timer_setting *settings, size_t count) noexcept
+    {
+        std::lock_guard<mutex_t> guard(loop_mech.lock);
+
+        bool update_mono = false;
+        bool update_sys = false;
+        for (size_t i = 0; i < count; i++) {
+            const timer_setting &setting = settings[i];
+            base_timer_watcher *btw = setting.watcher;
+            if (loop_mech.queue_timer_nolock(btw->timer_handle, setting.timeout, setting.interval, true,
+                    btw->clock)) {
+                if (btw->clock == clock_type::MONOTONIC) {
+                    update_mono = true;
+                }
+                else {
+                    update_sys = true;
+                }
+            }
+        }
+
+        if (update_mono) {
+            loop_mech.update_timer_nolock(clock_type::MONOTONIC);
+        }
+        if (update_sys) {
+            loop_mech.update_timer_nolock(clock_type::SYSTEM);
+        }
+    }
+
+    // Stop a batch of timers, equivalent to calling stop_timer(...) for each, but acquiring the loop
+    // lock only once for the whole batch and updating the backend timer (if any) at most once for each
+    // clock.
+    //   timers - pointer to the first timer pointer
+    //   count - number of timers
+    void stop_timers(timer * const *timers, size_t count) noexcept
+    {
+        std::lock_guard<mutex_t> guard(loop_mech.lock);
+
+        bool update_mono = false;
+        bool update_sys = false;
+        for (size_t i = 0; i < count; i++) {
+            base_timer_watcher *btw = timers[i];
+            if (loop_mech.unqueue_timer_nolock(btw->timer_handle, btw->clock)) {
+                if (btw->clock == clock_type::MONOTONIC) {
+                    update_mono = true;
+                }
+                else {
+                    update_sys = true;
+                }
+            }
+        }
+
+        if (update_mono) {
+            loop_mech.update_timer_nolock(clock_type::MONOTONIC);
+        }
+        if (update_sys) {
+            loop_mech.update_timer_nolock(clock_type::SYSTEM);
+        }
+    }
+
+    // Get the current time corresponding to a specific clock.
+    //   ts - the timespec variable to receive the time
+    //   clock - specifies the clock
+    //   force_update (default = false) - if true, the time returned will be updated from
+    //       the system rather than being a previously cached result. It may be more
+    //       accurate, but note that reading from a system clock may be relatively expensive.
+    void get_time(timespec &ts, clock_type clock, bool force_update = false) noexcept
+    {
+        loop_mech.get_time(ts, clock, force_update);
+    }
+
+    void get_time(time_val &tv, clock_type clock, bool force_update = false) noexcept
+    {
+        loop_mech.get_time(tv, clock, force_update);
+    }
+
+    event_loop() { }
+    event_loop(delayed_init d) noexcept : loop_mech(d) { }
+    event_loop(const event_loop &other) = delete;
+
+    // Perform delayed initialisation, if constructed with delayed_init
+    void init()
+    {
+        loop_mech.init();
+    }
+};
+
+typedef event_loop<null_mutex> event_loop_n;
+typedef event_loop<std::mutex> event_loop_th;
+
+} // v2
 
 namespace dprivate {
 
@@ -1597,13 +2304,27 @@ class signal_watcher : private dprivate::base_signal_watcher<typename EventLoop:
     // If an attempt is made to register with more than one event loop at
     // a time, behaviour is undefined. The signal should be masked before
     // call.
-    inline void add_watch(event_loop_t &eloop, int signo, int prio = DEFAULT_PRIORITY)
+    //   coalesce - if true, the signal remains enabled while the watcher is queued or its handler is
+    //              running, and signals received meanwhile are reported in a single dispatch (see
+    //              get_signal_count()). The siginfo is that of the most recent signal.
+    inline void add_watch(event_loop_t &eloop, int signo, int prio = DEFAULT_PRIORITY,
+            bool coalesce = false)
     {
         base_watcher::init();
         this->priority = prio;
         this->siginfo.set_signo(signo);
+        this->coalesce = coalesce;
+        this->sig_count = 0;
+        this->dispatch_count = 1;
         eloop.register_signal(this, signo);
     }
+
+    // Get the number of signals reported by the current dispatch; valid only in the received()
+    // callback. This is always 1 unless the watcher is coalescing (and is never 0).
+    int get_signal_count() noexcept
+    {
+        return this->dispatch_count;
+    }
     
     inline void deregister(event_loop_t &eloop) noexcept
     {
@@ -1612,14 +2333,26 @@ class signal_watcher : private dprivate::base_signal_watcher<typename EventLoop:
     
     template <typename T>
     static signal_watcher<event_loop_t> *add_watch(event_loop_t &eloop, int signo, T watch_hndlr)
+    {
+        return add_watch(std::allocator_arg, std::allocator<char>(), eloop, signo, watch_hndlr);
+    }
+
+    // Add a signal watch via a lambda, allocating the watcher using the specified allocator (for
+    // example, the allocator returned by event_loop::get_watcher_allocator()). The watcher destroys
+    // and deallocates itself when removed from the event loop.
+    template <typename Alloc, typename T>
+    static signal_watcher<event_loop_t> *add_watch(std::allocator_arg_t, const Alloc &alloc,
+            event_loop_t &eloop, int signo, T watch_hndlr)
     {
         class lambda_sig_watcher : public signal_watcher_impl<event_loop_t, lambda_sig_watcher>
         {
             private:
             T watch_hndlr;
+            Alloc alloc;
 
             public:
-            lambda_sig_watcher(T watch_handlr_a) : watch_hndlr(watch_handlr_a)
+            lambda_sig_watcher(T watch_handlr_a, const Alloc &alloc_a)
+                : watch_hndlr(watch_handlr_a), alloc(alloc_a)
             {
                 //
             }
@@ -1631,12 +2364,18 @@ class signal_watcher : private dprivate::base_signal_watcher<typename EventLoop:
 
             void watch_removed() noexcept override
             {
-                delete this;
+                dprivate::alloc_destroy(alloc, this);
             }
         };
 
-        lambda_sig_watcher *lsw = new lambda_sig_watcher(watch_hndlr);
-        lsw->add_watch(eloop, signo);
+        lambda_sig_watcher *lsw = dprivate::alloc_construct<lambda_sig_watcher>(alloc, watch_hndlr, alloc);
+        try {
+            lsw->add_watch(eloop, signo);
+        }
+        catch (...) {
+            dprivate::alloc_destroy(alloc, lsw);
+            throw;
+        }
         return lsw;
     }
 
@@ -1646,12 +2385,36 @@ class signal_watcher : private dprivate::base_signal_watcher<typename EventLoop:
 template <typename EventLoop, typename Derived>
 class signal_watcher_impl : public signal_watcher<EventLoop>
 {
+    static void do_dispatch(dprivate::queued_watcher *watcher, void *loop_ptr) noexcept
+    {
+        static_cast<signal_watcher_impl *>(watcher)->signal_watcher_impl::dispatch(loop_ptr);
+    }
+
+    public:
+    signal_watcher_impl() noexcept
+    {
+        this->dispatch_fn = &do_dispatch;
+    }
+
+    private:
     void dispatch(void *loop_ptr) noexcept override
     {
         EventLoop &loop = *static_cast<EventLoop *>(loop_ptr);
-        loop_access::get_base_lock(loop).unlock();
+        rearm rearm_type;
 
-        auto rearm_type = static_cast<Derived *>(this)->received(loop, this->siginfo.get_signo(), this->siginfo);
+        if (! this->coalesce) {
+            loop_access::get_base_lock(loop).unlock();
+            rearm_type = static_cast<Derived *>(this)->received(loop, this->siginfo.get_signo(), this->siginfo);
+        }
+        else {
+            // Further signals may be received (updating siginfo) while the handler is running, so
+            // pass a copy:
+            auto siginfo = this->siginfo;
+            this->dispatch_count = this->sig_count;
+            this->sig_count = 0;
+            loop_access::get_base_lock(loop).unlock();
+            rearm_type = static_cast<Derived *>(this)->received(loop, siginfo.get_signo(), siginfo);
+        }
 
         loop_access::get_base_lock(loop).lock();
 
@@ -1662,6 +2425,11 @@ class signal_watcher_impl : public signal_watcher<EventLoop>
                 // We don't want a watch that is marked "deleteme" to re-arm itself.
                 rearm_type = rearm::REMOVE;
             }
+            else if (this->coalesce && rearm_type == rearm::REQUEUE) {
+                // A coalescing watcher is dispatched only for received signals (so the signal count
+                // is never 0): REQUEUE is treated as REARM.
+                rearm_type = rearm::REARM;
+            }
 
             loop_access::process_signal_rearm(loop, this, rearm_type);
 
@@ -1675,6 +2443,7 @@ template <typename EventLoop>
 class fd_watcher : private dprivate::base_fd_watcher
 {
     template <typename, typename> friend class fd_watcher_impl;
+    template <typename, typename> friend class dasynq::event_loop;
 
     using base_watcher = dprivate::base_watcher;
     using mutex_t = typename EventLoop::mutex_t;
@@ -1765,14 +2534,25 @@ class fd_watcher : private dprivate::base_fd_watcher
     // itself when removed from the event loop.
     template <typename T>
     static fd_watcher<EventLoop> *add_watch(event_loop_t &eloop, int fd, int flags, T watchHndlr)
+    {
+        return add_watch(std::allocator_arg, std::allocator<char>(), eloop, fd, flags, watchHndlr);
+    }
+
+    // Add an Fd watch via a lambda, allocating the watcher using the specified allocator (for
+    // example, the allocator returned by event_loop::get_watcher_allocator()). The watcher destroys
+    // and deallocates itself when removed from the event loop.
+    template <typename Alloc, typename T>
+    static fd_watcher<EventLoop> *add_watch(std::allocator_arg_t, const Alloc &alloc, event_loop_t &eloop,
+            int fd, int flags, T watchHndlr)
     {
         class lambda_fd_watcher : public fd_watcher_impl<event_loop_t, lambda_fd_watcher>
         {
             private:
             T watchHndlr;
+            Alloc alloc;
 
             public:
-            lambda_fd_watcher(T watchHandlr_a) : watchHndlr(watchHandlr_a)
+            lambda_fd_watcher(T watchHandlr_a, const Alloc &alloc_a) : watchHndlr(watchHandlr_a), alloc(alloc_a)
             {
                 //
             }
@@ -1784,12 +2564,18 @@ class fd_watcher : private dprivate::base_fd_watcher
 
             void watch_removed() noexcept override
             {
-                delete this;
+                dprivate::alloc_destroy(alloc, this);
             }
         };
-        
-        lambda_fd_watcher *lfd = new lambda_fd_watcher(watchHndlr);
-        lfd->add_watch(eloop, fd, flags);
+
+        lambda_fd_watcher *lfd = dprivate::alloc_construct<lambda_fd_watcher>(alloc, watchHndlr, alloc);
+        try {
+            lfd->add_watch(eloop, fd, flags);
+        }
+        catch (...) {
+            dprivate::alloc_destroy(alloc, lfd);
+            throw;
+        }
         return lfd;
     }
     
@@ -1799,6 +2585,18 @@ class fd_watcher : private dprivate::base_fd_watcher
 template <typename EventLoop, typename Derived>
 class fd_watcher_impl : public fd_watcher<EventLoop>
 {
+    static void do_dispatch(dprivate::queued_watcher *watcher, void *loop_ptr) noexcept
+    {
+        static_cast<fd_watcher_impl *>(watcher)->fd_watcher_impl::dispatch(loop_ptr);
+    }
+
+    public:
+    fd_watcher_impl() noexcept
+    {
+        this->dispatch_fn = &do_dispatch;
+    }
+
+    private:
     void dispatch(void *loop_ptr) noexcept override
     {
         EventLoop &loop = *static_cast<EventLoop *>(loop_ptr);
@@ -1827,6 +2625,62 @@ class fd_watcher_impl : public fd_watcher<EventLoop>
     }
 };
 
+// A set of fd watchers which can be enabled or disabled as a group (for example, to pause reading
+// from a set of connections while a downstream buffer is full). Enabling or disabling all the
+// watchers in the set acquires the event loop lock only once, rather than once per watcher. The
+// set does not own the watchers; a watcher should be removed from the set before it is deregistered
+// (or not registered in the first place).
+template <typename EventLoop>
+class watcher_set
+{
+    using fd_watcher_t = fd_watcher<EventLoop>;
+
+    std::vector<fd_watcher_t *> watchers;
+
+    public:
+    // Add a watcher to the set. May throw std::bad_alloc.
+    void add(fd_watcher_t *watcher)
+    {
+        watchers.push_back(watcher);
+    }
+
+    // Remove a watcher from the set (does not change its enablement). Returns false if the watcher
+    // was not in the set.
+    bool remove(fd_watcher_t *watcher) noexcept
+    {
+        for (auto i = watchers.begin(); i != watchers.end(); ++i) {
+            if (*i == watcher) {
+                *i = watchers.back();
+                watchers.pop_back();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    size_t size() const noexcept
+    {
+        return watchers.size();
+    }
+
+    void clear() noexcept
+    {
+        watchers.clear();
+    }
+
+    // Disable all watchers in the set. As for fd_watcher::set_enabled, this is not safe to use if
+    // any watcher in the set may currently be active in another thread.
+    void disable_all(EventLoop &eloop) noexcept
+    {
+        loop_access::set_fd_watchers_enabled(eloop, watchers.data(), watchers.size(), false);
+    }
+
+    // Enable all watchers in the set.
+    void enable_all(EventLoop &eloop) noexcept
+    {
+        loop_access::set_fd_watchers_enabled(eloop, watchers.data(), watchers.size(), true);
+    }
+};
 
 // A Bi-directional file descriptor watcher with independent read- and write- channels.
 // This watcher type has two event notification methods which can both potentially be
@@ -1851,7 +2705,7 @@ class bidi_fd_watcher : private dprivate::base_bidi_fd_watcher
             this->watch_flags &= ~events;
         }
 
-        dprivate::base_watcher *watcher = in ? this : &this->out_watcher;
+        dprivate::queued_watcher *watcher = in ? this : &this->out_watcher;
 
         if (! watcher->emulatefd) {
             if (EventLoop::loop_traits_t::has_separate_rw_fd_watches) {
@@ -1923,7 +2777,7 @@ class bidi_fd_watcher : private dprivate::base_bidi_fd_watcher
     void add_watch(event_loop_t &eloop, int fd, int flags, int inprio = DEFAULT_PRIORITY, int outprio = DEFAULT_PRIORITY)
     {
         base_watcher::init();
-        this->out_watcher.base_watcher::init();
+        this->out_watcher.init();
         this->watch_fd = fd;
         this->watch_flags = flags | dprivate::multi_watch;
         this->read_removed = false;
@@ -1936,7 +2790,7 @@ class bidi_fd_watcher : private dprivate::base_bidi_fd_watcher
     void add_watch_noemu(event_loop_t &eloop, int fd, int flags, int inprio = DEFAULT_PRIORITY, int outprio = DEFAULT_PRIORITY)
     {
         base_watcher::init();
-        this->out_watcher.base_watcher::init();
+        this->out_watcher.init();
         this->watch_fd = fd;
         this->watch_flags = flags | dprivate::multi_watch;
         this->read_removed = false;
@@ -1966,14 +2820,26 @@ class bidi_fd_watcher : private dprivate::base_bidi_fd_watcher
     
     template <typename T>
     static bidi_fd_watcher<event_loop_t> *add_watch(event_loop_t &eloop, int fd, int flags, T watch_hndlr)
+    {
+        return add_watch(std::allocator_arg, std::allocator<char>(), eloop, fd, flags, watch_hndlr);
+    }
+
+    // Add a bidirectional Fd watch via a lambda, allocating the watcher using the specified allocator
+    // (for example, the allocator returned by event_loop::get_watcher_allocator()). The watcher
+    // destroys and deallocates itself when removed from the event loop.
+    template <typename Alloc, typename T>
+    static bidi_fd_watcher<event_loop_t> *add_watch(std::allocator_arg_t, const Alloc &alloc,
+            event_loop_t &eloop, int fd, int flags, T watch_hndlr)
     {
         class lambda_bidi_watcher : public bidi_fd_watcher_impl<event_loop_t, lambda_bidi_watcher>
         {
             private:
             T watch_hndlr;
+            Alloc alloc;
 
             public:
-            lambda_bidi_watcher(T watch_handlr_a) : watch_hndlr(watch_handlr_a)
+            lambda_bidi_watcher(T watch_handlr_a, const Alloc &alloc_a)
+                : watch_hndlr(watch_handlr_a), alloc(alloc_a)
             {
                 //
             }
@@ -1990,12 +2856,18 @@ class bidi_fd_watcher : private dprivate::base_bidi_fd_watcher
 
             void watch_removed() noexcept override
             {
-                delete this;
+                dprivate::alloc_destroy(alloc, this);
             }
         };
 
-        lambda_bidi_watcher *lfd = new lambda_bidi_watcher(watch_hndlr);
-        lfd->add_watch(eloop, fd, flags);
+        lambda_bidi_watcher *lfd = dprivate::alloc_construct<lambda_bidi_watcher>(alloc, watch_hndlr, alloc);
+        try {
+            lfd->add_watch(eloop, fd, flags);
+        }
+        catch (...) {
+            dprivate::alloc_destroy(alloc, lfd);
+            throw;
+        }
         return lfd;
     }
 
@@ -2006,6 +2878,25 @@ class bidi_fd_watcher : private dprivate::base_bidi_fd_watcher
 template <typename EventLoop, typename Derived>
 class bidi_fd_watcher_impl : public bidi_fd_watcher<EventLoop>
 {
+    static void do_dispatch(dprivate::queued_watcher *watcher, void *loop_ptr) noexcept
+    {
+        static_cast<bidi_fd_watcher_impl *>(watcher)->bidi_fd_watcher_impl::dispatch(loop_ptr);
+    }
+
+    static void do_dispatch_second(dprivate::queued_watcher *out_watcher, void *loop_ptr) noexcept
+    {
+        auto *bbfw = bidi_fd_watcher<EventLoop>::from_out_watcher(out_watcher);
+        static_cast<bidi_fd_watcher_impl *>(bbfw)->bidi_fd_watcher_impl::dispatch_second(loop_ptr);
+    }
+
+    public:
+    bidi_fd_watcher_impl() noexcept
+    {
+        this->dispatch_fn = &do_dispatch;
+        this->out_watcher.dispatch_fn = &do_dispatch_second;
+    }
+
+    private:
     void dispatch(void *loop_ptr) noexcept override
     {
         EventLoop &loop = *static_cast<EventLoop *>(loop_ptr);
@@ -2053,7 +2944,7 @@ class bidi_fd_watcher_impl : public bidi_fd_watcher<EventLoop>
             rearm_type = loop_access::process_secondary_rearm(loop, this, &outwatcher, rearm_type);
 
             if (rearm_type == rearm::REQUEUE) {
-                post_dispatch(loop, &outwatcher, rearm_type);
+                loop_access::requeue_watcher(loop, &outwatcher);
             }
             else {
                 post_dispatch(loop, this, &outwatcher, rearm_type);
@@ -2239,6 +3130,18 @@ class child_proc_watcher : private dprivate::base_child_watcher<typename EventLo
 template <typename EventLoop, typename Derived>
 class child_proc_watcher_impl : public child_proc_watcher<EventLoop>
 {
+    static void do_dispatch(dprivate::queued_watcher *watcher, void *loop_ptr) noexcept
+    {
+        static_cast<child_proc_watcher_impl *>(watcher)->child_proc_watcher_impl::dispatch(loop_ptr);
+    }
+
+    public:
+    child_proc_watcher_impl() noexcept
+    {
+        this->dispatch_fn = &do_dispatch;
+    }
+
+    private:
     void dispatch(void *loop_ptr) noexcept override
     {
         EventLoop &loop = *static_cast<EventLoop *>(loop_ptr);
@@ -2268,6 +3171,7 @@ template <typename EventLoop>
 class timer : private base_timer_watcher
 {
     template <typename, typename> friend class timer_impl;
+    template <typename, typename> friend class dasynq::event_loop;
     using base_t = base_timer_watcher;
     using mutex_t = typename EventLoop::mutex_t;
 
@@ -2305,6 +3209,23 @@ class timer : private base_timer_watcher
         eloop.set_timer_rel(this, timeout, interval, base_t::clock);
     }
     
+    // Extend the timer timeout to a later time. This is cheaper than arm_timer when the timeout
+    // is frequently pushed back (for example, an idle timeout which is extended whenever activity
+    // occurs): the new timeout is recorded without re-ordering the timer queue, and the timer is
+    // moved within the queue only if the original timeout is reached. If the timer is not armed, or
+    // the new timeout is earlier than the current timeout, this is equivalent to arm_timer (except
+    // that the timer interval is unchanged).
+    void extend_timer(event_loop_t &eloop, const timespec &timeout) noexcept
+    {
+        eloop.extend_timer(this, timeout, base_t::clock);
+    }
+
+    // Extend the timer timeout, relative to now (see extend_timer):
+    void extend_timer_rel(event_loop_t &eloop, const timespec &timeout) noexcept
+    {
+        eloop.extend_timer_rel(this, timeout, base_t::clock);
+    }
+
     void stop_timer(event_loop_t &eloop) noexcept
     {
         eloop.stop_timer(this, base_t::clock);
@@ -2327,14 +3248,27 @@ class timer : private base_timer_watcher
     template <typename T>
     static timer<EventLoop> *add_timer(EventLoop &eloop, clock_type clock, bool relative,
             const timespec &timeout, const timespec &interval, T watch_hndlr)
+    {
+        return add_timer(std::allocator_arg, std::allocator<char>(), eloop, clock, relative, timeout,
+                interval, watch_hndlr);
+    }
+
+    // Add a timer via a lambda, allocating the timer using the specified allocator (for example, the
+    // allocator returned by event_loop::get_watcher_allocator()). The timer destroys and deallocates
+    // itself when removed from the event loop.
+    template <typename Alloc, typename T>
+    static timer<EventLoop> *add_timer(std::allocator_arg_t, const Alloc &alloc, EventLoop &eloop,
+            clock_type clock, bool relative, const timespec &timeout, const timespec &interval,
+            T watch_hndlr)
     {
         class lambda_timer : public timer_impl<event_loop_t, lambda_timer>
         {
             private:
             T watch_hndlr;
+            Alloc alloc;
 
             public:
-            lambda_timer(T watch_handlr_a) : watch_hndlr(watch_handlr_a)
+            lambda_timer(T watch_handlr_a, const Alloc &alloc_a) : watch_hndlr(watch_handlr_a), alloc(alloc_a)
             {
                 //
             }
@@ -2346,12 +3280,18 @@ class timer : private base_timer_watcher
 
             void watch_removed() noexcept override
             {
-                delete this;
+                dprivate::alloc_destroy(alloc, this);
             }
         };
 
-        lambda_timer *lt = new lambda_timer(watch_hndlr);
-        lt->add_timer(eloop, clock);
+        lambda_timer *lt = dprivate::alloc_construct<lambda_timer>(alloc, watch_hndlr, alloc);
+        try {
+            lt->add_timer(eloop, clock);
+        }
+        catch (...) {
+            dprivate::alloc_destroy(alloc, lt);
+            throw;
+        }
         if (relative) {
             lt->arm_timer_rel(eloop, timeout, interval);
         }
@@ -2370,6 +3310,18 @@ class timer : private base_timer_watcher
 template <typename EventLoop, typename Derived>
 class timer_impl : public timer<EventLoop>
 {
+    static void do_dispatch(dprivate::queued_watcher *watcher, void *loop_ptr) noexcept
+    {
+        static_cast<timer_impl *>(watcher)->timer_impl::dispatch(loop_ptr);
+    }
+
+    public:
+    timer_impl() noexcept
+    {
+        this->dispatch_fn = &do_dispatch;
+    }
+
+    private:
     void dispatch(void *loop_ptr) noexcept override
     {
         EventLoop &loop = *static_cast<EventLoop *>(loop_ptr);
@@ -2396,7 +3348,154 @@ class timer_impl : public timer<EventLoop>
     }
 };
 
+// A group of timers which all have the same duration. Each timer in the group expires when the
+// group duration has elapsed from the time it was (most recently) armed, so timers expire in the
+// order they were armed: the group keeps its armed timers in a list in that order, and only the
+// first timer in the list is represented in the event loop's timer queue. Arming, re-arming and
+// stopping a group timer are O(1) operations, and the timer queue does not grow with the number of
+// timers in the group.
+//
+// Timers are added to a group via group_timer::add_timer. The group must be registered with the
+// loop (add_group) before timers are added to it, and must not be deregistered until all its timers
+// have been deregistered. As for a watcher, the group must not be destroyed until it has been
+// removed from the loop (which is signalled by a call to watch_removed()).
+//
+// The list order relies on the clock being monotonic; with clock_type::SYSTEM, timers may expire
+// late if the system time is set backwards.
+template <typename EventLoop>
+class timer_group : private base_timer_group
+{
+    template <typename> friend class group_timer;
+    using base_t = base_timer_group;
+
+    public:
+    using event_loop_t = EventLoop;
+
+    timer_group(const timespec &duration) noexcept : base_t(duration)
+    {
+    }
+
+    timer_group(const timer_group &) = delete;
+    timer_group &operator=(const timer_group &) = delete;
+
+    // Register the group with an event loop. The group's timers are registered with the loop
+    // individually, but are queued via the group.
+    //   may throw: std::bad_alloc
+    void add_group(event_loop_t &eloop, clock_type clock = clock_type::MONOTONIC)
+    {
+        base_watcher::init();
+        this->clock = clock;
+        this->intervals = 0;
+        eloop.register_timer(this, clock);
+    }
+
+    void deregister(event_loop_t &eloop) noexcept
+    {
+        eloop.deregister(this, this->clock);
+    }
+
+    const time_val &get_duration() const noexcept
+    {
+        return this->duration;
+    }
+};
+
+// A timer belonging to a timer_group.
+template <typename EventLoop>
+class group_timer : private base_group_timer_watcher
+{
+    template <typename, typename> friend class group_timer_impl;
+    using base_t = base_group_timer_watcher;
+
+    public:
+    using event_loop_t = EventLoop;
+    using timer_group_t = timer_group<EventLoop>;
+
+    // Add the timer to an event loop as a member of the given group (which must already be registered
+    // with the loop). The timer is not initially armed.
+    //   may throw: std::bad_alloc
+    void add_timer(event_loop_t &eloop, timer_group_t &group, int prio = DEFAULT_PRIORITY)
+    {
+        base_watcher::init();
+        this->priority = prio;
+        eloop.register_group_timer(this, &group);
+    }
+
+    // Arm (or re-arm) the timer, to expire when the group duration has elapsed from now.
+    void arm_timer(event_loop_t &eloop) noexcept
+    {
+        eloop.set_group_timer(this);
+    }
+
+    // Stop the timer. Any expiry which has not yet been reported is discarded.
+    void stop_timer(event_loop_t &eloop) noexcept
+    {
+        eloop.stop_group_timer(this);
+    }
+
+    void deregister(event_loop_t &eloop) noexcept
+    {
+        eloop.deregister(this);
+    }
+
+    // Timer expired. The expiry count is normally 1 (it can be higher if the timer was re-armed and
+    // expired again before the previous expiry was reported). The timer is not re-armed automatically;
+    // the handler may call arm_timer to re-arm it. Returning rearm::DISARM stops the timer.
+    // virtual rearm timer_expiry(event_loop_t &eloop, int intervals) = 0;
+};
+
+template <typename EventLoop, typename Derived>
+class group_timer_impl : public group_timer<EventLoop>
+{
+    static void do_dispatch(dprivate::queued_watcher *watcher, void *loop_ptr) noexcept
+    {
+        static_cast<group_timer_impl *>(watcher)->group_timer_impl::dispatch(loop_ptr);
+    }
+
+    public:
+    group_timer_impl() noexcept
+    {
+        this->dispatch_fn = &do_dispatch;
+    }
+
+    private:
+    void dispatch(void *loop_ptr) noexcept override
+    {
+        EventLoop &loop = *static_cast<EventLoop *>(loop_ptr);
+
+        auto intervals_report = this->intervals;
+        this->intervals = 0;
+
+        loop_access::get_base_lock(loop).unlock();
+
+        auto rearm_type = static_cast<Derived *>(this)->timer_expiry(loop, intervals_report);
+
+        loop_access::get_base_lock(loop).lock();
+
+        if (rearm_type != rearm::REMOVED) {
+
+            this->active = false;
+            if (this->deleteme) {
+                // We don't want a watch that is marked "deleteme" to re-arm itself.
+                rearm_type = rearm::REMOVE;
+            }
+
+            loop_access::process_group_timer_rearm(loop, this, rearm_type);
+
+            post_dispatch(loop, this, rearm_type);
+        }
+    }
+};
+
 } // namespace dprivate
 } // namespace dasynq
 
+#include "dasynq/stream.h"
+#include "dasynq/transfer.h"
+#include "dasynq/datagram.h"
+#include "dasynq/listener.h"
+#include "dasynq/offload.h"
+#include "dasynq/fileio.h"
+#include "dasynq/zerocopy.h"
+
 #endif /* DASYNQ_H_ */
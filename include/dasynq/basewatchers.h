@@ -9,8 +9,12 @@
 // In general access to the members of the basewatcher should be protected by a mutex. The
 // event_dispatch lock is used for this purpose.
 
+#include <memory>
 #include <type_traits>
 
+#include <cstddef>
+#include <cstdint>
+
 namespace dasynq {
 namespace dprivate {
 
@@ -39,6 +43,10 @@ template <typename T_Mutex> class default_traits
     template <typename Base> using backend_t = dasynq::loop_t<Base>;
     using backend_traits_t = dasynq::loop_traits_t;
 
+    // Allocator used for the event loop's internal data structures (event and timer queues, child
+    // process map). It is rebound to the required types, and default-constructed.
+    using allocator_t = std::allocator<char>;
+
     // Alter the current thread signal mask using the correct function
     // (sigprocmask or pthread_sigmask):
     static void sigmaskf(int how, const sigset_t *set, sigset_t *oset)
@@ -47,6 +55,26 @@ template <typename T_Mutex> class default_traits
     }
 };
 
+// Loop traits with a choice of optional backend features, which can be omitted to reduce the resources
+// (file descriptors, signal handling) required by each event loop instance:
+//   child_watch   - if false, child process watchers are not supported, and the loop does not mask or
+//                   handle SIGCHLD. Only one loop in a process can watch child processes.
+//   system_timers - if false, there is no separate timer for the system clock: system clock timers are
+//                   run from the monotonic clock timer, and may not expire at the correct time if the
+//                   system time is adjusted. This currently only has an effect with the epoll backend.
+// The member types allow removing features by name, eg.
+//     event_loop<null_mutex, custom_traits<null_mutex>::no_child_watch::no_system_timers>
+template <typename T_Mutex, bool child_watch = true, bool system_timers = true>
+class custom_traits : public default_traits<T_Mutex>
+{
+    public:
+    using backend_traits_t = dasynq::build_loop_traits_t<child_watch, system_timers>;
+    template <typename Base> using backend_t = typename backend_traits_t::template backend_tmpl<Base>;
+
+    using no_child_watch = custom_traits<T_Mutex, false, system_timers>;
+    using no_system_timers = custom_traits<T_Mutex, child_watch, false>;
+};
+
 // Forward declarations:
 template <typename T_Mutex, typename Traits = default_traits<T_Mutex>>
 class event_loop;
@@ -64,16 +92,29 @@ template <typename T_Loop> class bidi_fd_watcher;
 template <typename T_Loop> class signal_watcher;
 template <typename T_Loop> class child_proc_watcher;
 template <typename T_Loop> class timer;
+template <typename T_Loop> class watcher_set;
+template <typename T_Loop> class timer_group;
+template <typename T_Loop> class group_timer;
+template <typename T_Loop> class offload_pool;
 
 template <typename, typename> class fd_watcher_impl;
 template <typename, typename> class bidi_fd_watcher_impl;
 template <typename, typename> class signal_watcher_impl;
 template <typename, typename> class child_proc_watcher_impl;
 template <typename, typename> class timer_impl;
+template <typename, typename> class group_timer_impl;
+template <typename, typename> class stream_watcher_impl;
+template <typename, typename> class transfer_watcher_impl;
+template <typename, typename> class datagram_watcher_impl;
+template <typename, typename> class listener_watcher_impl;
+template <typename, typename> class offload_watcher_impl;
+template <typename, typename> class file_io_watcher_impl;
+template <typename, typename> class zerocopy_watcher_impl;
 
 inline namespace v2 {
     // (non-public API)
 
+class queued_watcher;
 class base_watcher;
 
 class empty_node
@@ -81,59 +122,96 @@ class empty_node
     DASYNQ_EMPTY_BODY
 };
 
-// heap_def decides the queue implementation that we use. It must be stable:
-template <typename A, typename B, typename C> using dary_heap_def = dary_heap<A,B,C>;
-template <typename A, typename B> using heap_def = stable_heap<dary_heap_def,A,B>;
+// heap_def decides the queue implementation that we use. It must be stable. The handle type must not
+// depend on the allocator (D):
+template <typename A, typename B, typename C, typename D> using dary_heap_def = dary_heap<A,B,C,4,D>;
+template <typename A, typename B, typename D = std::allocator<A>> using heap_def
+        = stable_heap<dary_heap_def,A,B,std::less<B>,D>;
 
 namespace {
 
-// use empty handles (not containing basewatcher *) if the handles returned from the
-// queue are handle references, because we can derive a pointer to the containing basewatcher
+// use empty handles (not containing queued_watcher *) if the handles returned from the
+// queue are handle references, because we can derive a pointer to the containing watcher
 // via the address of the handle in that case:
 constexpr bool use_empty_node = std::is_same<
         typename heap_def<empty_node, int>::handle_t_r,
         typename heap_def<empty_node, int>::handle_t &>::value;
 
-using node_type = std::conditional<use_empty_node, empty_node, base_watcher *>::type;
+using node_type = std::conditional<use_empty_node, empty_node, queued_watcher *>::type;
 
 } // namespace
 
 using prio_queue = heap_def<node_type, int>;
 
 using prio_queue_emptynode = heap_def<empty_node, int>;
-using prio_queue_bwnode = heap_def<base_watcher *, int>;
+using prio_queue_bwnode = heap_def<queued_watcher *, int>;
 
-enum class watch_type_t
+enum class watch_type_t : uint8_t
 {
     SIGNAL,
     FD,
     CHILD,
     SECONDARYFD,
-    TIMER
+    TIMER,
+    TIMER_GROUP,
+    COMPLETION
 };
 
 template <typename Traits, typename LoopTraits> class event_dispatch;
 
+// Determine the allocator to use for loop data structures from the loop traits: Traits::allocator_t
+// if it is defined, otherwise std::allocator.
+template <typename T> struct void_type
+{
+    using type = void;
+};
+
+template <typename Traits, typename = void> struct traits_allocator
+{
+    using type = std::allocator<char>;
+};
+
+template <typename Traits>
+struct traits_allocator<Traits, typename void_type<typename Traits::allocator_t>::type>
+{
+    using type = typename Traits::allocator_t;
+};
+
 // For FD watchers:
 // Use this watch flag to indicate that in and out events should be reported separately,
 // that is, watcher should not be disabled until all watched event types are queued.
 constexpr static int multi_watch = 4;
 
-// Represents a queued event notification. Various event watchers derive from this type.
-class base_watcher
+// The type of a watcher dispatch function (see queued_watcher::dispatch_fn).
+using dispatch_fn_t = void (*)(queued_watcher *watcher, void *loop_ptr);
+
+// Represents a queued event notification: the part of a watcher that is needed to queue and
+// dispatch it. This has no virtual functions, so that it can be embedded cheaply where a separately
+// queued sub-watcher is needed (the secondary watcher of a bidi fd watcher). Other watchers derive
+// from it via base_watcher.
+//
+// The members used for queueing and dispatch are kept together, and small, so that they share a
+// cache line; see also the size checks below.
+class queued_watcher
 {
     public:
-    watch_type_t watchType;
-    unsigned active : 1;    // currently executing handler?
-    unsigned deleteme : 1;  // delete when handler finished?
-    unsigned emulatefd : 1; // emulate file watch (by re-queueing)
-    unsigned emulate_enabled : 1;   // whether an emulated watch is enabled
-    unsigned child_termd : 1;  // child process has terminated
+    // The function called (by the event loop, with the loop lock held) to dispatch this watcher. By
+    // default (for base_watcher) it calls the virtual dispatch function; the watcher implementation
+    // templates replace it with a function which calls their dispatch function directly, so that
+    // dispatch requires only a single indirect call.
+    dispatch_fn_t dispatch_fn;
 
     prio_queue::handle_t heap_handle;
     int priority;
 
-    static void set_priority(base_watcher &p, int prio)
+    watch_type_t watchType;
+    uint8_t active : 1;    // currently executing handler?
+    uint8_t deleteme : 1;  // delete when handler finished?
+    uint8_t emulatefd : 1; // emulate file watch (by re-queueing)
+    uint8_t emulate_enabled : 1;   // whether an emulated watch is enabled
+    uint8_t child_termd : 1;  // child process has terminated
+
+    static void set_priority(queued_watcher &p, int prio)
     {
         p.priority = prio;
     }
@@ -150,9 +228,17 @@ class base_watcher
         priority = DEFAULT_PRIORITY;
     }
 
-    base_watcher(watch_type_t wt) noexcept : watchType(wt) { }
-    base_watcher(const base_watcher &) = delete;
-    base_watcher &operator=(const base_watcher &) = delete;
+    queued_watcher(watch_type_t wt, dispatch_fn_t dfn) noexcept : dispatch_fn(dfn), watchType(wt) { }
+    queued_watcher(const queued_watcher &) = delete;
+    queued_watcher &operator=(const queued_watcher &) = delete;
+};
+
+// A watcher, with virtual dispatch and removal notification. Various event watchers derive from this
+// type.
+class base_watcher : public queued_watcher
+{
+    public:
+    base_watcher(watch_type_t wt) noexcept : queued_watcher(wt, &virtual_dispatch) { }
 
     // The dispatch function is called to process a watcher's callback. It is the "real" callback
     // function; it usually delegates to a user-provided callback.
@@ -162,6 +248,11 @@ class base_watcher
     // watcher (i.e. the output watcher):
     virtual void dispatch_second(void *loop_ptr) noexcept { }
 
+    static void virtual_dispatch(queued_watcher *watcher, void *loop_ptr) noexcept
+    {
+        static_cast<base_watcher *>(watcher)->dispatch(loop_ptr);
+    }
+
     virtual ~base_watcher() noexcept { }
 
     // Called when the watcher has been removed.
@@ -175,29 +266,32 @@ class base_watcher
     }
 };
 
-// Retrieve watcher from queue handle:
-inline base_watcher *get_watcher(prio_queue_emptynode &q, prio_queue_emptynode::handle_t &n)
+// Retrieve watcher from queue handle (the queue allocator type, A, may vary):
+template <typename A>
+inline queued_watcher *get_watcher(heap_def<empty_node, int, A> &q, prio_queue_emptynode::handle_t &n)
 {
     uintptr_t bptr = (uintptr_t)&n;
-    _Pragma ("GCC diagnostic push")
-    _Pragma ("GCC diagnostic ignored \"-Winvalid-offsetof\"")
-    bptr -= offsetof(base_watcher, heap_handle);
-    _Pragma ("GCC diagnostic pop")
-    return (base_watcher *)bptr;
+    bptr -= offsetof(queued_watcher, heap_handle);
+    return (queued_watcher *)bptr;
 }
 
-inline base_watcher *get_watcher(prio_queue_bwnode &q, prio_queue_bwnode::handle_t &n)
+template <typename A>
+inline queued_watcher *get_watcher(heap_def<queued_watcher *, int, A> &q, prio_queue_bwnode::handle_t &n)
 {
     return q.node_data(n);
 }
 
 // Allocate queue handle:
-inline void allocate_handle(prio_queue_emptynode &q, prio_queue_emptynode::handle_t &n, base_watcher *bw)
+template <typename A>
+inline void allocate_handle(heap_def<empty_node, int, A> &q, prio_queue_emptynode::handle_t &n,
+        queued_watcher *bw)
 {
     q.allocate(n);
 }
 
-inline void allocate_handle(prio_queue_bwnode &q, prio_queue_bwnode::handle_t &n, base_watcher *bw)
+template <typename A>
+inline void allocate_handle(heap_def<queued_watcher *, int, A> &q, prio_queue_bwnode::handle_t &n,
+        queued_watcher *bw)
 {
     q.allocate(n, bw);
 }
@@ -211,6 +305,14 @@ class base_signal_watcher : public base_watcher
 
     protected:
     T_Sigdata siginfo;
+
+    // A coalescing watcher's signal remains enabled while the watcher is queued or its handler is
+    // running; further signals are counted (sig_count) and reported together. dispatch_count is the
+    // number of signals reported by the current dispatch.
+    bool coalesce = false;
+    int sig_count = 0;
+    int dispatch_count = 1;
+
     base_signal_watcher() : base_watcher(watch_type_t::SIGNAL) { }
 
     public:
@@ -248,13 +350,35 @@ class base_bidi_fd_watcher : public base_fd_watcher
     protected:
     base_bidi_fd_watcher() noexcept { }
 
+    uint8_t read_removed : 1; // read watch removed?
+    uint8_t write_removed : 1; // write watch removed?
+
     // The main instance is the "input" watcher only; we keep a secondary watcher with a secondary set
     // of flags for the "output" watcher. Note that some of the flags in the secondary watcher aren't
     // used; it exists mainly so that it can be queued independently of the primary watcher.
-    base_watcher out_watcher {watch_type_t::SECONDARYFD};
+    queued_watcher out_watcher {watch_type_t::SECONDARYFD, &virtual_dispatch_second};
+
+    // Get the main watcher from a pointer to its secondary (output) watcher.
+    static base_bidi_fd_watcher *from_out_watcher(queued_watcher *out_watcher) noexcept
+    {
+        // Construct a pointer to the main watcher, using integer arithmetic to avoid undefined
+        // pointer arithmetic:
+        uintptr_t rp = (uintptr_t)out_watcher;
+
+        // Here we take the offset of a member from a non-standard-layout class, which is
+        // specified to have undefined result by the C++ language standard, but which
+        // in practice works fine:
+        _Pragma ("GCC diagnostic push")
+        _Pragma ("GCC diagnostic ignored \"-Winvalid-offsetof\"")
+        rp -= offsetof(base_bidi_fd_watcher, out_watcher);
+        _Pragma ("GCC diagnostic pop")
+        return (base_bidi_fd_watcher *)rp;
+    }
 
-    unsigned read_removed : 1; // read watch removed?
-    unsigned write_removed : 1; // write watch removed?
+    static void virtual_dispatch_second(queued_watcher *out_watcher, void *loop_ptr) noexcept
+    {
+        from_out_watcher(out_watcher)->dispatch_second(loop_ptr);
+    }
 };
 
 template <typename ChildData>
@@ -288,6 +412,92 @@ class base_timer_watcher : public base_watcher
     }
 };
 
+class base_timer_group;
+
+// Base for a timer which is a member of a timer group (see base_timer_group).
+class base_group_timer_watcher : public base_watcher
+{
+    template <typename, typename> friend class event_dispatch;
+    template <typename, typename> friend class dasynq::event_loop;
+    friend class base_timer_group;
+
+    protected:
+    base_timer_group *group;
+    base_group_timer_watcher *prev;
+    base_group_timer_watcher *next;
+    time_val expiry;
+    int intervals;  // expiries not yet reported
+    bool armed;     // linked into group's list?
+
+    base_group_timer_watcher() : base_watcher(watch_type_t::TIMER) { }
+};
+
+// Base for a timer group. The members of a group all have the same duration, so the group can keep
+// its armed members in a list in order of expiry by appending each member as it is armed. The group
+// itself is registered as a single timer, set to the expiry of the first member of the list; when it
+// expires, the expired members are queued and the group timer is re-inserted into the timer queue
+// (see event_dispatch::receive_timer_expiry).
+class base_timer_group : public base_timer_watcher
+{
+    template <typename, typename> friend class event_dispatch;
+    template <typename, typename> friend class dasynq::event_loop;
+
+    protected:
+    time_val duration;
+    base_group_timer_watcher *first = nullptr;
+    base_group_timer_watcher *last = nullptr;
+
+    base_timer_group(const time_val &duration_p) noexcept : duration(duration_p)
+    {
+        this->watchType = watch_type_t::TIMER_GROUP;
+    }
+
+    // Append a timer to the list; returns true if it is now first.
+    bool link(base_group_timer_watcher *t) noexcept
+    {
+        t->prev = last;
+        t->next = nullptr;
+        t->armed = true;
+        if (last == nullptr) {
+            first = last = t;
+            return true;
+        }
+        last->next = t;
+        last = t;
+        return false;
+    }
+
+    void unlink(base_group_timer_watcher *t) noexcept
+    {
+        if (t->prev == nullptr) {
+            first = t->next;
+        }
+        else {
+            t->prev->next = t->next;
+        }
+        if (t->next == nullptr) {
+            last = t->prev;
+        }
+        else {
+            t->next->prev = t->prev;
+        }
+        t->armed = false;
+    }
+};
+
+// Size budgets, for 64-bit platforms using the default queue implementation (in which the queue
+// handle holds a 32-bit index). These guard against accidental growth of the watcher structures,
+// which are accessed when dispatching every event.
+namespace {
+constexpr bool check_watcher_sizes = use_empty_node && sizeof(void *) == 8;
+}
+
+static_assert(! check_watcher_sizes || sizeof(queued_watcher) <= 24, "queued_watcher exceeds size budget");
+static_assert(! check_watcher_sizes || sizeof(base_watcher) <= 32, "base_watcher exceeds size budget");
+static_assert(! check_watcher_sizes || sizeof(base_fd_watcher) <= 40, "base_fd_watcher exceeds size budget");
+static_assert(! check_watcher_sizes || sizeof(base_bidi_fd_watcher) <= 72,
+        "base_bidi_fd_watcher exceeds size budget");
+
 } // namespace v2
 } // namespace dprivate
 } // namespace dasynq
@@ -2,6 +2,8 @@
 #define DASYNQ_BTREE_SET_H_
 
 #include <functional>
+#include <limits>
+#include <memory>
 #include <utility>
 #include <cstddef>
 
@@ -10,17 +12,17 @@
 namespace dasynq {
 
 // A sorted set based on a B-Tree data structure, supporting pre-allocation of nodes.
+//
+// Tree nodes ("sept nodes") are allocated using the allocator type Alloc (rebound as necessary).
 
-template <typename T, typename P, typename Compare = std::less<P>, int N = 8>
-class btree_set
+// Node types for btree_set. These are defined in a separate base class so that the handle type does
+// not depend on the comparator or allocator type.
+template <typename T, typename P, int N>
+class btree_set_nodes
 {
+    protected:
     struct heapnode;
-
-    public:
     using handle_t = heapnode;
-    using handle_t_r = heapnode &;
-
-    private:
 
     struct septnode
     {
@@ -104,6 +106,26 @@ class btree_set
 
         }
     };
+};
+
+template <typename T, typename P, typename Compare = std::less<P>, int N = 8,
+        typename Alloc = std::allocator<T>>
+class btree_set : private btree_set_nodes<T, P, N>
+{
+    using heapnode = typename btree_set_nodes<T, P, N>::heapnode;
+    using septnode = typename btree_set_nodes<T, P, N>::septnode;
+
+    using sept_alloc_t = typename std::allocator_traits<Alloc>::template rebind_alloc<septnode>;
+    using sept_alloc_traits = std::allocator_traits<sept_alloc_t>;
+
+    public:
+    using handle_t = heapnode;
+    using handle_t_r = heapnode &;
+    using allocator_type = Alloc;
+
+    private:
+
+    sept_alloc_t sept_alloc;
 
     septnode * root_sept = nullptr; // root of the B-Tree
     septnode * left_sept = nullptr; // leftmost child (cache)
@@ -113,6 +135,7 @@ class btree_set
     unsigned num_septs = 0;
     unsigned num_septs_needed = 0;
     unsigned next_sept = 1;  // next num_allocd for which we need another septnode in reserve.
+    unsigned num_septs_reserved = 0; // sept nodes are not released below this number (see reserve())
 
     // Note that sept nodes are always at least half full, except for the root sept node.
     // For up to N nodes, one sept node is needed;
@@ -122,6 +145,19 @@ class btree_set
     // (Actually we get away with much less, if nodes have the same priority, since they are
     // then linked in list and effectively become a single node).
 
+    septnode * new_sept()
+    {
+        septnode *s = &*sept_alloc_traits::allocate(sept_alloc, 1);
+        new (s) septnode();
+        return s;
+    }
+
+    void delete_sept(septnode *s) noexcept
+    {
+        s->~septnode();
+        sept_alloc_traits::deallocate(sept_alloc, s, 1);
+    }
+
     void alloc_slot()
     {
         num_alloced++;
@@ -131,7 +167,7 @@ class btree_set
         if (DASYNQ_EXPECT(num_alloced == next_sept, 0)) {
             if (++num_septs_needed > num_septs) {
                 try {
-                    septnode *new_res = new septnode();
+                    septnode *new_res = new_sept();
                     new_res->parent = sn_reserve;
                     sn_reserve = new_res;
                     num_septs++;
@@ -323,16 +359,35 @@ class btree_set
         if (DASYNQ_EXPECT(num_alloced < next_sept - N/2, 0)) {
             next_sept -= N/2;
             num_septs_needed--;
-            if (num_septs_needed < num_septs - 1) {
+            if (num_septs_needed < num_septs - 1 && num_septs > num_septs_reserved) {
                 // Note the "-1" margin is to alleviate bouncing allocation/deallocation
                 septnode * r = sn_reserve;
                 sn_reserve = r->parent;
-                delete r;
+                delete_sept(r);
                 num_septs--;
             }
         }
     }
 
+    // Pre-allocate sept nodes sufficient for the specified total number of slots, so that slots
+    // can subsequently be allocated without further memory allocation. The pre-allocated nodes are
+    // retained (not released when slots are deallocated). Throws std::bad_alloc on failure.
+    void reserve(size_t amount)
+    {
+        if (amount == 0) return;
+        size_t needed = 1 + (amount - 1) / (N/2);
+        if (needed > std::numeric_limits<unsigned>::max()) {
+            throw std::bad_alloc();
+        }
+        while (num_septs < needed) {
+            septnode *new_res = new_sept();
+            new_res->parent = sn_reserve;
+            sn_reserve = new_res;
+            num_septs++;
+        }
+        num_septs_reserved = needed;
+    }
+
     // Insert an allocated slot, with a unique value, into the set. Does nothing if the value is
     // already in the set.
     // Return true if the value was inserted (or false if already present).
@@ -579,6 +634,12 @@ class btree_set
         return root_sept == nullptr;
     }
 
+    btree_set() { }
+
+    explicit btree_set(const Alloc &alloc) : sept_alloc(alloc) { }
+
+    btree_set(const btree_set &) = delete;
+
     ~btree_set()
     {
         while (left_sept != nullptr) {
@@ -587,7 +648,7 @@ class btree_set
 
         while (sn_reserve != nullptr) {
             auto *next = sn_reserve->parent;
-            delete sn_reserve;
+            delete_sept(sn_reserve);
             sn_reserve = next;
         }
     }
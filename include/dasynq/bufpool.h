@@ -0,0 +1,139 @@
+#ifndef DASYNQ_BUFPOOL_H_
+#define DASYNQ_BUFPOOL_H_
+
+#include <mutex>
+#include <new>
+
+#include <cstddef>
+
+// A pool of buffer segments, shared by the stream buffers (see stream.h) of the stream watchers
+// registered with an event loop.
+//
+// A stream buffer which is not attached to a pool retains a spare segment so that it can read without
+// allocating, which means that each connection holds (at least) a segment's worth of memory whether
+// or not it has any data buffered. A buffer attached to a pool instead borrows a segment only for the
+// duration of a read, and returns each segment to the pool as soon as its data has been consumed; an
+// idle connection with no pending data holds no segment memory at all. Free segments are retained by
+// the pool (up to a limit) for re-use by other buffers.
+
+namespace dasynq {
+
+// A segment of a stream buffer.
+struct stream_segment
+{
+    static constexpr std::size_t data_size = 16384;
+
+    stream_segment *next;
+    std::size_t start;  // offset of first byte of data
+    std::size_t end;    // offset following last byte of data
+    char data[data_size];
+};
+
+// A source of segments for stream buffers.
+class stream_segment_source
+{
+    public:
+    // Get a segment. May throw std::bad_alloc.
+    virtual stream_segment *get_segment() = 0;
+
+    // Return a segment previously obtained from get_segment().
+    virtual void put_segment(stream_segment *seg) noexcept = 0;
+
+    protected:
+    ~stream_segment_source() { }
+};
+
+// A pool of stream buffer segments. Each pool has its own mutex (of type T_Mutex), which protects the
+// free list and counts.
+template <typename T_Mutex>
+class stream_buffer_pool : public stream_segment_source
+{
+    T_Mutex lock;
+    stream_segment *free_list = nullptr;
+    std::size_t num_free = 0;    // segments in free list
+    std::size_t num_in_use = 0;  // segments obtained via get_segment() and not returned
+    std::size_t max_free = 256;  // maximum number of free segments to retain
+
+    public:
+    stream_buffer_pool() noexcept { }
+    stream_buffer_pool(const stream_buffer_pool &) = delete;
+    stream_buffer_pool &operator=(const stream_buffer_pool &) = delete;
+
+    ~stream_buffer_pool()
+    {
+        while (free_list != nullptr) {
+            stream_segment *next = free_list->next;
+            delete free_list;
+            free_list = next;
+        }
+    }
+
+    stream_segment *get_segment() override
+    {
+        {
+            std::lock_guard<T_Mutex> guard(lock);
+            stream_segment *seg = free_list;
+            if (seg != nullptr) {
+                free_list = seg->next;
+                num_free--;
+                num_in_use++;
+                return seg;
+            }
+        }
+
+        stream_segment *seg = new stream_segment;
+        std::lock_guard<T_Mutex> guard(lock);
+        num_in_use++;
+        return seg;
+    }
+
+    void put_segment(stream_segment *seg) noexcept override
+    {
+        {
+            std::lock_guard<T_Mutex> guard(lock);
+            num_in_use--;
+            if (num_free < max_free) {
+                seg->next = free_list;
+                free_list = seg;
+                num_free++;
+                return;
+            }
+        }
+        delete seg;
+    }
+
+    // Set the maximum number of free segments retained for re-use (default 256); any excess is
+    // released immediately.
+    void set_max_free(std::size_t max_free_p) noexcept
+    {
+        stream_segment *excess = nullptr;
+        {
+            std::lock_guard<T_Mutex> guard(lock);
+            max_free = max_free_p;
+            while (num_free > max_free) {
+                stream_segment *seg = free_list;
+                free_list = seg->next;
+                seg->next = excess;
+                excess = seg;
+                num_free--;
+            }
+        }
+        while (excess != nullptr) {
+            stream_segment *next = excess->next;
+            delete excess;
+            excess = next;
+        }
+    }
+
+    // Get the number of segments currently held by buffers, and the number held free by the pool.
+    void get_occupancy(std::size_t &in_use, std::size_t &free) noexcept
+    {
+        std::lock_guard<T_Mutex> guard(lock);
+        in_use = num_in_use;
+        free = num_free;
+    }
+};
+
+} // namespace dasynq
+
+#endif /* DASYNQ_BUFPOOL_H_ */
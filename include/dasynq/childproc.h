@@ -5,6 +5,7 @@
 #include <sys/wait.h>
 
 #include <csignal>
+#include <type_traits>
 
 #include "btree_set.h"
 
@@ -12,14 +13,16 @@ namespace dasynq {
 namespace dprivate {
 
 // Map of pid_t to void *, with possibility of reserving entries so that mappings can
-// be later added with no danger of allocator exhaustion (bad_alloc).
+// be later added with no danger of allocator exhaustion (bad_alloc). Map nodes are allocated
+// using Alloc.
+template <typename Alloc = std::allocator<char>>
 class pid_map
 {
-    using bmap_t = btree_set<void *, pid_t>;
+    using bmap_t = btree_set<void *, pid_t, std::less<pid_t>, 8, Alloc>;
     bmap_t b_map;
     
     public:
-    using pid_handle_t = bmap_t::handle_t;
+    using pid_handle_t = typename bmap_t::handle_t;
     
     // Map entry: present (bool), data (void *)
     using entry = std::pair<bool, void *>;
@@ -56,6 +59,12 @@ class pid_map
         b_map.allocate(hndl);
     }
     
+    // Pre-allocate capacity for the specified total number of entries. Throws bad_alloc on failure.
+    void reserve_entries(size_t amount)
+    {
+        b_map.reserve(amount);
+    }
+
     void unreserve(pid_handle_t &hndl) noexcept
     {
         b_map.deallocate(hndl);
@@ -109,9 +118,10 @@ class proc_status {
 
 inline namespace v2 {
 
-using pid_watch_handle_t = dasynq::dprivate::pid_map::pid_handle_t;
+using pid_watch_handle_t = dasynq::dprivate::pid_map<>::pid_handle_t;
 
 template <class Base> class child_proc_events;
+template <class Base> class no_child_proc_events;
 
 struct child_proc_traits
 {
@@ -119,6 +129,14 @@ struct child_proc_traits
     template <typename T> using backend_tmpl = child_proc_events<T>;
 };
 
+// Traits for a loop without support for child process watches (see custom_traits). Such a loop does not
+// mask or handle SIGCHLD.
+struct no_child_proc_traits
+{
+    using proc_status_t = dasynq::dprivate::proc_status;
+    template <typename T> using backend_tmpl = no_child_proc_events<T>;
+};
+
 template <class Base> class child_proc_events : public Base
 {
     public:
@@ -132,7 +150,7 @@ template <class Base> class child_proc_events : public Base
     };
 
     private:
-    dasynq::dprivate::pid_map child_waiters;
+    dasynq::dprivate::pid_map<typename Base::allocator_t> child_waiters;
     reaper_mutex_t reaper_lock; // used to prevent reaping while trying to signal a process
     
     protected:
@@ -170,6 +188,12 @@ template <class Base> class child_proc_events : public Base
     {
         child_waiters.reserve(handle);
     }
+
+    // Pre-allocate capacity for the specified total number of child watches.
+    void reserve_child_watches_nolock(size_t amount)
+    {
+        child_waiters.reserve_entries(amount);
+    }
     
     void unreserve_child_watch(pid_watch_handle_t &handle) noexcept
     {
@@ -246,6 +270,28 @@ template <class Base> class child_proc_events : public Base
     }
 };
 
+// Placeholder for child_proc_events, when child process watches are not supported. Attempting to add a
+// child process watcher to a loop using this will fail to compile.
+template <class Base> class no_child_proc_events : public Base
+{
+    public:
+    using reaper_mutex_t = typename Base::mutex_t;
+
+    class traits_t : public Base::traits_t
+    {
+        public:
+        constexpr static bool supports_childwatch_reservation = false;
+        using proc_status_t = dprivate::proc_status;
+    };
+
+    protected:
+    using sigdata_t = typename traits_t::sigdata_t;
+};
+
+// Select child_proc_traits or no_child_proc_traits:
+template <bool child_watch> using child_proc_traits_for
+        = typename std::conditional<child_watch, child_proc_traits, no_child_proc_traits>::type;
+
 } // namespace v2
 } // namespace dasynq
 
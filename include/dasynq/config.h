@@ -3,9 +3,10 @@
 
 // You can customise Dasynq's build options in this file. Typically, you won't need to do anything; the
 // defaults are sensible for a range of operating systems, though for some BSD family OSes you may need
-// to explicitly define DASYNQ_HAVE_KQUEUE to 1. If neither epoll nor kqueue are available, the select-
-// based backend is used, and DASYNQ_HAVE_PSELECT must be defined (to either 1 or 0, if pselect is or is
-// not available, respectively).
+// to explicitly define DASYNQ_HAVE_KQUEUE to 1. If neither epoll nor kqueue are available, the poll-
+// based backend is used if DASYNQ_HAVE_POLL is 1 (the default); otherwise the select-based backend is used,
+// and DASYNQ_HAVE_PSELECT must be defined (to either 1 or 0, if pselect is or is not available,
+// respectively).
 
 // There are two parts to the file: the first is the custom configuration section, where you may specify
 // custom settings, and the second section contains automatic configuration to fill in remaining settings
@@ -24,15 +25,39 @@
 // If the epoll family of system calls are available:
 //     #define DASYNQ_HAVE_EPOLL 1
 //
+// If the epoll_pwait2 system call may be available, and should be used (in place of a timerfd) to
+// implement monotonic-clock timers via the wait timeout. If the running kernel does not support it,
+// timerfd is used anyway:
+//     #define DASYNQ_HAVE_EPOLL_PWAIT2 1
+//
 // If the eventfd syscall is available:
 //     #define DASYNQ_HAVE_EVENTFD 1
 //
 // If the pipe2 system call is available:
 //     #define DASYNQ_HAVE_PIPE2 1
 //
+// If the poll system call is available (and should be used in preference to select/pselect when
+// neither epoll nor kqueue are available):
+//     #define DASYNQ_HAVE_POLL 1
+//
 // If the pselect system call is available:
 //     #define DASYNQ_HAVE_PSELECT 1
 //
+// If the (Linux) splice system call is available, for transfer_watcher:
+//     #define DASYNQ_HAVE_SPLICE 1
+//
+// If the (Linux) sendfile system call is available, for transfer_watcher:
+//     #define DASYNQ_HAVE_SENDFILE 1
+//
+// If the recvmmsg and sendmmsg system calls are available, for datagram_watcher:
+//     #define DASYNQ_HAVE_MMSG 1
+//
+// If the accept4 system call is available, for listener_watcher:
+//     #define DASYNQ_HAVE_ACCEPT4 1
+//
+// If (Linux) zero-copy socket sends (SO_ZEROCOPY, MSG_ZEROCOPY) are available, for zerocopy_watcher:
+//     #define DASYNQ_HAVE_MSG_ZEROCOPY 1
+//
 // A tag to include at the end of a class body for a class which is allowed to have zero size.
 // Normally, C++ mandates that all objects (except empty base subobjects) have non-zero size, but on some
 // compilers (at least GCC and LLVM-Clang) there are tricks to get around this awkward limitation. Note that
@@ -76,6 +101,11 @@
 #endif
 #endif
 
+#if !defined(DASYNQ_HAVE_POLL)
+// poll is specified by POSIX and is very widely available:
+#define DASYNQ_HAVE_POLL 1
+#endif
+
 #if !defined(DASYNQ_HAVE_PSELECT)
 #if defined(__sortix__)
 // Sortix doesn't have pselect yet (but has select):
@@ -92,6 +122,27 @@
 #define DASYNQ_HAVE_PIPE2 1
 #endif
 
+#if defined(__linux__) && ! defined(DASYNQ_HAVE_SPLICE)
+#define DASYNQ_HAVE_SPLICE 1
+#endif
+
+#if defined(__linux__) && ! defined(DASYNQ_HAVE_SENDFILE)
+#define DASYNQ_HAVE_SENDFILE 1
+#endif
+
+#if defined(__linux__) && ! defined(DASYNQ_HAVE_MMSG)
+#define DASYNQ_HAVE_MMSG 1
+#endif
+
+#if (defined(__linux__) || defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__NetBSD__)) \
+        && ! defined(DASYNQ_HAVE_ACCEPT4)
+#define DASYNQ_HAVE_ACCEPT4 1
+#endif
+
+#if defined(__linux__) && ! defined(DASYNQ_HAVE_MSG_ZEROCOPY)
+#define DASYNQ_HAVE_MSG_ZEROCOPY 1
+#endif
+
 
 // Allow optimisation of empty classes by including this in the body:
 // May be included as the last entry for a class which is only
@@ -1,12 +1,15 @@
 #ifndef DASYNQ_DARYHEAP_H_
 #define DASYNQ_DARYHEAP_H_
 
+#include <algorithm>
+#include <memory>
 #include <type_traits>
 #include <functional>
 #include <utility>
 #include <limits>
 
 #include <cstddef>
+#include <cstdint>
 
 #include "svec.h"
 
@@ -42,13 +45,47 @@ namespace dasynq {
  * P : priority type (eg int)
  * Compare : functional object type to compare priorities
  * N : fan out factor (number of child nodes per node)
+ * Alloc : allocator type, used (rebound) to allocate the node vector
  */
-template <typename T, typename P, typename Compare = std::less<P>, int N = 4>
+
+// Handle type for dary_heap. This is defined outside the heap class so that it does not depend on the
+// heap's comparator, fan-out or allocator (only on the node data type).
+template <typename T>
+struct dary_heap_handle
+{
+    // The index type stored in handles. This is narrower than the heap's index type (on 64-bit
+    // platforms) to keep handles small; it limits the number of nodes to (2^32 - 1). The maximum
+    // value is used to mark a handle that is not in the heap.
+    using index_t = uint32_t;
+    static constexpr index_t no_index = std::numeric_limits<index_t>::max();
+
+    union hd_u_t {
+        // The data member is kept in a union so it doesn't get constructed/destructed
+        // automatically, and we can construct it lazily.
+        public:
+        hd_u_t() { }
+        ~hd_u_t() { }
+        T hd;
+    } hd_u;
+
+    index_t heap_index;
+
+    dary_heap_handle(const dary_heap_handle &) = delete;
+    void operator=(const dary_heap_handle &) = delete;
+
+    dary_heap_handle() { }
+};
+
+template <typename T, typename P, typename Compare = std::less<P>, int N = 4, typename Alloc = std::allocator<T>>
 class dary_heap
 {
     public:
-    struct handle_t;
+    // Handle to an element on the heap in the node buffer; also contains the data associated
+    // with the node. (Alternative implementation would be to store the heap data in a
+    // separate container, and have the handle be an index into that container).
+    using handle_t = dary_heap_handle<T>;
     using handle_t_r = handle_t &;
+    using allocator_type = Alloc;
 
     private:
 
@@ -70,35 +107,25 @@ class dary_heap
         heap_node() { }
     };
 
-    svector<heap_node> hvec;
+    using node_alloc_t = typename std::allocator_traits<Alloc>::template rebind_alloc<heap_node>;
 
-    using hindex_t = typename decltype(hvec)::size_type;
+    svector<heap_node, node_alloc_t> hvec;
 
-    hindex_t num_nodes = 0;
+    using hindex_t = typename decltype(hvec)::size_type;
 
-    public:
+    using handle_index_t = typename handle_t::index_t;
+    static constexpr handle_index_t no_index = handle_t::no_index;
 
-    // Handle to an element on the heap in the node buffer; also contains the data associated
-    // with the node. (Alternative implementation would be to store the heap data in a
-    // separate container, and have the handle be an index into that container).
-    struct handle_t
-    {
-        union hd_u_t {
-            // The data member is kept in a union so it doesn't get constructed/destructed
-            // automatically, and we can construct it lazily.
-            public:
-            hd_u_t() { }
-            ~hd_u_t() { }
-            T hd;
-        } hd_u;
+    // The node vector capacity is not reduced below this amount (avoids repeatedly shrinking and
+    // re-growing the vector when the heap holds only a few nodes).
+    static constexpr hindex_t min_capacity = 16;
 
-        hindex_t heap_index;
+    // Capacity explicitly reserved via reserve(); the node vector is not shrunk below this amount.
+    hindex_t reserved_capacity = 0;
 
-        handle_t(const handle_t &) = delete;
-        void operator=(const handle_t &) = delete;
+    hindex_t num_nodes = 0;
 
-        handle_t() { }
-    };
+    public:
 
     // Initialise a handle (if it does not have a suitable constructor). Need not do anything
     // but may store a sentinel value to mark the handle as inactive. It should not be
@@ -182,7 +209,7 @@ class dary_heap
 
     void remove_h(hindex_t hidx) noexcept
     {
-        hvec[hidx].hnd->heap_index = -1;
+        hvec[hidx].hnd->heap_index = no_index;
         if (hvec.size() != hidx + 1) {
             bubble_up(hidx, *(hvec.back().hnd), hvec.back().prio);
             hvec.pop_back();
@@ -204,7 +231,7 @@ class dary_heap
     template <typename ...U> void allocate(handle_t & hnd, U&&... u)
     {
         // Note: this can be constexpr in C++20
-        const hindex_t max_allowed = hvec.max_size();
+        const hindex_t max_allowed = std::min(hvec.max_size(), hindex_t(no_index));
 
         if (num_nodes == max_allowed) {
             throw std::bad_alloc();
@@ -235,7 +262,7 @@ class dary_heap
         }
 
         new (& hnd.hd_u.hd) T(std::forward<U>(u)...);
-        hnd.heap_index = -1;
+        hnd.heap_index = no_index;
     }
 
     // Deallocate a slot
@@ -245,9 +272,14 @@ class dary_heap
         index.hd_u.hd.~T();
 
         // shrink the capacity of hvec if num_nodes is sufficiently less than
-        // its current capacity:
-        if (num_nodes < hvec.capacity() / 4) {
-            hvec.shrink_to(num_nodes * 2);
+        // its current capacity (i.e. after a spike in the number of nodes has subsided). We leave
+        // headroom of twice the current number of nodes, so that a subsequent smaller increase does
+        // not require the vector to grow again:
+        hindex_t capacity = hvec.capacity();
+        hindex_t floor = reserved_capacity > min_capacity ? reserved_capacity : min_capacity;
+        if (num_nodes < capacity / 4 && capacity > floor) {
+            hindex_t new_capacity = num_nodes * 2;
+            hvec.shrink_to(new_capacity > floor ? new_capacity : floor);
         }
     }
 
@@ -276,6 +308,12 @@ class dary_heap
         return hvec[0].prio;
     }
 
+    // Get the priority of a node (which must be in the heap)
+    P &get_priority(handle_t & hnd) noexcept
+    {
+        return hvec[hnd.heap_index].prio;
+    }
+
     void pull_root() noexcept
     {
         remove_h(0);
@@ -293,7 +331,7 @@ class dary_heap
 
     bool is_queued(handle_t & hnd) noexcept
     {
-        return hnd.heap_index != (hindex_t) -1;
+        return hnd.heap_index != no_index;
     }
 
     // Set a node priority. Returns true iff the node becomes the root node (and wasn't before).
@@ -322,7 +360,28 @@ class dary_heap
 
     dary_heap() { }
 
+    explicit dary_heap(const Alloc &alloc) : hvec(node_alloc_t(alloc)) { }
+
     dary_heap(const dary_heap &) = delete;
+
+    // Ensure capacity for (at least) the specified total number of nodes, so that they can be allocated
+    // without reallocating the node vector. The capacity will not subsequently be reduced below this
+    // amount. Throws std::bad_alloc on failure.
+    void reserve(size_t amount)
+    {
+        const hindex_t max_allowed = std::min(hvec.max_size(), hindex_t(no_index));
+        if (amount > max_allowed) {
+            throw std::bad_alloc();
+        }
+        hvec.reserve(amount);
+        reserved_capacity = amount;
+    }
+
+    // Current node capacity (number of nodes which can be inserted without reallocation)
+    size_t capacity() noexcept
+    {
+        return hvec.capacity();
+    }
 };
 
 } // namespace dasynq
@@ -0,0 +1,577 @@
+#ifndef DASYNQ_DATAGRAM_H_
+#define DASYNQ_DATAGRAM_H_
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <vector>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+
+// Datagram watcher.
+//
+// A datagram_watcher receives datagrams in batches (using recvmmsg where available) into a
+// preallocated set of buffers, and passes each batch to a handler. Outgoing datagrams are queued and
+// sent in batches (using sendmmsg where available). On Linux, UDP segmentation offload (UDP_SEGMENT)
+// can be used to send a run of equal-sized datagrams to the same destination as a single "super
+// datagram", and UDP receive offload (UDP_GRO) to receive them likewise; received super datagrams
+// are split before being passed to the handler.
+//
+// This header is included by dasynq.h; it should not be included directly.
+
+namespace dasynq {
+
+// A received datagram, as passed to a datagram watcher's datagrams_received() handler. The data and
+// address remain valid only until the handler returns.
+struct datagram
+{
+    const char *data;
+    size_t len;
+    const struct sockaddr *addr;  // source address (nullptr if not available)
+    socklen_t addr_len;
+    bool truncated;               // datagram was larger than the receive buffer
+};
+
+namespace dprivate {
+
+#if DASYNQ_HAVE_MMSG
+using datagram_msg = struct mmsghdr;
+#else
+// Equivalent to Linux's "struct mmsghdr":
+struct datagram_msg
+{
+    struct msghdr msg_hdr;
+    unsigned msg_len;
+};
+#endif
+
+// Receive a batch of datagrams; returns as for recvmmsg().
+inline int recv_datagrams(int fd, datagram_msg *msgs, unsigned count) noexcept
+{
+#if DASYNQ_HAVE_MMSG
+    return recvmmsg(fd, msgs, count, MSG_DONTWAIT, nullptr);
+#else
+    unsigned i = 0;
+    for ( ; i < count; i++) {
+        ssize_t r = recvmsg(fd, &msgs[i].msg_hdr, MSG_DONTWAIT);
+        if (r == -1) {
+            return (i == 0) ? -1 : i;
+        }
+        msgs[i].msg_len = r;
+    }
+    return i;
+#endif
+}
+
+// Send a batch of datagrams; returns as for sendmmsg().
+inline int send_datagrams(int fd, datagram_msg *msgs, unsigned count) noexcept
+{
+#if DASYNQ_HAVE_MMSG
+    return sendmmsg(fd, msgs, count, MSG_DONTWAIT);
+#else
+    unsigned i = 0;
+    for ( ; i < count; i++) {
+        ssize_t r = sendmsg(fd, &msgs[i].msg_hdr, MSG_DONTWAIT);
+        if (r == -1) {
+            return (i == 0) ? -1 : i;
+        }
+        msgs[i].msg_len = r;
+    }
+    return i;
+#endif
+}
+
+// A datagram watcher.
+//
+// The Derived class must provide:
+//
+//     rearm datagrams_received(EventLoop &eloop, const datagram *dgrams, size_t count)
+//         - called with a batch of received datagrams. Return rearm::REARM to continue receiving.
+//
+// and may provide:
+//
+//     rearm receive_error(EventLoop &eloop, int errcode)
+//         - called when receiving fails (eg ECONNREFUSED for a connected socket). The default
+//           implementation returns rearm::REARM.
+//     void send_error(EventLoop &eloop, int errcode)
+//         - called when sending a queued datagram fails (the datagram is discarded). The default
+//           implementation does nothing.
+//
+// Outgoing datagrams are queued with queue_datagram(), and sent with flush(); send_to() queues a
+// datagram and flushes. Datagrams which cannot be sent immediately remain queued and are sent when
+// the socket becomes writable. These functions may be called from any thread.
+template <typename EventLoop, typename Derived>
+class datagram_watcher_impl : public bidi_fd_watcher_impl<EventLoop, datagram_watcher_impl<EventLoop, Derived>>
+{
+    template <typename, typename> friend class bidi_fd_watcher_impl;
+
+    using mutex_t = typename EventLoop::mutex_t;
+
+    // Number of datagrams to receive, or send, with a single system call:
+    static constexpr unsigned batch_size = 32;
+
+    // Maximum number of receive batches to process in response to a single input event:
+    static constexpr int max_batches_per_event = 8;
+
+    // Maximum number of segments in a single super datagram (the kernel's UDP_MAX_SEGMENTS), and
+    // the maximum total size:
+    static constexpr unsigned max_segments = 64;
+    static constexpr size_t max_super_size = 65000;
+
+    // Size of control message buffer, for segment size:
+    static constexpr size_t ctrl_size = CMSG_SPACE(sizeof(int));
+
+    // State of the output side:
+    enum class out_state_t
+    {
+        IDLE,    // output watch disabled
+        ARMED,   // datagrams queued, output watch enabled
+        ACTIVE   // write_ready handler running
+    };
+
+    // A queued outgoing datagram:
+    struct tx_entry
+    {
+        size_t offset;  // in tx_data
+        size_t len;
+        struct sockaddr_storage addr;
+        socklen_t addr_len;
+    };
+
+    // Receive buffers, for batch_size messages:
+    struct rx_slot
+    {
+        struct sockaddr_storage addr;
+        struct iovec iov;
+        alignas(struct cmsghdr) char ctrl[ctrl_size];
+    };
+
+    size_t rx_buf_size = 0;
+    std::unique_ptr<char[]> rx_data;
+    std::unique_ptr<rx_slot[]> rx_slots;
+    std::unique_ptr<datagram_msg[]> rx_msgs;
+    std::unique_ptr<datagram[]> rx_dgrams;
+    size_t rx_dgram_capacity = 0;
+
+    bool want_gso = false;
+    bool want_gro = false;
+    bool use_gro = false;
+
+    // protects the output queue and output state:
+    mutex_t out_lock;
+    out_state_t out_state = out_state_t::IDLE;
+    bool use_gso = false;
+    std::vector<char> tx_data;
+    std::vector<tx_entry> tx_queue;
+    size_t tx_head = 0;
+    size_t tx_queued_bytes = 0;
+    size_t tx_limit = 4 * 1024 * 1024;
+
+    // Allocate receive buffers (if not already allocated with the required size).
+    void alloc_rx_buffers(size_t max_size)
+    {
+        size_t buf_size = use_gro ? 65536 : max_size;
+        size_t dgram_capacity = use_gro ? (batch_size * max_segments) : batch_size;
+        if (rx_data != nullptr && buf_size == rx_buf_size && dgram_capacity == rx_dgram_capacity) {
+            return;
+        }
+
+        std::unique_ptr<char[]> new_data(new char[buf_size * batch_size]);
+        std::unique_ptr<rx_slot[]> new_slots(new rx_slot[batch_size]);
+        std::unique_ptr<datagram_msg[]> new_msgs(new datagram_msg[batch_size]);
+        std::unique_ptr<datagram[]> new_dgrams(new datagram[dgram_capacity]);
+
+        rx_data = std::move(new_data);
+        rx_slots = std::move(new_slots);
+        rx_msgs = std::move(new_msgs);
+        rx_dgrams = std::move(new_dgrams);
+        rx_buf_size = buf_size;
+        rx_dgram_capacity = dgram_capacity;
+    }
+
+    // Prepare the receive message headers for a receive call.
+    void prepare_rx_msgs() noexcept
+    {
+        for (unsigned i = 0; i < batch_size; i++) {
+            rx_slot &slot = rx_slots[i];
+            slot.iov.iov_base = rx_data.get() + i * rx_buf_size;
+            slot.iov.iov_len = rx_buf_size;
+
+            struct msghdr &hdr = rx_msgs[i].msg_hdr;
+            memset(&hdr, 0, sizeof(hdr));
+            hdr.msg_name = &slot.addr;
+            hdr.msg_namelen = sizeof(slot.addr);
+            hdr.msg_iov = &slot.iov;
+            hdr.msg_iovlen = 1;
+            if (use_gro) {
+                hdr.msg_control = slot.ctrl;
+                hdr.msg_controllen = ctrl_size;
+            }
+        }
+    }
+
+    // Get the segment size of a received super datagram, or 0.
+    static size_t get_gro_size(struct msghdr &hdr) noexcept
+    {
+#ifdef UDP_GRO
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr); cmsg != nullptr; cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+            if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+                int gso_size;
+                memcpy(&gso_size, CMSG_DATA(cmsg), sizeof(gso_size));
+                return gso_size;
+            }
+        }
+#endif
+        return 0;
+    }
+
+    rearm read_ready(EventLoop &eloop, int fd) noexcept
+    {
+        Derived *derived = static_cast<Derived *>(this);
+
+        for (int batch = 0; batch < max_batches_per_event; batch++) {
+            prepare_rx_msgs();
+            int r = recv_datagrams(fd, rx_msgs.get(), batch_size);
+            if (r == -1) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+                rearm rr = derived->receive_error(eloop, errno);
+                if (rr != rearm::REARM) return rr;
+                continue;
+            }
+
+            size_t count = 0;
+            for (int i = 0; i < r; i++) {
+                struct msghdr &hdr = rx_msgs[i].msg_hdr;
+                const char *data = static_cast<const char *>(rx_slots[i].iov.iov_base);
+                size_t len = rx_msgs[i].msg_len;
+                const struct sockaddr *addr = hdr.msg_namelen != 0 ? (const struct sockaddr *)hdr.msg_name : nullptr;
+                bool truncated = (hdr.msg_flags & MSG_TRUNC) != 0;
+
+                size_t seg_size = use_gro ? get_gro_size(hdr) : 0;
+                if (seg_size == 0 || seg_size >= len) {
+                    seg_size = len;
+                }
+
+                // Split a super datagram (if there is no super datagram, the loop runs once):
+                size_t pos = 0;
+                do {
+                    if (count == rx_dgram_capacity) {
+                        rearm rr = derived->datagrams_received(eloop, rx_dgrams.get(), count);
+                        if (rr != rearm::REARM) return rr;
+                        count = 0;
+                    }
+                    size_t seg_len = std::min(seg_size, len - pos);
+                    rx_dgrams[count++] = datagram { data + pos, seg_len, addr, hdr.msg_namelen, truncated };
+                    pos += seg_len;
+                } while (pos < len);
+            }
+
+            if (count != 0) {
+                rearm rr = derived->datagrams_received(eloop, rx_dgrams.get(), count);
+                if (rr != rearm::REARM) return rr;
+            }
+
+            if (unsigned(r) < batch_size) {
+                // Probably no more datagrams for now
+                break;
+            }
+        }
+
+        return rearm::REARM;
+    }
+
+    // Count the queued datagrams, starting at index first, which can be sent together as a super
+    // datagram (same destination, equal length except for the last). Call with out_lock held.
+    size_t count_gso_run(size_t first) noexcept
+    {
+        const tx_entry &head = tx_queue[first];
+        size_t seg_len = head.len;
+        size_t total = seg_len;
+        size_t n = 1;
+
+        if (seg_len == 0) return 1;
+
+        while (first + n < tx_queue.size() && n < max_segments) {
+            const tx_entry &e = tx_queue[first + n];
+            if (e.len > seg_len || e.len == 0 || total + e.len > max_super_size) break;
+            if (e.addr_len != head.addr_len || memcmp(&e.addr, &head.addr, head.addr_len) != 0) break;
+            total += e.len;
+            n++;
+            if (e.len < seg_len) break; // a shorter datagram can only be the last segment
+        }
+        return n;
+    }
+
+    // Send as many queued datagrams as possible. Returns the first error number from a failed
+    // datagram, or 0. Call with out_lock held.
+    int send_queued(int fd) noexcept
+    {
+        int first_err = 0;
+
+        while (tx_head < tx_queue.size()) {
+            datagram_msg msgs[batch_size];
+            struct iovec iovs[batch_size];
+            size_t msg_entries[batch_size];
+            alignas(struct cmsghdr) char ctrls[batch_size][ctrl_size];
+
+            unsigned nmsgs = 0;
+            size_t idx = tx_head;
+            while (nmsgs < batch_size && idx < tx_queue.size()) {
+                tx_entry &e = tx_queue[idx];
+                size_t run = use_gso ? count_gso_run(idx) : 1;
+
+                // The entries in a run are contiguous in tx_data:
+                size_t run_len = 0;
+                for (size_t j = 0; j < run; j++) run_len += tx_queue[idx + j].len;
+
+                iovs[nmsgs].iov_base = tx_data.data() + e.offset;
+                iovs[nmsgs].iov_len = run_len;
+
+                struct msghdr &hdr = msgs[nmsgs].msg_hdr;
+                memset(&hdr, 0, sizeof(hdr));
+                if (e.addr_len != 0) {
+                    hdr.msg_name = &e.addr;
+                    hdr.msg_namelen = e.addr_len;
+                }
+                hdr.msg_iov = &iovs[nmsgs];
+                hdr.msg_iovlen = 1;
+
+#ifdef UDP_SEGMENT
+                if (run > 1) {
+                    hdr.msg_control = ctrls[nmsgs];
+                    hdr.msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+                    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr);
+                    cmsg->cmsg_level = SOL_UDP;
+                    cmsg->cmsg_type = UDP_SEGMENT;
+                    cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+                    uint16_t seg_size = e.len;
+                    memcpy(CMSG_DATA(cmsg), &seg_size, sizeof(seg_size));
+                }
+#endif
+
+                msg_entries[nmsgs] = run;
+                nmsgs++;
+                idx += run;
+            }
+
+            int r = send_datagrams(fd, msgs, nmsgs);
+            if (r == -1) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+                if (msg_entries[0] > 1 && (errno == EIO || errno == EINVAL || errno == EOPNOTSUPP)) {
+                    // Segmentation offload not supported (by the kernel or the device); retry without:
+                    use_gso = false;
+                    continue;
+                }
+                // Discard the failed datagram:
+                if (first_err == 0) first_err = errno;
+                r = 1;
+            }
+
+            for (int i = 0; i < r; i++) {
+                for (size_t j = 0; j < msg_entries[i]; j++) {
+                    tx_queued_bytes -= tx_queue[tx_head].len;
+                    tx_head++;
+                }
+            }
+        }
+
+        if (tx_head == tx_queue.size()) {
+            tx_queue.clear();
+            tx_data.clear();
+            tx_head = 0;
+        }
+        else if (tx_head * 2 >= tx_queue.size()) {
+            // Discard the sent datagrams, so that the queue doesn't grow indefinitely:
+            size_t sent_bytes = tx_queue[tx_head].offset;
+            tx_data.erase(tx_data.begin(), tx_data.begin() + sent_bytes);
+            tx_queue.erase(tx_queue.begin(), tx_queue.begin() + tx_head);
+            for (tx_entry &e : tx_queue) {
+                e.offset -= sent_bytes;
+            }
+            tx_head = 0;
+        }
+
+        return first_err;
+    }
+
+    // If no output is in progress, send as many queued datagrams as possible now, and enable the
+    // output watch if any remain. Returns an error number (for a discarded datagram) or 0. Call with
+    // out_lock held.
+    int start_output(EventLoop &eloop) noexcept
+    {
+        int errcode = 0;
+        if (out_state == out_state_t::IDLE && tx_head != tx_queue.size()) {
+            errcode = send_queued(this->get_watched_fd());
+            if (tx_head != tx_queue.size()) {
+                out_state = out_state_t::ARMED;
+                this->set_out_watch_enabled(eloop, true);
+            }
+        }
+        return errcode;
+    }
+
+    rearm write_ready(EventLoop &eloop, int fd) noexcept
+    {
+        out_lock.lock();
+        if (out_state != out_state_t::ARMED) {
+            // spurious:
+            out_lock.unlock();
+            return rearm::DISARM;
+        }
+        out_state = out_state_t::ACTIVE;
+
+        int errcode = send_queued(fd);
+        rearm result = rearm::REARM;
+
+        if (tx_head == tx_queue.size()) {
+            // Disable the output watch before we leave the ACTIVE state, so that a concurrent
+            // flush() which re-enables it cannot be overridden:
+            this->set_out_watch_enabled(eloop, false);
+            out_state = out_state_t::IDLE;
+            result = rearm::NOOP;
+        }
+        else {
+            out_state = out_state_t::ARMED;
+        }
+
+        out_lock.unlock();
+
+        if (errcode != 0) {
+            static_cast<Derived *>(this)->send_error(eloop, errcode);
+        }
+        return result;
+    }
+
+    public:
+
+    // Default handlers (may be hidden by Derived):
+
+    rearm receive_error(EventLoop &eloop, int errcode) noexcept
+    {
+        return rearm::REARM;
+    }
+
+    void send_error(EventLoop &eloop, int errcode) noexcept { }
+
+    // Enable UDP segmentation offload (gso) for sending, and/or receive offload (gro), if supported.
+    // Must be called before add_watch().
+    void set_offload(bool gso, bool gro) noexcept
+    {
+#ifdef UDP_SEGMENT
+        want_gso = gso;
+#endif
+#ifdef UDP_GRO
+        want_gro = gro;
+#endif
+    }
+
+    // Register the watcher with an event loop, for input. The socket should be in non-blocking mode.
+    // Receive buffers are allocated for datagrams of up to max_size bytes; larger datagrams are
+    // truncated.
+    //
+    // Can fail with std::bad_alloc or std::system_error.
+    void add_watch(EventLoop &eloop, int fd, size_t max_size = 2048, int inprio = DEFAULT_PRIORITY,
+            int outprio = DEFAULT_PRIORITY)
+    {
+        use_gro = false;
+#ifdef UDP_GRO
+        if (want_gro) {
+            int one = 1;
+            use_gro = setsockopt(fd, SOL_UDP, UDP_GRO, &one, sizeof(one)) == 0;
+        }
+#endif
+        alloc_rx_buffers(max_size);
+
+        out_state = out_state_t::IDLE;
+        use_gso = want_gso;
+        tx_queue.clear();
+        tx_data.clear();
+        tx_head = 0;
+        tx_queued_bytes = 0;
+        bidi_fd_watcher<EventLoop>::add_watch(eloop, fd, IN_EVENTS, inprio, outprio);
+    }
+
+    // Set the limit on the total size of queued outgoing datagrams (default 4MB).
+    void set_queue_limit(size_t limit) noexcept
+    {
+        std::lock_guard<mutex_t> guard(out_lock);
+        tx_limit = limit;
+    }
+
+    // Queue a datagram for sending to the specified address (or, if addr is nullptr, the connected
+    // peer), without sending it. Queued datagrams are sent by flush() or send_to(). Returns false,
+    // and discards the datagram, if the queue limit would be exceeded. May throw std::bad_alloc (in
+    // which case the datagram is not queued).
+    bool queue_datagram(EventLoop &eloop, const void *data, size_t len, const struct sockaddr *addr = nullptr,
+            socklen_t addr_len = 0)
+    {
+        std::lock_guard<mutex_t> guard(out_lock);
+
+        if (tx_queued_bytes + len > tx_limit) {
+            return false;
+        }
+
+        tx_entry entry;
+        entry.offset = tx_data.size();
+        entry.len = len;
+        entry.addr_len = (addr != nullptr) ? std::min(addr_len, socklen_t(sizeof(entry.addr))) : 0;
+        if (entry.addr_len != 0) {
+            memcpy(&entry.addr, addr, entry.addr_len);
+        }
+
+        tx_queue.reserve(tx_queue.size() + 1);
+        const char *data_c = static_cast<const char *>(data);
+        tx_data.insert(tx_data.end(), data_c, data_c + len);
+        tx_queue.push_back(entry);
+        tx_queued_bytes += len;
+        return true;
+    }
+
+    // Send queued datagrams (as many as possible immediately, and the remainder when the socket
+    // becomes writable).
+    void flush(EventLoop &eloop) noexcept
+    {
+        std::unique_lock<mutex_t> guard(out_lock);
+        int errcode = start_output(eloop);
+        guard.unlock();
+
+        if (errcode != 0) {
+            static_cast<Derived *>(this)->send_error(eloop, errcode);
+        }
+    }
+
+    // Queue a datagram and flush. Returns false if the queue limit would be exceeded. May throw
+    // std::bad_alloc.
+    bool send_to(EventLoop &eloop, const void *data, size_t len, const struct sockaddr *addr = nullptr,
+            socklen_t addr_len = 0)
+    {
+        if (! queue_datagram(eloop, data, len, addr, addr_len)) {
+            return false;
+        }
+        flush(eloop);
+        return true;
+    }
+
+    // Get the number of queued (unsent) datagrams.
+    size_t get_queued_count() noexcept
+    {
+        std::lock_guard<mutex_t> guard(out_lock);
+        return tx_queue.size() - tx_head;
+    }
+};
+
+} // namespace dprivate
+} // namespace dasynq
+
+#endif /* DASYNQ_DATAGRAM_H_ */
@@ -1,6 +1,7 @@
 #ifndef DASYNQ_EPOLL_H_
 #define DASYNQ_EPOLL_H_
 
+#include <atomic>
 #include <system_error>
 #include <mutex>
 #include <type_traits>
@@ -9,11 +10,14 @@
 
 #include <sys/epoll.h>
 #include <sys/signalfd.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 
 #include <unistd.h>
 #include <csignal>
+#include <cerrno>
+#include <ctime>
 
 namespace dasynq {
 
@@ -81,6 +85,33 @@ class epoll_fd_r {
     }
 };
 
+// Wrappers for the epoll_pwait2 system call (Linux 5.11+), which accepts a nanosecond-resolution
+// timeout. This is called directly, since the C library may not provide a wrapper. The kernel
+// timeout structure has a 64-bit seconds field, so only use it where time_t is also 64 bits.
+
+inline bool epoll_pwait2_available() noexcept
+{
+#if defined(SYS_epoll_pwait2)
+    if (sizeof(time_t) != 8) return false;
+    // With invalid arguments, this fails with EBADF or EINVAL if the call is supported (or ENOSYS,
+    // or possibly EPERM if filtered, if not):
+    if (syscall(SYS_epoll_pwait2, -1, nullptr, 0, nullptr, nullptr, 0) != -1) return false;
+    return errno == EBADF || errno == EINVAL;
+#else
+    return false;
+#endif
+}
+
+inline int epoll_pwait2(int epfd, epoll_event *events, int maxevents, const timespec *timeout) noexcept
+{
+#if defined(SYS_epoll_pwait2)
+    return syscall(SYS_epoll_pwait2, epfd, events, maxevents, timeout, nullptr, 0);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
 } // namespace dprivate
 
 inline namespace v3 {
@@ -110,6 +141,14 @@ template <class Base> class epoll_loop : public Base
     int sigfd = -1; // signalfd fd; -1 if not initialised
     sigset_t sigmask;
 
+    // A secondary ("fast") epoll set, nested within the main set, for watches registered with the
+    // FAST_FD flag. It is checked ahead of the main set when pulling events, so that readiness of
+    // high-priority descriptors is not delayed by a large number of ready descriptors in the main set.
+    // -1 if not yet created; once created, it persists until the loop is destroyed. It is only set
+    // with the lock held, but may be read without it (see fast_set_exists()).
+    std::atomic<int> fast_epfd {-1};
+    std::vector<bool> fast_fds; // descriptors in the fast set (protected by Base::lock)
+
     std::unordered_map<int, void *> sigdataMap;
 
     // Base contains:
@@ -120,46 +159,142 @@ template <class Base> class epoll_loop : public Base
     
     using sigdata_t = dprivate::epoll_sigdata_t;
     using fd_r = typename dprivate::epoll_fd_r;
-    
-    void process_events(epoll_event *events, int r)
+
+    // Get the epoll set containing the given descriptor (call with lock held).
+    int fd_epfd(int fd) noexcept
     {
-        std::lock_guard<decltype(Base::lock)> guard(Base::lock);
-        
-        for (int i = 0; i < r; i++) {
-            void *ptr = events[i].data.ptr;
-            
-            if (ptr == &sigfd) {
-                // Signal
-                sigdata_t siginfo;
-                while (true) {
-                    int r = read(sigfd, &siginfo.info, sizeof(siginfo.info));
-                    if (r == -1) break;
-                    auto iter = sigdataMap.find(siginfo.get_signo());
-                    if (iter != sigdataMap.end()) {
-                        void *userdata = (*iter).second;
-                        if (Base::receive_signal(*this, siginfo, userdata)) {
-                            sigdelset(&sigmask, siginfo.get_signo());
-                        }
+        if (size_t(fd) < fast_fds.size() && fast_fds[fd]) {
+            return fast_epfd.load(std::memory_order_relaxed);
+        }
+        return epfd;
+    }
+
+    // Check whether the fast set has been created, without the lock held. If it has not, no watch can
+    // be in the fast set. A watch is added to the fast set (creating it if necessary) with the lock
+    // held, and any operation on that watch happens after its registration, so a relaxed load is
+    // sufficient to see the fast set if the watch is in it.
+    bool fast_set_exists() noexcept
+    {
+        return fast_epfd.load(std::memory_order_relaxed) != -1;
+    }
+
+    // Create the fast epoll set, and add it to the main set (call with lock held).
+    void create_fast_set()
+    {
+        int new_epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (new_epfd == -1) {
+            throw std::system_error(errno, std::system_category());
+        }
+
+        struct epoll_event epevent;
+        epevent.data.ptr = &fast_epfd;
+        epevent.events = EPOLLIN;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, new_epfd, &epevent) == -1) {
+            int err = errno;
+            close(new_epfd);
+            throw std::system_error(err, std::system_category());
+        }
+
+        fast_epfd.store(new_epfd, std::memory_order_relaxed);
+    }
+
+    // Process an event (call with lock held).
+    void process_event(epoll_event &event)
+    {
+        void *ptr = event.data.ptr;
+
+        if (ptr == &sigfd) {
+            // Signal
+            sigdata_t siginfo;
+            bool mask_changed = false;
+            while (true) {
+                int r = read(sigfd, &siginfo.info, sizeof(siginfo.info));
+                if (r == -1) break;
+                auto iter = sigdataMap.find(siginfo.get_signo());
+                if (iter != sigdataMap.end()) {
+                    void *userdata = (*iter).second;
+                    if (Base::receive_signal(*this, siginfo, userdata)) {
+                        sigdelset(&sigmask, siginfo.get_signo());
+                        mask_changed = true;
                     }
                 }
+            }
+            if (mask_changed) {
                 signalfd(sigfd, &sigmask, SFD_NONBLOCK | SFD_CLOEXEC);
             }
-            else {
-                int flags = 0;
-                (events[i].events & EPOLLIN) && (flags |= IN_EVENTS);
-                (events[i].events & EPOLLOUT) && (flags |= OUT_EVENTS);
-                // We mustn't introduce IN/OUT events for error conditions as we don't know which are being
-                // watched! Just set ERR_EVENTS.
-                (events[i].events & EPOLLHUP) && (flags |= ERR_EVENTS);
-                (events[i].events & EPOLLERR) && (flags |= ERR_EVENTS);
-                auto r = Base::receive_fd_event(*this, fd_r(), ptr, flags);
-                if (std::get<0>(r) != 0) {
-                    enable_fd_watch_nolock(fd_r().get_fd(std::get<1>(r)), ptr, std::get<0>(r));
-                }
-            }            
+        }
+        else if (ptr == &fast_epfd) {
+            // The fast set has events pending (this can happen if fast events become ready while
+            // we are draining the main set); process them now.
+            epoll_event events[16];
+            int r = epoll_wait(fast_epfd.load(std::memory_order_relaxed), events, 16, 0);
+            for (int i = 0; i < r; i++) {
+                process_event(events[i]);
+            }
+        }
+        else {
+            int flags = 0;
+            (event.events & EPOLLIN) && (flags |= IN_EVENTS);
+            (event.events & EPOLLOUT) && (flags |= OUT_EVENTS);
+            // We mustn't introduce IN/OUT events for error conditions as we don't know which are being
+            // watched! Just set ERR_EVENTS.
+            (event.events & EPOLLHUP) && (flags |= ERR_EVENTS);
+            (event.events & EPOLLERR) && (flags |= ERR_EVENTS);
+            auto r = Base::receive_fd_event(*this, fd_r(), ptr, flags);
+            if (std::get<0>(r) != 0) {
+                enable_fd_watch_nolock(fd_r().get_fd(std::get<1>(r)), ptr, std::get<0>(r));
+            }
+        }
+    }
+
+    void process_events(epoll_event *events, int r)
+    {
+        std::lock_guard<decltype(Base::lock)> guard(Base::lock);
+        
+        for (int i = 0; i < r; i++) {
+            process_event(events[i]);
         }
     }
     
+    void set_epoll_events(int set_epfd, int fd, void *userdata, int flags) noexcept
+    {
+        struct epoll_event epevent;
+        // epevent.data.fd = fd;
+        epevent.data.ptr = userdata;
+        epevent.events = 0;
+        
+        if (flags & ONE_SHOT) {
+            epevent.events = EPOLLONESHOT;
+        }
+        if (flags & IN_EVENTS) {
+            epevent.events |= EPOLLIN;
+        }
+        if (flags & OUT_EVENTS) {
+            epevent.events |= EPOLLOUT;
+        }
+        
+        if (epoll_ctl(set_epfd, EPOLL_CTL_MOD, fd, &epevent) == -1) {
+            // Shouldn't be able to fail
+            // throw std::system_error(errno, std::system_category());
+        }
+    }
+
+    void clear_epoll_events(int set_epfd, int fd) noexcept
+    {
+        struct epoll_event epevent;
+        // epevent.data.fd = fd;
+        epevent.data.ptr = nullptr;
+        epevent.events = 0;
+        
+        // Epoll documentation says that hangup will still be reported, need to check
+        // whether this is really the case. Suspect it is really only the case if
+        // EPOLLIN is set.
+        if (epoll_ctl(set_epfd, EPOLL_CTL_MOD, fd, &epevent) == -1) {
+            // Let's assume that this can't fail.
+            // throw std::system_error(errno, std::system_category());
+        }
+    }
+
     public:
     
     /**
@@ -201,12 +336,16 @@ template <class Base> class epoll_loop : public Base
             if (sigfd != -1) {
                 close(sigfd);
             }
+            int fast_fd = fast_epfd.load(std::memory_order_relaxed);
+            if (fast_fd != -1) {
+                close(fast_fd);
+            }
         }
     }
     
     //        fd:  file descriptor to watch
     //  userdata:  data to associate with descriptor
-    //     flags:  IN_EVENTS | OUT_EVENTS | ONE_SHOT
+    //     flags:  IN_EVENTS | OUT_EVENTS | ONE_SHOT | FAST_FD
     // soft_fail:  true if unsupported file descriptors should fail by returning false instead
     //             of throwing an exception
     // returns: true on success; false if file descriptor type isn't supported and soft_fail == true
@@ -228,12 +367,28 @@ template <class Base> class epoll_loop : public Base
             epevent.events |= EPOLLOUT;
         }
 
-        if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &epevent) == -1) {
+        int add_epfd = epfd;
+        if (flags & FAST_FD) {
+            // Note add_fd_watch is called with the lock held.
+            if (fast_epfd.load(std::memory_order_relaxed) == -1) {
+                create_fast_set();
+            }
+            if (size_t(fd) >= fast_fds.size()) {
+                fast_fds.resize(fd + 1);
+            }
+            add_epfd = fast_epfd.load(std::memory_order_relaxed);
+        }
+
+        if (epoll_ctl(add_epfd, EPOLL_CTL_ADD, fd, &epevent) == -1) {
             if (soft_fail && errno == EPERM) {
                 return false;
             }
             throw std::system_error(errno, std::system_category());
         }
+
+        if (flags & FAST_FD) {
+            fast_fds[fd] = true;
+        }
         return true;
     }
     
@@ -247,12 +402,24 @@ template <class Base> class epoll_loop : public Base
     // separate read/write watches.
     void remove_fd_watch(int fd, int flags) noexcept
     {
-        epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr);
+        // If the fast set hasn't been created, no locking is needed; the fast set is only created
+        // (with the lock held) when a watch is added with FAST_FD, which cannot race with removal
+        // of that same watch.
+        if (! fast_set_exists()) {
+            epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr);
+            return;
+        }
+
+        std::lock_guard<decltype(Base::lock)> guard(Base::lock);
+        remove_fd_watch_nolock(fd, flags);
     }
     
     void remove_fd_watch_nolock(int fd, int flags) noexcept
     {
-        remove_fd_watch(fd, flags);
+        epoll_ctl(fd_epfd(fd), EPOLL_CTL_DEL, fd, nullptr);
+        if (size_t(fd) < fast_fds.size()) {
+            fast_fds[fd] = false;
+        }
     }
     
     void remove_bidi_fd_watch(int fd) noexcept
@@ -265,51 +432,34 @@ template <class Base> class epoll_loop : public Base
     // it can enable *or disable* read/write events.
     void enable_fd_watch(int fd, void *userdata, int flags) noexcept
     {
-        struct epoll_event epevent;
-        // epevent.data.fd = fd;
-        epevent.data.ptr = userdata;
-        epevent.events = 0;
-        
-        if (flags & ONE_SHOT) {
-            epevent.events = EPOLLONESHOT;
-        }
-        if (flags & IN_EVENTS) {
-            epevent.events |= EPOLLIN;
-        }
-        if (flags & OUT_EVENTS) {
-            epevent.events |= EPOLLOUT;
-        }
-        
-        if (epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &epevent) == -1) {
-            // Shouldn't be able to fail
-            // throw std::system_error(errno, std::system_category());
+        if (! fast_set_exists()) {
+            set_epoll_events(epfd, fd, userdata, flags);
+            return;
         }
+
+        std::lock_guard<decltype(Base::lock)> guard(Base::lock);
+        enable_fd_watch_nolock(fd, userdata, flags);
     }
     
     void enable_fd_watch_nolock(int fd, void *userdata, int flags) noexcept
     {
-        enable_fd_watch(fd, userdata, flags);
+        set_epoll_events(fd_epfd(fd), fd, userdata, flags);
     }
     
     void disable_fd_watch(int fd, int flags) noexcept
     {
-        struct epoll_event epevent;
-        // epevent.data.fd = fd;
-        epevent.data.ptr = nullptr;
-        epevent.events = 0;
-        
-        // Epoll documentation says that hangup will still be reported, need to check
-        // whether this is really the case. Suspect it is really only the case if
-        // EPOLLIN is set.
-        if (epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &epevent) == -1) {
-            // Let's assume that this can't fail.
-            // throw std::system_error(errno, std::system_category());
+        if (! fast_set_exists()) {
+            clear_epoll_events(epfd, fd);
+            return;
         }
+
+        std::lock_guard<decltype(Base::lock)> guard(Base::lock);
+        disable_fd_watch_nolock(fd, flags);
     }
     
     void disable_fd_watch_nolock(int fd, int flags) noexcept
     {
-        disable_fd_watch(fd, flags);
+        clear_epoll_events(fd_epfd(fd), fd);
     }
 
     // Note signal should be masked before call.
@@ -379,7 +529,35 @@ template <class Base> class epoll_loop : public Base
     void pull_events(bool do_wait)
     {
         epoll_event events[16];
-        int r = epoll_wait(epfd, events, 16, do_wait ? -1 : 0);
+
+        int fast_fd = fast_epfd.load(std::memory_order_relaxed);
+        if (fast_fd != -1) {
+            // Check the fast set first:
+            int r = epoll_wait(fast_fd, events, 16, 0);
+            if (r > 0) {
+                process_events(events, r);
+                do_wait = false;
+            }
+        }
+
+        // If the timer mechanism relies on the wait timeout (see pwait2timer.h), process expired
+        // timers and find the timeout for the next:
+        struct timespec ts;
+        struct timespec *wait_ts = nullptr;
+        int r;
+        if (this->begin_timer_wait(do_wait, ts, wait_ts)) {
+            if (! do_wait) {
+                ts.tv_sec = 0;
+                ts.tv_nsec = 0;
+                wait_ts = &ts;
+            }
+            r = dprivate::epoll_pwait2(epfd, events, 16, wait_ts);
+            this->end_timer_wait(r == 0 && do_wait);
+        }
+        else {
+            r = epoll_wait(epfd, events, 16, do_wait ? -1 : 0);
+        }
+
         if (r == -1 || r == 0) {
             // signal or no events
             return;
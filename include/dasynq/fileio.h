@@ -0,0 +1,131 @@
+#ifndef DASYNQ_FILEIO_H_
+#define DASYNQ_FILEIO_H_
+
+#include <cerrno>
+#include <cstddef>
+
+#include <sys/types.h>
+#include <unistd.h>
+
+// Asynchronous file I/O.
+//
+// Regular files are always "ready" as far as poll/epoll/kqueue are concerned, so an fd watcher on a
+// regular file is emulated (the watcher is simply requeued), and a read or write which must wait
+// for the disk blocks the thread running the event loop. Instead, a file_io_watcher can be used to
+// perform a read, write or sync operation using a pool of worker threads (an offload_pool, see
+// offload.h). When the operation completes, the watcher is queued, and its handler is called, like
+// any other watcher.
+//
+// This header is included by dasynq.h; it should not be included directly.
+
+namespace dasynq {
+
+// Asynchronous file operations:
+enum class file_op
+{
+    READ,
+    WRITE,
+    FSYNC,
+    FDATASYNC
+};
+
+namespace dprivate {
+
+// A file I/O watcher. One operation at a time can be submitted (read, write, sync); when it
+// completes, the watcher is queued and the handler is called:
+//
+//     rearm io_complete(EventLoop &eloop, ssize_t result, int errcode)
+//         - result is as returned by the operation's system call (pread, pwrite, fsync or
+//           fdatasync); if it is -1, errcode is the error number (otherwise it is 0). Another
+//           operation may be submitted from the handler. Return rearm::REMOVE to remove the watcher
+//           (once any newly submitted operation completes); other return values have no effect.
+//
+// Buffers passed to read() or write() must remain valid until the operation completes.
+template <typename EventLoop, typename Derived>
+class file_io_watcher_impl : public offload_watcher_impl<EventLoop, file_io_watcher_impl<EventLoop, Derived>>
+{
+    template <typename, typename> friend class offload_watcher_impl;
+
+    using base_t = offload_watcher_impl<EventLoop, file_io_watcher_impl<EventLoop, Derived>>;
+
+    // Operation parameters (set with the pool lock held, while no operation is in flight):
+    file_op op;
+    int fd;
+    void *buf;
+    size_t len;
+    off_t offset;
+
+    // Result:
+    ssize_t result;
+    int errcode;
+
+    // Perform the operation (in a worker thread).
+    void run_job() noexcept
+    {
+        do {
+            switch (op) {
+            case file_op::READ:
+                result = pread(fd, buf, len, offset);
+                break;
+            case file_op::WRITE:
+                result = pwrite(fd, buf, len, offset);
+                break;
+            case file_op::FSYNC:
+                result = ::fsync(fd);
+                break;
+            case file_op::FDATASYNC:
+#if defined(_POSIX_SYNCHRONIZED_IO) && _POSIX_SYNCHRONIZED_IO > 0
+                result = ::fdatasync(fd);
+#else
+                result = ::fsync(fd);
+#endif
+                break;
+            }
+        } while (result == -1 && errno == EINTR);
+
+        errcode = (result == -1) ? errno : 0;
+    }
+
+    rearm job_complete(EventLoop &eloop) noexcept
+    {
+        return static_cast<Derived *>(this)->io_complete(eloop, result, errcode);
+    }
+
+    bool submit_op(file_op op_p, int fd_p, void *buf_p, size_t len_p, off_t offset_p) noexcept
+    {
+        return this->submit_with([&]() {
+            op = op_p;
+            fd = fd_p;
+            buf = buf_p;
+            len = len_p;
+            offset = offset_p;
+        });
+    }
+
+    // Operations are submitted via read/write/fsync, below:
+    using base_t::submit;
+
+    public:
+
+    // Submit an operation. Each returns false if an operation is already in flight.
+
+    bool read(EventLoop &eloop, int fd_p, void *buf_p, size_t len_p, off_t offset_p) noexcept
+    {
+        return submit_op(file_op::READ, fd_p, buf_p, len_p, offset_p);
+    }
+
+    bool write(EventLoop &eloop, int fd_p, const void *buf_p, size_t len_p, off_t offset_p) noexcept
+    {
+        return submit_op(file_op::WRITE, fd_p, const_cast<void *>(buf_p), len_p, offset_p);
+    }
+
+    bool fsync(EventLoop &eloop, int fd_p, bool data_only = false) noexcept
+    {
+        return submit_op(data_only ? file_op::FDATASYNC : file_op::FSYNC, fd_p, nullptr, 0, 0);
+    }
+};
+
+} // namespace dprivate
+} // namespace dasynq
+
+#endif /* DASYNQ_FILEIO_H_ */
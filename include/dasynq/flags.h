@@ -10,6 +10,10 @@ constexpr unsigned int ERR_EVENTS = 4;
 
 constexpr unsigned int ONE_SHOT = 8;
 
+// Backend hint (fd watch registration only): the watch is for a high-priority watcher, and should be
+// polled ahead of other watches if the backend supports it. Ignored by backends which do not.
+constexpr unsigned int FAST_FD = 16;
+
 // Masks:
 constexpr unsigned int IO_EVENTS = IN_EVENTS | OUT_EVENTS;
 
@@ -224,38 +224,26 @@ class itimer_events : public timer_base<Base>
         Base::init(loop_mech);
     }
     
-    // starts (if not started) a timer to timeout at the given time. Resets the expiry count to 0.
-    //   enable: specifies whether to enable reporting of timeouts/intervals
-    void set_timer(timer_handle_t &timer_id, const time_val &timeouttv, const time_val &intervaltv,
-            bool enable, clock_type clock = clock_type::MONOTONIC) noexcept
+    // Update the alarm to match the first timer in the queues (after queue_timer_nolock or
+    // unqueue_timer_nolock has reported a change). Call with lock held.
+    void update_timer_nolock(clock_type clock) noexcept
     {
-        auto &timer_queue = this->queue_for_clock(clock);
-        timespec timeout = timeouttv;
-        timespec interval = intervaltv;
-
-        std::lock_guard<decltype(Base::lock)> guard(Base::lock);
-
-        auto &ts = timer_queue.node_data(timer_id);
-        ts.interval_time = interval;
-        ts.expiry_count = 0;
-        ts.enabled = enable;
-
-        bool do_set_timer;
-        if (timer_queue.is_queued(timer_id)) {
-            // Already queued; alter timeout
-            do_set_timer = timer_queue.set_priority(timer_id, timeout);
+        if (provide_mono_timer) {
+            set_timer_from_queue();
         }
         else {
-            do_set_timer = timer_queue.insert(timer_id, timeout);
+            this->interrupt_wait();
         }
+    }
 
-        if (do_set_timer) {
-            if (provide_mono_timer) {
-                set_timer_from_queue();
-            }
-            else {
-                this->interrupt_wait();
-            }
+    // starts (if not started) a timer to timeout at the given time. Resets the expiry count to 0.
+    //   enable: specifies whether to enable reporting of timeouts/intervals
+    void set_timer(timer_handle_t &timer_id, const time_val &timeout, const time_val &interval,
+            bool enable, clock_type clock = clock_type::MONOTONIC) noexcept
+    {
+        std::lock_guard<decltype(Base::lock)> guard(Base::lock);
+        if (this->queue_timer_nolock(timer_id, timeout, interval, enable, clock)) {
+            update_timer_nolock(clock);
         }
     }
 
@@ -285,13 +273,8 @@ class itimer_events : public timer_base<Base>
 
     void stop_timer_nolock(timer_handle_t &timer_id, clock_type clock = clock_type::MONOTONIC) noexcept
     {
-        auto &timer_queue = this->queue_for_clock(clock);
-        if (timer_queue.is_queued(timer_id)) {
-            bool was_first = (&timer_queue.get_root()) == &timer_id;
-            timer_queue.remove(timer_id);
-            if (was_first && provide_mono_timer) {
-                set_timer_from_queue();
-            }
+        if (this->unqueue_timer_nolock(timer_id, clock) && provide_mono_timer) {
+            set_timer_from_queue();
         }
     }
 };
@@ -85,6 +85,15 @@ template <class Base> class macos_kqueue_loop : public signal_events<Base, true>
 {
     int kqfd = -1; // kqueue fd
 
+#ifdef EV_RECEIPT
+    // Filter enable/disable changes collected during a batch (see begin_fd_changes()), protected by
+    // the lock:
+    static constexpr int max_pending_changes = 16;
+    struct kevent pending_changes[max_pending_changes];
+    int num_pending_changes = 0;
+    bool batching_changes = false;
+#endif
+
     // Base contains:
     //   lock - a lock that can be used to protect internal structure.
     //          receive*() methods will be called with lock held.
@@ -183,6 +192,38 @@ template <class Base> class macos_kqueue_loop : public signal_events<Base, true>
         kevent(kqfd, &kev, 1, nullptr, 0, nullptr);
     }
 
+    // If a batch of filter changes is in progress (see begin_fd_changes()), add a filter enable or
+    // disable to the batch and return true; otherwise return false. Call with lock held.
+    bool defer_filter_change(short filterType, uintptr_t ident, void *udata, bool enable) noexcept
+    {
+#ifdef EV_RECEIPT
+        if (batching_changes) {
+            int fflags = (filterType == EVFILT_READ) ? POLL_SEMANTICS : 0;
+            EV_SET(&pending_changes[num_pending_changes], ident, filterType,
+                    (enable ? EV_ENABLE : EV_DISABLE) | EV_RECEIPT, fflags, 0, udata);
+            if (++num_pending_changes == max_pending_changes) {
+                flush_filter_changes();
+            }
+            return true;
+        }
+#endif
+        return false;
+    }
+
+#ifdef EV_RECEIPT
+    // Submit pending filter changes. With EV_RECEIPT, a result is returned for each change (rather
+    // than any pending events), and a change which fails does not prevent the remaining changes from
+    // being applied.
+    void flush_filter_changes() noexcept
+    {
+        if (num_pending_changes != 0) {
+            struct kevent results[max_pending_changes];
+            kevent(kqfd, pending_changes, num_pending_changes, results, num_pending_changes, nullptr);
+            num_pending_changes = 0;
+        }
+    }
+#endif
+
     void remove_filter(short filterType, uintptr_t ident) noexcept
     {
         struct kevent kev;
@@ -340,7 +381,9 @@ template <class Base> class macos_kqueue_loop : public signal_events<Base, true>
 
     void enable_fd_watch_nolock(int fd, void *userdata, int flags)
     {
-        enable_fd_watch(fd, userdata, flags);
+        if (! defer_filter_change((flags & IN_EVENTS) ? EVFILT_READ : EVFILT_WRITE, fd, userdata, true)) {
+            enable_fd_watch(fd, userdata, flags);
+        }
     }
 
     void disable_fd_watch(int fd, int flags)
@@ -350,7 +393,28 @@ template <class Base> class macos_kqueue_loop : public signal_events<Base, true>
 
     void disable_fd_watch_nolock(int fd, int flags)
     {
-        disable_fd_watch(fd, flags);
+        if (! defer_filter_change((flags & IN_EVENTS) ? EVFILT_READ : EVFILT_WRITE, fd, nullptr, false)) {
+            disable_fd_watch(fd, flags);
+        }
+    }
+
+    // Begin a batch of fd watch enable/disable changes (via the _nolock functions): the changes are
+    // collected and submitted together, in as few kevent() calls as possible, by end_fd_changes().
+    // Call with lock held.
+    void begin_fd_changes() noexcept
+    {
+#ifdef EV_RECEIPT
+        batching_changes = true;
+#endif
+    }
+
+    // End a batch of fd watch changes, submitting any that are pending. Call with lock held.
+    void end_fd_changes() noexcept
+    {
+#ifdef EV_RECEIPT
+        flush_filter_changes();
+        batching_changes = false;
+#endif
     }
 
     // If events are pending, process an unspecified number of them.
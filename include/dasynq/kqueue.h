@@ -185,6 +185,15 @@ template <class Base> class kqueue_loop : public Base
 {
     int kqfd = -1; // kqueue fd
 
+#ifdef EV_RECEIPT
+    // Filter enable/disable changes collected during a batch (see begin_fd_changes()), protected by
+    // the lock:
+    static constexpr int max_pending_changes = 16;
+    struct kevent pending_changes[max_pending_changes];
+    int num_pending_changes = 0;
+    bool batching_changes = false;
+#endif
+
     // The kqueue signal reporting mechanism *coexists* with the regular signal
     // delivery mechanism without having any connection to it. Whereas regular signals can be
     // queued (especially "realtime" signals, via sigqueue()), kqueue just maintains a counter
@@ -341,6 +350,38 @@ template <class Base> class kqueue_loop : public Base
         EV_SET(&kev, ident, filterType, enable ? EV_ENABLE : EV_DISABLE, fflags, 0, udata);
         kevent(kqfd, &kev, 1, nullptr, 0, nullptr);
     }
+
+    // If a batch of filter changes is in progress (see begin_fd_changes()), add a filter enable or
+    // disable to the batch and return true; otherwise return false. Call with lock held.
+    bool defer_filter_change(short filterType, uintptr_t ident, void *udata, bool enable) noexcept
+    {
+#ifdef EV_RECEIPT
+        if (batching_changes) {
+            int fflags = (filterType == EVFILT_READ) ? POLL_SEMANTICS : 0;
+            EV_SET(&pending_changes[num_pending_changes], ident, filterType,
+                    (enable ? EV_ENABLE : EV_DISABLE) | EV_RECEIPT, fflags, 0, udata);
+            if (++num_pending_changes == max_pending_changes) {
+                flush_filter_changes();
+            }
+            return true;
+        }
+#endif
+        return false;
+    }
+
+#ifdef EV_RECEIPT
+    // Submit pending filter changes. With EV_RECEIPT, a result is returned for each change (rather
+    // than any pending events), and a change which fails does not prevent the remaining changes from
+    // being applied.
+    void flush_filter_changes() noexcept
+    {
+        if (num_pending_changes != 0) {
+            struct kevent results[max_pending_changes];
+            kevent(kqfd, pending_changes, num_pending_changes, results, num_pending_changes, nullptr);
+            num_pending_changes = 0;
+        }
+    }
+#endif
     
     void remove_filter(short filterType, uintptr_t ident)
     {
@@ -501,7 +542,9 @@ template <class Base> class kqueue_loop : public Base
     
     void enable_fd_watch_nolock(int fd, void *userdata, int flags)
     {
-        enable_fd_watch(fd, userdata, flags);
+        if (! defer_filter_change((flags & IN_EVENTS) ? EVFILT_READ : EVFILT_WRITE, fd, userdata, true)) {
+            enable_fd_watch(fd, userdata, flags);
+        }
     }
     
     void disable_fd_watch(int fd, int flags)
@@ -511,7 +554,28 @@ template <class Base> class kqueue_loop : public Base
     
     void disable_fd_watch_nolock(int fd, int flags)
     {
-        disable_fd_watch(fd, flags);
+        if (! defer_filter_change((flags & IN_EVENTS) ? EVFILT_READ : EVFILT_WRITE, fd, nullptr, false)) {
+            disable_fd_watch(fd, flags);
+        }
+    }
+
+    // Begin a batch of fd watch enable/disable changes (via the _nolock functions): the changes are
+    // collected and submitted together, in as few kevent() calls as possible, by end_fd_changes().
+    // Call with lock held.
+    void begin_fd_changes() noexcept
+    {
+#ifdef EV_RECEIPT
+        batching_changes = true;
+#endif
+    }
+
+    // End a batch of fd watch changes, submitting any that are pending. Call with lock held.
+    void end_fd_changes() noexcept
+    {
+#ifdef EV_RECEIPT
+        flush_filter_changes();
+        batching_changes = false;
+#endif
     }
 
     // Note signal should be masked before call.
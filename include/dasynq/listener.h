@@ -0,0 +1,146 @@
+#ifndef DASYNQ_LISTENER_H_
+#define DASYNQ_LISTENER_H_
+
+#include <cerrno>
+#include <cstddef>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// Listener watcher.
+//
+// A listener_watcher accepts connections on a listening socket. Each time the socket becomes ready,
+// connections are accepted in a loop (with accept4, where available, so that the new sockets are
+// non-blocking and close-on-exec) up to a budget, and delivered to a handler in batches. If the
+// budget is exhausted, the watcher is requeued (rearm::REQUEUE) rather than re-armed, so that other
+// pending watchers of the same priority are dispatched before more connections are accepted, without
+// another trip through the backend mechanism.
+//
+// This header is included by dasynq.h; it should not be included directly.
+
+namespace dasynq {
+namespace dprivate {
+
+// Accept a connection, setting the new socket non-blocking and close-on-exec. Returns the new socket,
+// or -1 on error (with errno set).
+inline int accept_nonblocking(int fd) noexcept
+{
+#if DASYNQ_HAVE_ACCEPT4
+    return accept4(fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+    int new_fd = accept(fd, nullptr, nullptr);
+    if (new_fd != -1) {
+        fcntl(new_fd, F_SETFD, FD_CLOEXEC);
+        fcntl(new_fd, F_SETFL, fcntl(new_fd, F_GETFL) | O_NONBLOCK);
+    }
+    return new_fd;
+#endif
+}
+
+// A listener watcher.
+//
+// The Derived class must provide:
+//
+//     rearm connections_accepted(EventLoop &eloop, const int *fds, size_t count)
+//         - called with a batch of accepted connections (non-blocking sockets). The handler takes
+//           ownership of the sockets. Return rearm::REARM to continue accepting connections.
+//
+// and may provide:
+//
+//     rearm accept_error(EventLoop &eloop, int errcode)
+//         - called when accepting fails, eg due to lack of resources (EMFILE, ENFILE, ENOBUFS,
+//           ENOMEM). The default implementation returns rearm::DISARM, since the listening socket
+//           will remain ready; the watcher can be re-enabled (set_enabled) once resources are
+//           available. Failure to accept a connection which was aborted before it could be accepted
+//           (ECONNABORTED, EPROTO, EPERM) is ignored.
+template <typename EventLoop, typename Derived>
+class listener_watcher_impl : public fd_watcher_impl<EventLoop, listener_watcher_impl<EventLoop, Derived>>
+{
+    template <typename, typename> friend class fd_watcher_impl;
+
+    // Maximum number of connections delivered in a single batch:
+    static constexpr unsigned max_batch = 64;
+
+    unsigned accept_budget = max_batch;
+
+    rearm fd_event(EventLoop &eloop, int fd, int flags) noexcept
+    {
+        Derived *derived = static_cast<Derived *>(this);
+
+        int fds[max_batch];
+        unsigned count = 0;
+        unsigned budget = accept_budget;
+
+        while (budget > 0) {
+            int new_fd = accept_nonblocking(fd);
+            if (new_fd == -1) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    break;
+                }
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == ECONNABORTED || errno == EPROTO || errno == EPERM) {
+                    // A connection which failed (or was rejected) before it could be accepted:
+                    budget--;
+                    continue;
+                }
+                int errcode = errno;
+                if (count != 0) {
+                    rearm r = derived->connections_accepted(eloop, fds, count);
+                    if (r != rearm::REARM) return r;
+                }
+                return derived->accept_error(eloop, errcode);
+            }
+
+            budget--;
+            fds[count++] = new_fd;
+            if (count == max_batch) {
+                rearm r = derived->connections_accepted(eloop, fds, count);
+                if (r != rearm::REARM) return r;
+                count = 0;
+            }
+        }
+
+        if (count != 0) {
+            rearm r = derived->connections_accepted(eloop, fds, count);
+            if (r != rearm::REARM) return r;
+        }
+
+        // If the budget was exhausted there may be more connections pending; requeue rather than
+        // waiting for the backend to report the socket ready again:
+        return (budget == 0) ? rearm::REQUEUE : rearm::REARM;
+    }
+
+    public:
+
+    // Default handler (may be hidden by Derived):
+
+    rearm accept_error(EventLoop &eloop, int errcode) noexcept
+    {
+        return rearm::DISARM;
+    }
+
+    // Register the watcher with an event loop. The listening socket should be in non-blocking mode.
+    //
+    // Can fail with std::bad_alloc or std::system_error.
+    void add_watch(EventLoop &eloop, int fd, int prio = DEFAULT_PRIORITY)
+    {
+        fd_watcher<EventLoop>::add_watch(eloop, fd, IN_EVENTS, true, prio);
+    }
+
+    // Set the maximum number of connections to accept each time the watcher is dispatched (default
+    // 64, must be at least 1). Should be called only from the handler or while the watcher is not
+    // registered.
+    void set_accept_budget(unsigned budget) noexcept
+    {
+        accept_budget = budget;
+    }
+};
+
+} // namespace dprivate
+} // namespace dasynq
+
+#endif /* DASYNQ_LISTENER_H_ */
@@ -2,6 +2,7 @@
 #define DASYNQ_MUTEX_H_
 
 #include <mutex>
+#include <type_traits>
 
 namespace dasynq {
 
@@ -17,6 +18,14 @@ class null_mutex
     DASYNQ_EMPTY_BODY;
 };
 
+// Whether a mutex type provides mutual exclusion between threads, i.e. whether an event loop using it
+// can be used from multiple threads. This is true for std::mutex and std::recursive_mutex; it may be
+// specialised for other mutex types. Where it is false, facilities which involve other threads (such as
+// the offload pool) do not access the event loop from those threads.
+template <typename T_Mutex> struct is_thread_safe_mutex : std::false_type { };
+template <> struct is_thread_safe_mutex<std::mutex> : std::true_type { };
+template <> struct is_thread_safe_mutex<std::recursive_mutex> : std::true_type { };
+
 } // namespace dasynq
 
 #endif /* DASYNQ_MUTEX_H_ */
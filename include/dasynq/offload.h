@@ -0,0 +1,651 @@
+#ifndef DASYNQ_OFFLOAD_H_
+#define DASYNQ_OFFLOAD_H_
+
+#include <cstddef>
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <system_error>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#if DASYNQ_HAVE_EVENTFD
+#include <sys/eventfd.h>
+#endif
+
+// Offload pool.
+//
+// An offload_pool runs jobs which may block (name resolution, compression, file I/O, etc) on a set of
+// worker threads, so that they do not block the thread(s) running the event loop. Each job is an
+// offload watcher; when its job has been run, the watcher is queued with the event loop at its
+// priority, and its completion handler is called (from a thread polling the event loop, as for
+// other watchers).
+//
+// For a thread-safe event loop (one whose mutex type satisfies is_thread_safe_mutex), a worker queues
+// a completed watcher directly and interrupts the loop via its interrupt channel; only one interrupt
+// is issued for any number of completions until one of them is dispatched. Any other event loop
+// cannot be interrupted or queued into by another thread, so completions are instead passed back via
+// a notification descriptor (an eventfd or pipe) watched by the pool, and queued together when it
+// becomes readable.
+//
+// This header is included by dasynq.h; it should not be included directly.
+
+namespace dasynq {
+namespace dprivate {
+
+// Base for an offload watcher (see offload_watcher_impl).
+class base_offload_watcher : public base_watcher
+{
+    template <typename> friend class offload_pool;
+
+    protected:
+    // The following are protected by the pool lock:
+    base_offload_watcher *next_job = nullptr;  // next job in queue (pending or completed)
+    base_offload_watcher *prev_in_flight = nullptr;  // links in the pool's list of in-flight jobs
+    base_offload_watcher *next_in_flight = nullptr;
+    bool in_flight = false;       // submitted and not yet dispatched
+    bool remove_pending = false;  // deregistered while in flight
+    bool dispatching = false;     // completion handler running
+    bool submit_deferred = false; // submitted while dispatching; to be queued after dispatch
+
+    base_offload_watcher() noexcept : base_watcher(watch_type_t::COMPLETION) { }
+
+    // Run the job (in a worker thread).
+    virtual void perform_job() noexcept = 0;
+};
+
+// A pool of worker threads which run jobs for offload watchers registered with an event loop.
+// Threads are started when the pool is added to the loop (add_pool), and stopped when it is removed
+// (remove_pool). Jobs are started in the order they are submitted, by whichever worker thread is
+// available.
+template <typename EventLoop>
+class offload_pool
+{
+    template <typename, typename> friend class offload_watcher_impl;
+
+    using mutex_t = std::mutex;
+
+    // Whether completions are queued directly by worker threads (see top of file):
+    static constexpr bool direct_queue = is_thread_safe_mutex<typename EventLoop::mutex_t>::value;
+
+    // Watches the notification descriptor, and queues completed watchers with the event loop (used
+    // only if direct_queue is false):
+    class notifier : public fd_watcher_impl<EventLoop, notifier>
+    {
+        public:
+        offload_pool *pool;
+
+        rearm fd_event(EventLoop &eloop, int fd, int flags) noexcept
+        {
+            pool->process_completions(eloop);
+            return rearm::REARM;
+        }
+    };
+
+    mutex_t pool_lock;
+    std::condition_variable pool_cv;
+
+    // Pending jobs (FIFO) and completed jobs (LIFO), protected by pool_lock:
+    base_offload_watcher *job_first = nullptr;
+    base_offload_watcher *job_last = nullptr;
+    base_offload_watcher *completed = nullptr;
+    bool stopping = false;
+
+    // All watchers with a job in flight (protected by pool_lock):
+    base_offload_watcher *in_flight_first = nullptr;
+
+    // Whether an interrupt has been issued for completions which have not yet been dispatched
+    // (protected by the event loop lock):
+    bool wake_pending = false;
+
+    EventLoop *loop = nullptr;
+    std::vector<std::thread> workers;
+    notifier notify_watcher;
+
+    // Notification descriptor (read end, and write end if using a pipe):
+    int notify_r_fd = -1;
+    int notify_w_fd = -1;
+
+    void signal_notifier() noexcept
+    {
+#if DASYNQ_HAVE_EVENTFD
+        eventfd_write(notify_w_fd, 1);
+#else
+        char buf[1] = { 0 };
+        write(notify_w_fd, buf, 1);
+#endif
+    }
+
+    void clear_notifier() noexcept
+    {
+#if DASYNQ_HAVE_EVENTFD
+        eventfd_t val;
+        eventfd_read(notify_r_fd, &val);
+#else
+        char buf[64];
+        while (read(notify_r_fd, buf, sizeof(buf)) == sizeof(buf)) { }
+#endif
+    }
+
+    // Deliver a completed job (in a worker thread). Call with pool_lock held, unless direct_queue.
+    void complete_job(base_offload_watcher *job) noexcept
+    {
+        if (direct_queue) {
+            loop_access::queue_completion_async(*loop, job, wake_pending);
+        }
+        else {
+            // Only notify the event loop if the completed list was empty (otherwise a notification is
+            // already pending):
+            bool notify = (completed == nullptr);
+            job->next_job = completed;
+            completed = job;
+            if (notify) {
+                signal_notifier();
+            }
+        }
+    }
+
+    void worker_thread() noexcept
+    {
+        std::unique_lock<mutex_t> guard(pool_lock);
+        while (true) {
+            while (job_first == nullptr && ! stopping) {
+                pool_cv.wait(guard);
+            }
+            if (job_first == nullptr) {
+                // stopping, and no jobs remain
+                return;
+            }
+
+            base_offload_watcher *job = job_first;
+            job_first = job->next_job;
+            if (job_first == nullptr) {
+                job_last = nullptr;
+            }
+            guard.unlock();
+
+            job->perform_job();
+
+            if (direct_queue) {
+                complete_job(job);
+                guard.lock();
+            }
+            else {
+                guard.lock();
+                complete_job(job);
+            }
+        }
+    }
+
+    // Submit a job; returns false if the watcher already has a job in flight.
+    bool submit(base_offload_watcher *job) noexcept
+    {
+        std::lock_guard<mutex_t> guard(pool_lock);
+        return submit_nolock(job);
+    }
+
+    bool submit_nolock(base_offload_watcher *job) noexcept
+    {
+        if (job->in_flight) {
+            return false;
+        }
+        set_in_flight_nolock(job);
+        job->remove_pending = false;
+        if (job->dispatching) {
+            // The watcher must not be queued while its handler is running; it is submitted once
+            // dispatch is complete (see end_dispatch()).
+            job->submit_deferred = true;
+            return true;
+        }
+        enqueue_nolock(job);
+        return true;
+    }
+
+    void set_in_flight_nolock(base_offload_watcher *job) noexcept
+    {
+        job->in_flight = true;
+        job->prev_in_flight = nullptr;
+        job->next_in_flight = in_flight_first;
+        if (in_flight_first != nullptr) {
+            in_flight_first->prev_in_flight = job;
+        }
+        in_flight_first = job;
+    }
+
+    void clear_in_flight_nolock(base_offload_watcher *job) noexcept
+    {
+        job->in_flight = false;
+        if (job->prev_in_flight == nullptr) {
+            in_flight_first = job->next_in_flight;
+        }
+        else {
+            job->prev_in_flight->next_in_flight = job->next_in_flight;
+        }
+        if (job->next_in_flight != nullptr) {
+            job->next_in_flight->prev_in_flight = job->prev_in_flight;
+        }
+        job->prev_in_flight = job->next_in_flight = nullptr;
+    }
+
+    void enqueue_nolock(base_offload_watcher *job) noexcept
+    {
+        job->next_job = nullptr;
+        if (job_last == nullptr) {
+            job_first = job;
+        }
+        else {
+            job_last->next_job = job;
+        }
+        job_last = job;
+        pool_cv.notify_one();
+    }
+
+    // Queue completed watchers with the event loop (when not queued directly by the workers).
+    void process_completions(EventLoop &eloop) noexcept
+    {
+        clear_notifier();
+
+        base_offload_watcher *list = nullptr;
+
+        {
+            std::lock_guard<mutex_t> guard(pool_lock);
+            base_offload_watcher *completed_list = completed;
+            completed = nullptr;
+
+            // Reverse the list, so that completions are queued in the order they completed:
+            while (completed_list != nullptr) {
+                base_offload_watcher *next = completed_list->next_job;
+                completed_list->next_job = list;
+                list = completed_list;
+                completed_list = next;
+            }
+        }
+
+        // Queue in batches, to limit the number of times the loop lock is acquired:
+        constexpr size_t batch_size = 32;
+        queued_watcher *batch[batch_size];
+        size_t count = 0;
+        while (list != nullptr) {
+            batch[count++] = list;
+            list = list->next_job;
+            if (count == batch_size) {
+                loop_access::queue_completions(eloop, batch, count);
+                count = 0;
+            }
+        }
+        if (count != 0) {
+            loop_access::queue_completions(eloop, batch, count);
+        }
+    }
+
+    // If a watcher has a job in flight, mark it for removal when the job completes and return
+    // true; otherwise return false.
+    bool defer_removal(base_offload_watcher *watcher) noexcept
+    {
+        std::lock_guard<mutex_t> guard(pool_lock);
+        if (watcher->in_flight) {
+            watcher->remove_pending = true;
+            return true;
+        }
+        return false;
+    }
+
+    // Deregister a watcher. If it has a job in flight, removal completes when the job does.
+    void deregister(EventLoop &eloop, base_offload_watcher *watcher) noexcept
+    {
+        if (! defer_removal(watcher)) {
+            loop_access::deregister_queued(eloop, watcher);
+        }
+    }
+
+    // Begin dispatch of a watcher whose job has completed: mark its job as no longer in flight.
+    // Returns true if the watcher should be removed instead of reporting completion.
+    bool begin_dispatch(base_offload_watcher *watcher) noexcept
+    {
+        std::lock_guard<mutex_t> guard(pool_lock);
+        clear_in_flight_nolock(watcher);
+        watcher->dispatching = true;
+        return watcher->remove_pending;
+    }
+
+    // Complete dispatch of a watcher, submitting any job which was submitted by the handler (unless
+    // the watcher is being removed). Call with the event loop lock held, so that the watcher cannot
+    // be queued again until it is no longer active.
+    void end_dispatch(base_offload_watcher *watcher, bool removing) noexcept
+    {
+        std::lock_guard<mutex_t> guard(pool_lock);
+        watcher->dispatching = false;
+        if (watcher->submit_deferred) {
+            watcher->submit_deferred = false;
+            if (removing) {
+                clear_in_flight_nolock(watcher);
+            }
+            else {
+                enqueue_nolock(watcher);
+            }
+        }
+    }
+
+    void stop_workers() noexcept
+    {
+        {
+            std::lock_guard<mutex_t> guard(pool_lock);
+            stopping = true;
+            pool_cv.notify_all();
+        }
+        for (std::thread &t : workers) {
+            t.join();
+        }
+        workers.clear();
+    }
+
+    void close_notifier() noexcept
+    {
+        if (notify_r_fd != -1) {
+            close(notify_r_fd);
+            if (notify_w_fd != notify_r_fd) {
+                close(notify_w_fd);
+            }
+            notify_r_fd = notify_w_fd = -1;
+        }
+    }
+
+    public:
+
+    offload_pool() noexcept
+    {
+        notify_watcher.pool = this;
+    }
+
+    offload_pool(const offload_pool &) = delete;
+    offload_pool &operator=(const offload_pool &) = delete;
+
+    // If the pool has not been removed from its event loop, it is removed (see remove_pool); the loop
+    // must still exist.
+    ~offload_pool()
+    {
+        if (loop != nullptr) {
+            remove_pool(*loop);
+        }
+    }
+
+    // Add the pool to an event loop, starting the specified number of worker threads. The priority
+    // is that of the watcher for the notification descriptor (used only for single-threaded loops);
+    // each completion is queued at the priority of its own watcher. Throws std::system_error or
+    // std::bad_alloc on failure.
+    void add_pool(EventLoop &eloop, unsigned num_threads = 4, int prio = DEFAULT_PRIORITY)
+    {
+        loop = &eloop;
+        wake_pending = false;
+
+        if (! direct_queue) {
+#if DASYNQ_HAVE_EVENTFD
+            notify_r_fd = notify_w_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+            if (notify_r_fd == -1) {
+                throw std::system_error(errno, std::system_category());
+            }
+#else
+            int pipe_fds[2];
+            if (pipe2(pipe_fds, O_CLOEXEC | O_NONBLOCK) == -1) {
+                throw std::system_error(errno, std::system_category());
+            }
+            notify_r_fd = pipe_fds[0];
+            notify_w_fd = pipe_fds[1];
+#endif
+
+            try {
+                notify_watcher.add_watch(eloop, notify_r_fd, IN_EVENTS, true, prio);
+            }
+            catch (...) {
+                close_notifier();
+                throw;
+            }
+        }
+
+        try {
+            stopping = false;
+            workers.reserve(num_threads);
+            for (unsigned i = 0; i < num_threads; i++) {
+                workers.emplace_back(&offload_pool::worker_thread, this);
+            }
+        }
+        catch (...) {
+            stop_workers();
+            if (! direct_queue) {
+                notify_watcher.deregister(eloop);
+                close_notifier();
+            }
+            throw;
+        }
+    }
+
+    // Remove the pool from the event loop. Any submitted jobs are run first, but their completion is
+    // not reported: watchers with a job in flight (including those used by run()) are instead removed
+    // from the loop, as if deregistered. Other offload watchers using the pool should be deregistered
+    // first. This must not be called from the completion handler of a watcher using the pool, nor
+    // while another thread may be dispatching such a handler.
+    void remove_pool(EventLoop &eloop) noexcept
+    {
+        stop_workers();
+        if (! direct_queue) {
+            notify_watcher.deregister(eloop);
+            close_notifier();
+        }
+
+        // All jobs have now been run, and their watchers may be queued with the loop; remove them, so
+        // that they are not dispatched (which requires the pool):
+        base_offload_watcher *list;
+        {
+            std::lock_guard<mutex_t> guard(pool_lock);
+            list = in_flight_first;
+            in_flight_first = nullptr;
+            completed = nullptr;
+        }
+        while (list != nullptr) {
+            base_offload_watcher *next = list->next_in_flight;
+            list->in_flight = false;
+            list->prev_in_flight = list->next_in_flight = nullptr;
+            loop_access::deregister_queued(eloop, list);
+            list = next;
+        }
+
+        loop = nullptr;
+    }
+
+    // Run a job on the pool, and then call a completion function (in the event loop) at the
+    // specified priority. The job is run as:
+    //     work()
+    // and the completion function is called as:
+    //     done(EventLoop &eloop, std::exception_ptr exc)
+    // where exc holds the exception thrown by work(), if any (and is null otherwise).
+    // The watcher used is allocated dynamically and destroys itself after calling the completion
+    // function. Throws std::bad_alloc on failure.
+    template <typename W, typename C>
+    void run(EventLoop &eloop, W work, C done, int prio = DEFAULT_PRIORITY);
+};
+
+// An offload watcher. One job at a time can be submitted; the job is run on a worker thread, after
+// which the watcher is queued and the completion handler is called. The Derived class must provide:
+//
+//     void run_job() noexcept
+//         - run the job. This is called from a worker thread, without any event loop lock held. It
+//           may block, but must not throw (an exception from run_job() terminates the program);
+//           any failure should instead be stored for job_complete().
+//
+//     rearm job_complete(EventLoop &eloop) noexcept
+//         - called in the event loop when the job has been run. Another job may be submitted from
+//           the handler. Return rearm::REMOVE to remove the watcher (once any newly submitted job
+//           completes); other return values have no effect.
+//
+// Results of the job can be stored in the Derived object by run_job(); they are visible to
+// job_complete() without any further synchronisation.
+template <typename EventLoop, typename Derived>
+class offload_watcher_impl : public base_offload_watcher
+{
+    static void do_dispatch(dprivate::queued_watcher *watcher, void *loop_ptr) noexcept
+    {
+        static_cast<offload_watcher_impl *>(watcher)->offload_watcher_impl::dispatch(loop_ptr);
+    }
+
+    using pool_t = offload_pool<EventLoop>;
+
+    pool_t *pool = nullptr;
+
+    void perform_job() noexcept override
+    {
+        static_cast<Derived *>(this)->run_job();
+    }
+
+    void dispatch(void *loop_ptr) noexcept override
+    {
+        EventLoop &loop = *static_cast<EventLoop *>(loop_ptr);
+
+        pool->wake_pending = false;
+        loop_access::get_base_lock(loop).unlock();
+
+        rearm rearm_type;
+        if (pool->begin_dispatch(this)) {
+            // deregistered while the job was in flight
+            rearm_type = rearm::REMOVE;
+        }
+        else {
+            rearm_type = static_cast<Derived *>(this)->job_complete(loop);
+            if (rearm_type == rearm::REMOVE && pool->defer_removal(this)) {
+                // A new job was submitted by the handler; the watcher will be removed once it
+                // completes.
+                rearm_type = rearm::NOOP;
+            }
+            else if (rearm_type == rearm::REQUEUE) {
+                // Not supported: the watcher may already be queued, if a new job has completed.
+                rearm_type = rearm::NOOP;
+            }
+        }
+
+        loop_access::get_base_lock(loop).lock();
+
+        if (rearm_type != rearm::REMOVED) {
+            this->active = false;
+            if (this->deleteme) {
+                rearm_type = rearm::REMOVE;
+            }
+            pool->end_dispatch(this, rearm_type == rearm::REMOVE);
+            post_dispatch(loop, this, rearm_type);
+        }
+    }
+
+    public:
+
+    using event_loop_t = EventLoop;
+
+    offload_watcher_impl() noexcept
+    {
+        this->dispatch_fn = &do_dispatch;
+    }
+
+    // Register the watcher with an event loop, to run jobs using the specified pool (which must have
+    // been added to the same loop). Completion is reported at the specified priority.
+    //   may throw: std::bad_alloc
+    void add_watch(EventLoop &eloop, pool_t &pool_p, int prio = DEFAULT_PRIORITY)
+    {
+        base_watcher::init();
+        this->priority = prio;
+        this->in_flight = false;
+        this->remove_pending = false;
+        pool = &pool_p;
+        loop_access::register_queued(eloop, this);
+    }
+
+    // Remove the watcher. If a job is in flight, the watcher is removed (and the watch_removed()
+    // callback is called) once it completes, without calling the completion handler.
+    void deregister(EventLoop &eloop) noexcept
+    {
+        pool->deregister(eloop, this);
+    }
+
+    // Submit the job. Returns false if a job is already in flight.
+    bool submit(EventLoop &eloop) noexcept
+    {
+        return pool->submit(this);
+    }
+
+    // Check whether a job is in flight (submitted, and completion not yet reported).
+    bool is_in_flight() noexcept
+    {
+        std::lock_guard<typename pool_t::mutex_t> guard(pool->pool_lock);
+        return this->in_flight;
+    }
+
+    protected:
+
+    // Set up job parameters and submit, atomically with respect to the in-flight check. The setup
+    // function is called (with the pool lock held) only if no job is in flight.
+    template <typename F>
+    bool submit_with(F setup) noexcept
+    {
+        std::lock_guard<typename pool_t::mutex_t> guard(pool->pool_lock);
+        if (this->in_flight) {
+            return false;
+        }
+        setup();
+        return pool->submit_nolock(this);
+    }
+};
+
+template <typename EventLoop>
+template <typename W, typename C>
+void offload_pool<EventLoop>::run(EventLoop &eloop, W work, C done, int prio)
+{
+    class lambda_offload_watcher : public offload_watcher_impl<EventLoop, lambda_offload_watcher>
+    {
+        private:
+        W work;
+        C done;
+        std::exception_ptr exc;
+
+        public:
+        lambda_offload_watcher(W work_a, C done_a) : work(work_a), done(done_a)
+        {
+            //
+        }
+
+        void run_job() noexcept
+        {
+            try {
+                work();
+            }
+            catch (...) {
+                exc = std::current_exception();
+            }
+        }
+
+        rearm job_complete(EventLoop &eloop) noexcept
+        {
+            done(eloop, exc);
+            return rearm::REMOVE;
+        }
+
+        void watch_removed() noexcept override
+        {
+            delete this;
+        }
+    };
+
+    lambda_offload_watcher *low = new lambda_offload_watcher(work, done);
+    try {
+        low->add_watch(eloop, *this, prio);
+    }
+    catch (...) {
+        delete low;
+        throw;
+    }
+    low->submit(eloop);
+}
+
+} // namespace dprivate
+} // namespace dasynq
+
+#endif /* DASYNQ_OFFLOAD_H_ */
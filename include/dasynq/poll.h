@@ -0,0 +1,420 @@
+#ifndef DASYNQ_POLL_H_
+#define DASYNQ_POLL_H_
+
+#include <system_error>
+#include <vector>
+#include <atomic>
+#include <climits>
+#include <new>
+
+#include <sys/types.h>
+#include <poll.h>
+
+#include <unistd.h>
+#include <csignal>
+#include <csetjmp>
+
+#include "config.h"
+#include "signal.h"
+
+// "poll"-based event loop mechanism.
+//
+// Unlike select, poll has no limit (FD_SETSIZE) on the value of file descriptors that can be watched. We
+// maintain a dense array of pollfd structures (one per watched file descriptor, with both read and write
+// watches for the same descriptor sharing an entry), together with an index mapping file descriptors to
+// array slots. Removing an entry swaps the last entry into its slot, so that adding and removing watches
+// are O(1) operations.
+//
+// Signals are handled as for the select backend (see signal.h), by unmasking watched signals around the
+// call to poll.
+
+namespace dasynq {
+
+namespace dprivate {
+
+// File descriptor optional storage. If the mechanism can return the file descriptor, this
+// class will be empty, otherwise it can hold a file descriptor.
+class poll_fd_s {
+    public:
+    poll_fd_s(int fd) noexcept { }
+
+    DASYNQ_EMPTY_BODY
+};
+
+// File descriptor reference (passed to event callback). If the mechanism can return the
+// file descriptor, this class holds the file descriptor. Otherwise, the file descriptor
+// must be stored in an fd_s instance.
+class poll_fd_r {
+    int fd;
+    public:
+    int get_fd(poll_fd_s ss)
+    {
+        return fd;
+    }
+    poll_fd_r(int nfd) : fd(nfd)
+    {
+    }
+};
+
+} // namespace dprivate
+
+inline namespace v3 {
+
+template <class Base> class poll_events;
+
+template <typename Base>
+struct poll_traits : public signal_traits, public Base
+{
+    using fd_r = dprivate::poll_fd_r;
+    using fd_s = dprivate::poll_fd_s;
+
+    constexpr static bool has_bidi_fd_watch = false;
+    constexpr static bool has_separate_rw_fd_watches = true;
+    // requires interrupt after adding/enabling an fd:
+    constexpr static bool interrupt_after_fd_add = true;
+    constexpr static bool supports_non_oneshot_fd = false;
+
+    template <typename T> using backend_tmpl = poll_events<typename Base::template backend_tmpl<T>>;
+};
+
+template <class Base> class poll_events : public signal_events<Base, true>
+{
+    // userdata pointers for the read and write watches on a descriptor (nullptr if no watch):
+    struct slot_udata
+    {
+        void *rd_udata;
+        void *wr_udata;
+    };
+
+    // The watched descriptors, and their userdata (the two arrays are kept in the same order):
+    std::vector<pollfd> poll_fds;
+    std::vector<slot_udata> udata;
+
+    // The slot in poll_fds for each file descriptor, or -1:
+    std::vector<int> fd_slot;
+
+    // Copy of poll_fds passed to poll() (so that watches can be modified while polling):
+    std::vector<pollfd> poll_fds_c;
+
+    bool initialised = false;
+
+    // Base contains:
+    //   lock - a lock that can be used to protect internal structure.
+    //          receive*() methods will be called with lock held.
+    //   receive_signal(sigdata_t &, user *) noexcept
+    //   receive_fd_event(fd_r, user *, int flags) noexcept
+
+    using fd_r = typename dprivate::poll_fd_r;
+
+    // Find the slot for a descriptor, or -1 if the descriptor is not watched.
+    int slot_for_fd(int fd) noexcept
+    {
+        return (size_t(fd) < fd_slot.size()) ? fd_slot[fd] : -1;
+    }
+
+    // Get the slot for a descriptor, allocating one if necessary.
+    // throws: std::system_error or std::bad_alloc on failure
+    int get_slot(int fd)
+    {
+        if (fd < 0) {
+            throw std::system_error(EBADF, std::system_category());
+        }
+
+        int slot = slot_for_fd(fd);
+        if (slot != -1) return slot;
+
+        if (size_t(fd) >= fd_slot.size()) {
+            fd_slot.resize(fd + 1, -1);
+        }
+        poll_fds.reserve(poll_fds.size() + 1);
+        udata.reserve(udata.size() + 1);
+
+        slot = poll_fds.size();
+        pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = 0;
+        pfd.revents = 0;
+        poll_fds.push_back(pfd);
+        udata.push_back(slot_udata {nullptr, nullptr});
+        fd_slot[fd] = slot;
+        return slot;
+    }
+
+    // Release a slot if it has no remaining watches, by moving the last slot into its place.
+    void release_slot_if_unused(int slot) noexcept
+    {
+        if (udata[slot].rd_udata != nullptr || udata[slot].wr_udata != nullptr) return;
+
+        fd_slot[poll_fds[slot].fd] = -1;
+        int last = poll_fds.size() - 1;
+        if (slot != last) {
+            poll_fds[slot] = poll_fds[last];
+            udata[slot] = udata[last];
+            fd_slot[poll_fds[slot].fd] = slot;
+        }
+        poll_fds.pop_back();
+        udata.pop_back();
+    }
+
+    void process_events(int count)
+    {
+        std::lock_guard<decltype(Base::lock)> guard(Base::lock);
+
+        for (auto &pfd : poll_fds_c) {
+            if (pfd.revents == 0) continue;
+
+            int fd = pfd.fd;
+            int err_flag = (pfd.revents & (POLLERR | POLLNVAL)) ? ERR_EVENTS : 0;
+
+            // The watch may have been removed or disabled since polling began; check the current
+            // state:
+            int slot = slot_for_fd(fd);
+            if (slot == -1) continue;
+            pollfd &cur_pfd = poll_fds[slot];
+
+            if ((pfd.revents & (POLLIN | POLLHUP | POLLERR | POLLNVAL)) && (cur_pfd.events & POLLIN)) {
+                // report read
+                auto r = Base::receive_fd_event(*this, fd_r(fd), udata[slot].rd_udata, IN_EVENTS | err_flag);
+                if (std::get<0>(r) == 0) {
+                    cur_pfd.events &= ~POLLIN;
+                }
+            }
+
+            if ((pfd.revents & (POLLOUT | POLLHUP | POLLERR | POLLNVAL)) && (cur_pfd.events & POLLOUT)) {
+                // report write
+                auto r = Base::receive_fd_event(*this, fd_r(fd), udata[slot].wr_udata, OUT_EVENTS | err_flag);
+                if (std::get<0>(r) == 0) {
+                    cur_pfd.events &= ~POLLOUT;
+                }
+            }
+
+            if (--count == 0) break;
+        }
+    }
+
+    // Convert a timeout to milliseconds for poll(), rounding up.
+    static int timeout_millis(const timespec *ts) noexcept
+    {
+        if (ts == nullptr) return -1;
+        if (ts->tv_sec >= INT_MAX / 1000 - 1) return INT_MAX;
+        return ts->tv_sec * 1000 + (ts->tv_nsec + 999999) / 1000000;
+    }
+
+    public:
+
+    /**
+     * poll_events constructor.
+     *
+     * Throws std::system_error or std::bad_alloc if the event loop cannot be initialised.
+     */
+    poll_events()
+    {
+        init();
+    }
+
+    poll_events(typename Base::delayed_init d) noexcept
+    {
+        // delayed initialisation
+    }
+
+    void init()
+    {
+        Base::init(this);
+        initialised = true;
+    }
+
+    ~poll_events() noexcept
+    {
+        if (initialised) {
+            Base::cleanup();
+        }
+    }
+
+    //        fd:  file descriptor to watch
+    //  userdata:  data to associate with descriptor
+    //     flags:  IN_EVENTS | OUT_EVENTS | ONE_SHOT
+    //             (only one of IN_EVENTS/OUT_EVENTS can be specified)
+    // soft_fail:  true if unsupported file descriptors should fail by returning false instead
+    //             of throwing an exception
+    // returns: true on success; false if file descriptor type isn't supported and emulate == true
+    // throws:  std::system_error or std::bad_alloc on failure
+    bool add_fd_watch(int fd, void *userdata, int flags, bool enabled = true, bool soft_fail = false)
+    {
+        int slot = get_slot(fd);
+
+        if (flags & IN_EVENTS) {
+            udata[slot].rd_udata = userdata;
+            if (enabled) poll_fds[slot].events |= POLLIN;
+        }
+        else {
+            udata[slot].wr_udata = userdata;
+            if (enabled) poll_fds[slot].events |= POLLOUT;
+        }
+
+        return true;
+    }
+
+    // returns: 0 on success
+    //          IN_EVENTS  if in watch requires emulation
+    //          OUT_EVENTS if out watch requires emulation
+    int add_bidi_fd_watch(int fd, void *userdata, int flags, bool emulate = false)
+    {
+        int slot = get_slot(fd);
+
+        // Record the userdata for both directions, even if one is initially disabled, since it
+        // may be enabled later (via enable_fd_watch):
+        udata[slot].rd_udata = userdata;
+        udata[slot].wr_udata = userdata;
+
+        if (flags & IN_EVENTS) {
+            poll_fds[slot].events |= POLLIN;
+        }
+        if (flags & OUT_EVENTS) {
+            poll_fds[slot].events |= POLLOUT;
+        }
+
+        return 0;
+    }
+
+    // flags specifies which watch to remove; ignored if the loop doesn't support
+    // separate read/write watches.
+    void remove_fd_watch_nolock(int fd, int flags)
+    {
+        int slot = slot_for_fd(fd);
+        if (slot == -1) return;
+
+        if (flags & IN_EVENTS) {
+            poll_fds[slot].events &= ~POLLIN;
+            udata[slot].rd_udata = nullptr;
+        }
+        if (flags & OUT_EVENTS) {
+            poll_fds[slot].events &= ~POLLOUT;
+            udata[slot].wr_udata = nullptr;
+        }
+        release_slot_if_unused(slot);
+    }
+
+    void remove_fd_watch(int fd, int flags)
+    {
+        std::lock_guard<decltype(Base::lock)> guard(Base::lock);
+        remove_fd_watch_nolock(fd, flags);
+    }
+
+    void remove_bidi_fd_watch(int fd) noexcept
+    {
+        remove_fd_watch_nolock(fd, IN_EVENTS | OUT_EVENTS);
+    }
+
+    void enable_fd_watch_nolock(int fd, void *userdata, int flags)
+    {
+        int slot = slot_for_fd(fd);
+        if (slot == -1) return;
+
+        if (flags & IN_EVENTS) {
+            poll_fds[slot].events |= POLLIN;
+        }
+        else {
+            poll_fds[slot].events |= POLLOUT;
+        }
+    }
+
+    void enable_fd_watch(int fd, void *userdata, int flags)
+    {
+        std::lock_guard<decltype(Base::lock)> guard(Base::lock);
+        enable_fd_watch_nolock(fd, userdata, flags);
+    }
+
+    void disable_fd_watch_nolock(int fd, int flags)
+    {
+        int slot = slot_for_fd(fd);
+        if (slot == -1) return;
+
+        if (flags & IN_EVENTS) {
+            poll_fds[slot].events &= ~POLLIN;
+        }
+        else {
+            poll_fds[slot].events &= ~POLLOUT;
+        }
+    }
+
+    void disable_fd_watch(int fd, int flags)
+    {
+        std::lock_guard<decltype(Base::lock)> guard(Base::lock);
+        disable_fd_watch_nolock(fd, flags);
+    }
+
+    // If events are pending, process an unspecified number of them.
+    // If no events are pending, wait until one event is received and
+    // process this event (and possibly any other events received
+    // simultaneously).
+    // If processing an event removes a watch, there is a possibility
+    // that the watched event will still be reported (if it has
+    // occurred) before pull_events() returns.
+    //
+    //  do_wait - if false, returns immediately if no events are
+    //            pending.
+    void pull_events(bool do_wait) noexcept
+    {
+        struct timespec ts;
+        struct timespec *wait_ts = nullptr;
+
+        Base::lock.lock();
+
+        // Check whether any timers are pending, and what the next timeout is.
+        this->process_monotonic_timers(do_wait, ts, wait_ts);
+
+        // Copy the descriptor array for polling. (The copy is only accessed by the polling thread).
+        // If the copy can't be enlarged, which can only happen if memory is exhausted, we poll a
+        // subset of descriptors for now:
+        try {
+            poll_fds_c.assign(poll_fds.begin(), poll_fds.end());
+        }
+        catch (std::bad_alloc &) {
+            poll_fds_c.assign(poll_fds.begin(), poll_fds.begin() + poll_fds_c.capacity());
+        }
+
+        const sigset_t &active_sigmask = this->get_active_sigmask();
+
+        Base::lock.unlock();
+
+        // using sigjmp/longjmp is ugly, but there is no other way. If a signal that we're watching is
+        // received during polling, it will longjmp back to here:
+        if (sigsetjmp(this->get_sigreceive_jmpbuf(), 1) != 0) {
+            this->process_signal();
+            do_wait = false;
+        }
+
+        if (!do_wait) {
+            ts.tv_sec = 0;
+            ts.tv_nsec = 0;
+            wait_ts = &ts;
+        }
+
+        std::atomic_signal_fence(std::memory_order::memory_order_release);
+
+        this->sigmaskf(SIG_UNBLOCK, &active_sigmask, nullptr);
+        int r = poll(poll_fds_c.data(), poll_fds_c.size(), timeout_millis(wait_ts));
+        // Note, a signal may be received here and the handler may perform siglongjmp to the above
+        // established jmpbuf; that means we will execute the poll statement again, but that's fine.
+        this->sigmaskf(SIG_BLOCK, &active_sigmask, nullptr);
+
+        if (r == -1 || r == 0) {
+            // signal or no events
+            if (r == 0 && do_wait) {
+                // timeout:
+                Base::lock.lock();
+                this->process_monotonic_timers();
+                Base::lock.unlock();
+            }
+
+            return;
+        }
+
+        process_events(r);
+    }
+};
+
+} // namespace dasynq::v3
+} // namespace dasynq
+
+#endif /* DASYNQ_POLL_H_ */
@@ -30,6 +30,8 @@ struct posix_timer_traits : public Base
 template <class Base, bool provide_mono_timer /* = true */>
 class posix_timer_events : public timer_base<Base>
 {
+    using timer_queue_t = typename timer_base<Base>::timer_queue_t;
+
     private:
     timer_t real_timer;
     timer_t mono_timer;
@@ -146,35 +148,23 @@ class posix_timer_events : public timer_base<Base>
         timer_delete(real_timer);
     }
 
+    // Update the timer for the specified clock to match the first timer in its queue (after
+    // queue_timer_nolock or unqueue_timer_nolock has reported a change). Call with lock held.
+    void update_timer_nolock(clock_type clock) noexcept
+    {
+        if (clock != clock_type::MONOTONIC || provide_mono_timer) {
+            set_timer_from_queue(timer_for_clock(clock), this->queue_for_clock(clock));
+        }
+    }
+
     // starts (if not started) a timer to timeout at the given time. Resets the expiry count to 0.
     //   enable: specifies whether to enable reporting of timeouts/intervals
     void set_timer(timer_handle_t &timer_id, const timespec &timeout, const timespec &interval,
             bool enable, clock_type clock = clock_type::MONOTONIC) noexcept
     {
         std::lock_guard<decltype(Base::lock)> guard(Base::lock);
-
-        timer_queue_t &timer_queue = this->queue_for_clock(clock);
-        timer_t &timer = timer_for_clock(clock);
-
-        auto &ts = timer_queue.node_data(timer_id);
-        ts.interval_time = interval;
-        ts.expiry_count = 0;
-        ts.enabled = enable;
-
-        if (timer_queue.is_queued(timer_id)) {
-            // Already queued; alter timeout
-            if (timer_queue.set_priority(timer_id, timeout)) {
-                if (clock != clock_type::MONOTONIC || provide_mono_timer) {
-                    set_timer_from_queue(timer, timer_queue);
-                }
-            }
-        }
-        else {
-            if (timer_queue.insert(timer_id, timeout)) {
-                if (clock != clock_type::MONOTONIC || provide_mono_timer) {
-                    set_timer_from_queue(timer, timer_queue);
-                }
-            }
+        if (this->queue_timer_nolock(timer_id, timeout, interval, enable, clock)) {
+            update_timer_nolock(clock);
         }
     }
 
@@ -201,15 +191,8 @@ class posix_timer_events : public timer_base<Base>
 
     void stop_timer_nolock(timer_handle_t &timer_id, clock_type clock = clock_type::MONOTONIC) noexcept
     {
-        timer_queue_t &timer_queue = this->queue_for_clock(clock);
-        timer_t &timer = timer_for_clock(clock);
-
-        if (timer_queue.is_queued(timer_id)) {
-            bool was_first = (&timer_queue.get_root()) == &timer_id;
-            timer_queue.remove(timer_id);
-            if (was_first && (clock != clock_type::MONOTONIC || provide_mono_timer)) {
-                set_timer_from_queue(timer, timer_queue);
-            }
+        if (this->unqueue_timer_nolock(timer_id, clock)) {
+            update_timer_nolock(clock);
         }
     }
 
@@ -1,6 +1,8 @@
 #ifndef DASYNQ_PSELECT_H_
 #define DASYNQ_PSELECT_H_
 
+#include <cstring>
+
 #include "select.h"
 #include "signal.h"
 
@@ -26,9 +28,16 @@ template <class Base> class pselect_events : public signal_events<Base, false>
     //fd_set error_set;  // logical OR of both the above
     int max_fd = -1; // highest fd in any of the sets, -1 if not initialised
 
-    // A signal set used during polling (pull_events). We need to use a non-local variable for
-    // this to avoid theoretical issues with variable values after sigsetjmp(...).
+    // The signal mask to use while polling: the signal mask of the polling thread (poll_basemask),
+    // as of the previous poll, with active signals removed. This is kept up to date as signal watches
+    // change, and recomputed in full only if the polling thread's signal mask changes. Protected by lock.
+    sigset_t poll_basemask;
     sigset_t poll_sigmask;
+    bool poll_sigmask_valid = false;
+
+    // A copy of poll_sigmask used during polling (pull_events). We need to use a non-local variable
+    // for this to avoid theoretical issues with variable values after sigsetjmp(...).
+    sigset_t wait_sigmask;
 
     // userdata pointers in read and write respectively, for each fd:
     std::vector<void *> rd_udata;
@@ -42,37 +51,46 @@ template <class Base> class pselect_events : public signal_events<Base, false>
 
     using fd_r = typename dprivate::select_fd_r;
 
+    // Update poll_sigmask for a signal which has become active/inactive. Call with lock held.
+    void poll_sigmask_activate(int signo) noexcept
+    {
+        if (poll_sigmask_valid) {
+            sigdelset(&poll_sigmask, signo);
+        }
+    }
+
+    void poll_sigmask_deactivate(int signo) noexcept
+    {
+        if (poll_sigmask_valid && sigismember(&poll_basemask, signo)) {
+            sigaddset(&poll_sigmask, signo);
+        }
+    }
+
     void process_events(fd_set *read_set_p, fd_set *write_set_p, fd_set *error_set_p)
     {
         std::lock_guard<decltype(Base::lock)> guard(Base::lock);
 
         // Note: if error is set, we expect read or write is also set.
 
-        for (int i = 0; i <= max_fd; i++) {
-            if (FD_ISSET(i, read_set_p)) {
-                if (FD_ISSET(i, &read_set) && rd_udata[i] != nullptr) {
-                    // report read
-                	int events = IN_EVENTS | (FD_ISSET(i, error_set_p) ? ERR_EVENTS : 0);
-                    auto r = Base::receive_fd_event(*this, fd_r(i), rd_udata[i], events);
-                    if (std::get<0>(r) == 0) {
-                        FD_CLR(i, &read_set);
-                    }
+        dprivate::for_each_ready_fd(read_set_p, write_set_p, max_fd, [&](int i, bool readable, bool writable) {
+            int err_flag = FD_ISSET(i, error_set_p) ? ERR_EVENTS : 0;
+
+            if (readable && FD_ISSET(i, &read_set) && rd_udata[i] != nullptr) {
+                // report read
+                auto r = Base::receive_fd_event(*this, fd_r(i), rd_udata[i], IN_EVENTS | err_flag);
+                if (std::get<0>(r) == 0) {
+                    FD_CLR(i, &read_set);
                 }
             }
-        }
 
-        for (int i = 0; i <= max_fd; i++) {
-            if (FD_ISSET(i, write_set_p)) {
-                if (FD_ISSET(i, &write_set) && wr_udata[i] != nullptr) {
-                    // report write
-                	int events = OUT_EVENTS | (FD_ISSET(i, error_set_p) ? ERR_EVENTS : 0);
-                    auto r = Base::receive_fd_event(*this, fd_r(i), wr_udata[i], events);
-                    if (std::get<0>(r) == 0) {
-                        FD_CLR(i, &write_set);
-                    }
+            if (writable && FD_ISSET(i, &write_set) && wr_udata[i] != nullptr) {
+                // report write
+                auto r = Base::receive_fd_event(*this, fd_r(i), wr_udata[i], OUT_EVENTS | err_flag);
+                if (std::get<0>(r) == 0) {
+                    FD_CLR(i, &write_set);
                 }
             }
-        }
+        });
     }
 
     public:
@@ -117,6 +135,9 @@ template <class Base> class pselect_events : public signal_events<Base, false>
     // throws:  std::system_error or std::bad_alloc on failure
     bool add_fd_watch(int fd, void *userdata, int flags, bool enabled = true, bool soft_fail = false)
     {
+        if (fd < 0) {
+            throw std::system_error(EBADF, std::system_category());
+        }
         if (fd >= FD_SETSIZE) {
             throw std::system_error(EMFILE, std::system_category());
         }
@@ -146,23 +167,29 @@ template <class Base> class pselect_events : public signal_events<Base, false>
     //          OUT_EVENTS if out watch requires emulation
     int add_bidi_fd_watch(int fd, void *userdata, int flags, bool emulate = false)
     {
+        if (fd < 0) {
+            throw std::system_error(EBADF, std::system_category());
+        }
         if (fd >= FD_SETSIZE) {
             throw std::system_error(EMFILE, std::system_category());
         }
 
+        // Record the userdata for both directions, even if one is initially disabled, since it
+        // may be enabled later (via enable_fd_watch):
+        if (size_t(fd) >= rd_udata.size()) {
+            rd_udata.resize(fd + 1);
+        }
+        if (size_t(fd) >= wr_udata.size()) {
+            wr_udata.resize(fd + 1);
+        }
+        rd_udata[fd] = userdata;
+        wr_udata[fd] = userdata;
+
         if (flags & IN_EVENTS) {
             FD_SET(fd, &read_set);
-            if (size_t(fd) >= rd_udata.size()) {
-                rd_udata.resize(fd + 1);
-            }
-            rd_udata[fd] = userdata;
         }
         if (flags & OUT_EVENTS) {
             FD_SET(fd, &write_set);
-            if (size_t(fd) >= wr_udata.size()) {
-                wr_udata.resize(fd + 1);
-            }
-            wr_udata[fd] = userdata;
         }
 
         max_fd = std::max(fd, max_fd);
@@ -228,6 +255,39 @@ template <class Base> class pselect_events : public signal_events<Base, false>
         disable_fd_watch_nolock(fd, flags);
     }
 
+    // Note signal should be masked before call.
+    void add_signal_watch(int signo, void *userdata)
+    {
+        std::lock_guard<decltype(Base::lock)> guard(Base::lock);
+        add_signal_watch_nolock(signo, userdata);
+    }
+
+    // Note signal should be masked before call.
+    void add_signal_watch_nolock(int signo, void *userdata)
+    {
+        signal_events<Base, false>::add_signal_watch_nolock(signo, userdata);
+        poll_sigmask_activate(signo);
+    }
+
+    // Note, called with lock held:
+    void rearm_signal_watch_nolock(int signo, void *userdata) noexcept
+    {
+        signal_events<Base, false>::rearm_signal_watch_nolock(signo, userdata);
+        poll_sigmask_activate(signo);
+    }
+
+    void remove_signal_watch_nolock(int signo) noexcept
+    {
+        signal_events<Base, false>::remove_signal_watch_nolock(signo);
+        poll_sigmask_deactivate(signo);
+    }
+
+    void remove_signal_watch(int signo) noexcept
+    {
+        std::lock_guard<decltype(Base::lock)> guard(Base::lock);
+        remove_signal_watch_nolock(signo);
+    }
+
     // If events are pending, process an unspecified number of them.
     // If no events are pending, wait until one event is received and
     // process this event (and possibly any other events received
@@ -256,19 +316,31 @@ template <class Base> class pselect_events : public signal_events<Base, false>
         write_set_c = write_set;
         err_set = read_set;
 
-        const sigset_t &active_sigmask = this->get_active_sigmask();
-
         // We want "poll_sigmask" to have unmasked both the signals that were previously unmasked, and
-        // the signals that we need to see because they are being watched.
-        this->sigmaskf(SIG_UNBLOCK, nullptr, &poll_sigmask);
-
-        // This is horrible, but hopefully will be optimised well. POSIX gives no way to combine signal
-        // sets other than this.
-        for (int i = 1; i < NSIG; i++) {
-            if (!sigismember(&active_sigmask, i)) {
-                sigdelset(&poll_sigmask, i);
+        // the signals that we need to see because they are being watched. It is maintained as watches
+        // change, but must be recomputed if the signal mask of the polling thread differs from that
+        // used previously. (Comparing the sets bytewise may spuriously report a difference, which is
+        // harmless; but the set must be zeroed first, since neither sigemptyset nor the system call
+        // necessarily fill all of it).
+        sigset_t thread_sigmask;
+        std::memset(&thread_sigmask, 0, sizeof(sigset_t));
+        this->sigmaskf(SIG_UNBLOCK, nullptr, &thread_sigmask);
+        if (! poll_sigmask_valid || std::memcmp(&thread_sigmask, &poll_basemask, sizeof(sigset_t)) != 0) {
+            const sigset_t &active_sigmask = this->get_active_sigmask();
+            poll_basemask = thread_sigmask;
+            poll_sigmask = thread_sigmask;
+
+            // This is horrible, but hopefully will be optimised well. POSIX gives no way to combine
+            // signal sets other than this.
+            for (int i = 1; i < NSIG; i++) {
+                if (!sigismember(&active_sigmask, i)) {
+                    sigdelset(&poll_sigmask, i);
+                }
             }
+            poll_sigmask_valid = true;
         }
+        wait_sigmask = poll_sigmask;
+
         int nfds = max_fd + 1;
         Base::lock.unlock();
 
@@ -276,6 +348,9 @@ template <class Base> class pselect_events : public signal_events<Base, false>
         // received during polling, it will longjmp back to here:
         if (sigsetjmp(this->get_sigreceive_jmpbuf(), 1) != 0) {
             this->process_signal(poll_sigmask);
+            Base::lock.lock();
+            wait_sigmask = poll_sigmask;
+            Base::lock.unlock();
             do_wait = false;
         }
 
@@ -287,7 +362,7 @@ template <class Base> class pselect_events : public signal_events<Base, false>
 
         std::atomic_signal_fence(std::memory_order::memory_order_release);
 
-        int r = pselect(nfds, &read_set_c, &write_set_c, &err_set, wait_ts, &poll_sigmask);
+        int r = pselect(nfds, &read_set_c, &write_set_c, &err_set, wait_ts, &wait_sigmask);
 
         if (r == -1 || r == 0) {
             // signal or no events
@@ -296,7 +371,7 @@ template <class Base> class pselect_events : public signal_events<Base, false>
                     // At least on Mac OS, pselect doesn't seem to give us a pending signal
                     // if we have a zero timeout. Force detection using sigmask:
                     sigset_t origmask;
-                    this->sigmaskf(SIG_SETMASK, &poll_sigmask, &origmask);
+                    this->sigmaskf(SIG_SETMASK, &wait_sigmask, &origmask);
                     this->sigmaskf(SIG_SETMASK, &origmask, nullptr);
                 }
                 else {
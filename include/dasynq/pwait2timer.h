@@ -0,0 +1,142 @@
+#ifndef DASYNQ_PWAIT2TIMER_H_
+#define DASYNQ_PWAIT2TIMER_H_
+
+#include <mutex>
+#include <ctime>
+
+#include "epoll.h"
+#include "timerfd.h"
+
+namespace dasynq {
+
+// Timer implementation for the epoll backend, based on the epoll_pwait2 system call (Linux 5.11+).
+//
+// Rather than keeping a timerfd programmed with the time of the first monotonic timer (which requires
+// a timerfd_settime call whenever the first timer changes, as well as an epoll wakeup for the timerfd
+// when it expires), the delay until the first monotonic timer is passed directly as the (nanosecond
+// resolution) timeout when polling; see begin_timer_wait/end_timer_wait, which are called by the backend
+// around the wait. If a timer earlier than the current wait timeout is set from another thread while the
+// loop is polling, the wait is interrupted (so the interrupt channel must be below this in the mechanism
+// chain).
+//
+// System clock timers still use a timerfd, so that they correctly track changes to the system time. If
+// epoll_pwait2 is not supported by the running kernel, or if use_pwait2 is false (which is mainly useful
+// for testing), this behaves exactly as timer_fd_events.
+
+template <class Base, bool use_pwait2 = true> class pwait2_timer_events;
+
+template <typename Base, bool use_pwait2 = true>
+struct pwait2_timer_traits : public Base
+{
+    template <typename T> using backend_tmpl
+            = pwait2_timer_events<typename Base::template backend_tmpl<T>, use_pwait2>;
+};
+
+template <class Base, bool use_pwait2> class pwait2_timer_events : public timer_fd_events<Base>
+{
+    using fd_timer_events = timer_fd_events<Base>;
+
+    // whether monotonic timers use the wait timeout (i.e. epoll_pwait2 is available):
+    bool use_wait_timeout = false;
+
+    // whether a wait is in progress, and (if has_deadline) the time the wait will time out:
+    bool waiting = false;
+    bool has_deadline = false;
+    time_val wait_deadline;
+
+    protected:
+
+    // Process expired monotonic timers and determine the timeout for the next wait (see
+    // timer_base::process_monotonic_timers). Returns false if monotonic timers don't rely on the wait
+    // timeout.
+    bool begin_timer_wait(bool &do_wait, timespec &ts, timespec *&wait_ts) noexcept
+    {
+        if (! use_wait_timeout) return false;
+
+        std::lock_guard<decltype(Base::lock)> guard(Base::lock);
+        this->process_monotonic_timers(do_wait, ts, wait_ts);
+        waiting = do_wait;
+        auto &queue = this->queue_for_clock(clock_type::MONOTONIC);
+        has_deadline = ! queue.empty();
+        if (has_deadline) {
+            wait_deadline = queue.get_root_priority();
+        }
+        return true;
+    }
+
+    // Called after the wait; timed_out indicates that the wait timed out (with no events).
+    void end_timer_wait(bool timed_out) noexcept
+    {
+        std::lock_guard<decltype(Base::lock)> guard(Base::lock);
+        waiting = false;
+        if (timed_out) {
+            this->process_monotonic_timers();
+        }
+    }
+
+    public:
+
+    template <typename T> void init(T *loop_mech)
+    {
+        // (The monotonic timerfd is only needed if not using the wait timeout):
+        use_wait_timeout = use_pwait2 && dprivate::epoll_pwait2_available();
+        fd_timer_events::init(loop_mech, ! use_wait_timeout);
+    }
+
+    // Update the timer for the specified clock to match the first timer in its queue (after
+    // queue_timer_nolock or unqueue_timer_nolock has reported a change). Call with lock held.
+    void update_timer_nolock(clock_type clock) noexcept
+    {
+        if (clock != clock_type::MONOTONIC || ! use_wait_timeout) {
+            fd_timer_events::update_timer_nolock(clock);
+            return;
+        }
+
+        // If the first timer is now earlier than the timeout of the current wait, interrupt the wait
+        // so that the timeout is recalculated:
+        auto &queue = this->queue_for_clock(clock);
+        if (waiting && ! queue.empty()) {
+            if (! has_deadline || queue.get_root_priority() < wait_deadline) {
+                has_deadline = true;
+                wait_deadline = queue.get_root_priority();
+                this->interrupt_wait();
+            }
+        }
+    }
+
+    void stop_timer(timer_handle_t &timer_id, clock_type clock = clock_type::MONOTONIC) noexcept
+    {
+        std::lock_guard<decltype(Base::lock)> guard(Base::lock);
+        stop_timer_nolock(timer_id, clock);
+    }
+
+    void stop_timer_nolock(timer_handle_t &timer_id, clock_type clock = clock_type::MONOTONIC) noexcept
+    {
+        if (this->unqueue_timer_nolock(timer_id, clock)) {
+            update_timer_nolock(clock);
+        }
+    }
+
+    void set_timer(timer_handle_t & timer_id, const time_val &timeout, const time_val &interval,
+            bool enable, clock_type clock = clock_type::MONOTONIC) noexcept
+    {
+        std::lock_guard<decltype(Base::lock)> guard(Base::lock);
+        if (this->queue_timer_nolock(timer_id, timeout, interval, enable, clock)) {
+            update_timer_nolock(clock);
+        }
+    }
+
+    void set_timer_rel(timer_handle_t & timer_id, const time_val &timeout, const time_val &interval,
+            bool enable, clock_type clock = clock_type::MONOTONIC) noexcept
+    {
+        time_val alarmtime;
+        this->get_time(alarmtime, clock, false);
+        alarmtime += timeout;
+
+        set_timer(timer_id, alarmtime, interval, enable, clock);
+    }
+};
+
+} // namespace dasynq
+
+#endif /* DASYNQ_PWAIT2TIMER_H_ */
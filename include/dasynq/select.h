@@ -4,6 +4,8 @@
 #include <system_error>
 #include <vector>
 #include <atomic>
+#include <climits>
+#include <cstring>
 
 #include <sys/time.h>
 #include <sys/types.h>
@@ -49,6 +51,83 @@ class select_fd_r {
     }
 };
 
+// Scanning of fd_set contents a word at a time.
+//
+// POSIX doesn't specify the representation of fd_set, but in practice it is an array of integer words in
+// which descriptor n is represented by bit (n % W) of word (n / W). We check (once) that this holds when
+// the set is viewed as an array of unsigned long, and otherwise fall back to testing each descriptor via
+// FD_ISSET.
+
+using fd_word_t = unsigned long;
+constexpr int fd_word_bits = sizeof(fd_word_t) * CHAR_BIT;
+
+// Find the index of the lowest set bit in a (non-zero) word.
+inline int fd_word_ctz(fd_word_t w) noexcept
+{
+#ifdef __GNUC__
+    return __builtin_ctzl(w);
+#else
+    int r = 0;
+    while ((w & 1) == 0) {
+        w >>= 1;
+        r++;
+    }
+    return r;
+#endif
+}
+
+inline fd_word_t fd_set_word(const fd_set *set, int index) noexcept
+{
+    fd_word_t w;
+    std::memcpy(&w, reinterpret_cast<const char *>(set) + index * sizeof(fd_word_t), sizeof(w));
+    return w;
+}
+
+inline bool fd_set_has_word_layout() noexcept
+{
+    static const bool has_word_layout = [] {
+        if (sizeof(fd_set) % sizeof(fd_word_t) != 0 || FD_SETSIZE <= fd_word_bits + 3) {
+            return false;
+        }
+        fd_set test_set;
+        FD_ZERO(&test_set);
+        FD_SET(1, &test_set);
+        FD_SET(fd_word_bits + 3, &test_set);
+        return fd_set_word(&test_set, 0) == 2u && fd_set_word(&test_set, 1) == 8u;
+    }();
+    return has_word_layout;
+}
+
+// Call func(fd, readable, writable) for each descriptor (up to max_fd) that is set in either of read_set
+// and write_set, in a single pass.
+template <typename F>
+inline void for_each_ready_fd(const fd_set *read_set, const fd_set *write_set, int max_fd, F func)
+{
+    if (! fd_set_has_word_layout()) {
+        for (int i = 0; i <= max_fd; i++) {
+            bool readable = FD_ISSET(i, read_set);
+            bool writable = FD_ISSET(i, write_set);
+            if (readable || writable) {
+                func(i, readable, writable);
+            }
+        }
+        return;
+    }
+
+    int last_word = max_fd / fd_word_bits;
+    for (int wi = 0; wi <= last_word; wi++) {
+        fd_word_t rd_word = fd_set_word(read_set, wi);
+        fd_word_t wr_word = fd_set_word(write_set, wi);
+        fd_word_t ready = rd_word | wr_word;
+        while (ready != 0) {
+            int bit = fd_word_ctz(ready);
+            fd_word_t mask = fd_word_t(1) << bit;
+            func(wi * fd_word_bits + bit, (rd_word & mask) != 0, (wr_word & mask) != 0);
+            ready &= ready - 1;
+        }
+    }
+}
+
 } // namespace dprivate
 
 inline namespace v3 {
@@ -94,31 +173,25 @@ template <class Base> class select_events : public signal_events<Base, true>
 
         // Note: if error is set, we expect read or write is also set.
 
-        for (int i = 0; i <= max_fd; i++) {
-            if (FD_ISSET(i, read_set_p)) {
-                if (FD_ISSET(i, &read_set) && rd_udata[i] != nullptr) {
-                    // report read
-                	int events = IN_EVENTS | (FD_ISSET(i, error_set_p) ? ERR_EVENTS : 0);
-                    auto r = Base::receive_fd_event(*this, fd_r(i), rd_udata[i], events);
-                    if (std::get<0>(r) == 0) {
-                        FD_CLR(i, &read_set);
-                    }
+        dprivate::for_each_ready_fd(read_set_p, write_set_p, max_fd, [&](int i, bool readable, bool writable) {
+            int err_flag = FD_ISSET(i, error_set_p) ? ERR_EVENTS : 0;
+
+            if (readable && FD_ISSET(i, &read_set) && rd_udata[i] != nullptr) {
+                // report read
+                auto r = Base::receive_fd_event(*this, fd_r(i), rd_udata[i], IN_EVENTS | err_flag);
+                if (std::get<0>(r) == 0) {
+                    FD_CLR(i, &read_set);
                 }
             }
-        }
 
-        for (int i = 0; i <= max_fd; i++) {
-            if (FD_ISSET(i, write_set_p)) {
-                if (FD_ISSET(i, &write_set) && wr_udata[i] != nullptr) {
-                    // report write
-                	int events = OUT_EVENTS | (FD_ISSET(i, error_set_p) ? ERR_EVENTS : 0);
-                    auto r = Base::receive_fd_event(*this, fd_r(i), wr_udata[i], events);
-                    if (std::get<0>(r) == 0) {
-                        FD_CLR(i, &write_set);
-                    }
+            if (writable && FD_ISSET(i, &write_set) && wr_udata[i] != nullptr) {
+                // report write
+                auto r = Base::receive_fd_event(*this, fd_r(i), wr_udata[i], OUT_EVENTS | err_flag);
+                if (std::get<0>(r) == 0) {
+                    FD_CLR(i, &write_set);
                 }
             }
-        }
+        });
     }
 
     public:
@@ -163,6 +236,9 @@ template <class Base> class select_events : public signal_events<Base, true>
     // throws:  std::system_error or std::bad_alloc on failure
     bool add_fd_watch(int fd, void *userdata, int flags, bool enabled = true, bool soft_fail = false)
     {
+        if (fd < 0) {
+            throw std::system_error(EBADF, std::system_category());
+        }
         if (fd >= FD_SETSIZE) {
             throw std::system_error(EMFILE, std::system_category());
         }
@@ -192,23 +268,29 @@ template <class Base> class select_events : public signal_events<Base, true>
     //          OUT_EVENTS if out watch requires emulation
     int add_bidi_fd_watch(int fd, void *userdata, int flags, bool emulate = false)
     {
+        if (fd < 0) {
+            throw std::system_error(EBADF, std::system_category());
+        }
         if (fd >= FD_SETSIZE) {
             throw std::system_error(EMFILE, std::system_category());
         }
 
+        // Record the userdata for both directions, even if one is initially disabled, since it
+        // may be enabled later (via enable_fd_watch):
+        if (size_t(fd) >= rd_udata.size()) {
+            rd_udata.resize(fd + 1);
+        }
+        if (size_t(fd) >= wr_udata.size()) {
+            wr_udata.resize(fd + 1);
+        }
+        rd_udata[fd] = userdata;
+        wr_udata[fd] = userdata;
+
         if (flags & IN_EVENTS) {
             FD_SET(fd, &read_set);
-            if (size_t(fd) >= rd_udata.size()) {
-                rd_udata.resize(fd + 1);
-            }
-            rd_udata[fd] = userdata;
         }
         if (flags & OUT_EVENTS) {
             FD_SET(fd, &write_set);
-            if (size_t(fd) >= wr_udata.size()) {
-                wr_udata.resize(fd + 1);
-            }
-            wr_udata[fd] = userdata;
         }
 
         max_fd = std::max(fd, max_fd);
@@ -191,8 +191,9 @@ template <class Base, bool mask_enables = false> class signal_events : public Ba
         Base::lock.unlock();
     }
 
-    // Process a received signal, and update sigmask - which should reflect the inverse of the
-    // active signal mask. See comments for process_signal() above.
+    // Process a received signal, and update sigmask - a signal mask used for polling - so that the
+    // signal is masked if its watch has been disabled. sigmask is updated with the lock held. See
+    // comments for process_signal() above.
     void process_signal(sigset_t &sigmask)
     {
         using namespace dprivate::signal_mech;
@@ -210,12 +211,11 @@ template <class Base, bool mask_enables = false> class signal_events : public Ba
         Base::lock.lock();
         void *udata = sig_userdata[sinfo->si_signo];
         if (udata != nullptr && Base::receive_signal(*this, sigdata, udata)) {
+            sigaddset(&sigmask, sinfo->si_signo);
             if (mask_enables) {
-                sigaddset(&sigmask, sinfo->si_signo);
                 sigdelset(&active_sigmask, sinfo->si_signo);
             }
             else {
-                sigdelset(&sigmask, sinfo->si_signo);
                 sigaddset(&active_sigmask, sinfo->si_signo);
             }
         }
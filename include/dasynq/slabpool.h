@@ -0,0 +1,206 @@
+#ifndef DASYNQ_SLABPOOL_H_
+#define DASYNQ_SLABPOOL_H_
+
+#include <mutex>
+#include <memory>
+#include <new>
+#include <utility>
+
+#include <cstddef>
+
+// A simple object pool, for recycling memory used by short-lived objects (in particular, dynamically
+// allocated watchers, such as those created by the lambda watcher factory functions).
+//
+// Memory is allocated from the system in slabs, each of which is divided into blocks of a single size
+// class (sizes are rounded up to a multiple of the fundamental alignment). Freed blocks are kept on a
+// free list for their size class and reused for subsequent allocations of the same class, so that an
+// application repeatedly creating and destroying watchers of the same type does not need to allocate
+// memory from the global heap. Slabs are only returned to the system when the pool is destroyed.
+// Allocations larger than the largest size class are passed directly to the global operator new.
+//
+// Each pool has its own mutex (of type T_Mutex), which protects its free lists.
+
+namespace dasynq {
+
+template <typename T_Mutex>
+class slab_pool
+{
+    static constexpr std::size_t granule = alignof(std::max_align_t);
+    static constexpr std::size_t max_block_size = 512;
+    static constexpr std::size_t num_classes = max_block_size / granule;
+    static constexpr std::size_t slab_size = 8192;
+
+    struct free_block
+    {
+        free_block *next;
+    };
+
+    // Slab header; the blocks follow it (at an offset of header_size).
+    struct slab
+    {
+        slab *next;
+    };
+
+    static constexpr std::size_t header_size = (sizeof(slab) + granule - 1) / granule * granule;
+
+    T_Mutex lock;
+    free_block *free_lists[num_classes] = {};
+    slab *slabs = nullptr;
+
+    static std::size_t size_class(std::size_t size) noexcept
+    {
+        return (size + granule - 1) / granule - 1;
+    }
+
+    // Allocate a new slab for the given size class, and place its blocks on the free list.
+    // Call with lock held.
+    void add_slab(std::size_t sclass)
+    {
+        std::size_t block_size = (sclass + 1) * granule;
+        std::size_t num_blocks = (slab_size - header_size) / block_size;
+
+        char *mem = static_cast<char *>(::operator new(slab_size));
+        slab *new_slab = reinterpret_cast<slab *>(mem);
+        new_slab->next = slabs;
+        slabs = new_slab;
+
+        char *block = mem + header_size;
+        for (std::size_t i = 0; i < num_blocks; i++) {
+            free_block *fb = reinterpret_cast<free_block *>(block);
+            fb->next = free_lists[sclass];
+            free_lists[sclass] = fb;
+            block += block_size;
+        }
+    }
+
+    public:
+    slab_pool() noexcept { }
+    slab_pool(const slab_pool &) = delete;
+    slab_pool &operator=(const slab_pool &) = delete;
+
+    ~slab_pool()
+    {
+        while (slabs != nullptr) {
+            slab *next = slabs->next;
+            ::operator delete(slabs);
+            slabs = next;
+        }
+    }
+
+    // Allocate a block of at least the given size (aligned to the fundamental alignment).
+    // Throws std::bad_alloc on failure.
+    void *allocate(std::size_t size)
+    {
+        if (size == 0) size = 1;
+        if (size > max_block_size) {
+            return ::operator new(size);
+        }
+
+        std::size_t sclass = size_class(size);
+        std::lock_guard<T_Mutex> guard(lock);
+        if (free_lists[sclass] == nullptr) {
+            add_slab(sclass);
+        }
+        free_block *fb = free_lists[sclass];
+        free_lists[sclass] = fb->next;
+        return fb;
+    }
+
+    // Return a block to the pool; size must be the same as was passed to allocate().
+    void deallocate(void *p, std::size_t size) noexcept
+    {
+        if (size == 0) size = 1;
+        if (size > max_block_size) {
+            ::operator delete(p);
+            return;
+        }
+
+        std::size_t sclass = size_class(size);
+        std::lock_guard<T_Mutex> guard(lock);
+        free_block *fb = static_cast<free_block *>(p);
+        fb->next = free_lists[sclass];
+        free_lists[sclass] = fb;
+    }
+};
+
+// An allocator (satisfying the standard Allocator requirements) which allocates from a pool, such
+// as a slab_pool.
+template <typename T, typename Pool>
+class pool_allocator
+{
+    template <typename, typename> friend class pool_allocator;
+
+    Pool *pool;
+
+    public:
+    using value_type = T;
+
+    pool_allocator(Pool &pool_p) noexcept : pool(&pool_p) { }
+
+    template <typename U>
+    pool_allocator(const pool_allocator<U, Pool> &other) noexcept : pool(other.pool) { }
+
+    T *allocate(std::size_t n)
+    {
+        static_assert(alignof(T) <= alignof(std::max_align_t), "over-aligned types not supported");
+        if (n > std::size_t(-1) / sizeof(T)) {
+            throw std::bad_alloc();
+        }
+        return static_cast<T *>(pool->allocate(n * sizeof(T)));
+    }
+
+    void deallocate(T *p, std::size_t n) noexcept
+    {
+        pool->deallocate(p, n * sizeof(T));
+    }
+
+    template <typename U>
+    bool operator==(const pool_allocator<U, Pool> &other) const noexcept
+    {
+        return pool == other.pool;
+    }
+
+    template <typename U>
+    bool operator!=(const pool_allocator<U, Pool> &other) const noexcept
+    {
+        return pool != other.pool;
+    }
+};
+
+namespace dprivate {
+
+// Allocate and construct an object of type W using (a rebound copy of) the given allocator.
+template <typename W, typename Alloc, typename ...U>
+W *alloc_construct(const Alloc &alloc, U&&... u)
+{
+    using traits = typename std::allocator_traits<Alloc>::template rebind_traits<W>;
+    typename traits::allocator_type w_alloc(alloc);
+
+    W *w = &*traits::allocate(w_alloc, 1);
+    try {
+        traits::construct(w_alloc, w, std::forward<U>(u)...);
+    }
+    catch (...) {
+        traits::deallocate(w_alloc, w, 1);
+        throw;
+    }
+    return w;
+}
+
+// Destroy and deallocate an object previously created via alloc_construct. Note the allocator is
+// passed by value so that it may be a member of the object being destroyed.
+template <typename W, typename Alloc>
+void alloc_destroy(Alloc alloc, W *w) noexcept
+{
+    using traits = typename std::allocator_traits<Alloc>::template rebind_traits<W>;
+    typename traits::allocator_type w_alloc(alloc);
+
+    traits::destroy(w_alloc, w);
+    traits::deallocate(w_alloc, w, 1);
+}
+
+} // namespace dprivate
+
+} // namespace dasynq
+
+#endif /* DASYNQ_SLABPOOL_H_ */
@@ -7,8 +7,12 @@
 // priority key (after the original key).
 //
 // The generation counter is a 64-bit integer and can not realistically overflow.
+//
+// The underlying queue template (H) takes the element type, priority type, comparator and an allocator
+// type.
 
 #include <functional>
+#include <memory>
 #include <utility>
 
 #include <cstdint>
@@ -54,11 +58,12 @@ class compare_stable_prio
 };
 
 
-template <template <typename H1, typename H2, typename H3> class H, typename T, typename P, typename C = std::less<P>>
-class stable_heap : private H<T,stable_prio<P>,compare_stable_prio<P,C>>
+template <template <typename H1, typename H2, typename H3, typename H4> class H, typename T, typename P,
+        typename C = std::less<P>, typename Alloc = std::allocator<T>>
+class stable_heap : private H<T,stable_prio<P>,compare_stable_prio<P,C>,Alloc>
 {
-    using Base = H<T,stable_prio<P>,compare_stable_prio<P,C>>;
-    
+    using Base = H<T,stable_prio<P>,compare_stable_prio<P,C>,Alloc>;
+
     // using H<T,P,compare_stable_prio<P,C>>:H;  // inherit constructors
     using Base::Base;
     
@@ -124,6 +129,16 @@ class stable_heap : private H<T,stable_prio<P>,compare_stable_prio<P,C>>
     {
         return Base::size();
     }
+
+    void reserve(size_t amount)
+    {
+        Base::reserve(amount);
+    }
+
+    size_t capacity() noexcept(noexcept(std::declval<Base>().capacity()))
+    {
+        return Base::capacity();
+    }
 };
 
 } // namespace dasynq
@@ -0,0 +1,719 @@
+#ifndef DASYNQ_STREAM_H_
+#define DASYNQ_STREAM_H_
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <new>
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+// Buffered stream watcher.
+//
+// stream_watcher_impl is a bidirectional fd watcher which manages input and output buffering for a
+// (non-blocking) stream file descriptor, such as a connected socket or a pipe. Buffered data is held
+// in stream_buffer instances: segmented ring buffers consisting of a chain of fixed-size segments,
+// with data consumed from the front and appended at the back, so that consuming data never requires
+// moving the remaining data. Input is read using readv (into the free space at the end of the last
+// segment, and a fresh segment), and output is written using writev, gathering buffered segments so
+// that a single call can write the whole buffer.
+//
+// The buffers of a stream watcher draw their segments from the event loop's stream buffer pool (see
+// bufpool.h), so that a connection holds segment memory only while it has data buffered.
+//
+// This header is included by dasynq.h; it should not be included directly.
+
+namespace dasynq {
+
+// A segmented buffer, used for buffering stream input and output.
+class stream_buffer
+{
+    public:
+    static constexpr size_t segment_size = stream_segment::data_size;
+
+    private:
+    using segment = stream_segment;
+
+    segment *head = nullptr;
+    segment *tail = nullptr;
+    segment *spare = nullptr;  // a free segment, retained for re-use (or borrowed, if pooled)
+    size_t length = 0;
+
+    // The pool from which segments are obtained, if any:
+    stream_segment_source *pool = nullptr;
+
+    segment *new_segment()
+    {
+        return (pool != nullptr) ? pool->get_segment() : new segment;
+    }
+
+    void delete_segment(segment *seg) noexcept
+    {
+        if (pool != nullptr) {
+            pool->put_segment(seg);
+        }
+        else {
+            delete seg;
+        }
+    }
+
+    segment *alloc_segment()
+    {
+        segment *seg = spare;
+        if (seg != nullptr) {
+            spare = nullptr;
+        }
+        else {
+            seg = new_segment();
+        }
+        seg->next = nullptr;
+        seg->start = 0;
+        seg->end = 0;
+        return seg;
+    }
+
+    // Free a segment; if not pooled, it is retained as the spare (if there is none already).
+    void free_segment(segment *seg) noexcept
+    {
+        if (spare == nullptr && pool == nullptr) {
+            spare = seg;
+        }
+        else {
+            delete_segment(seg);
+        }
+    }
+
+    void push_segment(segment *seg) noexcept
+    {
+        if (tail != nullptr) {
+            tail->next = seg;
+        }
+        else {
+            head = seg;
+        }
+        tail = seg;
+    }
+
+    size_t tail_space() const noexcept
+    {
+        return (tail == nullptr) ? 0 : (segment_size - tail->end);
+    }
+
+    public:
+    stream_buffer() noexcept { }
+    stream_buffer(const stream_buffer &) = delete;
+    stream_buffer &operator=(const stream_buffer &) = delete;
+
+    ~stream_buffer()
+    {
+        clear();
+        release_space();
+        delete spare;
+    }
+
+    // Set the pool from which the buffer obtains segments (nullptr for none). The buffer must be
+    // empty. If a pool is set, it must outlive the buffer (or a subsequent set_pool() call).
+    void set_pool(stream_segment_source *pool_p) noexcept
+    {
+        if (spare != nullptr) {
+            delete_segment(spare);
+            spare = nullptr;
+        }
+        pool = pool_p;
+    }
+
+    // Get the number of bytes of data in the buffer.
+    size_t size() const noexcept
+    {
+        return length;
+    }
+
+    bool empty() const noexcept
+    {
+        return length == 0;
+    }
+
+    // Append data to the buffer. If allocation fails, std::bad_alloc is thrown and the buffer is
+    // unchanged.
+    void append(const void *data, size_t len)
+    {
+        // Allocate all required segments first, so that we can fail cleanly:
+        segment *new_segs = nullptr;
+        segment *new_tail = nullptr;
+        size_t space = tail_space();
+        try {
+            while (space < len) {
+                segment *seg = alloc_segment();
+                if (new_tail != nullptr) {
+                    new_tail->next = seg;
+                }
+                else {
+                    new_segs = seg;
+                }
+                new_tail = seg;
+                space += segment_size;
+            }
+        }
+        catch (std::bad_alloc &) {
+            while (new_segs != nullptr) {
+                segment *next = new_segs->next;
+                free_segment(new_segs);
+                new_segs = next;
+            }
+            throw;
+        }
+
+        const char *src = static_cast<const char *>(data);
+        length += len;
+        if (tail != nullptr) {
+            size_t n = std::min(len, segment_size - tail->end);
+            std::memcpy(tail->data + tail->end, src, n);
+            tail->end += n;
+            src += n;
+            len -= n;
+        }
+        while (new_segs != nullptr) {
+            segment *seg = new_segs;
+            new_segs = seg->next;
+            seg->next = nullptr;
+            size_t n = std::min(len, size_t(segment_size));
+            std::memcpy(seg->data, src, n);
+            seg->end = n;
+            src += n;
+            len -= n;
+            push_segment(seg);
+        }
+    }
+
+    // Get a pointer to the contiguous data at the front of the buffer, and its length (which may be
+    // less than size()). Returns nullptr (with len 0) if the buffer is empty.
+    const char *front(size_t &len) const noexcept
+    {
+        if (head == nullptr) {
+            len = 0;
+            return nullptr;
+        }
+        len = head->end - head->start;
+        return head->data + head->start;
+    }
+
+    // Copy up to len bytes from the front of the buffer, without consuming them. Returns the number of
+    // bytes copied.
+    size_t peek(void *dest, size_t len) const noexcept
+    {
+        char *dest_c = static_cast<char *>(dest);
+        size_t copied = 0;
+        for (segment *seg = head; seg != nullptr && copied < len; seg = seg->next) {
+            size_t n = std::min(len - copied, seg->end - seg->start);
+            std::memcpy(dest_c + copied, seg->data + seg->start, n);
+            copied += n;
+        }
+        return copied;
+    }
+
+    // Copy up to len bytes from the front of the buffer, and consume them. Returns the number of bytes
+    // copied.
+    size_t read(void *dest, size_t len) noexcept
+    {
+        size_t n = peek(dest, len);
+        consume(n);
+        return n;
+    }
+
+    // Discard len bytes (which must not be more than size()) from the front of the buffer.
+    void consume(size_t len) noexcept
+    {
+        length -= len;
+        while (len > 0) {
+            size_t seg_len = head->end - head->start;
+            if (len < seg_len) {
+                head->start += len;
+                return;
+            }
+            len -= seg_len;
+            segment *seg = head;
+            head = seg->next;
+            if (head == nullptr) {
+                tail = nullptr;
+            }
+            free_segment(seg);
+        }
+    }
+
+    // Discard all data in the buffer.
+    void clear() noexcept
+    {
+        while (head != nullptr) {
+            segment *seg = head;
+            head = seg->next;
+            free_segment(seg);
+        }
+        tail = nullptr;
+        length = 0;
+    }
+
+    // Fill in iovec structures describing the data in the buffer, from the front, using at most
+    // max_iov entries. Returns the number of entries filled.
+    int get_data_iovecs(struct iovec *iov, int max_iov) const noexcept
+    {
+        int count = 0;
+        for (segment *seg = head; seg != nullptr && count < max_iov; seg = seg->next) {
+            iov[count].iov_base = seg->data + seg->start;
+            iov[count].iov_len = seg->end - seg->start;
+            count++;
+        }
+        return count;
+    }
+
+    // Fill in (at most two) iovec structures describing free space at the end of the buffer, into
+    // which data can be placed and then added to the buffer by calling commit(). Returns the number
+    // of entries filled. May throw std::bad_alloc.
+    int get_space_iovecs(struct iovec *iov)
+    {
+        if (spare == nullptr) {
+            spare = new_segment();
+        }
+
+        int count = 0;
+        size_t space = tail_space();
+        if (space != 0) {
+            iov[0].iov_base = tail->data + tail->end;
+            iov[0].iov_len = space;
+            count++;
+        }
+        iov[count].iov_base = spare->data;
+        iov[count].iov_len = segment_size;
+        return count + 1;
+    }
+
+    // Add len bytes of data, placed in the space returned by the preceding call to
+    // get_space_iovecs(), to the buffer.
+    void commit(size_t len) noexcept
+    {
+        length += len;
+        size_t space = tail_space();
+        if (space != 0) {
+            size_t n = std::min(len, space);
+            tail->end += n;
+            len -= n;
+        }
+        if (len != 0) {
+            segment *seg = spare;
+            spare = nullptr;
+            seg->next = nullptr;
+            seg->start = 0;
+            seg->end = len;
+            push_segment(seg);
+        }
+    }
+
+    // Release free space obtained via get_space_iovecs() and not filled, if the buffer is pooled (the
+    // spare segment is returned to the pool). Otherwise, has no effect.
+    void release_space() noexcept
+    {
+        if (pool != nullptr && spare != nullptr) {
+            pool->put_segment(spare);
+            spare = nullptr;
+        }
+    }
+};
+
+namespace dprivate {
+
+// A stream watcher: a bidirectional fd watcher which buffers input and output. The Derived class
+// must provide:
+//
+//     rearm data_received(EventLoop &eloop, stream_buffer &input)
+//         - called when data has been read into the input buffer. The handler should consume the
+//           data that it processes; any remaining data stays in the buffer.
+//
+// and may provide (defaults are provided):
+//
+//     rearm input_closed(EventLoop &eloop, int errcode)
+//         - called when end-of-file is reached on input (errcode == 0) or a read error occurs (errcode
+//           is the error number). The default returns rearm::REMOVE (which removes the input side of
+//           the watcher).
+//     rearm output_error(EventLoop &eloop, int errcode)
+//         - called if writing buffered output fails. The buffered output is discarded and subsequent
+//           send() calls fail. The default returns rearm::DISARM.
+//     void output_high_water(EventLoop &eloop)
+//     void output_low_water(EventLoop &eloop)
+//         - called when the amount of buffered output rises to (at least) the high watermark, and
+//           subsequently when it falls to (at most) the low watermark; see set_output_watermarks().
+//           These can be used to apply back-pressure to the source of the output data.
+//
+// Output is sent with send(). If no output is buffered, the data is written immediately, and only
+// data which cannot be written is buffered (in which case the output watch is enabled until the
+// buffer is drained). Alternatively, output can be accumulated with buffer_output() and then written
+// with flush(). These functions may be called from any thread; the watermark callbacks are called
+// from the thread which causes the watermark to be crossed, without any lock held.
+template <typename EventLoop, typename Derived>
+class stream_watcher_impl : public bidi_fd_watcher_impl<EventLoop, stream_watcher_impl<EventLoop, Derived>>
+{
+    template <typename, typename> friend class bidi_fd_watcher_impl;
+
+    using mutex_t = typename EventLoop::mutex_t;
+
+    // Maximum number of segments to write with a single writev call:
+    static constexpr int max_write_iov = 64;
+
+    // Maximum amount of data to read in response to a single input event:
+    static constexpr size_t max_read_per_event = 16 * stream_buffer::segment_size;
+
+    // State of the output side:
+    enum class out_state_t
+    {
+        IDLE,    // no output buffered, output watch disabled
+        ARMED,   // output buffered, output watch enabled
+        ACTIVE,  // write_ready handler running
+        FAILED   // write failed
+    };
+
+    stream_buffer input_buf;
+    stream_buffer output_buf;
+
+    // protects output_buf and output state:
+    mutex_t out_lock;
+    out_state_t out_state = out_state_t::IDLE;
+    int out_errcode = 0;
+
+    size_t out_low_water = 0;
+    size_t out_high_water = SIZE_MAX;
+    bool above_high_water = false;
+
+    // Write as much buffered output as possible. Returns 0 on success (including if the write would
+    // block) or an error number. Call with out_lock held.
+    int write_buffered(int fd) noexcept
+    {
+        struct iovec iov[max_write_iov];
+        while (! output_buf.empty()) {
+            int iov_count = output_buf.get_data_iovecs(iov, max_write_iov);
+            ssize_t r = writev(fd, iov, iov_count);
+            if (r == -1) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+                return errno;
+            }
+            output_buf.consume(r);
+        }
+        return 0;
+    }
+
+    // If no output is in progress, write as much buffered output as possible now, and enable the
+    // output watch if any remains. Returns false if the stream has failed. Call with out_lock held.
+    bool start_output(EventLoop &eloop) noexcept
+    {
+        if (out_state == out_state_t::FAILED) {
+            return false;
+        }
+
+        if (out_state == out_state_t::IDLE && ! output_buf.empty()) {
+            int errcode = write_buffered(this->get_watched_fd());
+            if (errcode != 0) {
+                out_state = out_state_t::FAILED;
+                out_errcode = errcode;
+                output_buf.clear();
+                above_high_water = false;
+                return false;
+            }
+            if (! output_buf.empty()) {
+                out_state = out_state_t::ARMED;
+                this->set_out_watch_enabled(eloop, true);
+            }
+        }
+        return true;
+    }
+
+    // Check whether the high watermark has been reached. Call with out_lock held.
+    bool check_high_water() noexcept
+    {
+        if (! above_high_water && output_buf.size() >= out_high_water) {
+            above_high_water = true;
+            return true;
+        }
+        return false;
+    }
+
+    // Check whether the low watermark has been reached. Call with out_lock held.
+    bool check_low_water() noexcept
+    {
+        if (above_high_water && output_buf.size() <= out_low_water) {
+            above_high_water = false;
+            return true;
+        }
+        return false;
+    }
+
+    rearm read_ready(EventLoop &eloop, int fd) noexcept
+    {
+        size_t total_read = 0;
+        int errcode = -1; // -1 = no EOF/error
+
+        while (total_read < max_read_per_event) {
+            struct iovec iov[2];
+            int iov_count;
+            try {
+                iov_count = input_buf.get_space_iovecs(iov);
+            }
+            catch (std::bad_alloc &) {
+                if (total_read == 0) {
+                    errcode = ENOMEM;
+                }
+                break;
+            }
+
+            ssize_t r = readv(fd, iov, iov_count);
+            if (r == -1) {
+                if (errno == EINTR) continue;
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    errcode = errno;
+                }
+                break;
+            }
+            if (r == 0) {
+                errcode = 0;
+                break;
+            }
+
+            input_buf.commit(r);
+            total_read += r;
+
+            size_t space = iov[0].iov_len + ((iov_count == 2) ? iov[1].iov_len : 0);
+            if (size_t(r) < space) {
+                // Short read; probably no more data available for now
+                break;
+            }
+        }
+
+        // Don't hold on to an unfilled segment (if pooled) while no data is pending:
+        input_buf.release_space();
+
+        Derived *derived = static_cast<Derived *>(this);
+
+        if (total_read != 0) {
+            rearm r = derived->data_received(eloop, input_buf);
+            if (r != rearm::REARM || errcode == -1) {
+                return r;
+            }
+        }
+
+        if (errcode != -1) {
+            return derived->input_closed(eloop, errcode);
+        }
+
+        return rearm::REARM;
+    }
+
+    rearm write_ready(EventLoop &eloop, int fd) noexcept
+    {
+        out_lock.lock();
+        if (out_state != out_state_t::ARMED) {
+            // spurious (eg failed):
+            out_lock.unlock();
+            return rearm::DISARM;
+        }
+        out_state = out_state_t::ACTIVE;
+
+        int errcode = write_buffered(fd);
+        Derived *derived = static_cast<Derived *>(this);
+
+        if (errcode != 0) {
+            out_state = out_state_t::FAILED;
+            out_errcode = errcode;
+            output_buf.clear();
+            above_high_water = false;
+            out_lock.unlock();
+            return derived->output_error(eloop, errcode);
+        }
+
+        bool low_water = check_low_water();
+
+        if (output_buf.empty()) {
+            // Disable the output watch before we leave the ACTIVE state, so that a concurrent send()
+            // which re-enables it cannot be overridden:
+            this->set_out_watch_enabled(eloop, false);
+            out_state = out_state_t::IDLE;
+            out_lock.unlock();
+            if (low_water) {
+                derived->output_low_water(eloop);
+            }
+            return rearm::NOOP;
+        }
+
+        out_state = out_state_t::ARMED;
+        out_lock.unlock();
+        if (low_water) {
+            derived->output_low_water(eloop);
+        }
+        return rearm::REARM;
+    }
+
+    public:
+
+    // Default handlers (may be hidden by Derived):
+
+    rearm input_closed(EventLoop &eloop, int errcode) noexcept
+    {
+        return rearm::REMOVE;
+    }
+
+    rearm output_error(EventLoop &eloop, int errcode) noexcept
+    {
+        return rearm::DISARM;
+    }
+
+    void output_high_water(EventLoop &eloop) noexcept { }
+
+    void output_low_water(EventLoop &eloop) noexcept { }
+
+    // Register the watcher with an event loop, for input. The file descriptor should be in
+    // non-blocking mode.
+    //
+    // Can fail with std::bad_alloc or std::system_error.
+    void add_watch(EventLoop &eloop, int fd, int inprio = DEFAULT_PRIORITY, int outprio = DEFAULT_PRIORITY)
+    {
+        if (input_buf.empty()) {
+            input_buf.set_pool(&eloop.get_stream_buffer_pool());
+        }
+        if (output_buf.empty()) {
+            output_buf.set_pool(&eloop.get_stream_buffer_pool());
+        }
+        out_state = out_state_t::IDLE;
+        out_errcode = 0;
+        above_high_water = false;
+        bidi_fd_watcher<EventLoop>::add_watch(eloop, fd, IN_EVENTS, inprio, outprio);
+    }
+
+    // Set the output watermarks. When the amount of buffered output rises to at least high, the
+    // output_high_water() handler is called; after that, once it has fallen to at most low, the
+    // output_low_water() handler is called. By default, the high watermark is SIZE_MAX (i.e. the
+    // handlers are not called).
+    void set_output_watermarks(size_t low, size_t high) noexcept
+    {
+        std::lock_guard<mutex_t> guard(out_lock);
+        out_low_water = low;
+        out_high_water = high;
+    }
+
+    // Send data. If there is no output already buffered, as much data as possible is written
+    // immediately; any remaining data is buffered and written when the descriptor becomes ready for
+    // output. Returns true on success, or false if the stream has failed (see get_output_error()).
+    // May throw std::bad_alloc (in which case no data has been buffered, though some data may have
+    // been written).
+    bool send(EventLoop &eloop, const void *data, size_t len)
+    {
+        std::unique_lock<mutex_t> guard(out_lock);
+
+        if (out_state == out_state_t::FAILED) {
+            return false;
+        }
+
+        if (out_state == out_state_t::IDLE && output_buf.empty()) {
+            // Try writing immediately:
+            const char *data_c = static_cast<const char *>(data);
+            while (len > 0) {
+                ssize_t r = write(this->get_watched_fd(), data_c, len);
+                if (r == -1) {
+                    if (errno == EINTR) continue;
+                    if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+                    out_state = out_state_t::FAILED;
+                    out_errcode = errno;
+                    return false;
+                }
+                data_c += r;
+                len -= r;
+            }
+            if (len == 0) {
+                return true;
+            }
+            data = data_c;
+        }
+
+        output_buf.append(data, len);
+        if (! start_output(eloop)) {
+            return false;
+        }
+
+        bool high_water = check_high_water();
+        guard.unlock();
+
+        if (high_water) {
+            static_cast<Derived *>(this)->output_high_water(eloop);
+        }
+        return true;
+    }
+
+    // Buffer data for output, without writing it or enabling the output watch. The data is sent by a
+    // subsequent call to flush() or send(). Buffering a number of small items and then calling
+    // flush() allows them to be written with a single system call. Returns true on success, or false
+    // if the stream has failed. May throw std::bad_alloc (in which case no data has been buffered).
+    bool buffer_output(EventLoop &eloop, const void *data, size_t len)
+    {
+        std::unique_lock<mutex_t> guard(out_lock);
+
+        if (out_state == out_state_t::FAILED) {
+            return false;
+        }
+
+        output_buf.append(data, len);
+
+        bool high_water = check_high_water();
+        guard.unlock();
+
+        if (high_water) {
+            static_cast<Derived *>(this)->output_high_water(eloop);
+        }
+        return true;
+    }
+
+    // Write buffered output (as much as possible immediately, and the remainder when the descriptor
+    // becomes ready for output). Returns true on success, or false if the stream has failed.
+    bool flush(EventLoop &eloop) noexcept
+    {
+        std::unique_lock<mutex_t> guard(out_lock);
+
+        if (! start_output(eloop)) {
+            return false;
+        }
+
+        bool low_water = check_low_water();
+        guard.unlock();
+
+        if (low_water) {
+            static_cast<Derived *>(this)->output_low_water(eloop);
+        }
+        return true;
+    }
+
+    // Get the amount of buffered output.
+    size_t get_output_size() noexcept
+    {
+        std::lock_guard<mutex_t> guard(out_lock);
+        return output_buf.size();
+    }
+
+    // Get the error number for a failed write, or 0 if output has not failed.
+    int get_output_error() noexcept
+    {
+        std::lock_guard<mutex_t> guard(out_lock);
+        return out_errcode;
+    }
+
+    // Get the input buffer. This should only be accessed from within the data_received() handler
+    // or while the input side of the watcher is disabled.
+    stream_buffer &get_input_buffer() noexcept
+    {
+        return input_buf;
+    }
+};
+
+} // namespace dprivate
+} // namespace dasynq
+
+#endif /* DASYNQ_STREAM_H_ */
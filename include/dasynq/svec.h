@@ -1,8 +1,10 @@
 #ifndef DASYNQ_SVEC_H_
 #define DASYNQ_SVEC_H_
 
+#include <algorithm>
 #include <type_traits>
 #include <limits>
+#include <memory>
 #include <utility>
 #include <new>
 
@@ -11,6 +13,9 @@
 // The standard vector (std::vector) only allows shrinking a vector's capacity to its current size. In cases
 // where we need to keep some reserved capacity beyond the current size, we need an alternative solution: hence,
 // this class, svector.
+//
+// Storage is obtained from an allocator (Alloc) meeting the standard Allocator requirements. Allocation
+// failure is reported by the allocator throwing an exception (normally std::bad_alloc).
 
 #if defined(__GNUC__) && !defined(__clang__)
 
@@ -92,33 +97,61 @@ struct move_helper<T, true, __dontcare>
 
 } // namespace svec_helper
 
-template <typename T>
-class svector
+// The allocator is held as a private base class, so that a stateless allocator (such as std::allocator)
+// occupies no space.
+template <typename T, typename Alloc = std::allocator<T>>
+class svector : private std::allocator_traits<Alloc>::template rebind_alloc<T>
 {
 public:
+    using allocator_type = typename std::allocator_traits<Alloc>::template rebind_alloc<T>;
     using size_type = decltype(sizeof(0));
     using pointer = T*;
     using difference_type = decltype(std::declval<pointer>() - std::declval<pointer>());
 
 private:
+    using alloc_traits = std::allocator_traits<allocator_type>;
+
     T * array;
     size_type size_v;
     size_type capacity_v;
 
+    allocator_type &alloc() noexcept
+    {
+        return *this;
+    }
+
+    T *allocate_storage(size_type c) noexcept
+    {
+        if (c == 0) return nullptr;
+        try {
+            return &*alloc_traits::allocate(alloc(), c);
+        }
+        catch (...) {
+            return nullptr;
+        }
+    }
+
+    void free_storage() noexcept
+    {
+        if (array != nullptr) {
+            alloc_traits::deallocate(alloc(), array, capacity_v);
+        }
+    }
+
     bool change_capacity(size_type c)
             noexcept(std::is_nothrow_move_constructible<T>::value || std::is_nothrow_copy_constructible<T>::value)
     {
         NO_LARGE_ALLOC_WARN_ON
 
-        T *new_storage = (T *)(new (std::nothrow) char[c * sizeof(T)]);
-        if (new_storage == nullptr) return false;
+        T *new_storage = allocate_storage(c);
+        if (new_storage == nullptr && c != 0) return false;
 
         NO_LARGE_ALLOC_WARN_OFF
 
         // To transfer, we prefer move unless it is throwing and copy exists
         svec_helper::move_helper<T>::move(array, new_storage, size_v);
 
-        delete[] (char *)array;
+        free_storage();
         array = new_storage;
         capacity_v = c;
 
@@ -153,19 +186,26 @@ private:
 
 public:
 
-    svector() : array(nullptr), size_v(0), capacity_v(0)
+    svector() noexcept(noexcept(allocator_type())) : array(nullptr), size_v(0), capacity_v(0)
+    {
+
+    }
+
+    explicit svector(const Alloc &alloc_p) noexcept
+        : allocator_type(alloc_p), array(nullptr), size_v(0), capacity_v(0)
     {
 
     }
 
     template <typename U = T, typename = typename std::enable_if<std::is_copy_constructible<U>::value>::type>
-    svector(const svector<T> &other)
+    svector(const svector &other)
+        : allocator_type(alloc_traits::select_on_container_copy_construction(other)),
+          array(nullptr), size_v(0), capacity_v(0)
     {
-        capacity_v = other.size_v;
-        size_v = other.size_v;
-        array = new T[capacity_v];
-        for (size_t i = 0; i < size_v; i++) {
-            new (&array[i].elem) T(other[i].elem);
+        reserve(other.size_v);
+        for (size_type i = 0; i < other.size_v; i++) {
+            new (&array[i]) T(other[i]);
+            size_v++;
         }
     }
 
@@ -174,7 +214,12 @@ public:
         for (size_t i = 0; i < size_v; i++) {
             array[i].T::~T();
         }
-        delete[] array;
+        free_storage();
+    }
+
+    allocator_type get_allocator() const noexcept
+    {
+        return *this;
     }
 
     template <typename U = T, typename = typename std::enable_if<std::is_copy_constructible<U>::value>::type>
@@ -183,7 +228,7 @@ public:
         if (!ensure_capacity(size_v + 1)) {
             throw std::bad_alloc();
         }
-        new (&array[size_v].elem) T(t);
+        new (&array[size_v]) T(t);
         size_v++;
     }
 
@@ -193,7 +238,7 @@ public:
         if (!ensure_capacity(size_v + 1)) {
             throw std::bad_alloc();
         }
-        new (&array[size_v].elem) T(t);
+        new (&array[size_v]) T(std::move(t));
         size_v++;
     }
 
@@ -237,13 +282,10 @@ public:
         return size_v == 0;
     }
 
-    static size_t max_size() noexcept
+    size_t max_size() const noexcept
     {
-        return std::numeric_limits<size_type>::max() / sizeof(T);
-
-        // if we were to support allocators:
-        //size_t max = std::allocator_traits<std::allocator<T>>::max_size(std::allocator<T>());
-        //return max;
+        return std::min<size_type>(alloc_traits::max_size(*this),
+                std::numeric_limits<size_type>::max() / sizeof(T));
     }
 
     void reserve(size_t amount)
@@ -255,8 +297,11 @@ public:
         }
     }
 
+    // Reduce capacity to the specified amount (but not below the current size). If memory cannot
+    // be allocated for the reduced capacity, the capacity is left unchanged.
     void shrink_to(size_t amount)
     {
+        if (amount < size_v) amount = size_v;
         if (capacity_v > amount) {
             change_capacity(amount);
         }
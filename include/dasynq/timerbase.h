@@ -184,11 +184,14 @@ class timer_data
 {
     public:
     time_val interval_time; // interval (if 0, one-off timer)
+    time_val extended_time; // extended timeout (valid if extended is true); see extend_timer_nolock
     int expiry_count;  // number of times expired
     bool enabled;   // whether timer reports events
+    bool extended;  // whether timeout has been (lazily) extended to extended_time
     void *userdata;
 
-    timer_data(void *udata = nullptr) noexcept : interval_time(0,0), expiry_count(0), enabled(true), userdata(udata)
+    timer_data(void *udata = nullptr) noexcept : interval_time(0,0), extended_time(0,0), expiry_count(0),
+            enabled(true), extended(false), userdata(udata)
     {
         // constructor
     }
@@ -283,6 +286,12 @@ static inline int divide_timespec(const struct timespec &num, const struct times
 
 template <typename Base> class timer_base : public Base
 {
+    protected:
+    // The timer queue type, using the loop allocator. (The handle type is the same as for the default
+    // timer_queue_t).
+    using timer_queue_t = dary_heap<timer_data, time_val, compare_timespec, 4,
+            typename std::allocator_traits<typename Base::allocator_t>::template rebind_alloc<timer_data>>;
+
     private:
     timer_queue_t timer_queue;
 
@@ -331,6 +340,18 @@ template <typename Base> class timer_base : public Base
         while (*timeout <= curtime_tv) {
             auto & thandle = queue.get_root();
             timer_data &data = queue.node_data(thandle);
+
+            if (data.extended) {
+                // The timeout was lazily extended; if the extended timeout has not yet passed,
+                // move the timer to its correct position in the queue (without expiring it).
+                data.extended = false;
+                if (curtime_tv < data.extended_time) {
+                    queue.set_priority(thandle, data.extended_time);
+                    timeout = &queue.get_root_priority();
+                    continue;
+                }
+            }
+
             time_val &interval = data.interval_time;
             data.expiry_count++;
             queue.pull_root();
@@ -340,7 +361,13 @@ template <typename Base> class timer_base : public Base
                     data.enabled = false;
                     int expiry_count = data.expiry_count;
                     data.expiry_count = 0;
-                    Base::receive_timer_expiry(thandle, data.userdata, expiry_count);
+                    time_val next_timeout;
+                    if (Base::receive_timer_expiry(thandle, data.userdata, expiry_count, curtime_tv,
+                            next_timeout)) {
+                        // The receiver has re-armed the timer (as for a timer group):
+                        data.enabled = true;
+                        queue.insert(thandle, next_timeout);
+                    }
                 }
                 if (queue.empty()) {
                     break;
@@ -470,6 +497,77 @@ template <typename Base> class timer_base : public Base
     }
 #endif
 
+    // Extend the timeout of a timer (which must currently be armed) to a later time, without
+    // altering the timer queue: the new timeout is recorded, and when the original timeout is
+    // reached, the timer is silently moved to its new position in the queue. This makes frequent
+    // extension (as for an idle timeout) cheap. The expiry count is reset and reporting is enabled,
+    // as for set_timer; the interval is unchanged.
+    // Returns false, and does nothing, if the timer is not armed or if the new timeout is earlier
+    // than the current timeout (in which case set_timer should be used instead); in that case,
+    // interval is set to the current timer interval.
+    bool extend_timer_nolock(timer_handle_t &timer_id, const time_val &timeout, time_val &interval,
+            clock_type clock = clock_type::MONOTONIC) noexcept
+    {
+        auto &timer_queue = this->queue_for_clock(clock);
+        auto &ts = timer_queue.node_data(timer_id);
+        if (! timer_queue.is_queued(timer_id) || timeout < timer_queue.get_priority(timer_id)) {
+            interval = ts.interval_time;
+            return false;
+        }
+
+        ts.extended_time = timeout;
+        ts.extended = true;
+        ts.expiry_count = 0;
+        ts.enabled = true;
+        return true;
+    }
+
+    // Set a timer's timeout and interval in the timer queue, without updating the backend timer (if
+    // any). Resets the expiry count to 0. Returns true if the timer has become the first timer in the
+    // queue, in which case the backend timer must be updated (see update_timer_nolock in the timer
+    // backend). Call with lock held.
+    bool queue_timer_nolock(timer_handle_t &timer_id, const time_val &timeout, const time_val &interval,
+            bool enable, clock_type clock = clock_type::MONOTONIC) noexcept
+    {
+        auto &timer_queue = this->queue_for_clock(clock);
+        auto &ts = timer_queue.node_data(timer_id);
+        ts.interval_time = interval;
+        ts.expiry_count = 0;
+        ts.enabled = enable;
+        ts.extended = false;
+
+        if (timer_queue.is_queued(timer_id)) {
+            // Already queued; alter timeout
+            return timer_queue.set_priority(timer_id, timeout);
+        }
+        else {
+            return timer_queue.insert(timer_id, timeout);
+        }
+    }
+
+    // Remove a timer from the timer queue, without updating the backend timer (if any). Returns true
+    // if the timer was the first timer in the queue, in which case the backend timer should be
+    // updated. Call with lock held.
+    bool unqueue_timer_nolock(timer_handle_t &timer_id, clock_type clock = clock_type::MONOTONIC) noexcept
+    {
+        auto &timer_queue = this->queue_for_clock(clock);
+        if (timer_queue.is_queued(timer_id)) {
+            bool was_first = (&timer_queue.get_root()) == &timer_id;
+            timer_queue.remove(timer_id);
+            return was_first;
+        }
+        return false;
+    }
+
+    // Pre-allocate capacity for the specified total number of timers, for each clock.
+    void reserve_timers_nolock(size_t amount)
+    {
+        timer_queue.reserve(amount);
+#if defined(CLOCK_MONOTONIC)
+        mono_timer_queue.reserve(amount);
+#endif
+    }
+
     void add_timer_nolock(timer_handle_t &h, void *userdata, clock_type clock = clock_type::MONOTONIC)
     {
         this->queue_for_clock(clock).allocate(h, userdata);
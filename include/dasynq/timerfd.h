@@ -22,21 +22,28 @@ namespace dasynq {
 // we are given a handle; we need to use this to modify the watch. We delegate the
 // process of allocating a handle to a priority heap implementation (BinaryHeap).
 
+// If provide_sys_timer is false, no separate timerfd is used for the system clock; system clock timers
+// are instead run from the monotonic clock timerfd, set for the earlier of the first monotonic timer and
+// the (converted) time of the first system clock timer. In that case, system clock timers will not
+// respond correctly to adjustments of the system time.
 
-template <class Base> class timer_fd_events;
+template <class Base, bool provide_sys_timer = true> class timer_fd_events;
 
-template <typename Base>
+template <typename Base, bool provide_sys_timer = true>
 struct timer_fd_traits : public Base
 {
-    template <typename T> using backend_tmpl = timer_fd_events<typename Base::template backend_tmpl<T>>;
+    template <typename T> using backend_tmpl
+            = timer_fd_events<typename Base::template backend_tmpl<T>, provide_sys_timer>;
 };
 
-template <class Base> class timer_fd_events : public timer_base<Base>
+template <class Base, bool provide_sys_timer> class timer_fd_events : public timer_base<Base>
 {
+    using timer_queue_t = typename timer_base<Base>::timer_queue_t;
+
     private:
     int timerfd_fd = -1;
     int systemtime_fd = -1;
-    
+
     // Set the timerfd timeout to match the first timer in the queue (disable the timerfd
     // if there are no active timers).
     static void set_timer_from_queue(int fd, timer_queue_t &queue) noexcept
@@ -53,7 +60,48 @@ template <class Base> class timer_fd_events : public timer_base<Base>
         timerfd_settime(fd, TFD_TIMER_ABSTIME, &newtime, nullptr);
     }
     
-    void process_timer(clock_type clock, int fd) noexcept
+    // Set the monotonic timerfd timeout to match the first monotonic timer, or, if there is no separate
+    // system clock timer, the first system clock timer if it is earlier.
+    void set_mono_timer() noexcept
+    {
+        auto &mono_queue = this->queue_for_clock(clock_type::MONOTONIC);
+        auto &sys_queue = this->queue_for_clock(clock_type::SYSTEM);
+        if (provide_sys_timer || sys_queue.empty()) {
+            set_timer_from_queue(timerfd_fd, mono_queue);
+            return;
+        }
+
+        time_val now_sys;
+        time_val timeout;
+        this->get_time(now_sys, clock_type::SYSTEM, true);
+        this->get_time(timeout, clock_type::MONOTONIC, true);
+        const time_val &sys_timeout = sys_queue.get_root_priority();
+        if (now_sys < sys_timeout) {
+            timeout += sys_timeout - now_sys;
+        }
+        if (! mono_queue.empty() && mono_queue.get_root_priority() < timeout) {
+            timeout = mono_queue.get_root_priority();
+        }
+
+        struct itimerspec newtime;
+        newtime.it_value = timeout;
+        newtime.it_interval = {0, 0};
+        timerfd_settime(timerfd_fd, TFD_TIMER_ABSTIME, &newtime, nullptr);
+    }
+    
+    void close_timerfds() noexcept
+    {
+        if (timerfd_fd != -1) {
+            close(timerfd_fd);
+            timerfd_fd = -1;
+        }
+        if (systemtime_fd != -1) {
+            close(systemtime_fd);
+            systemtime_fd = -1;
+        }
+    }
+
+    void process_timer(clock_type clock) noexcept
     {
         timer_queue_t &queue = this->queue_for_clock(clock);
         struct timespec curtime;
@@ -69,42 +117,13 @@ template <class Base> class timer_fd_events : public timer_base<Base>
         }
 
         timer_base<Base>::process_timer_queue(queue, curtime);
-
-        // arm timerfd with timeout from head of queue
-        set_timer_from_queue(fd, queue);
-    }
-
-    void set_timer(timer_handle_t & timer_id, const time_val &timeouttv, const time_val &intervaltv,
-            timer_queue_t &queue, int fd, bool enable) noexcept
-    {
-        timespec timeout = timeouttv;
-        timespec interval = intervaltv;
-
-        std::lock_guard<decltype(Base::lock)> guard(Base::lock);
-
-        auto &ts = queue.node_data(timer_id);
-        ts.interval_time = interval;
-        ts.expiry_count = 0;
-        ts.enabled = enable;
-
-        if (queue.is_queued(timer_id)) {
-            // Already queued; alter timeout
-            if (queue.set_priority(timer_id, timeout)) {
-                set_timer_from_queue(fd, queue);
-            }
-        }
-        else {
-            if (queue.insert(timer_id, timeout)) {
-                set_timer_from_queue(fd, queue);
-            }
-        }
     }
 
     public:
 
     class traits_t : public Base::traits_t
     {
-        constexpr static bool full_timer_support = true;
+        constexpr static bool full_timer_support = provide_sys_timer;
     };
 
     template <typename T>
@@ -112,12 +131,18 @@ template <class Base> class timer_fd_events : public timer_base<Base>
     receive_fd_event(T &loop_mech, typename traits_t::fd_r fd_r_a, void * userdata, int flags)
     {
         if (userdata == &timerfd_fd) {
-            process_timer(clock_type::MONOTONIC, timerfd_fd);
+            process_timer(clock_type::MONOTONIC);
+            if (! provide_sys_timer) {
+                process_timer(clock_type::SYSTEM);
+            }
+            // arm timerfd with timeout from head of queue
+            set_mono_timer();
             unsigned re_enable = (Base::traits_t::supports_non_oneshot_fd ? 0 : IN_EVENTS);
             return std::make_tuple(re_enable, typename traits_t::fd_s(timerfd_fd));
         }
         else if (userdata == &systemtime_fd) {
-            process_timer(clock_type::SYSTEM, systemtime_fd);
+            process_timer(clock_type::SYSTEM);
+            set_timer_from_queue(systemtime_fd, this->queue_for_clock(clock_type::SYSTEM));
             unsigned re_enable = (Base::traits_t::supports_non_oneshot_fd ? 0 : IN_EVENTS);
             return std::make_tuple(re_enable, typename traits_t::fd_s(systemtime_fd));
         }
@@ -128,33 +153,50 @@ template <class Base> class timer_fd_events : public timer_base<Base>
 
     template <typename T> void init(T *loop_mech)
     {
-        timerfd_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
-        if (timerfd_fd == -1) {
-            throw std::system_error(errno, std::system_category());
+        init(loop_mech, true);
+    }
+
+    protected:
+
+    // Initialise, optionally without the monotonic clock timerfd (for a derived mechanism which
+    // implements monotonic timers by other means; requires provide_sys_timer).
+    template <typename T> void init(T *loop_mech, bool mono_timerfd)
+    {
+        if (mono_timerfd) {
+            timerfd_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+            if (timerfd_fd == -1) {
+                throw std::system_error(errno, std::system_category());
+            }
         }
-        systemtime_fd = timerfd_create(CLOCK_REALTIME, TFD_CLOEXEC | TFD_NONBLOCK);
-        if (systemtime_fd == -1) {
-            close (timerfd_fd);
-            throw std::system_error(errno, std::system_category());
+        if (provide_sys_timer) {
+            systemtime_fd = timerfd_create(CLOCK_REALTIME, TFD_CLOEXEC | TFD_NONBLOCK);
+            if (systemtime_fd == -1) {
+                close_timerfds();
+                throw std::system_error(errno, std::system_category());
+            }
         }
 
         try {
-            loop_mech->add_fd_watch(timerfd_fd, &timerfd_fd, IN_EVENTS);
-            loop_mech->add_fd_watch(systemtime_fd, &systemtime_fd, IN_EVENTS);
+            if (mono_timerfd) {
+                loop_mech->add_fd_watch(timerfd_fd, &timerfd_fd, IN_EVENTS);
+            }
+            if (provide_sys_timer) {
+                loop_mech->add_fd_watch(systemtime_fd, &systemtime_fd, IN_EVENTS);
+            }
             Base::init(loop_mech);
         }
         catch (...) {
-            close(timerfd_fd);
-            close(systemtime_fd);
+            close_timerfds();
             throw;
         }
     }
 
+    public:
+
     void cleanup() noexcept
     {
         Base::cleanup();
-        close(timerfd_fd);
-        close(systemtime_fd);
+        close_timerfds();
     }
 
     void stop_timer(timer_handle_t &timer_id, clock_type clock = clock_type::MONOTONIC) noexcept
@@ -165,35 +207,31 @@ template <class Base> class timer_fd_events : public timer_base<Base>
 
     void stop_timer_nolock(timer_handle_t &timer_id, clock_type clock = clock_type::MONOTONIC) noexcept
     {
-        timer_queue_t &queue = this->queue_for_clock(clock);
-        int fd = (clock == clock_type::MONOTONIC) ? timerfd_fd : systemtime_fd;
-        if (queue.is_queued(timer_id)) {
-            bool was_first = (&queue.get_root()) == &timer_id;
-            queue.remove(timer_id);
-            if (was_first) {
-                set_timer_from_queue(fd, queue);
-            }
+        if (this->unqueue_timer_nolock(timer_id, clock)) {
+            update_timer_nolock(clock);
+        }
+    }
+
+    // Update the timer for the specified clock to match the first timer in its queue (after
+    // queue_timer_nolock or unqueue_timer_nolock has reported a change). Call with lock held.
+    void update_timer_nolock(clock_type clock) noexcept
+    {
+        if (clock == clock_type::SYSTEM && provide_sys_timer) {
+            set_timer_from_queue(systemtime_fd, this->queue_for_clock(clock));
+        }
+        else {
+            set_mono_timer();
         }
     }
 
     // starts (if not started) a timer to timeout at the given time. Resets the expiry count to 0.
     //   enable: specifies whether to enable reporting of timeouts/intervals
-    void set_timer(timer_handle_t & timer_id, const time_val &timeouttv, const time_val &intervaltv,
+    void set_timer(timer_handle_t & timer_id, const time_val &timeout, const time_val &interval,
             bool enable, clock_type clock = clock_type::MONOTONIC) noexcept
     {
-        timespec timeout = timeouttv;
-        timespec interval = intervaltv;
-        timer_queue_t &queue = this->queue_for_clock(clock);
-
-        switch (clock) {
-        case clock_type::SYSTEM:
-            set_timer(timer_id, timeout, interval, queue, systemtime_fd, enable);
-            break;
-        case clock_type::MONOTONIC:
-            set_timer(timer_id, timeout, interval, queue, timerfd_fd, enable);
-            break;
-        default:
-            DASYNQ_UNREACHABLE;
+        std::lock_guard<decltype(Base::lock)> guard(Base::lock);
+        if (this->queue_timer_nolock(timer_id, timeout, interval, enable, clock)) {
+            update_timer_nolock(clock);
         }
     }
 
@@ -0,0 +1,604 @@
+#ifndef DASYNQ_TRANSFER_H_
+#define DASYNQ_TRANSFER_H_
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <system_error>
+
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#if DASYNQ_HAVE_SENDFILE
+#include <sys/sendfile.h>
+#endif
+
+// Transfer watcher.
+//
+// A transfer_watcher moves data from a source file descriptor to a sink file descriptor (and, for a
+// bidirectional transfer between two sockets, from the sink back to the source), without the data
+// being processed by the application. Where splice(2) is available (Linux), data is moved through an
+// internal pipe using splice, so that it is never copied to or from user space. A regular file can be
+// transferred to a sink using sendfile(2), where available. Otherwise, data is moved via a user-space
+// buffer using read and write.
+//
+// Each of the two descriptors is watched using a bidi_fd_watcher ("endpoint"). The input side of the
+// source endpoint is enabled only while the pipe has space, and the output side of the sink endpoint
+// is enabled only while the pipe has data, so that the watched events follow the pipe filling and
+// draining.
+//
+// This header is included by dasynq.h; it should not be included directly.
+
+namespace dasynq {
+
+// Status reported by a transfer watcher (see transfer_watcher_impl):
+enum class transfer_status
+{
+    PROGRESS,  // data has been transferred
+    COMPLETE,  // end-of-file reached on the source, and all data written to the sink
+    FAILED     // an error occurred (see get_error())
+};
+
+namespace dprivate {
+
+// The buffer for one direction of a transfer: a pipe (when splice is available) or a user-space
+// buffer.
+class transfer_buffer
+{
+    static constexpr size_t default_capacity = 65536;
+
+    size_t capacity = default_capacity;
+    size_t length = 0;
+
+#if DASYNQ_HAVE_SPLICE
+    int pipe_fds[2] = { -1, -1 };
+#else
+    std::unique_ptr<char[]> buf;
+    size_t start = 0;
+#endif
+
+    public:
+    transfer_buffer() noexcept { }
+    transfer_buffer(const transfer_buffer &) = delete;
+    transfer_buffer &operator=(const transfer_buffer &) = delete;
+
+    ~transfer_buffer()
+    {
+        close_buffer();
+    }
+
+    // Allocate the buffer; throws std::system_error or std::bad_alloc.
+    void open_buffer()
+    {
+#if DASYNQ_HAVE_SPLICE
+        if (pipe2(pipe_fds, O_CLOEXEC | O_NONBLOCK) == -1) {
+            throw std::system_error(errno, std::system_category());
+        }
+#ifdef F_GETPIPE_SZ
+        int pipe_sz = fcntl(pipe_fds[1], F_GETPIPE_SZ);
+        if (pipe_sz > 0) {
+            capacity = pipe_sz;
+        }
+#endif
+#else
+        buf.reset(new char[capacity]);
+        start = 0;
+#endif
+        length = 0;
+    }
+
+    void close_buffer() noexcept
+    {
+#if DASYNQ_HAVE_SPLICE
+        if (pipe_fds[0] != -1) {
+            close(pipe_fds[0]);
+            close(pipe_fds[1]);
+            pipe_fds[0] = pipe_fds[1] = -1;
+        }
+#else
+        buf.reset();
+#endif
+    }
+
+    // Amount of data in the buffer:
+    size_t size() const noexcept
+    {
+        return length;
+    }
+
+    // Whether the buffer can accept more data:
+    bool has_space() const noexcept
+    {
+#if DASYNQ_HAVE_SPLICE
+        return length < capacity;
+#else
+        return start + length < capacity;
+#endif
+    }
+
+    // Read from fd into the buffer; returns as for read().
+    ssize_t fill(int fd) noexcept
+    {
+#if DASYNQ_HAVE_SPLICE
+        ssize_t r = splice(fd, nullptr, pipe_fds[1], nullptr, capacity - length,
+                SPLICE_F_NONBLOCK | SPLICE_F_MOVE);
+#else
+        ssize_t r = read(fd, buf.get() + start + length, capacity - start - length);
+#endif
+        if (r > 0) length += r;
+        return r;
+    }
+
+    // Read from a (regular) file at the specified offset into the buffer, reading at most max_len
+    // bytes; returns as for pread().
+    ssize_t fill_file(int fd, off_t offset, size_t max_len) noexcept
+    {
+#if DASYNQ_HAVE_SPLICE
+        loff_t off = offset;
+        size_t len = std::min(max_len, capacity - length);
+        ssize_t r = splice(fd, &off, pipe_fds[1], nullptr, len, SPLICE_F_NONBLOCK | SPLICE_F_MOVE);
+#else
+        size_t len = std::min(max_len, capacity - start - length);
+        ssize_t r = pread(fd, buf.get() + start + length, len, offset);
+#endif
+        if (r > 0) length += r;
+        return r;
+    }
+
+    // Write from the buffer to fd; returns as for write().
+    ssize_t drain(int fd) noexcept
+    {
+#if DASYNQ_HAVE_SPLICE
+        ssize_t r = splice(pipe_fds[0], nullptr, fd, nullptr, length, SPLICE_F_NONBLOCK | SPLICE_F_MOVE);
+        if (r > 0) length -= r;
+#else
+        ssize_t r = write(fd, buf.get() + start, length);
+        if (r > 0) {
+            length -= r;
+            start = (length == 0) ? 0 : (start + r);
+        }
+#endif
+        return r;
+    }
+};
+
+// A transfer watcher. Moves data from a source descriptor to a sink descriptor, and optionally (for
+// sockets) in the reverse direction as well. The descriptors should be in non-blocking mode.
+//
+// The Derived class must provide:
+//
+//     rearm transfer_event(EventLoop &eloop, int channel, size_t bytes, transfer_status status)
+//         - called when data has been transferred (bytes is the amount transferred since the previous
+//           call for the channel) and/or when the transfer in one direction completes or fails.
+//           channel is 0 for the source-to-sink direction, and 1 for the sink-to-source direction
+//           (bidirectional transfers only). Return rearm::REMOVE to remove the watcher (both
+//           directions), or rearm::REARM to continue.
+//
+// and may provide:
+//
+//     void watch_removed() noexcept
+//         - called when the watcher has been removed from the event loop (the default does nothing).
+//
+// Completion of a direction does not shut down or close the sink; the handler can do that if
+// appropriate (eg via shutdown(fd, SHUT_WR)).
+template <typename EventLoop, typename Derived>
+class transfer_watcher_impl
+{
+    using mutex_t = typename EventLoop::mutex_t;
+
+    // Maximum amount of data to transfer in one direction in response to a single event:
+    static constexpr size_t max_transfer_per_event = 1024 * 1024;
+
+    // A watched descriptor:
+    class endpoint : public bidi_fd_watcher_impl<EventLoop, endpoint>
+    {
+        friend class bidi_fd_watcher_impl<EventLoop, endpoint>;
+
+        rearm read_ready(EventLoop &eloop, int fd) noexcept
+        {
+            return owner->endpoint_ready(eloop, index, IN_EVENTS);
+        }
+
+        rearm write_ready(EventLoop &eloop, int fd) noexcept
+        {
+            return owner->endpoint_ready(eloop, index, OUT_EVENTS);
+        }
+
+        public:
+        transfer_watcher_impl *owner;
+        int index;
+        bool in_enabled = false;
+        bool out_enabled = false;
+
+        void watch_removed() noexcept override
+        {
+            owner->endpoint_removed();
+        }
+    };
+
+    // State of one direction of the transfer:
+    struct channel
+    {
+        dprivate::transfer_buffer buffer;
+        int src_ep;        // source endpoint (index), -1 for file source
+        int sink_ep;       // sink endpoint (index)
+        bool active = false;
+        bool eof = false;
+        bool reported_done = false;
+        int errcode = 0;
+
+        // for a file source:
+        int file_fd = -1;
+        off_t file_offset = 0;
+        size_t file_remaining = 0;
+        bool use_sendfile = false;
+
+        size_t total_bytes = 0;
+    };
+
+    endpoint endpoints[2];
+    channel channels[2];
+    int num_endpoints = 0;
+    int removed_endpoints = 0;
+
+    mutex_t xfer_lock;
+
+    // Move data for a channel. Returns the number of bytes written to the sink. Call with xfer_lock
+    // held.
+    size_t pump(channel &ch) noexcept
+    {
+        int src_fd = (ch.src_ep == -1) ? -1 : endpoints[ch.src_ep].get_watched_fd();
+        int sink_fd = endpoints[ch.sink_ep].get_watched_fd();
+        size_t moved = 0;
+
+        while (ch.errcode == 0 && moved < max_transfer_per_event) {
+            bool progress = false;
+
+#if DASYNQ_HAVE_SENDFILE
+            if (ch.use_sendfile) {
+                if (ch.file_remaining == 0) {
+                    ch.eof = true;
+                    break;
+                }
+                size_t len = std::min(ch.file_remaining, max_transfer_per_event - moved);
+                ssize_t r = sendfile(sink_fd, ch.file_fd, &ch.file_offset, len);
+                if (r > 0) {
+                    ch.file_remaining -= r;
+                    moved += r;
+                    continue;
+                }
+                if (r == 0) {
+                    ch.eof = true; // file truncated?
+                }
+                else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                    ch.errcode = errno;
+                }
+                if (r == 0 || errno != EINTR) break;
+                continue;
+            }
+#endif
+
+            // Fill the buffer from the source:
+            while (! ch.eof && ch.buffer.has_space()) {
+                ssize_t r;
+                if (ch.file_fd != -1) {
+                    if (ch.file_remaining == 0) {
+                        ch.eof = true;
+                        break;
+                    }
+                    r = ch.buffer.fill_file(ch.file_fd, ch.file_offset, ch.file_remaining);
+                    if (r > 0) {
+                        ch.file_offset += r;
+                        ch.file_remaining -= r;
+                    }
+                }
+                else {
+                    r = ch.buffer.fill(src_fd);
+                }
+
+                if (r > 0) {
+                    progress = true;
+                }
+                else if (r == 0) {
+                    ch.eof = true;
+                }
+                else if (errno == EINTR) {
+                    continue;
+                }
+                else {
+                    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                        ch.errcode = errno;
+                    }
+                    break;
+                }
+            }
+
+            // Drain the buffer to the sink:
+            while (ch.errcode == 0 && ch.buffer.size() != 0) {
+                ssize_t r = ch.buffer.drain(sink_fd);
+                if (r > 0) {
+                    moved += r;
+                    progress = true;
+                }
+                else if (r == -1 && errno == EINTR) {
+                    continue;
+                }
+                else {
+                    if (r == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+                        ch.errcode = errno;
+                    }
+                    break;
+                }
+            }
+
+            if (! progress) break;
+        }
+
+        ch.total_bytes += moved;
+        return moved;
+    }
+
+    // Whether the source/sink of a channel should be watched. Call with xfer_lock held.
+    static bool want_source(const channel &ch) noexcept
+    {
+        return ch.active && ch.src_ep != -1 && ! ch.eof && ch.errcode == 0 && ch.buffer.has_space();
+    }
+
+    static bool want_sink(const channel &ch) noexcept
+    {
+        if (! ch.active || ch.errcode != 0) return false;
+        if (ch.use_sendfile) return ! ch.eof;
+        return ch.buffer.size() != 0;
+    }
+
+    // Update the enabled input/output watches of the endpoints, except for the one whose handler
+    // is currently running (identified by ep_index and dir), for which the required state is
+    // returned (as true to enable). Call with xfer_lock held.
+    bool update_watches(EventLoop &eloop, int ep_index, int dir) noexcept
+    {
+        bool self_enable = false;
+        for (int i = 0; i < num_endpoints; i++) {
+            endpoint &ep = endpoints[i];
+            bool want_in = false;
+            bool want_out = false;
+            for (channel &ch : channels) {
+                if (! ch.active) continue;
+                if (ch.src_ep == i) want_in = want_in || want_source(ch);
+                if (ch.sink_ep == i) want_out = want_out || want_sink(ch);
+            }
+
+            if (i == ep_index && dir == IN_EVENTS) {
+                self_enable = want_in;
+                ep.in_enabled = want_in;
+            }
+            else if (ep.in_enabled != want_in) {
+                ep.in_enabled = want_in;
+                ep.set_in_watch_enabled(eloop, want_in);
+            }
+
+            if (i == ep_index && dir == OUT_EVENTS) {
+                self_enable = want_out;
+                ep.out_enabled = want_out;
+            }
+            else if (ep.out_enabled != want_out) {
+                ep.out_enabled = want_out;
+                ep.set_out_watch_enabled(eloop, want_out);
+            }
+        }
+        return self_enable;
+    }
+
+    rearm endpoint_ready(EventLoop &eloop, int ep_index, int dir) noexcept
+    {
+        size_t moved[2] = { 0, 0 };
+        transfer_status status[2] = { transfer_status::PROGRESS, transfer_status::PROGRESS };
+        bool report[2] = { false, false };
+
+        xfer_lock.lock();
+
+        for (int c = 0; c < 2; c++) {
+            channel &ch = channels[c];
+            if (! ch.active) continue;
+            if ((dir == IN_EVENTS && ch.src_ep != ep_index) || (dir == OUT_EVENTS && ch.sink_ep != ep_index)) {
+                continue;
+            }
+
+            moved[c] = pump(ch);
+            report[c] = (moved[c] != 0);
+            if (ch.errcode != 0) {
+                status[c] = transfer_status::FAILED;
+            }
+            else if (ch.eof && ch.buffer.size() == 0) {
+                status[c] = transfer_status::COMPLETE;
+            }
+            if (status[c] != transfer_status::PROGRESS && ! ch.reported_done) {
+                ch.reported_done = true;
+                report[c] = true;
+            }
+        }
+
+        bool self_enable = update_watches(eloop, ep_index, dir);
+
+        xfer_lock.unlock();
+
+        Derived *derived = static_cast<Derived *>(this);
+        for (int c = 0; c < 2; c++) {
+            if (report[c]) {
+                rearm r = derived->transfer_event(eloop, c, moved[c], status[c]);
+                if (r == rearm::REMOVE) {
+                    deregister(eloop);
+                    return rearm::REMOVE;
+                }
+            }
+        }
+
+        return self_enable ? rearm::REARM : rearm::DISARM;
+    }
+
+    void endpoint_removed() noexcept
+    {
+        xfer_lock.lock();
+        bool all_removed = (++removed_endpoints == num_endpoints);
+        xfer_lock.unlock();
+
+        if (all_removed) {
+            for (channel &ch : channels) {
+                ch.buffer.close_buffer();
+                ch.active = false;
+            }
+            static_cast<Derived *>(this)->watch_removed();
+        }
+    }
+
+    void init_endpoints(int count) noexcept
+    {
+        num_endpoints = count;
+        removed_endpoints = 0;
+        for (int i = 0; i < 2; i++) {
+            endpoints[i].owner = this;
+            endpoints[i].index = i;
+            endpoints[i].in_enabled = false;
+            endpoints[i].out_enabled = false;
+            channels[i].active = false;
+            channels[i].eof = false;
+            channels[i].reported_done = false;
+            channels[i].errcode = 0;
+            channels[i].file_fd = -1;
+            channels[i].use_sendfile = false;
+            channels[i].total_bytes = 0;
+        }
+    }
+
+    // Register the endpoints; on failure, all are removed and the exception is rethrown.
+    void register_endpoints(EventLoop &eloop, int *fds, int prio)
+    {
+        int flags[2] = { 0, 0 };
+        for (int i = 0; i < num_endpoints; i++) {
+            flags[i] = (endpoints[i].in_enabled ? IN_EVENTS : 0) | (endpoints[i].out_enabled ? OUT_EVENTS : 0);
+        }
+
+        int registered = 0;
+        try {
+            for ( ; registered < num_endpoints; registered++) {
+                endpoints[registered].add_watch(eloop, fds[registered], flags[registered], prio, prio);
+            }
+        }
+        catch (...) {
+            // Removal notifications for the endpoints already registered must be ignored:
+            num_endpoints = -1;
+            for (int i = 0; i < registered; i++) {
+                endpoints[i].deregister(eloop);
+            }
+            for (channel &ch : channels) {
+                ch.buffer.close_buffer();
+                ch.active = false;
+            }
+            throw;
+        }
+    }
+
+    public:
+
+    // Default handler (may be hidden by Derived):
+    void watch_removed() noexcept { }
+
+    transfer_watcher_impl() noexcept { }
+    transfer_watcher_impl(const transfer_watcher_impl &) = delete;
+    transfer_watcher_impl &operator=(const transfer_watcher_impl &) = delete;
+
+    // Start a transfer from src_fd to sink_fd (and, if bidirectional is true, from sink_fd to
+    // src_fd). The descriptors must be different, and should be non-blocking; they must not be
+    // watched by any other watcher.
+    //
+    // Can fail with std::bad_alloc or std::system_error.
+    void add_watch(EventLoop &eloop, int src_fd, int sink_fd, bool bidirectional = false,
+            int prio = DEFAULT_PRIORITY)
+    {
+        init_endpoints(2);
+
+        channels[0].src_ep = 0;
+        channels[0].sink_ep = 1;
+        channels[0].buffer.open_buffer();
+        channels[0].active = true;
+        endpoints[0].in_enabled = true;
+
+        if (bidirectional) {
+            channels[1].src_ep = 1;
+            channels[1].sink_ep = 0;
+            try {
+                channels[1].buffer.open_buffer();
+            }
+            catch (...) {
+                channels[0].buffer.close_buffer();
+                channels[0].active = false;
+                throw;
+            }
+            channels[1].active = true;
+            endpoints[1].in_enabled = true;
+        }
+
+        int fds[2] = { src_fd, sink_fd };
+        register_endpoints(eloop, fds, prio);
+    }
+
+    // Start a transfer of count bytes from a regular file (file_fd), beginning at the specified
+    // offset, to sink_fd. The file descriptor is not watched (and its file position is not used or
+    // changed). The sink should be non-blocking, and must not be watched by any other watcher.
+    //
+    // Can fail with std::bad_alloc or std::system_error.
+    void add_file_watch(EventLoop &eloop, int file_fd, off_t offset, size_t count, int sink_fd,
+            int prio = DEFAULT_PRIORITY)
+    {
+        init_endpoints(1);
+
+        channel &ch = channels[0];
+        ch.src_ep = -1;
+        ch.sink_ep = 0;
+        ch.file_fd = file_fd;
+        ch.file_offset = offset;
+        ch.file_remaining = count;
+#if DASYNQ_HAVE_SENDFILE
+        ch.use_sendfile = true;
+#else
+        ch.buffer.open_buffer();
+#endif
+        ch.active = true;
+        endpoints[0].out_enabled = true;
+
+        int fds[1] = { sink_fd };
+        register_endpoints(eloop, fds, prio);
+    }
+
+    // Remove the watcher from the event loop. The watch_removed() handler will be called once
+    // removal is complete (see bidi_fd_watcher::deregister).
+    void deregister(EventLoop &eloop) noexcept
+    {
+        int n = num_endpoints;
+        for (int i = 0; i < n; i++) {
+            endpoints[i].deregister(eloop);
+        }
+    }
+
+    // Get the total number of bytes transferred in a direction (0 = source to sink, 1 = sink to
+    // source).
+    size_t get_bytes_transferred(int channel_num) noexcept
+    {
+        std::lock_guard<mutex_t> guard(xfer_lock);
+        return channels[channel_num].total_bytes;
+    }
+
+    // Get the error number for a failed direction, or 0.
+    int get_error(int channel_num) noexcept
+    {
+        std::lock_guard<mutex_t> guard(xfer_lock);
+        return channels[channel_num].errcode;
+    }
+};
+
+} // namespace dprivate
+} // namespace dasynq
+
+#endif /* DASYNQ_TRANSFER_H_ */
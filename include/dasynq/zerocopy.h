@@ -0,0 +1,465 @@
+#ifndef DASYNQ_ZEROCOPY_H_
+#define DASYNQ_ZEROCOPY_H_
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <mutex>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <unistd.h>
+
+#if DASYNQ_HAVE_MSG_ZEROCOPY
+#include <linux/errqueue.h>
+#endif
+
+// Zero-copy send watcher.
+//
+// A zerocopy_watcher sends data from user buffers on a (non-blocking) stream socket. On Linux, large
+// sends use MSG_ZEROCOPY, so that the data is transmitted directly from the user's buffer rather than
+// being copied into the socket. The kernel reports when it has finished with each such send via the
+// socket's error queue (which makes the socket readable, i.e. it is reported to the input side of the
+// watcher); a buffer is released back to the user (via a callback) only once all sends from it have
+// been completed.
+//
+// Zero-copy is not used for sends smaller than a threshold (for which copying is cheaper than the
+// page pinning and notification overhead), if the socket doesn't support it, or once the kernel
+// reports that it had to copy the data anyway (eg. for loopback connections); in those cases data is
+// sent normally and the buffer is released as soon as it has been written.
+//
+// This header is included by dasynq.h; it should not be included directly.
+
+namespace dasynq {
+namespace dprivate {
+
+#if DASYNQ_HAVE_MSG_ZEROCOPY && defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY) && defined(SO_EE_ORIGIN_ZEROCOPY)
+constexpr bool have_msg_zerocopy = true;
+constexpr int msg_zerocopy_flag = MSG_ZEROCOPY;
+#else
+constexpr bool have_msg_zerocopy = false;
+constexpr int msg_zerocopy_flag = 0;
+#endif
+
+#ifdef MSG_NOSIGNAL
+constexpr int msg_nosignal_flag = MSG_NOSIGNAL;
+#else
+constexpr int msg_nosignal_flag = 0;
+#endif
+
+// A zero-copy send watcher. The Derived class must provide:
+//
+//     void send_complete(EventLoop &eloop, const void *data, size_t len)
+//         - called when the kernel has finished with a buffer passed to send(), which may then be
+//           re-used or freed. Buffers are released in the order they were sent. This may be called
+//           from within send() (if the data could be written, or was copied, immediately).
+//
+// and may provide (defaults are provided):
+//
+//     rearm input_ready(EventLoop &eloop, int fd)
+//         - called when the socket may be readable, if input has been enabled with
+//           set_input_enabled(). Return rearm::REARM to continue watching for input, or rearm::DISARM
+//           to stop. Note that while zero-copy sends are outstanding, the input side of the watcher
+//           remains enabled to receive completion notifications; unread input will then cause
+//           repeated wakeups, so input should be read (or the peer should not send any).
+//     void send_error(EventLoop &eloop, int errcode)
+//         - called if sending fails (in the output handler). Unsent data is discarded (its buffers
+//           are released) and subsequent send() calls fail.
+template <typename EventLoop, typename Derived>
+class zerocopy_watcher_impl : public bidi_fd_watcher_impl<EventLoop, zerocopy_watcher_impl<EventLoop, Derived>>
+{
+    template <typename, typename> friend class bidi_fd_watcher_impl;
+
+    using mutex_t = typename EventLoop::mutex_t;
+
+    // Maximum number of buffers released (with the lock released) in one batch:
+    static constexpr int release_batch = 16;
+
+    struct send_req
+    {
+        const char *data;
+        size_t len;
+        size_t sent;
+        uint32_t last_seq;  // sequence number of last zero-copy send from this buffer (if zc_used)
+        bool zc_used;
+    };
+
+    // State of each side of the watcher:
+    enum class watch_state_t
+    {
+        IDLE,    // watch disabled
+        ARMED,   // watch enabled
+        ACTIVE   // handler running
+    };
+
+    // protects all the following:
+    mutex_t zc_lock;
+
+    std::deque<send_req> reqs;  // buffers not yet released, in order
+    size_t num_sent = 0;        // number of buffers (from the front) fully sent
+
+    watch_state_t in_state = watch_state_t::IDLE;
+    watch_state_t out_state = watch_state_t::IDLE;
+    bool input_wanted = false;
+
+    bool zc_enabled = false;    // zero-copy enabled on socket, and worthwhile
+    size_t zc_threshold = 10240;
+    uint32_t next_seq = 0;      // notification sequence number for next zero-copy send
+    uint32_t completed_seq = 0; // all sends with prior sequence numbers have been completed
+
+    bool failed = false;
+    int out_errcode = 0;
+
+    bool seq_completed(uint32_t seq) const noexcept
+    {
+        return int32_t(seq - completed_seq) < 0;
+    }
+
+    bool zc_outstanding() const noexcept
+    {
+        return next_seq != completed_seq;
+    }
+
+    // Send as much pending data as possible. Returns 0 if all data was sent or the socket would block
+    // (in which case blocked is set), or an error number. Call with zc_lock held.
+    int send_pending(int fd, bool &blocked) noexcept
+    {
+        blocked = false;
+        bool no_zc = false;
+        while (num_sent < reqs.size()) {
+            send_req &req = reqs[num_sent];
+            size_t remaining = req.len - req.sent;
+            if (remaining == 0) {
+                // (empty buffer)
+                num_sent++;
+                continue;
+            }
+            bool use_zc = zc_enabled && ! no_zc && remaining >= zc_threshold;
+            int flags = MSG_DONTWAIT | msg_nosignal_flag | (use_zc ? msg_zerocopy_flag : 0);
+
+            ssize_t r = ::send(fd, req.data + req.sent, remaining, flags);
+            if (r == -1) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    blocked = true;
+                    return 0;
+                }
+                if (errno == ENOBUFS && use_zc) {
+                    // Too many zero-copy sends outstanding (socket option memory limit); copy instead:
+                    no_zc = true;
+                    continue;
+                }
+                return errno;
+            }
+
+            if (use_zc) {
+                req.last_seq = next_seq++;
+                req.zc_used = true;
+            }
+            no_zc = false;
+            req.sent += r;
+            if (req.sent == req.len) {
+                num_sent++;
+            }
+        }
+        return 0;
+    }
+
+    // Process zero-copy completion notifications from the socket error queue. Call with zc_lock held.
+    void read_notifications(int fd) noexcept
+    {
+#if DASYNQ_HAVE_MSG_ZEROCOPY && defined(SO_EE_ORIGIN_ZEROCOPY)
+        while (zc_outstanding()) {
+            char control[128];
+            struct msghdr msg;
+            std::memset(&msg, 0, sizeof(msg));
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+
+            if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1) {
+                if (errno == EINTR) continue;
+                break;
+            }
+
+            for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+                bool is_recverr = (cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR)
+                        || (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR);
+                if (! is_recverr) continue;
+
+                struct sock_extended_err serr;
+                std::memcpy(&serr, CMSG_DATA(cmsg), sizeof(serr));
+                if (serr.ee_origin != SO_EE_ORIGIN_ZEROCOPY || serr.ee_errno != 0) continue;
+
+                // ee_info..ee_data is the (inclusive) range of completed sends; ranges are reported in
+                // order for stream sockets.
+                uint32_t next = serr.ee_data + 1;
+                if (int32_t(next - completed_seq) > 0) {
+                    completed_seq = next;
+                }
+#ifdef SO_EE_CODE_ZEROCOPY_COPIED
+                if (serr.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                    // The kernel copied the data anyway; zero-copy isn't worthwhile for this socket.
+                    zc_enabled = false;
+                }
+#endif
+            }
+        }
+#endif
+    }
+
+    // Collect up to release_batch buffers which can be released. Call with zc_lock held.
+    int collect_released(send_req *released) noexcept
+    {
+        int count = 0;
+        while (count < release_batch && ! reqs.empty()) {
+            send_req &req = reqs.front();
+            bool send_done = (req.sent == req.len) || failed;
+            if (! send_done || (req.zc_used && ! seq_completed(req.last_seq))) {
+                break;
+            }
+            released[count++] = req;
+            reqs.pop_front();
+            if (num_sent != 0) {
+                num_sent--;
+            }
+        }
+        return count;
+    }
+
+    // Release completed buffers, with the lock held on entry; the lock is released on return.
+    void release_completed(EventLoop &eloop, std::unique_lock<mutex_t> &guard) noexcept
+    {
+        send_req released[release_batch];
+        int count = collect_released(released);
+        while (count != 0) {
+            guard.unlock();
+            for (int i = 0; i < count; i++) {
+                static_cast<Derived *>(this)->send_complete(eloop, released[i].data, released[i].len);
+            }
+            guard.lock();
+            count = collect_released(released);
+        }
+        guard.unlock();
+    }
+
+    // Enable the input watch if it is needed (for input, or for completion notifications) and not
+    // already enabled or active. Call with zc_lock held.
+    void update_in_watch(EventLoop &eloop) noexcept
+    {
+        if (in_state == watch_state_t::IDLE && (input_wanted || zc_outstanding())) {
+            in_state = watch_state_t::ARMED;
+            this->set_in_watch_enabled(eloop, true);
+        }
+    }
+
+    void set_failed(int errcode) noexcept
+    {
+        failed = true;
+        out_errcode = errcode;
+    }
+
+    rearm read_ready(EventLoop &eloop, int fd) noexcept
+    {
+        std::unique_lock<mutex_t> guard(zc_lock);
+        in_state = watch_state_t::ACTIVE;
+        read_notifications(fd);
+        bool want_input = input_wanted;
+        release_completed(eloop, guard);
+
+        if (want_input) {
+            rearm r = static_cast<Derived *>(this)->input_ready(eloop, fd);
+            if (r == rearm::REMOVE || r == rearm::REMOVED) {
+                return r;
+            }
+            if (r == rearm::DISARM) {
+                guard.lock();
+                input_wanted = false;
+                guard.unlock();
+            }
+        }
+
+        guard.lock();
+        if (input_wanted || zc_outstanding()) {
+            in_state = watch_state_t::ARMED;
+            return rearm::REARM;
+        }
+
+        // Disable the input watch before we leave the ACTIVE state, so that a concurrent send() which
+        // re-enables it cannot be overridden:
+        this->set_in_watch_enabled(eloop, false);
+        in_state = watch_state_t::IDLE;
+        return rearm::NOOP;
+    }
+
+    rearm write_ready(EventLoop &eloop, int fd) noexcept
+    {
+        std::unique_lock<mutex_t> guard(zc_lock);
+        if (out_state != watch_state_t::ARMED) {
+            // spurious (eg failed):
+            return rearm::DISARM;
+        }
+        out_state = watch_state_t::ACTIVE;
+
+        bool blocked;
+        int errcode = send_pending(fd, blocked);
+        if (errcode != 0) {
+            set_failed(errcode);
+        }
+        update_in_watch(eloop);
+
+        rearm r;
+        if (blocked) {
+            out_state = watch_state_t::ARMED;
+            r = rearm::REARM;
+        }
+        else {
+            this->set_out_watch_enabled(eloop, false);
+            out_state = watch_state_t::IDLE;
+            r = rearm::NOOP;
+        }
+
+        release_completed(eloop, guard);
+
+        if (errcode != 0) {
+            static_cast<Derived *>(this)->send_error(eloop, errcode);
+        }
+        return r;
+    }
+
+    public:
+
+    // Default handlers (may be hidden by Derived):
+
+    rearm input_ready(EventLoop &eloop, int fd) noexcept
+    {
+        return rearm::DISARM;
+    }
+
+    void send_error(EventLoop &eloop, int errcode) noexcept { }
+
+    // Register the watcher with an event loop. The socket should be a connected stream socket in
+    // non-blocking mode. Zero-copy sends are enabled (SO_ZEROCOPY) if the socket supports them.
+    //
+    // Can fail with std::bad_alloc or std::system_error.
+    void add_watch(EventLoop &eloop, int fd, int inprio = DEFAULT_PRIORITY, int outprio = DEFAULT_PRIORITY)
+    {
+        in_state = watch_state_t::IDLE;
+        out_state = watch_state_t::IDLE;
+        input_wanted = false;
+        failed = false;
+        out_errcode = 0;
+        next_seq = completed_seq = 0;
+
+        zc_enabled = false;
+#if DASYNQ_HAVE_MSG_ZEROCOPY && defined(SO_ZEROCOPY)
+        int one = 1;
+        zc_enabled = setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0;
+#endif
+
+        bidi_fd_watcher<EventLoop>::add_watch(eloop, fd, 0, inprio, outprio);
+    }
+
+    // Set the minimum size of a send for which zero-copy is used (default 10240 bytes). Specify
+    // SIZE_MAX to always copy.
+    void set_zerocopy_threshold(size_t threshold) noexcept
+    {
+        std::lock_guard<mutex_t> guard(zc_lock);
+        zc_threshold = threshold;
+    }
+
+    // Check whether zero-copy sends are in use (i.e. supported by the socket, and the kernel has not
+    // reported that it needed to copy data).
+    bool is_zerocopy_enabled() noexcept
+    {
+        std::lock_guard<mutex_t> guard(zc_lock);
+        return zc_enabled;
+    }
+
+    // Enable or disable input (see input_ready()).
+    void set_input_enabled(EventLoop &eloop, bool enable) noexcept
+    {
+        std::lock_guard<mutex_t> guard(zc_lock);
+        input_wanted = enable;
+        update_in_watch(eloop);
+    }
+
+    // Send data from a buffer. As much data as possible is sent immediately (if no earlier data is
+    // waiting to be sent), and the rest when the socket becomes writable. The buffer must remain
+    // valid, and unmodified, until it is released via send_complete(). Returns true on success, or
+    // false if sending has failed (see get_send_error()), in which case the buffer is not released.
+    // If sending fails after part of the buffer has been sent using zero-copy, the kernel may still
+    // be using it; in that case true is returned, and the buffer is released (via send_complete())
+    // once the kernel is done with it, but subsequent sends fail.
+    // May throw std::bad_alloc.
+    bool send(EventLoop &eloop, const void *data, size_t len)
+    {
+        std::unique_lock<mutex_t> guard(zc_lock);
+
+        if (failed) {
+            return false;
+        }
+
+        reqs.push_back(send_req {static_cast<const char *>(data), len, 0, 0, false});
+
+        if (out_state == watch_state_t::IDLE) {
+            bool blocked;
+            int errcode = send_pending(this->get_watched_fd(), blocked);
+            if (errcode != 0) {
+                set_failed(errcode);
+                // Don't release the buffer passed in this call, unless the kernel may still be using
+                // it (in which case it is released once the zero-copy send completes):
+                bool keep = reqs.back().zc_used;
+                if (! keep) {
+                    reqs.pop_back();
+                    if (num_sent > reqs.size()) {
+                        num_sent = reqs.size();
+                    }
+                }
+                update_in_watch(eloop);
+                release_completed(eloop, guard);
+                return keep;
+            }
+            if (blocked) {
+                out_state = watch_state_t::ARMED;
+                this->set_out_watch_enabled(eloop, true);
+            }
+        }
+
+        update_in_watch(eloop);
+        release_completed(eloop, guard);
+        return true;
+    }
+
+    // Get the number of buffers which have not yet been released.
+    size_t get_pending_count() noexcept
+    {
+        std::lock_guard<mutex_t> guard(zc_lock);
+        return reqs.size();
+    }
+
+    // Get the error number for a failed send, or 0 if sending has not failed.
+    int get_send_error() noexcept
+    {
+        std::lock_guard<mutex_t> guard(zc_lock);
+        return out_errcode;
+    }
+
+    // Release all buffers not yet released, regardless of whether the kernel has finished with them.
+    // This should only be used once the watcher has been removed and the socket closed (or reset), in
+    // which case no further completion notifications can be received.
+    void release_pending(EventLoop &eloop) noexcept
+    {
+        std::unique_lock<mutex_t> guard(zc_lock);
+        failed = true;
+        completed_seq = next_seq;
+        release_completed(eloop, guard);
+    }
+};
+
+} // namespace dprivate
+} // namespace dasynq
+
+#endif /* DASYNQ_ZEROCOPY_H_ */
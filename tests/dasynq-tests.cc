@@ -1,13 +1,26 @@
 #include <sys/socket.h>
+#include <sys/resource.h>
 #include <sys/un.h>
+#include <netinet/in.h>
 
+#include <algorithm>
 #include <cassert>
+#include <chrono>
+#include <cstring>
 #include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
 #include <thread>
+#include <vector>
 
 #include "testbackend.h"
 #include "dasynq.h"
 
+#if ! DASYNQ_HAVE_KQUEUE && DASYNQ_HAVE_EPOLL
+#include "dasynq/pwait2timer.h"
+#endif
+
 class checking_mutex
 {
     bool is_locked = false;
@@ -366,286 +379,431 @@ void test_limited_run()
     watcher4.deregister(my_loop);
 }
 
-static void test_timespec_div()
+// Check that with a re-poll interval set, a high-priority watcher which becomes ready while a batch
+// of low-priority watchers is being processed is dispatched before the rest of the batch. An interval
+// set by a watcher during a batch takes effect from the next batch.
+void test_repoll()
 {
-    using dasynq::divide_timespec;
-
-    struct timespec n;
-    struct timespec d;
-    struct timespec rem;
-
-    // 0.9999.. / 0.2
-    n.tv_sec = 0;
-    n.tv_nsec = 999999999;
-    d.tv_sec = 0;
-    d.tv_nsec = 200000000;
-
-    assert(divide_timespec(n, d, rem) == 4);
-    assert(rem.tv_sec == 0);
-    assert(rem.tv_nsec == 199999999);
-
-    // 0.9999.. / 0.1
-    d.tv_nsec = 100000000;
-    assert(divide_timespec(n, d, rem) == 9);
-    assert(rem.tv_sec == 0);
-    assert(rem.tv_nsec == 99999999);
-
-    // 12.0 / 2.9999..
-    n.tv_sec = 12;
-    n.tv_nsec = 0; // n is 12.0
-    d.tv_sec = 2;
-    d.tv_nsec = 999999999; // d is now 2.999999..
-    assert(divide_timespec(n, d, rem) == 4);
-    assert(rem.tv_sec == 0);
-    assert(rem.tv_nsec == 4);
+    class my_watcher : public Loop_t::fd_watcher_impl<my_watcher>
+    {
+        public:
+        std::vector<int> &order;
+        bool set_interval = false;
 
-    // 12.999999996 / 2.99...
-    n.tv_nsec = 999999996;
-    assert(divide_timespec(n, d, rem) == 4);
-    assert(rem.tv_sec == 1);
-    assert(rem.tv_nsec == 0);
+        my_watcher(std::vector<int> &order_p) : order(order_p) { }
 
-    // 0.9 / 1.5
-    n.tv_sec = 0;
-    n.tv_nsec = 900000000;
-    d.tv_sec = 1;
-    d.tv_nsec = 500000000;
-    assert(divide_timespec(n, d, rem) == 0);
-    assert(rem.tv_sec == 0);
-    assert(rem.tv_nsec == 900000000);
-}
+        rearm fd_event(Loop_t &eloop, int fd, int flags)
+        {
+            order.push_back(fd);
+            if (fd == 0) {
+                // high-priority watcher becomes ready:
+                test_io_engine::trigger_fd_event(3, dasynq::IN_EVENTS);
+                if (set_interval) {
+                    eloop.set_repoll_interval(0, 1000000);
+                }
+            }
+            return rearm::REARM;
+        }
+    };
 
-static void test_time_val_sub()
-{
-    using dasynq::time_val;
+    // repoll: 0 - no re-poll interval; 1 - interval set before the batch; 2 - set during the batch
+    for (int repoll = 0; repoll < 3; repoll++) {
+        test_io_engine::clear_fd_data();
+        Loop_t my_loop;
+        std::vector<int> order;
 
-    time_val t1 = {0, 0};
-    time_val t2 = {0, 0};
-    time_val t3 = t2 - t1;
+        if (repoll == 1) {
+            my_loop.set_repoll_interval(1);
+        }
 
-    assert(t3 == time_val(0, 0));
+        my_watcher watcher1(order), watcher2(order), watcher3(order), watcher_hi(order);
+        watcher1.set_interval = (repoll == 2);
+        watcher1.add_watch(my_loop, 0, dasynq::IN_EVENTS, true, 100);
+        watcher2.add_watch(my_loop, 1, dasynq::IN_EVENTS, true, 100);
+        watcher3.add_watch(my_loop, 2, dasynq::IN_EVENTS, true, 100);
+        watcher_hi.add_watch(my_loop, 3, dasynq::IN_EVENTS, true, 1);
 
-    t1 = {0, 1};
-    t2 = {1, 0};
-    t3 = t2 - t1;
+        test_io_engine::trigger_fd_event(0, dasynq::IN_EVENTS);
+        test_io_engine::trigger_fd_event(1, dasynq::IN_EVENTS);
+        test_io_engine::trigger_fd_event(2, dasynq::IN_EVENTS);
 
-    assert(t3 == time_val(0, 999999999));
+        // The batch is limited to the 3 events queued initially:
+        my_loop.run();
+        assert(order.size() == 3);
+        assert(order[0] == 0);
+        if (repoll == 1) {
+            assert(order[1] == 3);
+            assert(order[2] == 1);
+        }
+        else {
+            assert(order[1] == 1);
+            assert(order[2] == 2);
+        }
 
-    t1 = {3, 4};
-    t2 = {5, 7};
-    t3 = t2 - t1;
+        my_loop.run();
+        assert(order.size() == 4);
+        assert(order[3] == (repoll == 1 ? 2 : 3));
 
-    assert(t3 == time_val(2, 3));
+        watcher1.deregister(my_loop);
+        watcher2.deregister(my_loop);
+        watcher3.deregister(my_loop);
+        watcher_hi.deregister(my_loop);
+    }
 }
 
-static void test_timers_1()
+// A single queued watcher is held outside the priority queue; check that ordering is still correct
+// when further watchers are queued.
+void test_queue_order()
 {
-    using dasynq::clock_type;
-    using dasynq::time_val;
-    using loop_t = Loop_t;
-    loop_t my_loop;
+    test_io_engine::clear_fd_data();
+    Loop_t my_loop;
+    std::vector<int> order;
 
-    class my_timer : public loop_t::timer_impl<my_timer>
+    class my_watcher : public Loop_t::fd_watcher_impl<my_watcher>
     {
         public:
-        rearm timer_expiry(loop_t &loop, int expiry_count)
+        std::vector<int> &order;
+
+        my_watcher(std::vector<int> &order_p) : order(order_p) { }
+
+        rearm fd_event(Loop_t &eloop, int fd, int flags)
         {
-            expiries += expiry_count;
+            order.push_back(fd);
             return rearm::REARM;
         }
-
-        int expiries = 0;
     };
 
-    // First timer is a one-shot timer expiring at 3 seconds:
-    my_timer timer_1;
-    struct timespec timeout_1 = { .tv_sec = 3, .tv_nsec = 0 };
-    timer_1.add_timer(my_loop, clock_type::MONOTONIC);
-    timer_1.arm_timer(my_loop, timeout_1);
-
-    // Second timer expires at 4 seconds and then every 1 second after:
-    my_timer timer_2;
-    struct timespec timeout_2 = { .tv_sec = 4, .tv_nsec = 0 };
-    struct timespec interval_2 = { .tv_sec = 1, .tv_nsec = 0 };
-    timer_2.add_timer(my_loop, clock_type::MONOTONIC);
-    timer_2.arm_timer(my_loop, timeout_2, interval_2);
+    my_watcher watcher1(order), watcher2(order), watcher3(order);
+    watcher1.add_watch(my_loop, 0, dasynq::IN_EVENTS, true, 100);
+    watcher2.add_watch(my_loop, 1, dasynq::IN_EVENTS, true, 1);
+    watcher3.add_watch(my_loop, 2, dasynq::IN_EVENTS, true, 100);
 
-    test_io_engine::cur_mono_time = time_val(0, 0);
+    // A lone event:
+    test_io_engine::trigger_fd_event(0, dasynq::IN_EVENTS);
+    my_loop.run();
+    assert(order.size() == 1 && order[0] == 0);
 
-    my_loop.poll();
-    assert(timer_1.expiries == 0);
-    assert(timer_2.expiries == 0);
+    // Lower priority first, then higher priority:
+    order.clear();
+    test_io_engine::trigger_fd_event(0, dasynq::IN_EVENTS);
+    test_io_engine::trigger_fd_event(1, dasynq::IN_EVENTS);
+    my_loop.run();
+    assert(order.size() == 2 && order[0] == 1 && order[1] == 0);
 
-    // After 1 second, should be no expirations:
-    test_io_engine::cur_mono_time = time_val(1, 0);
+    // Same priority, should be processed in order:
+    order.clear();
+    test_io_engine::trigger_fd_event(2, dasynq::IN_EVENTS);
+    test_io_engine::trigger_fd_event(0, dasynq::IN_EVENTS);
+    my_loop.run();
+    assert(order.size() == 2 && order[0] == 2 && order[1] == 0);
+
+    // An emulated watcher is queued when added; disable it before it is processed:
+    order.clear();
+    my_watcher watcher4(order);
+    test_io_engine::mark_fd_needs_emulation(3);
+    watcher4.add_watch(my_loop, 3, dasynq::IN_EVENTS, true, 100);
+    watcher4.set_enabled(my_loop, false);
     my_loop.poll();
-    assert(timer_1.expiries == 0);
-    assert(timer_2.expiries == 0);
+    assert(order.empty());
 
-    // After 3 seconds, should have one expiration on t1:
-    test_io_engine::cur_mono_time = time_val(3, 0);
-    my_loop.poll();
-    assert(timer_1.expiries == 1);
-    assert(timer_2.expiries == 0);
+    watcher4.deregister(my_loop);
+    watcher1.deregister(my_loop);
+    watcher2.deregister(my_loop);
+    watcher3.deregister(my_loop);
+}
 
-    // After 4.5 seconds, should have an expiration on t2:
-    test_io_engine::cur_mono_time = time_val(4, 500000000);
-    my_loop.poll();
-    assert(timer_1.expiries == 1);
-    assert(timer_2.expiries == 1);
+// An allocator which counts outstanding allocations:
+template <typename T>
+class counting_allocator
+{
+    public:
+    using value_type = T;
 
-    // After 5.5 seconds, a second expiration on t2:
-    test_io_engine::cur_mono_time = time_val(5, 500000000);
-    my_loop.poll();
-    assert(timer_1.expiries == 1);
-    assert(timer_2.expiries == 2);
+    int *count;
 
-    // After 6 seconds, a third expiration on t2:
-    test_io_engine::cur_mono_time = time_val(6, 0);
-    my_loop.poll();
-    assert(timer_1.expiries == 1);
-    assert(timer_2.expiries == 3);
+    counting_allocator(int *count_p) noexcept : count(count_p) { }
 
-    timer_1.deregister(my_loop);
-    timer_2.deregister(my_loop);
-}
+    template <typename U>
+    counting_allocator(const counting_allocator<U> &other) noexcept : count(other.count) { }
 
-static void test_timers_2()
-{
-    using dasynq::clock_type;
-    using dasynq::time_val;
-    using loop_t = Loop_t;
-    loop_t my_loop;
+    T *allocate(std::size_t n)
+    {
+        (*count)++;
+        return std::allocator<T>().allocate(n);
+    }
 
-    class my_timer : public loop_t::timer_impl<my_timer>
+    void deallocate(T *p, std::size_t n) noexcept
     {
-        public:
-        rearm timer_expiry(loop_t &loop, int expiry_count)
-        {
-            expiries += expiry_count;
-            return handler_rearm;
-        }
+        (*count)--;
+        std::allocator<T>().deallocate(p, n);
+    }
 
-        int expiries = 0;
-        rearm handler_rearm = rearm::REARM;
+    template <typename U> bool operator==(const counting_allocator<U> &o) const { return count == o.count; }
+    template <typename U> bool operator!=(const counting_allocator<U> &o) const { return count != o.count; }
+};
+
+// Check the allocator-accepting lambda watcher factories, and the loop's watcher pool.
+void test_allocator_lambdas()
+{
+    test_io_engine::clear_fd_data();
+    Loop_t my_loop;
+
+    // Watchers allocated from the pool are recycled:
+    int seen = 0;
+    auto handler = [&seen](Loop_t &eloop, int fd, int flags) -> rearm {
+        seen++;
+        return rearm::REMOVE;
     };
 
-    // Create timer expiring at 1 second intervals:
-    my_timer timer_1;
-    struct timespec timeout_1 = { .tv_sec = 1, .tv_nsec = 0 };
-    struct timespec interval_1 = { .tv_sec = 1, .tv_nsec = 0 };
-    timer_1.add_timer(my_loop, clock_type::MONOTONIC);
-    timer_1.arm_timer(my_loop, timeout_1, interval_1);
+    auto alloc = my_loop.get_watcher_allocator();
+    uintptr_t w1 = (uintptr_t) Loop_t::fd_watcher::add_watch(std::allocator_arg, alloc, my_loop, 0,
+            dasynq::IN_EVENTS, handler);
+    test_io_engine::trigger_fd_event(0, dasynq::IN_EVENTS);
+    my_loop.run();
+    assert(seen == 1);
 
-    test_io_engine::cur_mono_time = time_val(0, 0);
-    my_loop.poll();
-    assert(timer_1.expiries == 0);
+    uintptr_t w2 = (uintptr_t) Loop_t::fd_watcher::add_watch(std::allocator_arg, alloc, my_loop, 0,
+            dasynq::IN_EVENTS, handler);
+    assert(w1 == w2);
+    test_io_engine::trigger_fd_event(0, dasynq::IN_EVENTS);
+    my_loop.run();
+    assert(seen == 2);
 
-    // Have the timer disarm after it fires once:
-    test_io_engine::cur_mono_time = time_val(1, 0);
-    timer_1.handler_rearm = rearm::DISARM;
-    my_loop.poll();
-    assert(timer_1.expiries == 1);
+    // Watchers allocated via an allocator are deallocated when removed:
+    int count = 0;
+    counting_allocator<char> calloc(&count);
 
-    // Check that the timer doesn't fire when disabled:
-    test_io_engine::cur_mono_time = time_val(5, 0);
-    my_loop.poll();
-    assert(timer_1.expiries == 1);
+    auto bidi_w = Loop_t::bidi_fd_watcher::add_watch(std::allocator_arg, calloc, my_loop, 1,
+            dasynq::IN_EVENTS | dasynq::OUT_EVENTS, [](Loop_t &eloop, int fd, int flags) -> rearm {
+        return rearm::REARM;
+    });
+    assert(count == 1);
+    bidi_w->deregister(my_loop);
+    assert(count == 0);
 
-    // Re-enable timer and check that it fires immediately:
-    timer_1.set_enabled(my_loop, clock_type::MONOTONIC, true);
-    my_loop.poll();
-    assert(timer_1.expiries == 5);
+    Loop_t::fd_watcher::add_watch(std::allocator_arg, calloc, my_loop, 0, dasynq::IN_EVENTS, handler);
+    assert(count == 1);
+    test_io_engine::trigger_fd_event(0, dasynq::IN_EVENTS);
+    my_loop.run();
+    assert(seen == 3);
+    assert(count == 0);
+}
 
-    // It's disabled again; check 2 more periods:
-    test_io_engine::cur_mono_time = time_val(7, 0);
-    my_loop.poll();
-    assert(timer_1.expiries == 5);
+// An allocator which tracks the total number of bytes allocated (for use as a loop allocator):
+static size_t tracked_bytes = 0;
 
-    // Re-enable, and then disable, and wait two more periods:
-    timer_1.set_enabled(my_loop, clock_type::MONOTONIC, true);
-    timer_1.set_enabled(my_loop, clock_type::MONOTONIC, false);
-    test_io_engine::cur_mono_time = time_val(9, 0);
-    my_loop.poll();
-    assert(timer_1.expiries == 5);
+template <typename T>
+class tracking_allocator
+{
+    public:
+    using value_type = T;
 
-    // Now re-enable and check for the 4 missing periods reported:
-    timer_1.set_enabled(my_loop, clock_type::MONOTONIC, true);
-    my_loop.poll();
-    assert(timer_1.expiries == 9);
+    tracking_allocator() noexcept { }
 
-    timer_1.deregister(my_loop);
-}
+    template <typename U>
+    tracking_allocator(const tracking_allocator<U> &other) noexcept { }
 
-static void test_timers_3()
+    T *allocate(std::size_t n)
+    {
+        tracked_bytes += n * sizeof(T);
+        return std::allocator<T>().allocate(n);
+    }
+
+    void deallocate(T *p, std::size_t n) noexcept
+    {
+        tracked_bytes -= n * sizeof(T);
+        std::allocator<T>().deallocate(p, n);
+    }
+
+    template <typename U> bool operator==(const tracking_allocator<U> &o) const { return true; }
+    template <typename U> bool operator!=(const tracking_allocator<U> &o) const { return false; }
+};
+
+class alloc_test_traits : public test_traits
 {
-    // Create a lot of timers, test they come out in the right
-    // order:
+    public:
+    using allocator_t = tracking_allocator<char>;
+};
 
+// Check that loop data structures are allocated via the allocator specified in the traits, and
+// that the timer queue shrinks after a spike in the number of timers.
+static void test_loop_allocator()
+{
     using dasynq::clock_type;
-    using dasynq::time_val;
-    using loop_t = Loop_t;
-    loop_t my_loop;
+    using loop_t = dasynq::event_loop<checking_mutex, alloc_test_traits>;
+    size_t &outstanding = tracked_bytes;
 
-    class my_timer : public loop_t::timer_impl<my_timer>
     {
-        public:
-        rearm timer_expiry(loop_t &loop, int expiry_count)
+        loop_t my_loop;
+
+        class my_timer : public loop_t::timer_impl<my_timer>
         {
-            expiries += expiry_count;
-            return handler_rearm;
+            public:
+            rearm timer_expiry(loop_t &loop, int expiry_count)
+            {
+                return rearm::REARM;
+            }
+        };
+
+        std::vector<my_timer> timers(1000);
+        for (auto &t : timers) {
+            t.add_timer(my_loop, clock_type::MONOTONIC);
         }
 
-        int expiries = 0;
-        rearm handler_rearm = rearm::DISARM;
-    };
+        size_t peak = outstanding;
+        assert(peak >= 1000 * sizeof(void *));
 
-    my_timer timers[100];
+        for (auto &t : timers) {
+            t.deregister(my_loop);
+        }
 
-    // Create a series of timers, each expiring 1ns after the previous:
+        assert(outstanding < peak / 4);
+    }
 
-    struct timespec timeout_1 = { .tv_sec = 1, .tv_nsec = 0 };
+    assert(outstanding == 0);
+}
 
-    for (auto & t : timers) {
-        t.add_timer(my_loop, clock_type::MONOTONIC);
-        t.arm_timer(my_loop, timeout_1);
-        timeout_1.tv_nsec++;
-    }
+// Check that capacity reserved via event_loop::reserve() is sufficient to add watchers without
+// further allocation, and register a batch of fd watchers via register_fds().
+static void test_reserve_and_register_fds()
+{
+    using dasynq::clock_type;
+    using loop_t = dasynq::event_loop<checking_mutex, alloc_test_traits>;
 
-    test_io_engine::cur_mono_time = time_val(0, 0);
-    my_loop.poll();
-    for (auto &  t : timers) {
-        assert(t.expiries == 0);
+    test_io_engine::clear_fd_data();
+
+    {
+        loop_t my_loop;
+        my_loop.reserve(100, 100);
+        size_t reserved = tracked_bytes;
+
+        class my_timer : public loop_t::timer_impl<my_timer>
+        {
+            public:
+            rearm timer_expiry(loop_t &loop, int expiry_count)
+            {
+                return rearm::REARM;
+            }
+        };
+
+        class my_fd_watcher : public loop_t::fd_watcher_impl<my_fd_watcher>
+        {
+            public:
+            int events = 0;
+
+            rearm fd_event(loop_t &loop, int fd, int flags)
+            {
+                events++;
+                return rearm::REARM;
+            }
+        };
+
+        std::vector<my_timer> timers(100);
+        for (auto &t : timers) {
+            t.add_timer(my_loop, clock_type::MONOTONIC);
+        }
+
+        const int num_fds = 100;
+        std::vector<my_fd_watcher> watchers(num_fds);
+        std::vector<loop_t::fd_registration> regs;
+        for (int i = 0; i < num_fds; i++) {
+            regs.emplace_back(&watchers[i], i, dasynq::IN_EVENTS);
+        }
+        my_loop.register_fds(regs.data(), regs.size());
+
+        assert(tracked_bytes == reserved);
+
+        test_io_engine::trigger_fd_event(3, dasynq::IN_EVENTS);
+        test_io_engine::trigger_fd_event(70, dasynq::IN_EVENTS);
+        my_loop.run();
+        for (int i = 0; i < num_fds; i++) {
+            assert(watchers[i].events == ((i == 3 || i == 70) ? 1 : 0));
+        }
+
+        // Removing watchers does not reduce capacity below the reserved amount:
+        for (auto &t : timers) {
+            t.deregister(my_loop);
+        }
+        for (auto &w : watchers) {
+            w.deregister(my_loop);
+        }
+        assert(tracked_bytes == reserved);
     }
 
-    for (int i = 0; i < 100; i++) {
-        test_io_engine::cur_mono_time = time_val(1, i);
-        my_loop.poll();
-        assert(timers[i].expiries == 1);
+    assert(tracked_bytes == 0);
+}
+
+// Check enabling/disabling a group of fd watchers via watcher_set, including an emulated watcher.
+static void test_watcher_set()
+{
+    test_io_engine::clear_fd_data();
+    Loop_t my_loop;
+
+    class my_watcher : public Loop_t::fd_watcher_impl<my_watcher>
+    {
+        public:
+        int events = 0;
+
+        rearm fd_event(Loop_t &eloop, int fd, int flags)
+        {
+            events++;
+            return rearm::REARM;
+        }
+    };
+
+    const int num_watchers = 10;
+    my_watcher watchers[num_watchers];
+    Loop_t::watcher_set wset;
+
+    // fd 0 needs emulation (it is always "ready" while enabled):
+    test_io_engine::mark_fd_needs_emulation(0);
+
+    for (int i = 0; i < num_watchers; i++) {
+        watchers[i].add_watch(my_loop, i, dasynq::IN_EVENTS);
+        wset.add(&watchers[i]);
     }
+    assert(wset.size() == num_watchers);
 
-    // Now try in reverse order:
-    timeout_1.tv_sec = 2;
-    for (int i = 0; i < 100; i++) {
-        timeout_1.tv_nsec = 99 - i;
-        timers[i].arm_timer(my_loop, timeout_1);
+    // The emulated watcher is queued on registration:
+    my_loop.run();
+    assert(watchers[0].events == 1);
+
+    wset.disable_all(my_loop);
+    for (int i = 1; i < num_watchers; i++) {
+        test_io_engine::trigger_fd_event(i, dasynq::IN_EVENTS);
+    }
+    my_loop.poll();
+    for (int i = 0; i < num_watchers; i++) {
+        assert(watchers[i].events == (i == 0 ? 1 : 0));
     }
 
-    for (int i = 0; i < 100; i++) {
-        test_io_engine::cur_mono_time = time_val(2, i);
-        my_loop.poll();
-        assert(timers[99 - i].expiries == 2);
+    wset.enable_all(my_loop);
+    for (int i = 1; i < num_watchers; i++) {
+        test_io_engine::trigger_fd_event(i, dasynq::IN_EVENTS);
+    }
+    my_loop.run();
+    for (int i = 0; i < num_watchers; i++) {
+        assert(watchers[i].events == (i == 0 ? 2 : 1));
     }
 
-    for (int i = 0; i < 100; i++) {
-        timers[i].deregister(my_loop);
+    // A watcher removed from the set is not affected:
+    assert(wset.remove(&watchers[5]));
+    assert(! wset.remove(&watchers[5]));
+    wset.disable_all(my_loop);
+    test_io_engine::trigger_fd_event(4, dasynq::IN_EVENTS);
+    test_io_engine::trigger_fd_event(5, dasynq::IN_EVENTS);
+    my_loop.run();
+    assert(watchers[4].events == 1);
+    assert(watchers[5].events == 2);
+
+    for (int i = 0; i < num_watchers; i++) {
+        watchers[i].deregister(my_loop);
     }
 }
 
-static void test_timers_4()
+// Check lazy extension of timer timeouts (timer::extend_timer).
+static void test_timer_extend()
 {
-    // Test that we can re-arm a lone timer:
-
     using dasynq::clock_type;
     using dasynq::time_val;
     using loop_t = Loop_t;
@@ -657,316 +815,2064 @@ static void test_timers_4()
         rearm timer_expiry(loop_t &loop, int expiry_count)
         {
             expiries += expiry_count;
-            return handler_rearm;
+            return rearm::REARM;
         }
 
         int expiries = 0;
-        rearm handler_rearm = rearm::DISARM;
     };
 
-    my_timer timer;
+    test_io_engine::cur_mono_time = time_val(0, 0);
 
-    // Create a series of timers, each expiring 1ns after the previous:
+    my_timer timer_1;
+    my_timer timer_2;
+    timer_1.add_timer(my_loop, clock_type::MONOTONIC);
+    timer_2.add_timer(my_loop, clock_type::MONOTONIC);
 
-    struct timespec timeout = { .tv_sec = 1, .tv_nsec = 0 };
+    // Timer 1 expires at 3 seconds, extended to 5 seconds; timer 2 expires at 4 seconds:
+    struct timespec timeout_3 = { .tv_sec = 3, .tv_nsec = 0 };
+    struct timespec timeout_4 = { .tv_sec = 4, .tv_nsec = 0 };
+    struct timespec timeout_5 = { .tv_sec = 5, .tv_nsec = 0 };
+    timer_1.arm_timer(my_loop, timeout_3);
+    timer_2.arm_timer(my_loop, timeout_4);
+    timer_1.extend_timer(my_loop, timeout_5);
 
-    timer.add_timer(my_loop, clock_type::MONOTONIC);
-    timer.arm_timer(my_loop, timeout);
+    test_io_engine::cur_mono_time = time_val(3, 500000000);
+    my_loop.poll();
+    assert(timer_1.expiries == 0);
+    assert(timer_2.expiries == 0);
 
-    timeout.tv_sec++;
+    test_io_engine::cur_mono_time = time_val(4, 0);
+    my_loop.poll();
+    assert(timer_1.expiries == 0);
+    assert(timer_2.expiries == 1);
 
-    timer.arm_timer(my_loop, timeout);
+    test_io_engine::cur_mono_time = time_val(5, 0);
+    my_loop.poll();
+    assert(timer_1.expiries == 1);
+    assert(timer_2.expiries == 1);
 
-    test_io_engine::cur_mono_time = time_val(1, 0);
+    // Extending a timer which is not armed arms it:
+    struct timespec timeout_10 = { .tv_sec = 10, .tv_nsec = 0 };
+    timer_1.extend_timer(my_loop, timeout_10);
+
+    // "Extending" to an earlier time re-arms it normally:
+    struct timespec timeout_8 = { .tv_sec = 8, .tv_nsec = 0 };
+    timer_1.extend_timer(my_loop, timeout_8);
+    test_io_engine::cur_mono_time = time_val(8, 0);
     my_loop.poll();
-    assert(timer.expiries == 0);
+    assert(timer_1.expiries == 2);
+
+    // Re-arming after extension cancels the extension:
+    struct timespec timeout_12 = { .tv_sec = 12, .tv_nsec = 0 };
+    struct timespec timeout_20 = { .tv_sec = 20, .tv_nsec = 0 };
+    timer_1.arm_timer(my_loop, timeout_10);
+    timer_1.extend_timer(my_loop, timeout_20);
+    timer_1.arm_timer(my_loop, timeout_12);
+    test_io_engine::cur_mono_time = time_val(12, 0);
+    my_loop.poll();
+    assert(timer_1.expiries == 3);
+    test_io_engine::cur_mono_time = time_val(20, 0);
+    my_loop.poll();
+    assert(timer_1.expiries == 3);
 
-    test_io_engine::cur_mono_time = time_val(2, 0);
+    timer_1.deregister(my_loop);
+    timer_2.deregister(my_loop);
+}
+
+static void test_timer_group()
+{
+    using dasynq::time_val;
+    using loop_t = Loop_t;
+    loop_t my_loop;
+
+    class my_timer : public loop_t::group_timer_impl<my_timer>
+    {
+        public:
+        rearm timer_expiry(loop_t &loop, int expiry_count)
+        {
+            expiries += expiry_count;
+            return rearm::REARM;
+        }
+
+        int expiries = 0;
+    };
+
+    test_io_engine::cur_mono_time = time_val(0, 0);
+
+    struct timespec timeout_10 = { .tv_sec = 10, .tv_nsec = 0 };
+    loop_t::timer_group group(timeout_10);
+    group.add_group(my_loop);
+
+    my_timer timer_1;
+    my_timer timer_2;
+    my_timer timer_3;
+    timer_1.add_timer(my_loop, group);
+    timer_2.add_timer(my_loop, group);
+    timer_3.add_timer(my_loop, group);
+
+    // All three timers expire at 10 seconds:
+    timer_1.arm_timer(my_loop);
+    timer_2.arm_timer(my_loop);
+    timer_3.arm_timer(my_loop);
+
+    // Re-arm timer 1 at 5 seconds (expires at 15), and stop timer 2:
+    test_io_engine::cur_mono_time = time_val(5, 0);
+    timer_1.arm_timer(my_loop);
+    timer_2.stop_timer(my_loop);
+
+    test_io_engine::cur_mono_time = time_val(10, 0);
     my_loop.poll();
-    assert(timer.expiries == 1);
+    assert(timer_1.expiries == 0);
+    assert(timer_2.expiries == 0);
+    assert(timer_3.expiries == 1);
 
-    // Now try reducing timeout:
-    timeout.tv_sec = 4;
-    timer.arm_timer(my_loop, timeout);
-    timeout.tv_sec = 3;
-    timer.arm_timer(my_loop, timeout);
+    // Re-arm timer 3 (expires at 20):
+    timer_3.arm_timer(my_loop);
 
-    test_io_engine::cur_mono_time = time_val(3, 0);
+    test_io_engine::cur_mono_time = time_val(15, 0);
     my_loop.poll();
-    assert(timer.expiries == 2);
+    assert(timer_1.expiries == 1);
+    assert(timer_3.expiries == 1);
 
-    timer.deregister(my_loop);
+    // Stop timer 3; the group is now empty. Arm timer 2 (expires at 30):
+    timer_3.stop_timer(my_loop);
+    timer_2.arm_timer(my_loop);
+    test_io_engine::cur_mono_time = time_val(20, 0);
+    my_loop.poll();
+    assert(timer_2.expiries == 0);
+    assert(timer_3.expiries == 1);
+
+    test_io_engine::cur_mono_time = time_val(30, 0);
+    my_loop.poll();
+    assert(timer_1.expiries == 1);
+    assert(timer_2.expiries == 1);
+    assert(timer_3.expiries == 1);
+
+    // Several timers expiring at once are all reported:
+    timer_1.arm_timer(my_loop);
+    timer_2.arm_timer(my_loop);
+    test_io_engine::cur_mono_time = time_val(45, 0);
+    my_loop.poll();
+    assert(timer_1.expiries == 2);
+    assert(timer_2.expiries == 2);
+
+    timer_1.deregister(my_loop);
+    timer_2.deregister(my_loop);
+    timer_3.deregister(my_loop);
+    group.deregister(my_loop);
+}
+
+static void test_batch_timers()
+{
+    using dasynq::clock_type;
+    using dasynq::time_val;
+    using loop_t = Loop_t;
+    loop_t my_loop;
+
+    class my_timer : public loop_t::timer_impl<my_timer>
+    {
+        public:
+        rearm timer_expiry(loop_t &loop, int expiry_count)
+        {
+            expiries += expiry_count;
+            return rearm::REARM;
+        }
+
+        int expiries = 0;
+    };
+
+    test_io_engine::cur_mono_time = time_val(0, 0);
+    test_io_engine::cur_sys_time = time_val(0, 0);
+
+    const int num_timers = 6;
+    my_timer timers[num_timers];
+    std::vector<loop_t::timer_setting> settings;
+    for (int i = 0; i < num_timers; i++) {
+        // Alternate between clocks; timer i expires at (i + 1) seconds:
+        timers[i].add_timer(my_loop, (i % 2) ? clock_type::SYSTEM : clock_type::MONOTONIC);
+        settings.emplace_back(&timers[i], timespec {i + 1, 0});
+    }
+
+    my_loop.arm_timers(settings.data(), settings.size());
+
+    // Stop timers 2 and 3 (one for each clock):
+    loop_t::timer *stop_list[] = { &timers[2], &timers[3] };
+    my_loop.stop_timers(stop_list, 2);
+
+    test_io_engine::cur_mono_time = time_val(2, 0);
+    test_io_engine::cur_sys_time = time_val(2, 0);
+    my_loop.poll();
+    assert(timers[0].expiries == 1);
+    assert(timers[1].expiries == 1);
+    assert(timers[2].expiries == 0);
+
+    test_io_engine::cur_mono_time = time_val(10, 0);
+    test_io_engine::cur_sys_time = time_val(10, 0);
+    my_loop.poll();
+    assert(timers[2].expiries == 0);
+    assert(timers[3].expiries == 0);
+    assert(timers[4].expiries == 1);
+    assert(timers[5].expiries == 1);
+
+    // Re-arming in a batch replaces the previous timeout:
+    settings.clear();
+    settings.emplace_back(&timers[0], timespec {20, 0});
+    settings.emplace_back(&timers[1], timespec {12, 0}, timespec {4, 0});
+    my_loop.arm_timers(settings.data(), settings.size());
+    settings.clear();
+    settings.emplace_back(&timers[0], timespec {15, 0});
+    my_loop.arm_timers(settings.data(), settings.size());
+
+    test_io_engine::cur_mono_time = time_val(16, 0);
+    test_io_engine::cur_sys_time = time_val(16, 0);
+    my_loop.poll();
+    assert(timers[0].expiries == 2);
+    assert(timers[1].expiries == 3);  // 12 and 16 seconds
+
+    for (int i = 0; i < num_timers; i++) {
+        timers[i].deregister(my_loop);
+    }
+}
+
+static void test_timespec_div()
+{
+    using dasynq::divide_timespec;
+
+    struct timespec n;
+    struct timespec d;
+    struct timespec rem;
+
+    // 0.9999.. / 0.2
+    n.tv_sec = 0;
+    n.tv_nsec = 999999999;
+    d.tv_sec = 0;
+    d.tv_nsec = 200000000;
+
+    assert(divide_timespec(n, d, rem) == 4);
+    assert(rem.tv_sec == 0);
+    assert(rem.tv_nsec == 199999999);
+
+    // 0.9999.. / 0.1
+    d.tv_nsec = 100000000;
+    assert(divide_timespec(n, d, rem) == 9);
+    assert(rem.tv_sec == 0);
+    assert(rem.tv_nsec == 99999999);
+
+    // 12.0 / 2.9999..
+    n.tv_sec = 12;
+    n.tv_nsec = 0; // n is 12.0
+    d.tv_sec = 2;
+    d.tv_nsec = 999999999; // d is now 2.999999..
+    assert(divide_timespec(n, d, rem) == 4);
+    assert(rem.tv_sec == 0);
+    assert(rem.tv_nsec == 4);
+
+    // 12.999999996 / 2.99...
+    n.tv_nsec = 999999996;
+    assert(divide_timespec(n, d, rem) == 4);
+    assert(rem.tv_sec == 1);
+    assert(rem.tv_nsec == 0);
+
+    // 0.9 / 1.5
+    n.tv_sec = 0;
+    n.tv_nsec = 900000000;
+    d.tv_sec = 1;
+    d.tv_nsec = 500000000;
+    assert(divide_timespec(n, d, rem) == 0);
+    assert(rem.tv_sec == 0);
+    assert(rem.tv_nsec == 900000000);
+}
+
+static void test_time_val_sub()
+{
+    using dasynq::time_val;
+
+    time_val t1 = {0, 0};
+    time_val t2 = {0, 0};
+    time_val t3 = t2 - t1;
+
+    assert(t3 == time_val(0, 0));
+
+    t1 = {0, 1};
+    t2 = {1, 0};
+    t3 = t2 - t1;
+
+    assert(t3 == time_val(0, 999999999));
+
+    t1 = {3, 4};
+    t2 = {5, 7};
+    t3 = t2 - t1;
+
+    assert(t3 == time_val(2, 3));
+}
+
+static void test_timers_1()
+{
+    using dasynq::clock_type;
+    using dasynq::time_val;
+    using loop_t = Loop_t;
+    loop_t my_loop;
+
+    class my_timer : public loop_t::timer_impl<my_timer>
+    {
+        public:
+        rearm timer_expiry(loop_t &loop, int expiry_count)
+        {
+            expiries += expiry_count;
+            return rearm::REARM;
+        }
+
+        int expiries = 0;
+    };
+
+    // First timer is a one-shot timer expiring at 3 seconds:
+    my_timer timer_1;
+    struct timespec timeout_1 = { .tv_sec = 3, .tv_nsec = 0 };
+    timer_1.add_timer(my_loop, clock_type::MONOTONIC);
+    timer_1.arm_timer(my_loop, timeout_1);
+
+    // Second timer expires at 4 seconds and then every 1 second after:
+    my_timer timer_2;
+    struct timespec timeout_2 = { .tv_sec = 4, .tv_nsec = 0 };
+    struct timespec interval_2 = { .tv_sec = 1, .tv_nsec = 0 };
+    timer_2.add_timer(my_loop, clock_type::MONOTONIC);
+    timer_2.arm_timer(my_loop, timeout_2, interval_2);
+
+    test_io_engine::cur_mono_time = time_val(0, 0);
+
+    my_loop.poll();
+    assert(timer_1.expiries == 0);
+    assert(timer_2.expiries == 0);
+
+    // After 1 second, should be no expirations:
+    test_io_engine::cur_mono_time = time_val(1, 0);
+    my_loop.poll();
+    assert(timer_1.expiries == 0);
+    assert(timer_2.expiries == 0);
+
+    // After 3 seconds, should have one expiration on t1:
+    test_io_engine::cur_mono_time = time_val(3, 0);
+    my_loop.poll();
+    assert(timer_1.expiries == 1);
+    assert(timer_2.expiries == 0);
+
+    // After 4.5 seconds, should have an expiration on t2:
+    test_io_engine::cur_mono_time = time_val(4, 500000000);
+    my_loop.poll();
+    assert(timer_1.expiries == 1);
+    assert(timer_2.expiries == 1);
+
+    // After 5.5 seconds, a second expiration on t2:
+    test_io_engine::cur_mono_time = time_val(5, 500000000);
+    my_loop.poll();
+    assert(timer_1.expiries == 1);
+    assert(timer_2.expiries == 2);
+
+    // After 6 seconds, a third expiration on t2:
+    test_io_engine::cur_mono_time = time_val(6, 0);
+    my_loop.poll();
+    assert(timer_1.expiries == 1);
+    assert(timer_2.expiries == 3);
+
+    timer_1.deregister(my_loop);
+    timer_2.deregister(my_loop);
+}
+
+static void test_timers_2()
+{
+    using dasynq::clock_type;
+    using dasynq::time_val;
+    using loop_t = Loop_t;
+    loop_t my_loop;
+
+    class my_timer : public loop_t::timer_impl<my_timer>
+    {
+        public:
+        rearm timer_expiry(loop_t &loop, int expiry_count)
+        {
+            expiries += expiry_count;
+            return handler_rearm;
+        }
+
+        int expiries = 0;
+        rearm handler_rearm = rearm::REARM;
+    };
+
+    // Create timer expiring at 1 second intervals:
+    my_timer timer_1;
+    struct timespec timeout_1 = { .tv_sec = 1, .tv_nsec = 0 };
+    struct timespec interval_1 = { .tv_sec = 1, .tv_nsec = 0 };
+    timer_1.add_timer(my_loop, clock_type::MONOTONIC);
+    timer_1.arm_timer(my_loop, timeout_1, interval_1);
+
+    test_io_engine::cur_mono_time = time_val(0, 0);
+    my_loop.poll();
+    assert(timer_1.expiries == 0);
+
+    // Have the timer disarm after it fires once:
+    test_io_engine::cur_mono_time = time_val(1, 0);
+    timer_1.handler_rearm = rearm::DISARM;
+    my_loop.poll();
+    assert(timer_1.expiries == 1);
+
+    // Check that the timer doesn't fire when disabled:
+    test_io_engine::cur_mono_time = time_val(5, 0);
+    my_loop.poll();
+    assert(timer_1.expiries == 1);
+
+    // Re-enable timer and check that it fires immediately:
+    timer_1.set_enabled(my_loop, clock_type::MONOTONIC, true);
+    my_loop.poll();
+    assert(timer_1.expiries == 5);
+
+    // It's disabled again; check 2 more periods:
+    test_io_engine::cur_mono_time = time_val(7, 0);
+    my_loop.poll();
+    assert(timer_1.expiries == 5);
+
+    // Re-enable, and then disable, and wait two more periods:
+    timer_1.set_enabled(my_loop, clock_type::MONOTONIC, true);
+    timer_1.set_enabled(my_loop, clock_type::MONOTONIC, false);
+    test_io_engine::cur_mono_time = time_val(9, 0);
+    my_loop.poll();
+    assert(timer_1.expiries == 5);
+
+    // Now re-enable and check for the 4 missing periods reported:
+    timer_1.set_enabled(my_loop, clock_type::MONOTONIC, true);
+    my_loop.poll();
+    assert(timer_1.expiries == 9);
+
+    timer_1.deregister(my_loop);
+}
+
+static void test_timers_3()
+{
+    // Create a lot of timers, test they come out in the right
+    // order:
+
+    using dasynq::clock_type;
+    using dasynq::time_val;
+    using loop_t = Loop_t;
+    loop_t my_loop;
+
+    class my_timer : public loop_t::timer_impl<my_timer>
+    {
+        public:
+        rearm timer_expiry(loop_t &loop, int expiry_count)
+        {
+            expiries += expiry_count;
+            return handler_rearm;
+        }
+
+        int expiries = 0;
+        rearm handler_rearm = rearm::DISARM;
+    };
+
+    my_timer timers[100];
+
+    // Create a series of timers, each expiring 1ns after the previous:
+
+    struct timespec timeout_1 = { .tv_sec = 1, .tv_nsec = 0 };
+
+    for (auto & t : timers) {
+        t.add_timer(my_loop, clock_type::MONOTONIC);
+        t.arm_timer(my_loop, timeout_1);
+        timeout_1.tv_nsec++;
+    }
+
+    test_io_engine::cur_mono_time = time_val(0, 0);
+    my_loop.poll();
+    for (auto &  t : timers) {
+        assert(t.expiries == 0);
+    }
+
+    for (int i = 0; i < 100; i++) {
+        test_io_engine::cur_mono_time = time_val(1, i);
+        my_loop.poll();
+        assert(timers[i].expiries == 1);
+    }
+
+    // Now try in reverse order:
+    timeout_1.tv_sec = 2;
+    for (int i = 0; i < 100; i++) {
+        timeout_1.tv_nsec = 99 - i;
+        timers[i].arm_timer(my_loop, timeout_1);
+    }
+
+    for (int i = 0; i < 100; i++) {
+        test_io_engine::cur_mono_time = time_val(2, i);
+        my_loop.poll();
+        assert(timers[99 - i].expiries == 2);
+    }
+
+    for (int i = 0; i < 100; i++) {
+        timers[i].deregister(my_loop);
+    }
+}
+
+static void test_timers_4()
+{
+    // Test that we can re-arm a lone timer:
+
+    using dasynq::clock_type;
+    using dasynq::time_val;
+    using loop_t = Loop_t;
+    loop_t my_loop;
+
+    class my_timer : public loop_t::timer_impl<my_timer>
+    {
+        public:
+        rearm timer_expiry(loop_t &loop, int expiry_count)
+        {
+            expiries += expiry_count;
+            return handler_rearm;
+        }
+
+        int expiries = 0;
+        rearm handler_rearm = rearm::DISARM;
+    };
+
+    my_timer timer;
+
+    // Create a series of timers, each expiring 1ns after the previous:
+
+    struct timespec timeout = { .tv_sec = 1, .tv_nsec = 0 };
+
+    timer.add_timer(my_loop, clock_type::MONOTONIC);
+    timer.arm_timer(my_loop, timeout);
+
+    timeout.tv_sec++;
+
+    timer.arm_timer(my_loop, timeout);
+
+    test_io_engine::cur_mono_time = time_val(1, 0);
+    my_loop.poll();
+    assert(timer.expiries == 0);
+
+    test_io_engine::cur_mono_time = time_val(2, 0);
+    my_loop.poll();
+    assert(timer.expiries == 1);
+
+    // Now try reducing timeout:
+    timeout.tv_sec = 4;
+    timer.arm_timer(my_loop, timeout);
+    timeout.tv_sec = 3;
+    timer.arm_timer(my_loop, timeout);
+
+    test_io_engine::cur_mono_time = time_val(3, 0);
+    my_loop.poll();
+    assert(timer.expiries == 2);
+
+    timer.deregister(my_loop);
+}
+
+static void create_pipe(int filedes[2])
+{
+    if (pipe(filedes) == -1) {
+        throw std::system_error(errno, std::system_category());
+    }
+}
+
+static void create_bidi_pipe(int filedes[2])
+{
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, filedes) == -1) {
+        throw std::system_error(errno, std::system_category());
+    }
+}
+
+void ftest_fd_watch1()
+{
+    using Loop_t = dasynq::event_loop<checking_mutex>;
+    Loop_t my_loop;
+
+    bool seen1 = false;
+    bool seen2 = false;
+
+    int pipe1[2];
+    int pipe2[2];
+    create_pipe(pipe1);
+    create_pipe(pipe2);
+
+    Loop_t::fd_watcher::add_watch(my_loop, pipe1[0], dasynq::IN_EVENTS,
+            [&seen1](Loop_t &eloop, int fd, int flags) -> rearm {
+        seen1 = true;
+        return rearm::REMOVE;
+    });
+
+    Loop_t::fd_watcher::add_watch(my_loop, pipe2[0], dasynq::IN_EVENTS,
+            [&seen2](Loop_t &eloop, int fd, int flags) -> rearm {
+        seen2 = true;
+        return rearm::REMOVE;
+    });
+
+    // test_io_engine::trigger_fd_event(0, dasynq::IN_EVENTS);
+    char wbuf[1] = {'a'};
+    char rbuf[1];
+    write(pipe1[1], wbuf, 1);
+
+    my_loop.run();
+
+    assert(seen1);
+    assert(!seen2);
+
+    seen1 = false;
+
+    read(pipe1[0], rbuf, 1);
+
+    //test_io_engine::trigger_fd_event(0, dasynq::IN_EVENTS);
+    //test_io_engine::trigger_fd_event(1, dasynq::IN_EVENTS);
+    write(pipe1[1], wbuf, 1);
+    write(pipe2[1], wbuf, 1);
+
+    my_loop.run();
+
+    assert(!seen1);
+    assert(seen2);
+
+    close(pipe1[0]);
+    close(pipe1[1]);
+    close(pipe2[0]);
+    close(pipe2[1]);
+}
+
+// Check that watchers registered as "fast" (above the fast fd priority threshold) receive events,
+// can be re-armed, disabled and removed, and are dispatched ahead of many other ready watchers.
+void ftest_fast_fd_watch()
+{
+    using Loop_t = dasynq::event_loop<checking_mutex>;
+    Loop_t my_loop;
+    my_loop.set_fast_fd_priority(10);
+
+    const int num_bulk = 40;
+    int bulk_pipes[num_bulk][2];
+    int fast_pipe[2];
+    std::vector<int> order;
+    char wbuf[1] = {'a'};
+
+    std::vector<Loop_t::fd_watcher *> bulk_watchers;
+    for (int i = 0; i < num_bulk; i++) {
+        create_pipe(bulk_pipes[i]);
+        int bulk_fd = bulk_pipes[i][0];
+        auto w = Loop_t::fd_watcher::add_watch(my_loop, bulk_fd, dasynq::IN_EVENTS,
+                [&order, bulk_fd](Loop_t &eloop, int fd, int flags) -> rearm {
+            char buf[1];
+            read(fd, buf, 1);
+            order.push_back(bulk_fd);
+            return rearm::REARM;
+        });
+        bulk_watchers.push_back(w);
+    }
+
+    create_pipe(fast_pipe);
+
+    class fast_watcher : public Loop_t::fd_watcher_impl<fast_watcher>
+    {
+        public:
+        std::vector<int> &order;
+
+        fast_watcher(std::vector<int> &order_p) : order(order_p) { }
+
+        rearm fd_event(Loop_t &eloop, int fd, int flags)
+        {
+            char buf[1];
+            read(fd, buf, 1);
+            order.push_back(fd);
+            return rearm::REARM;
+        }
+    };
+
+    fast_watcher fwatcher(order);
+    fwatcher.add_watch(my_loop, fast_pipe[0], dasynq::IN_EVENTS, true, 1);
+
+    for (int i = 0; i < num_bulk; i++) {
+        write(bulk_pipes[i][1], wbuf, 1);
+    }
+    write(fast_pipe[1], wbuf, 1);
+
+    my_loop.run(1);
+    assert(order.size() == 1);
+    assert(order[0] == fast_pipe[0]);
+
+    while (order.size() < num_bulk + 1) {
+        my_loop.run();
+    }
+
+    // Re-armed: should receive another event
+    write(fast_pipe[1], wbuf, 1);
+    my_loop.run();
+    assert(order.size() == num_bulk + 2);
+    assert(order.back() == fast_pipe[0]);
+
+    // Disabled: should not receive an event
+    fwatcher.set_enabled(my_loop, false);
+    write(fast_pipe[1], wbuf, 1);
+    my_loop.poll();
+    assert(order.size() == num_bulk + 2);
+
+    fwatcher.set_enabled(my_loop, true);
+    my_loop.run();
+    assert(order.size() == num_bulk + 3);
+    assert(order.back() == fast_pipe[0]);
+
+    // After removal, the same descriptor can be added as a regular (non-fast) watch:
+    fwatcher.deregister(my_loop);
+    fwatcher.add_watch(my_loop, fast_pipe[0], dasynq::IN_EVENTS, true, 50);
+    write(fast_pipe[1], wbuf, 1);
+    my_loop.run();
+    assert(order.size() == num_bulk + 4);
+    assert(order.back() == fast_pipe[0]);
+    fwatcher.deregister(my_loop);
+
+    for (int i = 0; i < num_bulk; i++) {
+        bulk_watchers[i]->deregister(my_loop);
+        close(bulk_pipes[i][0]);
+        close(bulk_pipes[i][1]);
+    }
+    close(fast_pipe[0]);
+    close(fast_pipe[1]);
+}
+
+// If a batch registration fails, watchers registered earlier in the batch are removed.
+void ftest_register_fds_rollback()
+{
+    using Loop_t = dasynq::event_loop<checking_mutex>;
+    Loop_t my_loop;
+
+    class my_fd_watcher : public Loop_t::fd_watcher_impl<my_fd_watcher>
+    {
+        public:
+        int events = 0;
+
+        rearm fd_event(Loop_t &eloop, int fd, int flags)
+        {
+            char buf[1];
+            read(fd, buf, 1);
+            events++;
+            return rearm::REARM;
+        }
+    };
+
+    int pipes[3][2];
+    my_fd_watcher watchers[3];
+    std::vector<Loop_t::fd_registration> regs;
+    for (int i = 0; i < 3; i++) {
+        create_pipe(pipes[i]);
+        regs.emplace_back(&watchers[i], pipes[i][0], dasynq::IN_EVENTS);
+    }
+
+    // An invalid descriptor in the middle of the batch causes failure (all backends reject a negative
+    // descriptor with EBADF):
+    my_fd_watcher bad_watcher;
+    regs.insert(regs.begin() + 2, Loop_t::fd_registration(&bad_watcher, -1, dasynq::IN_EVENTS));
+
+    int errcode = 0;
+    try {
+        my_loop.register_fds(regs.data(), regs.size());
+    }
+    catch (std::system_error &e) {
+        errcode = e.code().value();
+    }
+    assert(errcode == EBADF);
+
+    // The watchers can now be registered (they would fail with EEXIST if still registered):
+    regs.erase(regs.begin() + 2);
+    my_loop.register_fds(regs.data(), regs.size());
+
+    char wbuf[1] = {'a'};
+    write(pipes[1][1], wbuf, 1);
+    my_loop.run();
+    assert(watchers[0].events == 0);
+    assert(watchers[1].events == 1);
+    assert(watchers[2].events == 0);
+
+    for (int i = 0; i < 3; i++) {
+        watchers[i].deregister(my_loop);
+        close(pipes[i][0]);
+        close(pipes[i][1]);
+    }
+}
+
+void ftest_bidi_fd_watch1()
+{
+    using Loop_t = dasynq::event_loop<checking_mutex>;
+    Loop_t my_loop;
+
+    bool flags1[3] = { false, false, false };  // in, out, removed
+
+    int pipe1[2];
+    create_bidi_pipe(pipe1);
+
+    class MyBidiWatcher : public Loop_t::bidi_fd_watcher_impl<MyBidiWatcher> {
+        bool (&flags)[3];
+
+        public:
+        MyBidiWatcher(bool (&flags_a)[3]) : flags(flags_a)
+        {
+        }
+
+        rearm read_ready(Loop_t &eloop, int fd) noexcept
+        {
+            flags[0] = true;
+            char rbuf;
+            read(fd, &rbuf, 1);
+            return rearm::REMOVE;
+        }
+
+        rearm write_ready(Loop_t &eloop, int fd) noexcept
+        {
+            flags[1] = true;
+            return rearm::REMOVE;
+        }
+
+        void watch_removed() noexcept override
+        {
+            flags[2] = true;
+        }
+    };
+
+    MyBidiWatcher watch {flags1};
+
+    // Both read and write trigger remove. Once both have triggered, the watch should auto-remove.
+
+    char wbuf = 'a';
+    write(pipe1[1], &wbuf, 1);
+
+    watch.add_watch(my_loop, pipe1[0], dasynq::IN_EVENTS | dasynq::OUT_EVENTS);
+
+    my_loop.run();
+
+    assert(flags1[0] && flags1[1]);   // in and out flag should be set
+    assert(flags1[2]);
+
+    close(pipe1[0]);
+    close(pipe1[1]);
+}
+
+void ftest_bidi_fd_watch2()
+{
+    using Loop_t = dasynq::event_loop<checking_mutex>;
+    Loop_t my_loop;
+
+    bool flags1[3] = { false, false, false };  // in, out, removed
+
+    int pipe1[2];
+    create_bidi_pipe(pipe1);
+
+    class MyBidiWatcher : public Loop_t::bidi_fd_watcher_impl<MyBidiWatcher> {
+        bool (&flags)[3];
+
+        public:
+        MyBidiWatcher(bool (&flags_a)[3]) : flags(flags_a)
+        {
+        }
+
+        rearm read_ready(Loop_t &eloop, int fd) noexcept
+        {
+            flags[0] = true;
+            char rbuf;
+            read(fd, &rbuf, 1);
+            return rearm::REMOVE;
+        }
+
+        rearm write_ready(Loop_t &eloop, int fd) noexcept
+        {
+            flags[1] = true;
+            return rearm::REARM;
+        }
+
+        void watch_removed() noexcept override
+        {
+            flags[2] = true;
+        }
+    };
+
+    MyBidiWatcher watch {flags1};
+
+    // Only read watch triggers remove. Once both have triggered, the watch should not have been removed.
+
+    char wbuf = 'a';
+    write(pipe1[1], &wbuf, 1);
+
+    watch.add_watch(my_loop, pipe1[0], dasynq::IN_EVENTS | dasynq::OUT_EVENTS);
+
+    my_loop.run();
+
+    assert(flags1[0] && flags1[1]);   // in and out flag should be set
+    assert(! flags1[2]);  // watch not removed (write watch not removed)
+
+    flags1[0] = false;
+    flags1[1] = false;
+
+    // Send more to pipe; read watch should not see this, as it is inactive:
+    write(pipe1[1], &wbuf, 1);
+
+    my_loop.run();
+
+    assert(!flags1[0]); // should see no input
+    assert(flags1[1]);  // should see output
+    assert(! flags1[2]);  // watch not removed
+
+    close(pipe1[0]);
+    close(pipe1[1]);
+
+    watch.deregister(my_loop);
+}
+
+void ftest_bidi_fd_watch3()
+{
+    using Loop_t = dasynq::event_loop<checking_mutex>;
+    Loop_t my_loop;
+
+    bool flags1[3] = { false, false, false };  // in, out, removed
+
+    int pipe1[2];
+    create_bidi_pipe(pipe1);
+
+    class MyBidiWatcher : public Loop_t::bidi_fd_watcher_impl<MyBidiWatcher> {
+        bool (&flags)[3];
+
+        public:
+        MyBidiWatcher(bool (&flags_a)[3]) : flags(flags_a)
+        {
+        }
+
+        rearm read_ready(Loop_t &eloop, int fd) noexcept
+        {
+            flags[0] = true;
+            char rbuf;
+            read(fd, &rbuf, 1);
+            return rearm::REARM;
+        }
+
+        rearm write_ready(Loop_t &eloop, int fd) noexcept
+        {
+            flags[1] = true;
+            return rearm::NOOP;
+        }
+
+        void watch_removed() noexcept override
+        {
+            flags[2] = true;
+        }
+    };
+
+    MyBidiWatcher watch {flags1};
+
+    watch.add_watch(my_loop, pipe1[0], dasynq::IN_EVENTS | dasynq::OUT_EVENTS);
+
+    my_loop.run(); // write watch should trigger, and remain disabled
+
+    assert(flags1[1]);
+    assert(!flags1[0]);
+    assert(!flags1[2]);
+
+    watch.set_watches(my_loop, dasynq::IN_EVENTS | dasynq::OUT_EVENTS);
+
+    char wbuf = 'a';
+    write(pipe1[1], &wbuf, 1);
+
+    my_loop.run();
+
+    assert(flags1[0] && flags1[1]);   // in and out flag should be set
+    assert(! flags1[2]);  // watch not removed (write watch not removed)
+
+    flags1[0] = false;
+    flags1[1] = false;
+
+    // Send more to pipe
+    write(pipe1[1], &wbuf, 1);
+
+    my_loop.run();
+
+    assert(flags1[0]); // should see input
+    assert(! flags1[1]);  // should see output
+    assert(! flags1[2]);  // watch not removed
+
+    close(pipe1[0]);
+    close(pipe1[1]);
+
+    watch.deregister(my_loop);
+}
+
+void ftest_bidi_fd_watch4()
+{
+    using Loop_t = dasynq::event_loop<checking_mutex>;
+    Loop_t my_loop;
+
+    bool flags1[2] = { false, false };  // in, out
+
+    int pipe1[2];
+    create_bidi_pipe(pipe1);
+
+    class MyBidiWatcher : public Loop_t::bidi_fd_watcher_impl<MyBidiWatcher> {
+        bool (&flags)[2];
+
+        public:
+        MyBidiWatcher(bool (&flags_a)[2]) : flags(flags_a)
+        {
+        }
+
+        rearm read_ready(Loop_t &eloop, int fd) noexcept
+        {
+            flags[0] = true;
+            char rbuf;
+            read(fd, &rbuf, 1);
+            return rearm::REARM;
+        }
+
+        rearm write_ready(Loop_t &eloop, int fd) noexcept
+        {
+            flags[1] = true;
+            return rearm::DISARM;
+        }
+    };
+
+    MyBidiWatcher watch {flags1};
+
+    // Add with only the read watch enabled; the write watch, enabled later, must still dispatch
+    // to this watcher:
+    watch.add_watch(my_loop, pipe1[0], dasynq::IN_EVENTS);
+    watch.set_out_watch_enabled(my_loop, true);
+
+    my_loop.run();
+
+    assert(! flags1[0]);
+    assert(flags1[1]);
+
+    flags1[1] = false;
+
+    char wbuf = 'a';
+    write(pipe1[1], &wbuf, 1);
+
+    my_loop.run();
+
+    assert(flags1[0]);
+    assert(! flags1[1]);  // write watch disarmed
+
+    watch.deregister(my_loop);
+
+    close(pipe1[0]);
+    close(pipe1[1]);
+}
+
+// function test for removing the watches for a descriptor other than the most recently added (with the
+// poll backend, the last descriptor's slot is moved into the removed descriptor's slot)
+void ftest_fd_watch_remove_middle()
+{
+    using Loop_t = dasynq::event_loop<checking_mutex>;
+    Loop_t my_loop;
+
+    class MyBidiWatcher : public Loop_t::bidi_fd_watcher_impl<MyBidiWatcher> {
+        public:
+        int in_events = 0;
+        int out_events = 0;
+
+        rearm read_ready(Loop_t &eloop, int fd) noexcept
+        {
+            in_events++;
+            char rbuf;
+            read(fd, &rbuf, 1);
+            return rearm::REARM;
+        }
+
+        rearm write_ready(Loop_t &eloop, int fd) noexcept
+        {
+            out_events++;
+            return rearm::DISARM;
+        }
+    };
+
+    int pipes[3][2];
+    MyBidiWatcher watches[3];
+    for (int i = 0; i < 3; i++) {
+        create_bidi_pipe(pipes[i]);
+        watches[i].add_watch(my_loop, pipes[i][0], dasynq::IN_EVENTS | dasynq::OUT_EVENTS);
+    }
+
+    for (int i = 0; i < 3; i++) {
+        while (watches[i].out_events == 0) {
+            my_loop.run();
+        }
+    }
+
+    // Remove the middle watcher (both directions), then check that events for the other descriptors
+    // are dispatched to the correct watchers:
+    watches[1].deregister(my_loop);
+
+    char wbuf = 'a';
+    for (int i = 0; i < 3; i++) {
+        write(pipes[i][1], &wbuf, 1);
+    }
+    watches[2].set_out_watch_enabled(my_loop, true);
+
+    while (watches[0].in_events == 0 || watches[2].in_events == 0 || watches[2].out_events == 1) {
+        my_loop.run();
+    }
+    my_loop.poll();
+
+    assert(watches[0].in_events == 1);
+    assert(watches[0].out_events == 1);
+    assert(watches[1].in_events == 0);
+    assert(watches[1].out_events == 1);
+    assert(watches[2].in_events == 1);
+    assert(watches[2].out_events == 2);
+
+    watches[0].deregister(my_loop);
+    watches[2].deregister(my_loop);
+
+    // discard the byte written to the removed watcher's descriptor:
+    char rbuf;
+    read(pipes[1][0], &rbuf, 1);
+
+    if (Loop_t::loop_traits_t::has_separate_rw_fd_watches) {
+        // The same, with separate read and write watchers for each descriptor, removed one at a time:
+        class MyFdWatcher : public Loop_t::fd_watcher_impl<MyFdWatcher> {
+            public:
+            bool is_in = false;
+            int events = 0;
+
+            rearm fd_event(Loop_t &eloop, int fd, int flags) noexcept
+            {
+                events++;
+                if (is_in) {
+                    char rbuf;
+                    read(fd, &rbuf, 1);
+                    return rearm::REARM;
+                }
+                return rearm::DISARM;
+            }
+        };
+
+        MyFdWatcher in_watches[3];
+        MyFdWatcher out_watches[3];
+        for (int i = 0; i < 3; i++) {
+            in_watches[i].is_in = true;
+            in_watches[i].add_watch(my_loop, pipes[i][0], dasynq::IN_EVENTS);
+            out_watches[i].add_watch(my_loop, pipes[i][0], dasynq::OUT_EVENTS);
+        }
+
+        for (int i = 0; i < 3; i++) {
+            while (out_watches[i].events == 0) {
+                my_loop.run();
+            }
+        }
+
+        // The descriptor remains watched while either watch remains:
+        in_watches[1].deregister(my_loop);
+        out_watches[1].set_enabled(my_loop, true);
+        while (out_watches[1].events == 1) {
+            my_loop.run();
+        }
+        out_watches[1].deregister(my_loop);
+
+        for (int i = 0; i < 3; i++) {
+            write(pipes[i][1], &wbuf, 1);
+        }
+        out_watches[2].set_enabled(my_loop, true);
+
+        while (in_watches[0].events == 0 || in_watches[2].events == 0 || out_watches[2].events == 1) {
+            my_loop.run();
+        }
+        my_loop.poll();
+
+        assert(in_watches[0].events == 1);
+        assert(out_watches[0].events == 1);
+        assert(in_watches[1].events == 0);
+        assert(out_watches[1].events == 2);
+        assert(in_watches[2].events == 1);
+        assert(out_watches[2].events == 2);
+
+        for (int i : {0, 2}) {
+            in_watches[i].deregister(my_loop);
+            out_watches[i].deregister(my_loop);
+        }
+    }
+
+    for (int i = 0; i < 3; i++) {
+        close(pipes[i][0]);
+        close(pipes[i][1]);
+    }
+}
+
+#if DASYNQ_HAVE_KQUEUE || DASYNQ_HAVE_EPOLL || DASYNQ_HAVE_POLL
+// function test for watching descriptors numbered FD_SETSIZE or higher (which the select-based backends
+// do not support)
+void ftest_fd_watch_high_fd()
+{
+    using Loop_t = dasynq::event_loop<checking_mutex>;
+
+    int high_fd = FD_SETSIZE + 10;
+
+    struct rlimit rl;
+    getrlimit(RLIMIT_NOFILE, &rl);
+    if (rl.rlim_cur <= rlim_t(high_fd + 1)) {
+        if (rl.rlim_max <= rlim_t(high_fd + 1)) {
+            // can't open a descriptor that high; nothing to test
+            return;
+        }
+        rl.rlim_cur = high_fd + 2;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    Loop_t my_loop;
+
+    int pipe1[2];
+    int pipe2[2];
+    create_bidi_pipe(pipe1);
+    create_pipe(pipe2);
+
+    // move pipe1 to high-numbered descriptors:
+    int r1 = dup2(pipe1[0], high_fd);
+    int r2 = dup2(pipe1[1], high_fd + 1);
+    assert(r1 == high_fd && r2 == high_fd + 1);
+    close(pipe1[0]);
+    close(pipe1[1]);
+
+    int high_in_events = 0;
+    int high_out_events = 0;
+    int low_in_events = 0;
+
+    auto *low_watch = Loop_t::fd_watcher::add_watch(my_loop, pipe2[0], dasynq::IN_EVENTS,
+            [&low_in_events](Loop_t &eloop, int fd, int flags) -> rearm {
+        char rbuf;
+        read(fd, &rbuf, 1);
+        low_in_events++;
+        return rearm::REARM;
+    });
+
+    auto *high_in_watch = Loop_t::fd_watcher::add_watch(my_loop, high_fd, dasynq::IN_EVENTS,
+            [&high_in_events](Loop_t &eloop, int fd, int flags) -> rearm {
+        char rbuf;
+        read(fd, &rbuf, 1);
+        high_in_events++;
+        return rearm::REARM;
+    });
+
+    auto *high_out_watch = Loop_t::fd_watcher::add_watch(my_loop, high_fd + 1, dasynq::OUT_EVENTS,
+            [&high_out_events](Loop_t &eloop, int fd, int flags) -> rearm {
+        char wbuf = 'a';
+        write(fd, &wbuf, 1);
+        high_out_events++;
+        return rearm::DISARM;
+    });
+
+    char wbuf = 'a';
+    write(pipe2[1], &wbuf, 1);
+
+    while (high_in_events == 0 || low_in_events == 0) {
+        my_loop.run();
+    }
+
+    assert(high_out_events == 1);
+    assert(high_in_events == 1);
+    assert(low_in_events == 1);
+
+    low_watch->deregister(my_loop);
+    high_in_watch->deregister(my_loop);
+    high_out_watch->deregister(my_loop);
+
+    close(high_fd);
+    close(high_fd + 1);
+    close(pipe2[0]);
+    close(pipe2[1]);
+}
+#endif
+
+void ftest_stream_watcher()
+{
+    using Loop_t = dasynq::event_loop<checking_mutex>;
+    Loop_t my_loop;
+
+    int pipe1[2];
+    create_bidi_pipe(pipe1);
+    fcntl(pipe1[0], F_SETFL, O_NONBLOCK);
+    fcntl(pipe1[1], F_SETFL, O_NONBLOCK);
+
+    class my_stream_watcher : public Loop_t::stream_watcher_impl<my_stream_watcher> {
+        public:
+        std::string received;
+        int high_water = 0;
+        int low_water = 0;
+        int closed_err = -1;
+
+        rearm data_received(Loop_t &eloop, dasynq::stream_buffer &input) noexcept
+        {
+            char buf[64];
+            size_t n;
+            while ((n = input.read(buf, sizeof(buf))) != 0) {
+                received.append(buf, n);
+            }
+            return rearm::REARM;
+        }
+
+        rearm input_closed(Loop_t &eloop, int errcode) noexcept
+        {
+            closed_err = errcode;
+            return rearm::DISARM;
+        }
+
+        void output_high_water(Loop_t &eloop) noexcept
+        {
+            high_water++;
+        }
+
+        void output_low_water(Loop_t &eloop) noexcept
+        {
+            low_water++;
+        }
+    };
+
+    my_stream_watcher watch;
+    watch.add_watch(my_loop, pipe1[0]);
+    watch.set_output_watermarks(0, 64 * 1024);
+
+    // Input:
+    write(pipe1[1], "hello", 5);
+    my_loop.run();
+    assert(watch.received == "hello");
+
+    // Small output is written immediately:
+    assert(watch.send(my_loop, "world", 5));
+    assert(watch.get_output_size() == 0);
+    char rbuf[4096];
+    assert(read(pipe1[1], rbuf, sizeof(rbuf)) == 5);
+    assert(memcmp(rbuf, "world", 5) == 0);
+
+    // Large output is buffered, and written as the peer reads:
+    std::vector<char> big(1024 * 1024);
+    for (size_t i = 0; i < big.size(); i++) {
+        big[i] = char(i * 7 + (i >> 12));
+    }
+    assert(watch.send(my_loop, big.data(), big.size()));
+    assert(watch.get_output_size() != 0);
+    assert(watch.high_water == 1);
+    assert(watch.low_water == 0);
+
+    std::vector<char> got;
+    while (got.size() < big.size()) {
+        ssize_t r = read(pipe1[1], rbuf, sizeof(rbuf));
+        if (r > 0) {
+            got.insert(got.end(), rbuf, rbuf + r);
+        }
+        else {
+            my_loop.run();
+        }
+    }
+    assert(got == big);
+    my_loop.poll();
+    assert(watch.get_output_size() == 0);
+    assert(watch.low_water == 1);
+
+    // End of input:
+    shutdown(pipe1[1], SHUT_WR);
+    my_loop.run();
+    assert(watch.closed_err == 0);
+
+    watch.deregister(my_loop);
+    close(pipe1[0]);
+    close(pipe1[1]);
 }
 
-static void create_pipe(int filedes[2])
+void ftest_stream_buffer_pool()
 {
-    if (pipe(filedes) == -1) {
-        throw std::system_error(errno, std::system_category());
+    using Loop_t = dasynq::event_loop<checking_mutex>;
+    Loop_t my_loop;
+
+    // Two connections sharing the loop's buffer pool. Each keeps the last byte it receives
+    // buffered, until it receives a '.':
+    class my_stream_watcher : public Loop_t::stream_watcher_impl<my_stream_watcher> {
+        public:
+        size_t received = 0;
+        size_t in_use_during = 0;
+
+        rearm data_received(Loop_t &eloop, dasynq::stream_buffer &input) noexcept
+        {
+            in_use_during = eloop.get_stats().buffer_segments_in_use;
+            char buf[64];
+            while (input.size() > 1) {
+                received += input.read(buf, std::min(sizeof(buf), input.size() - 1));
+            }
+            input.peek(buf, 1);
+            if (buf[0] == '.') {
+                input.consume(1);
+                received++;
+            }
+            return rearm::REARM;
+        }
+    };
+
+    int pipe1[2], pipe2[2];
+    create_bidi_pipe(pipe1);
+    create_bidi_pipe(pipe2);
+    fcntl(pipe1[0], F_SETFL, O_NONBLOCK);
+    fcntl(pipe2[0], F_SETFL, O_NONBLOCK);
+
+    my_stream_watcher watch1, watch2;
+    watch1.add_watch(my_loop, pipe1[0]);
+    watch2.add_watch(my_loop, pipe2[0]);
+
+    // Registered, but nothing read yet: no segments are held.
+    dasynq::loop_stats stats = my_loop.get_stats();
+    assert(stats.buffer_segments_in_use == 0);
+    assert(stats.buffer_segment_size == dasynq::stream_buffer::segment_size);
+
+    write(pipe1[1], "abc", 3);
+    write(pipe2[1], "xyz.", 4);
+    while (watch1.received < 2 || watch2.received < 4) {
+        my_loop.run();
     }
-}
 
-static void create_bidi_pipe(int filedes[2])
-{
-    if (socketpair(AF_UNIX, SOCK_STREAM, 0, filedes) == -1) {
-        throw std::system_error(errno, std::system_category());
+    // During a read, a segment is borrowed; afterwards, only the connection with pending data
+    // (watch1) holds one, and the other is back in the pool.
+    assert(watch1.in_use_during >= 1 && watch2.in_use_during >= 1);
+    stats = my_loop.get_stats();
+    assert(stats.buffer_segments_in_use == 1);
+    assert(stats.buffer_segments_free >= 1);
+    assert(watch1.get_input_buffer().size() == 1);
+
+    write(pipe1[1], ".", 1);
+    while (watch1.received < 4) {
+        my_loop.run();
     }
+    stats = my_loop.get_stats();
+    assert(stats.buffer_segments_in_use == 0);
+
+    // Trimming the pool releases free segments:
+    my_loop.get_stream_buffer_pool().set_max_free(0);
+    assert(my_loop.get_stats().buffer_segments_free == 0);
+
+    watch1.deregister(my_loop);
+    watch2.deregister(my_loop);
+    close(pipe1[0]);
+    close(pipe1[1]);
+    close(pipe2[0]);
+    close(pipe2[1]);
 }
 
-void ftest_fd_watch1()
+void ftest_transfer_watcher()
 {
     using Loop_t = dasynq::event_loop<checking_mutex>;
     Loop_t my_loop;
 
-    bool seen1 = false;
-    bool seen2 = false;
-
     int pipe1[2];
     int pipe2[2];
-    create_pipe(pipe1);
-    create_pipe(pipe2);
-
-    Loop_t::fd_watcher::add_watch(my_loop, pipe1[0], dasynq::IN_EVENTS,
-            [&seen1](Loop_t &eloop, int fd, int flags) -> rearm {
-        seen1 = true;
-        return rearm::REMOVE;
-    });
+    create_bidi_pipe(pipe1);
+    create_bidi_pipe(pipe2);
+    for (int fd : { pipe1[0], pipe1[1], pipe2[0], pipe2[1] }) {
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+    }
 
-    Loop_t::fd_watcher::add_watch(my_loop, pipe2[0], dasynq::IN_EVENTS,
-            [&seen2](Loop_t &eloop, int fd, int flags) -> rearm {
-        seen2 = true;
-        return rearm::REMOVE;
-    });
+    class my_transfer_watcher : public Loop_t::transfer_watcher_impl<my_transfer_watcher> {
+        public:
+        size_t bytes[2] = { 0, 0 };
+        dasynq::transfer_status status[2] = { dasynq::transfer_status::PROGRESS, dasynq::transfer_status::PROGRESS };
+        bool removed = false;
 
-    // test_io_engine::trigger_fd_event(0, dasynq::IN_EVENTS);
-    char wbuf[1] = {'a'};
-    char rbuf[1];
-    write(pipe1[1], wbuf, 1);
+        rearm transfer_event(Loop_t &eloop, int channel, size_t nbytes, dasynq::transfer_status xstatus) noexcept
+        {
+            bytes[channel] += nbytes;
+            status[channel] = xstatus;
+            return rearm::REARM;
+        }
 
-    my_loop.run();
+        void watch_removed() noexcept
+        {
+            removed = true;
+        }
+    };
 
-    assert(seen1);
-    assert(!seen2);
+    // Transfer (in both directions) between pipe1[1] and pipe2[0]:
+    my_transfer_watcher watch;
+    watch.add_watch(my_loop, pipe1[1], pipe2[0], true);
 
-    seen1 = false;
+    std::vector<char> big(1024 * 1024);
+    for (size_t i = 0; i < big.size(); i++) {
+        big[i] = char(i * 7 + (i >> 12));
+    }
 
-    read(pipe1[0], rbuf, 1);
+    std::vector<char> got;
+    size_t written = 0;
+    char rbuf[4096];
+    while (got.size() < big.size()) {
+        if (written < big.size()) {
+            ssize_t r = write(pipe1[0], big.data() + written, big.size() - written);
+            if (r > 0) written += r;
+        }
+        ssize_t r = read(pipe2[1], rbuf, sizeof(rbuf));
+        if (r > 0) {
+            got.insert(got.end(), rbuf, rbuf + r);
+        }
+        else {
+            my_loop.run();
+        }
+    }
+    assert(got == big);
+    assert(watch.bytes[0] == big.size());
+    assert(watch.get_bytes_transferred(0) == big.size());
+    assert(watch.status[0] == dasynq::transfer_status::PROGRESS);
+
+    // Reverse direction:
+    write(pipe2[1], "hello", 5);
+    while (watch.bytes[1] < 5) {
+        my_loop.run();
+    }
+    assert(read(pipe1[0], rbuf, sizeof(rbuf)) == 5);
+    assert(memcmp(rbuf, "hello", 5) == 0);
 
-    //test_io_engine::trigger_fd_event(0, dasynq::IN_EVENTS);
-    //test_io_engine::trigger_fd_event(1, dasynq::IN_EVENTS);
-    write(pipe1[1], wbuf, 1);
-    write(pipe2[1], wbuf, 1);
+    // End of input in one direction:
+    shutdown(pipe1[0], SHUT_WR);
+    while (watch.status[0] == dasynq::transfer_status::PROGRESS) {
+        my_loop.run();
+    }
+    assert(watch.status[0] == dasynq::transfer_status::COMPLETE);
+    assert(watch.status[1] == dasynq::transfer_status::PROGRESS);
 
-    my_loop.run();
+    watch.deregister(my_loop);
+    assert(watch.removed);
+
+    // Transfer from a regular file:
+    char tmpname[] = "/tmp/dasynq-test-XXXXXX";
+    int file_fd = mkstemp(tmpname);
+    assert(file_fd != -1);
+    unlink(tmpname);
+    assert(write(file_fd, big.data(), big.size()) == (ssize_t)big.size());
+
+    my_transfer_watcher fwatch;
+    fwatch.add_file_watch(my_loop, file_fd, 4096, big.size() - 4096, pipe2[0]);
+
+    got.clear();
+    while (got.size() < big.size() - 4096) {
+        ssize_t r = read(pipe2[1], rbuf, sizeof(rbuf));
+        if (r > 0) {
+            got.insert(got.end(), rbuf, rbuf + r);
+        }
+        else {
+            my_loop.run();
+        }
+    }
+    assert(std::equal(got.begin(), got.end(), big.begin() + 4096));
+    while (fwatch.status[0] == dasynq::transfer_status::PROGRESS) {
+        my_loop.run();
+    }
+    assert(fwatch.status[0] == dasynq::transfer_status::COMPLETE);
+    assert(fwatch.bytes[0] == big.size() - 4096);
 
-    assert(!seen1);
-    assert(seen2);
+    fwatch.deregister(my_loop);
+    assert(fwatch.removed);
 
+    close(file_fd);
     close(pipe1[0]);
     close(pipe1[1]);
     close(pipe2[0]);
     close(pipe2[1]);
 }
 
-void ftest_bidi_fd_watch1()
+void ftest_datagram_watcher()
 {
     using Loop_t = dasynq::event_loop<checking_mutex>;
     Loop_t my_loop;
 
-    bool flags1[3] = { false, false, false };  // in, out, removed
-
-    int pipe1[2];
-    create_bidi_pipe(pipe1);
-
-    class MyBidiWatcher : public Loop_t::bidi_fd_watcher_impl<MyBidiWatcher> {
-        bool (&flags)[3];
-
+    class my_datagram_watcher : public Loop_t::datagram_watcher_impl<my_datagram_watcher> {
         public:
-        MyBidiWatcher(bool (&flags_a)[3]) : flags(flags_a)
+        std::vector<std::string> received;
+        int send_errors = 0;
+
+        rearm datagrams_received(Loop_t &eloop, const dasynq::datagram *dgrams, size_t count) noexcept
         {
+            for (size_t i = 0; i < count; i++) {
+                assert(! dgrams[i].truncated);
+                assert(dgrams[i].addr != nullptr);
+                received.emplace_back(dgrams[i].data, dgrams[i].len);
+            }
+            return rearm::REARM;
         }
 
-        rearm read_ready(Loop_t &eloop, int fd) noexcept
+        void send_error(Loop_t &eloop, int errcode) noexcept
         {
-            flags[0] = true;
-            char rbuf;
-            read(fd, &rbuf, 1);
-            return rearm::REMOVE;
+            send_errors++;
         }
+    };
 
-        rearm write_ready(Loop_t &eloop, int fd) noexcept
-        {
-            flags[1] = true;
-            return rearm::REMOVE;
+    for (int offload = 0; offload < 2; offload++) {
+        int socks[2];
+        struct sockaddr_in addrs[2];
+        for (int i = 0; i < 2; i++) {
+            socks[i] = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+            assert(socks[i] != -1);
+            memset(&addrs[i], 0, sizeof(addrs[i]));
+            addrs[i].sin_family = AF_INET;
+            addrs[i].sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            assert(bind(socks[i], (struct sockaddr *)&addrs[i], sizeof(addrs[i])) == 0);
+            socklen_t len = sizeof(addrs[i]);
+            getsockname(socks[i], (struct sockaddr *)&addrs[i], &len);
         }
 
-        void watch_removed() noexcept override
+        my_datagram_watcher sender;
+        my_datagram_watcher receiver;
+        sender.set_offload(offload, offload);
+        receiver.set_offload(offload, offload);
+        sender.add_watch(my_loop, socks[0]);
+        receiver.add_watch(my_loop, socks[1]);
+
+        // A batch of equal-sized datagrams, followed by a shorter one:
+        const int num_dgrams = 40;
+        std::vector<std::string> sent;
+        for (int i = 0; i < num_dgrams; i++) {
+            std::string dgram(1000, char('a' + i % 26));
+            dgram[0] = char(i);
+            if (i == num_dgrams - 1) dgram.resize(10);
+            sent.push_back(dgram);
+            assert(sender.queue_datagram(my_loop, dgram.data(), dgram.size(),
+                    (struct sockaddr *)&addrs[1], sizeof(addrs[1])));
+        }
+        assert(sender.get_queued_count() == num_dgrams);
+        sender.flush(my_loop);
+
+        while (receiver.received.size() < sent.size()) {
+            my_loop.run();
+        }
+        assert(receiver.received == sent);
+        assert(sender.get_queued_count() == 0);
+        assert(sender.send_errors == 0);
+
+        // Reply to the sender:
+        assert(receiver.send_to(my_loop, "reply", 5, (struct sockaddr *)&addrs[0], sizeof(addrs[0])));
+        while (sender.received.empty()) {
+            my_loop.run();
+        }
+        assert(sender.received.size() == 1 && sender.received[0] == "reply");
+
+        sender.deregister(my_loop);
+        receiver.deregister(my_loop);
+        close(socks[0]);
+        close(socks[1]);
+    }
+}
+
+void ftest_listener_watcher()
+{
+    using Loop_t = dasynq::event_loop<checking_mutex>;
+    Loop_t my_loop;
+
+    int listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    assert(listen_fd != -1);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    assert(bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+    socklen_t addr_len = sizeof(addr);
+    getsockname(listen_fd, (struct sockaddr *)&addr, &addr_len);
+    assert(listen(listen_fd, 64) == 0);
+
+    // Records the order of events: 'L' for a batch of connections, 'P' for the pipe watcher:
+    std::string events;
+
+    class my_listener : public Loop_t::listener_watcher_impl<my_listener> {
+        public:
+        std::string *events;
+        std::vector<int> accepted;
+        size_t max_batch = 0;
+
+        rearm connections_accepted(Loop_t &eloop, const int *fds, size_t count) noexcept
         {
-            flags[2] = true;
+            *events += 'L';
+            for (size_t i = 0; i < count; i++) {
+                assert(fcntl(fds[i], F_GETFL) & O_NONBLOCK);
+                accepted.push_back(fds[i]);
+            }
+            max_batch = std::max(max_batch, count);
+            return rearm::REARM;
         }
     };
 
-    MyBidiWatcher watch {flags1};
-
-    // Both read and write trigger remove. Once both have triggered, the watch should auto-remove.
+    my_listener listener;
+    listener.events = &events;
+    listener.set_accept_budget(4);
+    listener.add_watch(my_loop, listen_fd);
 
-    char wbuf = 'a';
-    write(pipe1[1], &wbuf, 1);
+    int pipe1[2];
+    create_pipe(pipe1);
+    write(pipe1[1], "x", 1);
 
-    watch.add_watch(my_loop, pipe1[0], dasynq::IN_EVENTS | dasynq::OUT_EVENTS);
+    auto pipe_watcher = Loop_t::fd_watcher::add_watch(my_loop, pipe1[0], dasynq::IN_EVENTS,
+            [&](Loop_t &eloop, int fd, int flags) -> rearm {
+        events += 'P';
+        return rearm::DISARM;
+    });
 
-    my_loop.run();
+    const int num_clients = 10;
+    std::vector<int> clients;
+    for (int i = 0; i < num_clients; i++) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        assert(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+        clients.push_back(fd);
+    }
 
-    assert(flags1[0] && flags1[1]);   // in and out flag should be set
-    assert(flags1[2]);
+    while (listener.accepted.size() < num_clients || events.find('P') == std::string::npos) {
+        my_loop.run();
+    }
 
+    assert(listener.accepted.size() == num_clients);
+    assert(listener.max_batch == 4);
+    assert(events.size() == 4);
+    // The budget was exhausted, so the listener was requeued behind the pipe watcher:
+    assert(events.find('P') < events.rfind('L'));
+
+    listener.deregister(my_loop);
+    pipe_watcher->deregister(my_loop);
+    for (int fd : listener.accepted) close(fd);
+    for (int fd : clients) close(fd);
+    close(listen_fd);
     close(pipe1[0]);
     close(pipe1[1]);
 }
 
-void ftest_bidi_fd_watch2()
+void ftest_zerocopy_watcher()
 {
     using Loop_t = dasynq::event_loop<checking_mutex>;
     Loop_t my_loop;
 
-    bool flags1[3] = { false, false, false };  // in, out, removed
-
-    int pipe1[2];
-    create_bidi_pipe(pipe1);
-
-    class MyBidiWatcher : public Loop_t::bidi_fd_watcher_impl<MyBidiWatcher> {
-        bool (&flags)[3];
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    assert(listen_fd != -1);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    assert(bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+    socklen_t addr_len = sizeof(addr);
+    getsockname(listen_fd, (struct sockaddr *)&addr, &addr_len);
+    assert(listen(listen_fd, 1) == 0);
+
+    int send_fd = socket(AF_INET, SOCK_STREAM, 0);
+    assert(connect(send_fd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+    int recv_fd = accept(listen_fd, nullptr, nullptr);
+    assert(recv_fd != -1);
+    fcntl(send_fd, F_SETFL, fcntl(send_fd, F_GETFL) | O_NONBLOCK);
+    fcntl(recv_fd, F_SETFL, fcntl(recv_fd, F_GETFL) | O_NONBLOCK);
+
+    // Large buffers (zero-copy, if supported) interleaved with a small buffer (always copied):
+    const size_t big_size = 256 * 1024;
+    std::vector<char> big1(big_size), big2(big_size);
+    for (size_t i = 0; i < big_size; i++) {
+        big1[i] = char(i % 251);
+        big2[i] = char(i % 241);
+    }
+    const char small[] = "small buffer";
 
+    class my_zc_watcher : public Loop_t::zerocopy_watcher_impl<my_zc_watcher> {
         public:
-        MyBidiWatcher(bool (&flags_a)[3]) : flags(flags_a)
+        std::vector<const void *> released;
+
+        void send_complete(Loop_t &eloop, const void *data, size_t len) noexcept
         {
+            released.push_back(data);
         }
+    };
 
-        rearm read_ready(Loop_t &eloop, int fd) noexcept
+    my_zc_watcher zc_watcher;
+    zc_watcher.add_watch(my_loop, send_fd);
+
+    assert(zc_watcher.send(my_loop, big1.data(), big_size));
+    assert(zc_watcher.send(my_loop, small, sizeof(small)));
+    assert(zc_watcher.send(my_loop, big2.data(), big_size));
+
+    std::vector<char> received;
+    auto recv_watcher = Loop_t::fd_watcher::add_watch(my_loop, recv_fd, dasynq::IN_EVENTS,
+            [&](Loop_t &eloop, int fd, int flags) -> rearm {
+        char buf[16384];
+        ssize_t r;
+        while ((r = read(fd, buf, sizeof(buf))) > 0) {
+            received.insert(received.end(), buf, buf + r);
+        }
+        return rearm::REARM;
+    });
+
+    const size_t total = big_size * 2 + sizeof(small);
+    while (received.size() < total || zc_watcher.get_pending_count() != 0) {
+        my_loop.run();
+    }
+
+    // Buffers are released in order, once the kernel is done with them:
+    assert(zc_watcher.released.size() == 3);
+    assert(zc_watcher.released[0] == big1.data());
+    assert(zc_watcher.released[1] == small);
+    assert(zc_watcher.released[2] == big2.data());
+    assert(zc_watcher.get_send_error() == 0);
+
+    assert(received.size() == total);
+    assert(std::equal(big1.begin(), big1.end(), received.begin()));
+    assert(memcmp(received.data() + big_size, small, sizeof(small)) == 0);
+    assert(std::equal(big2.begin(), big2.end(), received.begin() + big_size + sizeof(small)));
+
+    // An empty buffer sent while output is blocked doesn't complete the partly-sent buffer before it:
+    int sndbuf = 65536;
+    setsockopt(send_fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+    const size_t huge_size = 4 * 1024 * 1024;
+    std::vector<char> huge(huge_size);
+    for (size_t i = 0; i < huge_size; i++) {
+        huge[i] = char(i % 239);
+    }
+    received.clear();
+    zc_watcher.released.clear();
+    assert(zc_watcher.send(my_loop, huge.data(), huge_size));
+    assert(zc_watcher.send(my_loop, small, 0));
+    assert(zc_watcher.get_pending_count() == 2);
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+    while (received.size() < huge_size || zc_watcher.get_pending_count() != 0) {
+        assert(std::chrono::steady_clock::now() < deadline);
+        my_loop.poll();
+    }
+    assert(received.size() == huge_size);
+    assert(std::equal(huge.begin(), huge.end(), received.begin()));
+    assert(zc_watcher.released.size() == 2);
+    assert(zc_watcher.released[0] == huge.data());
+    assert(zc_watcher.released[1] == small);
+
+    // Small sends are copied, and released immediately:
+    assert(zc_watcher.send(my_loop, small, sizeof(small)));
+    assert(zc_watcher.released.size() == 3);
+
+    zc_watcher.deregister(my_loop);
+    recv_watcher->deregister(my_loop);
+    close(send_fd);
+    close(recv_fd);
+    close(listen_fd);
+}
+
+void ftest_file_io_watcher()
+{
+    using Loop_t = dasynq::event_loop<checking_mutex>;
+    Loop_t my_loop;
+
+    char tmpl[] = "/tmp/dasynq-test-XXXXXX";
+    int file_fd = mkstemp(tmpl);
+    assert(file_fd != -1);
+    unlink(tmpl);
+
+    Loop_t::file_io_pool pool;
+    pool.add_pool(my_loop, 2);
+
+    // Write, then sync, then read back (each operation submitted from the handler for the previous):
+    class my_file_io : public Loop_t::file_io_watcher_impl<my_file_io> {
+        public:
+        int fd;
+        int stage = 0;
+        char rbuf[64];
+        ssize_t read_len = -1;
+
+        rearm io_complete(Loop_t &eloop, ssize_t result, int errcode) noexcept
         {
-            flags[0] = true;
-            char rbuf;
-            read(fd, &rbuf, 1);
-            return rearm::REMOVE;
+            assert(result != -1 && errcode == 0);
+            switch (stage++) {
+            case 0:
+                assert(result == 11);
+                fsync(eloop, fd, true);
+                break;
+            case 1:
+                assert(result == 0);
+                read(eloop, fd, rbuf, sizeof(rbuf), 6);
+                break;
+            default:
+                read_len = result;
+                break;
+            }
+            return rearm::REARM;
         }
+    };
 
-        rearm write_ready(Loop_t &eloop, int fd) noexcept
+    my_file_io fio;
+    fio.fd = file_fd;
+    fio.add_watch(my_loop, pool);
+    assert(fio.write(my_loop, file_fd, "hello world", 11, 0));
+    assert(! fio.write(my_loop, file_fd, "x", 1, 0)); // already in flight
+
+    while (fio.read_len == -1) {
+        my_loop.run();
+    }
+
+    assert(fio.stage == 3);
+    assert(fio.read_len == 5);
+    assert(memcmp(fio.rbuf, "world", 5) == 0);
+    fio.deregister(my_loop);
+
+    // Deregister while an operation is in flight: the handler should not be called, but
+    // watch_removed should be (once the operation completes).
+    class my_file_io2 : public Loop_t::file_io_watcher_impl<my_file_io2> {
+        public:
+        bool completed = false;
+        bool removed = false;
+
+        rearm io_complete(Loop_t &eloop, ssize_t result, int errcode) noexcept
         {
-            flags[1] = true;
+            completed = true;
             return rearm::REARM;
         }
 
         void watch_removed() noexcept override
         {
-            flags[2] = true;
+            removed = true;
         }
     };
 
-    MyBidiWatcher watch {flags1};
+    char rbuf[8];
+    my_file_io2 fio2;
+    fio2.add_watch(my_loop, pool);
+    assert(fio2.read(my_loop, file_fd, rbuf, sizeof(rbuf), 0));
+    fio2.deregister(my_loop);
 
-    // Only read watch triggers remove. Once both have triggered, the watch should not have been removed.
+    while (! fio2.removed) {
+        my_loop.run();
+    }
+    assert(! fio2.completed);
 
-    char wbuf = 'a';
-    write(pipe1[1], &wbuf, 1);
+    pool.remove_pool(my_loop);
+    close(file_fd);
+}
 
-    watch.add_watch(my_loop, pipe1[0], dasynq::IN_EVENTS | dasynq::OUT_EVENTS);
+void ftest_offload_pool()
+{
+    using Loop_t = dasynq::event_loop_th;
+    Loop_t my_loop;
 
-    my_loop.run();
+    Loop_t::offload_pool pool;
+    pool.add_pool(my_loop, 3);
+
+    // Jobs submitted via lambdas; the completion functions run in the loop thread:
+    const int num_jobs = 50;
+    std::vector<int> results(num_jobs, 0);
+    int completed = 0;
+    std::thread::id loop_thread = std::this_thread::get_id();
+    for (int i = 0; i < num_jobs; i++) {
+        pool.run(my_loop, [&results, i]() { results[i] = i * i; },
+                [&completed, loop_thread](Loop_t &eloop, std::exception_ptr exc) {
+                    assert(std::this_thread::get_id() == loop_thread);
+                    assert(! exc);
+                    completed++;
+                });
+    }
 
-    assert(flags1[0] && flags1[1]);   // in and out flag should be set
-    assert(! flags1[2]);  // watch not removed (write watch not removed)
+    // A job which throws: the exception is passed to the completion function.
+    bool caught = false;
+    pool.run(my_loop, []() { throw std::runtime_error("job failed"); },
+            [&caught](Loop_t &eloop, std::exception_ptr exc) {
+                try {
+                    std::rethrow_exception(exc);
+                }
+                catch (std::runtime_error &e) {
+                    caught = true;
+                }
+            });
+
+    // A watcher which resubmits its job from the completion handler:
+    class my_offload : public Loop_t::offload_watcher_impl<my_offload> {
+        public:
+        int runs = 0;
+        int completions = 0;
+        bool removed = false;
 
-    flags1[0] = false;
-    flags1[1] = false;
+        void run_job() noexcept
+        {
+            runs++;
+        }
 
-    // Send more to pipe; read watch should not see this, as it is inactive:
-    write(pipe1[1], &wbuf, 1);
+        rearm job_complete(Loop_t &eloop) noexcept
+        {
+            completions++;
+            assert(runs == completions);
+            if (completions < 5) {
+                assert(submit(eloop));
+                return rearm::REARM;
+            }
+            return rearm::REMOVE;
+        }
 
-    my_loop.run();
+        void watch_removed() noexcept override
+        {
+            removed = true;
+        }
+    };
 
-    assert(!flags1[0]); // should see no input
-    assert(flags1[1]);  // should see output
-    assert(! flags1[2]);  // watch not removed
+    my_offload offw;
+    offw.add_watch(my_loop, pool, dasynq::DEFAULT_PRIORITY - 1);
+    assert(offw.submit(my_loop));
+    assert(! offw.submit(my_loop)); // already in flight
 
-    close(pipe1[0]);
-    close(pipe1[1]);
+    while (completed < num_jobs || ! offw.removed || ! caught) {
+        my_loop.run();
+    }
 
-    watch.deregister(my_loop);
+    for (int i = 0; i < num_jobs; i++) {
+        assert(results[i] == i * i);
+    }
+    assert(offw.completions == 5);
+
+    pool.remove_pool(my_loop);
+
+    // A pool which is not removed is removed on destruction (the worker threads must be stopped):
+    Loop_t::offload_pool pool2;
+    pool2.add_pool(my_loop, 2);
+    int completed2 = 0;
+    pool2.run(my_loop, []() { }, [&completed2](Loop_t &eloop, std::exception_ptr exc) { completed2++; });
+    while (completed2 == 0) {
+        my_loop.run();
+    }
 }
 
-void ftest_bidi_fd_watch3()
+// Destroy a pool while jobs are in flight: their watchers are removed without reporting completion.
+template <typename Loop_t> void test_offload_pool_destroy()
 {
-    using Loop_t = dasynq::event_loop<checking_mutex>;
     Loop_t my_loop;
 
-    bool flags1[3] = { false, false, false };  // in, out, removed
-
-    int pipe1[2];
-    create_bidi_pipe(pipe1);
-
-    class MyBidiWatcher : public Loop_t::bidi_fd_watcher_impl<MyBidiWatcher> {
-        bool (&flags)[3];
-
+    class my_offload : public Loop_t::template offload_watcher_impl<my_offload> {
         public:
-        MyBidiWatcher(bool (&flags_a)[3]) : flags(flags_a)
-        {
-        }
+        bool completed = false;
+        bool removed = false;
 
-        rearm read_ready(Loop_t &eloop, int fd) noexcept
+        void run_job() noexcept
         {
-            flags[0] = true;
-            char rbuf;
-            read(fd, &rbuf, 1);
-            return rearm::REARM;
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
         }
 
-        rearm write_ready(Loop_t &eloop, int fd) noexcept
+        rearm job_complete(Loop_t &eloop) noexcept
         {
-            flags[1] = true;
-            return rearm::NOOP;
+            completed = true;
+            return rearm::REMOVE;
         }
 
         void watch_removed() noexcept override
         {
-            flags[2] = true;
+            removed = true;
         }
     };
 
-    MyBidiWatcher watch {flags1};
-
-    watch.add_watch(my_loop, pipe1[0], dasynq::IN_EVENTS | dasynq::OUT_EVENTS);
-
-    my_loop.run(); // write watch should trigger, and remain disabled
-
-    assert(flags1[1]);
-    assert(!flags1[0]);
-    assert(!flags1[2]);
-
-    watch.set_watches(my_loop, dasynq::IN_EVENTS | dasynq::OUT_EVENTS);
-
-    char wbuf = 'a';
-    write(pipe1[1], &wbuf, 1);
-
-    my_loop.run();
-
-    assert(flags1[0] && flags1[1]);   // in and out flag should be set
-    assert(! flags1[2]);  // watch not removed (write watch not removed)
-
-    flags1[0] = false;
-    flags1[1] = false;
-
-    // Send more to pipe
-    write(pipe1[1], &wbuf, 1);
+    my_offload offw;
+    bool done_called = false;
+    std::shared_ptr<int> token = std::make_shared<int>(0);
 
-    my_loop.run();
+    {
+        typename Loop_t::offload_pool pool;
+        pool.add_pool(my_loop, 2);
+        offw.add_watch(my_loop, pool);
+        assert(offw.submit(my_loop));
+        pool.run(my_loop, []() { std::this_thread::sleep_for(std::chrono::milliseconds(100)); },
+                [&done_called, token](Loop_t &eloop, std::exception_ptr exc) { done_called = true; });
+    }
 
-    assert(flags1[0]); // should see input
-    assert(! flags1[1]);  // should see output
-    assert(! flags1[2]);  // watch not removed
+    assert(offw.removed);
+    assert(token.use_count() == 1); // lambda watcher destroyed
 
-    close(pipe1[0]);
-    close(pipe1[1]);
+    my_loop.poll();
+    my_loop.poll();
+    assert(! offw.completed);
+    assert(! done_called);
+}
 
-    watch.deregister(my_loop);
+void ftest_offload_pool_destroy()
+{
+    test_offload_pool_destroy<dasynq::event_loop_th>();
+    test_offload_pool_destroy<dasynq::event_loop<checking_mutex>>();
 }
 
 void ftest_sig_watch1()
@@ -1063,6 +2969,183 @@ void ftest_sig_watch2()
     swatch->deregister(my_loop);
 }
 
+// function test for removing and re-adding a signal watch between polls (the pselect backend maintains
+// the signal mask used for polling as watches are added and removed)
+void ftest_sig_watch_readd()
+{
+    using Loop_t = dasynq::event_loop<checking_mutex>;
+    Loop_t my_loop;
+
+    int seen = 0;
+
+    using siginfo_p = Loop_t::signal_watcher::siginfo_p;
+
+    // (SIGURG is not used by other tests, so is not pending)
+    sigset_t sigmask;
+    sigemptyset(&sigmask);
+    sigaddset(&sigmask, SIGURG);
+    sigprocmask(SIG_BLOCK, &sigmask, nullptr);
+
+    auto handler = [&seen](Loop_t &eloop, int signo, siginfo_p info) -> rearm {
+        seen++;
+        return rearm::REMOVE;
+    };
+
+    // Add and remove the watch, with a poll in between. The signal must then be masked while polling,
+    // and so remain pending:
+    auto *swatch = Loop_t::signal_watcher::add_watch(my_loop, SIGURG, handler);
+    my_loop.poll();
+    swatch->deregister(my_loop);
+    kill(getpid(), SIGURG);
+    my_loop.poll();
+
+    assert(seen == 0);
+
+    // ... until the watch is re-added:
+    Loop_t::signal_watcher::add_watch(my_loop, SIGURG, handler);
+    my_loop.poll();
+
+    assert(seen == 1);
+
+    // The watch was removed when the signal was received; again, the signal must remain pending:
+    kill(getpid(), SIGURG);
+    my_loop.poll();
+
+    assert(seen == 1);
+
+    // ... until the watch is re-added:
+    Loop_t::signal_watcher::add_watch(my_loop, SIGURG, handler);
+    my_loop.poll();
+
+    assert(seen == 2);
+}
+
+// function test for a coalescing signal watcher
+void ftest_sig_coalesce()
+{
+    using Loop_t = dasynq::event_loop<checking_mutex>;
+    Loop_t my_loop;
+
+    int signo = SIGRTMIN + 1;
+
+    sigset_t sigmask;
+    sigemptyset(&sigmask);
+    sigaddset(&sigmask, signo);
+    sigprocmask(SIG_BLOCK, &sigmask, nullptr);
+
+    class my_sig_watcher : public Loop_t::signal_watcher_impl<my_sig_watcher>
+    {
+        public:
+        int dispatches = 0;
+        int count = 0;
+        int last_value = 0;
+        rearm rearm_type = rearm::REARM;
+
+        rearm received(Loop_t &eloop, int signo, siginfo_p siginfo)
+        {
+            assert(get_signal_count() > 0);
+            dispatches++;
+            count += get_signal_count();
+            last_value = siginfo.get_sival_int();
+            return rearm_type;
+        }
+    };
+
+    my_sig_watcher swatch;
+    swatch.add_watch(my_loop, signo, dasynq::DEFAULT_PRIORITY, true);
+
+    // Realtime signals are queued individually:
+    for (int i = 1; i <= 3; i++) {
+        union sigval val;
+        val.sival_int = i;
+        sigqueue(getpid(), signo, val);
+    }
+
+    my_loop.run();
+
+    assert(swatch.dispatches == 1);
+    assert(swatch.count == 3);
+    assert(swatch.last_value == 3);
+
+    // The watch remains enabled:
+    union sigval val;
+    val.sival_int = 4;
+    sigqueue(getpid(), signo, val);
+
+    my_loop.run();
+
+    assert(swatch.dispatches == 2);
+    assert(swatch.count == 4);
+    assert(swatch.last_value == 4);
+
+    // REQUEUE is treated as REARM (no further dispatch unless another signal is received):
+    swatch.rearm_type = rearm::REQUEUE;
+    val.sival_int = 5;
+    sigqueue(getpid(), signo, val);
+
+    my_loop.run();
+    my_loop.poll();
+
+    assert(swatch.dispatches == 3);
+    assert(swatch.count == 5);
+
+    swatch.deregister(my_loop);
+    sigprocmask(SIG_UNBLOCK, &sigmask, nullptr);
+}
+
+// function test for a loop without child watch support or a separate system clock timer
+void ftest_custom_traits()
+{
+    using traits_t = dasynq::custom_traits<checking_mutex>::no_child_watch::no_system_timers;
+    using loop_t = dasynq::event_loop<checking_mutex, traits_t>;
+    using clock_type = dasynq::clock_type;
+    loop_t my_loop;
+
+    int fired = 0;
+    int fd_events = 0;
+
+    struct timespec timeout;
+    my_loop.get_time(timeout, clock_type::SYSTEM, true);
+    timeout.tv_nsec += 10000000;
+    if (timeout.tv_nsec >= 1000000000) {
+        timeout.tv_sec++;
+        timeout.tv_nsec -= 1000000000;
+    }
+
+    loop_t::timer::add_timer(my_loop, clock_type::SYSTEM, false, timeout, {0, 0},
+            [&fired](loop_t &eloop, int expiry_count) -> rearm {
+        fired++;
+        return rearm::REMOVE;
+    });
+
+    loop_t::timer::add_timer(my_loop, clock_type::MONOTONIC, true, {0, 20000000}, {0, 0},
+            [&fired](loop_t &eloop, int expiry_count) -> rearm {
+        fired++;
+        return rearm::REMOVE;
+    });
+
+    int pipefds[2];
+    create_pipe(pipefds);
+    auto *fwatch = loop_t::fd_watcher::add_watch(my_loop, pipefds[0], dasynq::IN_EVENTS,
+            [&fd_events](loop_t &eloop, int fd, int flags) -> rearm {
+        char buf[1];
+        read(fd, buf, 1);
+        fd_events++;
+        return rearm::REARM;
+    });
+
+    write(pipefds[1], "a", 1);
+
+    while (fired < 2) {
+        my_loop.run();
+    }
+    assert(fd_events == 1);
+
+    fwatch->deregister(my_loop);
+    close(pipefds[0]);
+    close(pipefds[1]);
+}
+
 // function test for immediate timer expiry
 void ftest_timers1()
 {
@@ -1258,6 +3341,144 @@ void ftest_timers4()
     timer_2.deregister(my_loop);
 }
 
+#if ! DASYNQ_HAVE_KQUEUE && DASYNQ_HAVE_EPOLL
+
+// Loop traits using the epoll_pwait2 timer mechanism; if use_pwait2 is false, the timerfd fallback is used
+// (as if epoll_pwait2 were not supported by the kernel).
+template <typename T_Mutex, bool use_pwait2>
+class pwait2_test_traits : public dasynq::default_traits<T_Mutex>
+{
+    public:
+    using backend_traits_t = dasynq::epoll_traits<dasynq::pwait2_timer_traits<
+            dasynq::interrupt_channel_traits<dasynq::child_proc_traits_for<false>>, use_pwait2>>;
+    template <typename Base> using backend_t = typename backend_traits_t::template backend_tmpl<Base>;
+};
+
+// Count the open file descriptors (below 1024) of the process
+static int count_open_fds()
+{
+    int count = 0;
+    for (int fd = 0; fd < 1024; fd++) {
+        if (fcntl(fd, F_GETFD) != -1) count++;
+    }
+    return count;
+}
+
+// Check that a timer armed from another thread, earlier than the timer the loop is currently waiting for,
+// interrupts the wait and expires on time.
+template <typename loop_t>
+static void test_timer_cross_thread_rearm()
+{
+    using clock_type = dasynq::clock_type;
+    loop_t my_loop;
+
+    bool late_fired = false;
+    bool early_fired = false;
+
+    auto *late_timer = loop_t::timer::add_timer(my_loop, clock_type::MONOTONIC, true, {10, 0}, {0, 0},
+            [&late_fired](loop_t &eloop, int expiry_count) -> rearm {
+        late_fired = true;
+        return rearm::REARM;
+    });
+
+    auto start = std::chrono::steady_clock::now();
+
+    std::thread t([&my_loop, &early_fired]() {
+        while (! early_fired) {
+            my_loop.run();
+        }
+    });
+
+    // Give the loop thread time to begin waiting for the late timer:
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    loop_t::timer::add_timer(my_loop, clock_type::MONOTONIC, true, {0, 50000000}, {0, 0},
+            [&early_fired](loop_t &eloop, int expiry_count) -> rearm {
+        early_fired = true;
+        return rearm::REMOVE;
+    });
+
+    t.join();
+
+    assert(early_fired);
+    assert(! late_fired);
+    assert(std::chrono::steady_clock::now() - start < std::chrono::seconds(5));
+
+    late_timer->deregister(my_loop);
+}
+
+// function test for monotonic timer expiry via the epoll_pwait2 wait timeout
+void ftest_pwait2_timer()
+{
+    using loop_t = dasynq::event_loop<checking_mutex, pwait2_test_traits<checking_mutex, true>>;
+    using fallback_loop_t = dasynq::event_loop<checking_mutex, pwait2_test_traits<checking_mutex, false>>;
+    using clock_type = dasynq::clock_type;
+
+    int fd_base = count_open_fds();
+    loop_t my_loop;
+    int loop_fds = count_open_fds() - fd_base;
+
+    fd_base = count_open_fds();
+    {
+        fallback_loop_t fallback_loop;
+        int fallback_fds = count_open_fds() - fd_base;
+
+        // If epoll_pwait2 is available, the monotonic clock timerfd is not needed and should not be created:
+        if (dasynq::dprivate::epoll_pwait2_available()) {
+            assert(loop_fds == fallback_fds - 1);
+        }
+        else {
+            assert(loop_fds == fallback_fds);
+        }
+    }
+
+    int expiries = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    loop_t::timer::add_timer(my_loop, clock_type::MONOTONIC, true, {0, 50000000}, {0, 0},
+            [&expiries](loop_t &eloop, int expiry_count) -> rearm {
+        expiries += expiry_count;
+        return rearm::REMOVE;
+    });
+
+    while (expiries == 0) {
+        my_loop.run();
+    }
+
+    assert(expiries == 1);
+    assert(std::chrono::steady_clock::now() - start >= std::chrono::milliseconds(50));
+}
+
+// function test for a timer armed from another thread during an epoll_pwait2 wait
+void ftest_pwait2_timer_interrupt()
+{
+    test_timer_cross_thread_rearm<dasynq::event_loop<std::mutex, pwait2_test_traits<std::mutex, true>>>();
+}
+
+// function test for the timerfd fallback of the epoll_pwait2 timer mechanism
+void ftest_pwait2_timer_fallback()
+{
+    using loop_t = dasynq::event_loop<checking_mutex, pwait2_test_traits<checking_mutex, false>>;
+    using clock_type = dasynq::clock_type;
+    loop_t my_loop;
+
+    int expiries = 0;
+    loop_t::timer::add_timer(my_loop, clock_type::MONOTONIC, true, {0, 20000000}, {0, 0},
+            [&expiries](loop_t &eloop, int expiry_count) -> rearm {
+        expiries += expiry_count;
+        return rearm::REMOVE;
+    });
+
+    while (expiries == 0) {
+        my_loop.run();
+    }
+    assert(expiries == 1);
+
+    test_timer_cross_thread_rearm<dasynq::event_loop<std::mutex, pwait2_test_traits<std::mutex, false>>>();
+}
+
+#endif
+
 void ftest_multi_thread1()
 {
     using Loop_t = dasynq::event_loop<std::mutex>;
@@ -1540,6 +3761,42 @@ int main(int argc, char **argv)
     test_limited_run();
     std::cout << "PASSED" << std::endl;
 
+    std::cout << "test_repoll... ";
+    test_repoll();
+    std::cout << "PASSED" << std::endl;
+
+    std::cout << "test_queue_order... ";
+    test_queue_order();
+    std::cout << "PASSED" << std::endl;
+
+    std::cout << "test_allocator_lambdas... ";
+    test_allocator_lambdas();
+    std::cout << "PASSED" << std::endl;
+
+    std::cout << "test_loop_allocator... ";
+    test_loop_allocator();
+    std::cout << "PASSED" << std::endl;
+
+    std::cout << "test_reserve_and_register_fds... ";
+    test_reserve_and_register_fds();
+    std::cout << "PASSED" << std::endl;
+
+    std::cout << "test_watcher_set... ";
+    test_watcher_set();
+    std::cout << "PASSED" << std::endl;
+
+    std::cout << "test_timer_extend... ";
+    test_timer_extend();
+    std::cout << "PASSED" << std::endl;
+
+    std::cout << "test_timer_group... ";
+    test_timer_group();
+    std::cout << "PASSED" << std::endl;
+
+    std::cout << "test_batch_timers... ";
+    test_batch_timers();
+    std::cout << "PASSED" << std::endl;
+
     std::cout << "test_timespec_div... ";
     test_timespec_div();
     std::cout << "PASSED" << std::endl;
@@ -1568,6 +3825,14 @@ int main(int argc, char **argv)
     ftest_fd_watch1();
     std::cout << "PASSED" << std::endl;
 
+    std::cout << "ftest_fast_fd_watch... ";
+    ftest_fast_fd_watch();
+    std::cout << "PASSED" << std::endl;
+
+    std::cout << "ftest_register_fds_rollback... ";
+    ftest_register_fds_rollback();
+    std::cout << "PASSED" << std::endl;
+
     std::cout << "ftest_bidi_fd_watch1... ";
     ftest_bidi_fd_watch1();
     std::cout << "PASSED" << std::endl;
@@ -1580,6 +3845,56 @@ int main(int argc, char **argv)
     ftest_bidi_fd_watch3();
     std::cout << "PASSED" << std::endl;
 
+    std::cout << "ftest_bidi_fd_watch4... ";
+    ftest_bidi_fd_watch4();
+    std::cout << "PASSED" << std::endl;
+
+    std::cout << "ftest_fd_watch_remove_middle... ";
+    ftest_fd_watch_remove_middle();
+    std::cout << "PASSED" << std::endl;
+
+#if DASYNQ_HAVE_KQUEUE || DASYNQ_HAVE_EPOLL || DASYNQ_HAVE_POLL
+    std::cout << "ftest_fd_watch_high_fd... ";
+    ftest_fd_watch_high_fd();
+    std::cout << "PASSED" << std::endl;
+
+#endif
+    std::cout << "ftest_stream_watcher... ";
+    ftest_stream_watcher();
+    std::cout << "PASSED" << std::endl;
+
+    std::cout << "ftest_stream_buffer_pool... ";
+    ftest_stream_buffer_pool();
+    std::cout << "PASSED" << std::endl;
+
+    std::cout << "ftest_transfer_watcher... ";
+    ftest_transfer_watcher();
+    std::cout << "PASSED" << std::endl;
+
+    std::cout << "ftest_datagram_watcher... ";
+    ftest_datagram_watcher();
+    std::cout << "PASSED" << std::endl;
+
+    std::cout << "ftest_listener_watcher... ";
+    ftest_listener_watcher();
+    std::cout << "PASSED" << std::endl;
+
+    std::cout << "ftest_zerocopy_watcher... ";
+    ftest_zerocopy_watcher();
+    std::cout << "PASSED" << std::endl;
+
+    std::cout << "ftest_file_io_watcher... ";
+    ftest_file_io_watcher();
+    std::cout << "PASSED" << std::endl;
+
+    std::cout << "ftest_offload_pool... ";
+    ftest_offload_pool();
+    std::cout << "PASSED" << std::endl;
+
+    std::cout << "ftest_offload_pool_destroy... ";
+    ftest_offload_pool_destroy();
+    std::cout << "PASSED" << std::endl;
+
     std::cout << "ftest_sig_watch1... ";
     ftest_sig_watch1();
     std::cout << "PASSED" << std::endl;
@@ -1588,6 +3903,18 @@ int main(int argc, char **argv)
     ftest_sig_watch2();
     std::cout << "PASSED" << std::endl;
 
+    std::cout << "ftest_sig_watch_readd... ";
+    ftest_sig_watch_readd();
+    std::cout << "PASSED" << std::endl;
+
+    std::cout << "ftest_sig_coalesce... ";
+    ftest_sig_coalesce();
+    std::cout << "PASSED" << std::endl;
+
+    std::cout << "ftest_custom_traits... ";
+    ftest_custom_traits();
+    std::cout << "PASSED" << std::endl;
+
     std::cout << "ftest_timers1... ";
     ftest_timers1();
     std::cout << "PASSED" << std::endl;
@@ -1604,6 +3931,20 @@ int main(int argc, char **argv)
     ftest_timers3();
     std::cout << "PASSED" << std::endl;
 
+#if ! DASYNQ_HAVE_KQUEUE && DASYNQ_HAVE_EPOLL
+    std::cout << "ftest_pwait2_timer... ";
+    ftest_pwait2_timer();
+    std::cout << "PASSED" << std::endl;
+
+    std::cout << "ftest_pwait2_timer_interrupt... ";
+    ftest_pwait2_timer_interrupt();
+    std::cout << "PASSED" << std::endl;
+
+    std::cout << "ftest_pwait2_timer_fallback... ";
+    ftest_pwait2_timer_fallback();
+    std::cout << "PASSED" << std::endl;
+
+#endif
     std::cout << "ftest_multi_thread1... ";
     ftest_multi_thread1();
     std::cout << "PASSED" << std::endl;
@@ -181,6 +181,17 @@ template <class Base> class test_loop : public timer_base<Base>, io_receiver
     {
     
     }
+
+    // Use the simulated clocks:
+    void get_time(timespec &ts, clock_type clock, bool force_update) noexcept
+    {
+        ts = (clock == clock_type::MONOTONIC) ? test_io_engine::cur_mono_time : test_io_engine::cur_sys_time;
+    }
+
+    void get_time(time_val &tv, clock_type clock, bool force_update) noexcept
+    {
+        get_time(tv.get_timespec(), clock, force_update);
+    }
     
     bool add_fd_watch(int fd, void * callback, int eventmask, bool enabled, bool emulate = false)
     {
@@ -258,31 +269,22 @@ template <class Base> class test_loop : public timer_base<Base>, io_receiver
         // TODO
     }
     
-    void set_timer(timer_handle_t &timer_id, const time_val &timeouttv, const time_val &intervaltv,
+    void set_timer(timer_handle_t &timer_id, const time_val &timeout, const time_val &interval,
             bool enable, clock_type clock = clock_type::MONOTONIC) noexcept
     {
-        auto &timer_queue = this->queue_for_clock(clock);
-        timespec timeout = timeouttv;
-        timespec interval = intervaltv;
-
         std::lock_guard<decltype(Base::lock)> guard(Base::lock);
+        this->queue_timer_nolock(timer_id, timeout, interval, enable, clock);
+    }
 
-        auto &ts = timer_queue.node_data(timer_id);
-        ts.interval_time = interval;
-        ts.expiry_count = 0;
-        ts.enabled = enable;
+    void stop_timer(timer_handle_t &timer_id, clock_type clock = clock_type::MONOTONIC) noexcept
+    {
+        std::lock_guard<decltype(Base::lock)> guard(Base::lock);
+        this->unqueue_timer_nolock(timer_id, clock);
+    }
 
-        if (timer_queue.is_queued(timer_id)) {
-            // Already queued; alter timeout
-            if (timer_queue.set_priority(timer_id, timeout)) {
-                // set_timer_from_queue();
-            }
-        }
-        else {
-            if (timer_queue.insert(timer_id, timeout)) {
-                // set_timer_from_queue();
-            }
-        }
+    void update_timer_nolock(clock_type clock) noexcept
+    {
+        // (timers are processed on each poll)
     }
 
     // Receive events from test queue: